@@ -0,0 +1,582 @@
+#ifndef ASYNCLOG__H__
+#define ASYNCLOG__H__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE (16 * 1024)            // records buffered per thread, a power of two
+#define LOG_SHARED_RING_SIZE (1024 * 1024)   // ... and for all threads whose own ring is full
+#define LOG_MAX_RECORD 8192                  // longer string arguments are truncated
+#define LOG_WRITE_BATCH (64 * 1024)  // formatted text is written in chunks of up to this size
+#define LOG_FLUSH_INTERVAL_MS 10
+
+enum LogLevel {
+  LOG_FATAL,
+  LOG_CRITICAL,
+  LOG_ERROR,
+  LOG_WARNING,
+  LOG_INFO,
+  LOG_DEBUG,
+  LOG_VERBOSE,
+  LOG_TRACE
+};
+
+/* One printf conversion: %[flags][width][.precision][length]conversion */
+// --------------------------------------------------------------------------------------------------------------------
+struct LogSpec {
+  const char* flags;  // past '%'
+  const char* end;    // past the conversion character
+  bool is_star_width;
+  bool is_star_precision;
+  int precision;  // -1 if not given
+  char length[3];
+  char conversion;
+};
+
+inline const char* nextLogSpec(const char* p, LogSpec* spec) {  // nullptr when there are no more
+  for (; *p != '\0'; ++p) {
+    if (*p == '%' && p[1] == '%') {
+      ++p;
+    } else if (*p == '%') {
+      break;
+    }
+  }
+  if (*p == '\0') {
+    return nullptr;
+  }
+  spec->flags = ++p;
+  while (*p != '\0' && strchr("-+ #0'", *p) != nullptr) {
+    ++p;
+  }
+  spec->is_star_width = *p == '*';
+  if (spec->is_star_width) {
+    ++p;
+  }
+  while (*p >= '0' && *p <= '9') {
+    ++p;
+  }
+  spec->is_star_precision = false;
+  spec->precision = -1;
+  if (*p == '.') {
+    ++p;
+    spec->precision = 0;
+    if (*p == '*') {
+      spec->is_star_precision = true;
+      ++p;
+    }
+    while (*p >= '0' && *p <= '9') {
+      spec->precision = spec->precision * 10 + (*p++ - '0');
+    }
+  }
+  size_t length = 0;
+  while (*p != '\0' && strchr("hljztL", *p) != nullptr && length < 2) {
+    spec->length[length++] = *p++;
+  }
+  spec->length[length] = '\0';
+  spec->conversion = *p;
+  spec->end = *p != '\0' ? p + 1 : p;
+  return spec->end;
+}
+
+/* Arguments of one record, in printf order. Strings are copied, everything else takes an 8-byte slot */
+// --------------------------------------------------------------------------------------------------------------------
+class LogCapture {
+public:
+  LogCapture(const char* format, char* out, size_t capacity)
+    : m_cursor(format), m_stars(0), m_last_star(-1), m_out(out), m_end(out + capacity), m_size(0) {
+    nextSpec();
+  }
+
+  template <typename T>
+  void add(T value) {
+    if (m_stars > 0) {  // '*' width or precision
+      --m_stars;
+      m_last_star = static_cast<int>(slot(value));
+      putSlot(slot(value));
+      return;
+    }
+    if (m_cursor != nullptr && m_spec.conversion == 's') {
+      putString(value);
+    } else {
+      putSlot(slot(value));
+    }
+    nextSpec();
+  }
+
+  size_t size() const { return m_size; }
+
+private:
+  const char* m_cursor;  // nullptr past the last conversion
+  LogSpec m_spec;
+  int m_stars;      // '*' arguments still expected before the value of the current conversion
+  int m_last_star;  // the precision, if it was given by '*'
+  char* m_out;
+  char* m_end;
+  size_t m_size;
+
+  void nextSpec() {
+    if (m_cursor != nullptr) {
+      m_cursor = nextLogSpec(m_cursor, &m_spec);
+      m_stars = m_cursor == nullptr ? 0 : (m_spec.is_star_width ? 1 : 0) + (m_spec.is_star_precision ? 1 : 0);
+    }
+  }
+
+  template <typename T>
+  static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uint64_t>::type slot(T value) {
+    return static_cast<uint64_t>(static_cast<int64_t>(value));
+  }
+  template <typename T>
+  static typename std::enable_if<std::is_floating_point<T>::value, uint64_t>::type slot(T value) {
+    double number = static_cast<double>(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return bits;
+  }
+  template <typename T>
+  static uint64_t slot(T* value) { return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(value)); }
+  static uint64_t slot(std::nullptr_t) { return 0; }
+
+  void putSlot(uint64_t value) {
+    if (m_out + m_size + sizeof(value) <= m_end) {
+      memcpy(m_out + m_size, &value, sizeof(value));
+    }
+    m_size += sizeof(value);
+  }
+
+  void putString(const char* value) {
+    if (value == nullptr) {
+      value = "(null)";
+    }
+    size_t limit = m_spec.is_star_precision ? static_cast<size_t>(m_last_star)
+                                            : static_cast<size_t>(m_spec.precision);  // -1 - unbounded
+    size_t room = m_out + m_size + sizeof(uint64_t) <= m_end ? m_end - m_out - m_size - sizeof(uint64_t) : 0;
+    size_t length = strnlen(value, std::min(limit, room));
+    putSlot(length);
+    if (length > 0) {
+      memcpy(m_out + m_size, value, length);
+    }
+    m_size += (length + 7) & ~static_cast<size_t>(7);
+  }
+  void putString(char* value) { putString(const_cast<const char*>(value)); }
+  template <typename T>
+  void putString(T) { putSlot(0); }  // not a string, printf would have misbehaved as well
+};
+
+/* Single-producer single-consumer ring of records, one per logging thread and a shared one */
+// --------------------------------------------------------------------------------------------------------------------
+struct LogRecord {
+  uint32_t size;  // with the arguments, a multiple of 16; level LOG_PADDING skips to the ring's start
+  uint32_t level;
+  const char* format;
+};
+
+#define LOG_PADDING 0xffffffffu
+
+struct LogRing {
+  std::atomic<size_t> head;  // consumer
+  char padding[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail;  // producer
+  std::atomic<long> dropped;
+  std::atomic<bool> is_abandoned;  // thread has exited, the ring goes away once drained
+  size_t spilled_until;  // producer's own: the shared ring's tail past its last record put there
+  const size_t capacity;
+  std::unique_ptr<char[]> data;  // records are 16-byte aligned, as new[] aligns
+
+  explicit LogRing(size_t capacity)
+    : head(0), tail(0), dropped(0), is_abandoned(false), spilled_until(0), capacity(capacity), data(new char[capacity]) {}
+
+  bool push(const char* record, size_t size);  // false - no room
+  size_t used() const { return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed); }
+};
+
+inline bool LogRing::push(const char* record, size_t size) {
+  size_t position = tail.load(std::memory_order_relaxed);
+  size_t free = capacity - (position - head.load(std::memory_order_acquire));
+  size_t contiguous = capacity - (position & (capacity - 1));
+  size_t needed = contiguous < size ? contiguous + size : size;  // records never wrap around
+  if (free < needed) {
+    return false;
+  }
+  if (contiguous < size) {
+    LogRecord padding = { static_cast<uint32_t>(contiguous), LOG_PADDING, nullptr };
+    memcpy(&data[position & (capacity - 1)], &padding, sizeof(padding));
+    position += contiguous;
+  }
+  memcpy(&data[position & (capacity - 1)], record, size);
+  tail.store(position + size, std::memory_order_release);
+  return true;
+}
+
+/**
+ * Asynchronous logger. A log call copies the format pointer and the raw arguments into its thread's
+ * lock-free ring and returns; a background thread formats the records and writes them to the log file
+ * in batches. Nothing is formatted for records below the runtime level. A thread's own ring is small,
+ * so a server with a thread per connection doesn't pay much memory for it; a burst that overflows it goes
+ * to one larger ring shared by all threads under a mutex, and the thread keeps using that one until its
+ * records there are written, so they stay in order. When the shared ring is full as well records are
+ * dropped (their count is logged) instead of blocking the caller. Records of different threads are
+ * interleaved in batches.
+ */
+class AsyncLog {
+public:
+  static AsyncLog& instance();
+  static bool isEnabled(int level) { return level <= levelValue().load(std::memory_order_relaxed); }
+  static void setLevel(int level) { levelValue().store(level, std::memory_order_relaxed); }
+  static int parseLevel(const char* name);  // -1 if unknown
+
+  bool open(const char* path);  // appends to path instead of stdout
+  void stop();                  // drains everything; later records are written synchronously
+
+  template <typename... Args>
+  void log(int level, const char* format, Args... args);
+
+private:
+  std::mutex m_mutex;  // rings list, wakeups
+  std::condition_variable m_wakeup;
+  std::vector<LogRing*> m_rings;
+  std::vector<LogRing*> m_drained_rings;  // copy of m_rings, writer thread only
+  std::mutex m_shared_mutex;  // producers of the shared ring
+  LogRing m_shared;  // drained after the threads' own rings, so a thread's records there come after those
+  std::atomic<bool> m_is_stopped;
+  std::atomic<int> m_fd;
+  std::thread m_thread;
+
+  AsyncLog();
+
+  static std::atomic<int>& levelValue() {
+    static std::atomic<int> level(LOG_TRACE);
+    return level;
+  }
+  static LogRing& localRing();
+  static char* localScratch() {
+    alignas(16) static thread_local char scratch[LOG_MAX_RECORD];
+    return scratch;
+  }
+
+  void run();
+  bool drain(std::vector<char>& out);
+  bool drainRing(LogRing& ring, std::vector<char>& out, size_t tail);  // records up to tail
+  void write(std::vector<char>& out);
+  static void formatRecord(const LogRecord& record, std::vector<char>& out);
+};
+
+// ----------------------------------------------
+inline AsyncLog::AsyncLog(): m_shared(LOG_SHARED_RING_SIZE), m_is_stopped(false), m_fd(STDOUT_FILENO) {
+  m_thread = std::thread(&AsyncLog::run, this);
+}
+
+inline AsyncLog& AsyncLog::instance() {
+  // never destroyed: threads may log during static destruction, at exit the writer is only stopped
+  static AsyncLog* log = [] {
+    AsyncLog* created = new AsyncLog();
+    std::atexit([] { AsyncLog::instance().stop(); });
+    return created;
+  }();
+  return *log;
+}
+
+inline int AsyncLog::parseLevel(const char* name) {
+  static const char* names[] = { "fatal", "critical", "error", "warning", "info", "debug", "verbose", "trace" };
+  for (int i = 0; i <= LOG_TRACE; ++i) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+inline bool AsyncLog::open(const char* path) {
+  int fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  int previous = m_fd.exchange(fd);
+  if (previous != STDOUT_FILENO) {
+    close(previous);  // records of the old file are written already or go to the new one
+  }
+  return true;
+}
+
+inline void AsyncLog::stop() {
+  if (m_is_stopped.exchange(true)) {
+    return;
+  }
+  m_wakeup.notify_one();
+  m_thread.join();
+}
+
+inline LogRing& AsyncLog::localRing() {
+  struct Local {
+    LogRing* ring;
+    Local(): ring(new LogRing(LOG_RING_SIZE)) {
+      AsyncLog& log = instance();
+      std::lock_guard<std::mutex> lock(log.m_mutex);
+      log.m_rings.push_back(ring);
+    }
+    ~Local() { ring->is_abandoned.store(true, std::memory_order_release); }
+  };
+  static thread_local Local local;
+  return *local.ring;
+}
+
+template <typename... Args>
+void AsyncLog::log(int level, const char* format, Args... args) {
+  char* record = localScratch();
+  LogCapture capture(format, record + sizeof(LogRecord), LOG_MAX_RECORD - sizeof(LogRecord));
+  int expand[] = { 0, (capture.add(args), 0)... };
+  (void) expand;
+  size_t size = std::min((sizeof(LogRecord) + capture.size() + 15) & ~static_cast<size_t>(15), static_cast<size_t>(LOG_MAX_RECORD));
+  LogRecord header = { static_cast<uint32_t>(size), static_cast<uint32_t>(level), format };
+  memcpy(record, &header, sizeof(header));
+
+  if (m_is_stopped.load(std::memory_order_acquire)) {  // process is exiting
+    std::vector<char> out;
+    formatRecord(*reinterpret_cast<const LogRecord*>(record), out);
+    write(out);
+    return;
+  }
+  LogRing& ring = localRing();
+  bool is_spilling = ring.spilled_until > m_shared.head.load(std::memory_order_acquire);  // earlier ones still there
+  if (is_spilling || !ring.push(record, header.size)) {
+    std::lock_guard<std::mutex> lock(m_shared_mutex);
+    if (m_shared.push(record, header.size)) {
+      ring.spilled_until = m_shared.tail.load(std::memory_order_relaxed);
+      is_spilling = true;
+    } else {
+      ++ring.dropped;
+    }
+  }
+  if (level <= LOG_ERROR || is_spilling || ring.used() > LOG_RING_SIZE / 2) {
+    m_wakeup.notify_one();
+  }
+}
+
+// ----------------------------------------------
+inline void AsyncLog::run() {
+  std::vector<char> out;
+  out.reserve(LOG_WRITE_BATCH + LOG_MAX_RECORD);
+  while (true) {
+    bool is_stopping = m_is_stopped.load(std::memory_order_acquire);
+    bool has_records = drain(out);
+    write(out);
+    if (is_stopping && !has_records) {
+      return;
+    }
+    if (!has_records) {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wakeup.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+    }
+  }
+}
+
+inline bool AsyncLog::drain(std::vector<char>& out) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_drained_rings = m_rings;  // keeps its capacity, the writer doesn't allocate between batches
+  }
+  // a record spilled after this point may follow one its thread put in its own ring after that ring
+  // was drained, so it waits for the next time
+  size_t shared_tail = m_shared.tail.load(std::memory_order_acquire);
+  bool has_records = false;
+  for (LogRing* ring : m_drained_rings) {
+    bool is_abandoned = ring->is_abandoned.load(std::memory_order_acquire);
+    has_records |= drainRing(*ring, out, ring->tail.load(std::memory_order_acquire));
+    if (is_abandoned) {  // producer is gone and everything it wrote is drained, but maybe not what it spilled
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_rings.erase(std::find(m_rings.begin(), m_rings.end(), ring));
+      delete ring;
+    }
+  }
+  has_records |= drainRing(m_shared, out, shared_tail);
+  return has_records || m_shared.tail.load(std::memory_order_acquire) != shared_tail;
+}
+
+inline bool AsyncLog::drainRing(LogRing& ring, std::vector<char>& out, size_t tail) {
+  size_t head = ring.head.load(std::memory_order_relaxed);
+  bool has_records = head != tail;
+  while (head != tail) {
+    const char* data = &ring.data[head & (ring.capacity - 1)];
+    LogRecord record;
+    memcpy(&record, data, sizeof(record));
+    if (record.level != LOG_PADDING) {
+      formatRecord(*reinterpret_cast<const LogRecord*>(data), out);
+    }
+    head += record.size;
+    if (out.size() >= LOG_WRITE_BATCH) {
+      ring.head.store(head, std::memory_order_release);
+      write(out);
+    }
+  }
+  ring.head.store(head, std::memory_order_release);
+
+  long dropped = ring.dropped.exchange(0);
+  if (dropped > 0) {
+    char line[64];
+    int size = snprintf(line, sizeof(line), "... %li log records dropped\n", dropped);
+    out.insert(out.end(), line, line + size);
+  }
+  return has_records;
+}
+
+inline void AsyncLog::write(std::vector<char>& out) {
+  int fd = m_fd.load(std::memory_order_relaxed);
+  size_t written = 0;
+  while (written < out.size()) {
+    ssize_t result = ::write(fd, out.data() + written, out.size() - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;  // nowhere to report it
+    }
+    written += result;
+  }
+  out.clear();
+}
+
+inline void AsyncLog::formatRecord(const LogRecord& record, std::vector<char>& out) {
+  const char* args = reinterpret_cast<const char*>(&record + 1);
+  const char* args_end = reinterpret_cast<const char*>(&record) + record.size;
+  auto next = [&]() -> uint64_t {
+    uint64_t value = 0;
+    if (args + sizeof(value) <= args_end) {
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+    }
+    return value;
+  };
+  auto append = [&](const char* data, size_t size) { out.insert(out.end(), data, data + size); };
+
+  const char* text = record.format;
+  LogSpec spec;
+  const char* p;
+  while ((p = nextLogSpec(text, &spec)) != nullptr) {
+    for (const char* c = text; c < spec.flags - 1; ++c) {  // literal text, "%%" becomes '%'
+      append(c, 1);
+      if (c[0] == '%' && c[1] == '%') {
+        ++c;
+      }
+    }
+    text = p;
+
+    // the conversion without '*' and length modifiers, values are passed as the widest type
+    // strings are copied up to their precision already, so theirs is dropped
+    char conversion[48];
+    size_t size = 0;
+    bool is_precision = false;
+    conversion[size++] = '%';
+    for (const char* c = spec.flags; c < spec.end - 1 && size < 32; ++c) {
+      is_precision |= *c == '.';
+      if (*c == '*') {
+        int star = static_cast<int>(next());
+        if (!is_precision || spec.conversion != 's') {
+          size += snprintf(conversion + size, 12, "%i", star);
+        }
+      } else if (strchr("hljztL", *c) == nullptr && (!is_precision || spec.conversion != 's')) {
+        conversion[size++] = *c;
+      }
+    }
+
+    char buffer[512];
+    int length = 0;
+    uint64_t value = 0;
+    switch (spec.conversion) {
+      case 's': {
+        size_t string_size = next();
+        const char* string = args;
+        args += std::min(static_cast<size_t>(args_end - args), (string_size + 7) & ~static_cast<size_t>(7));
+        if (size == 1) {  // no flags or width
+          append(string, string_size);
+          continue;
+        }
+        memcpy(conversion + size, ".*s", 4);
+        length = snprintf(buffer, sizeof(buffer), conversion, static_cast<int>(string_size), string);
+        if (length >= static_cast<int>(sizeof(buffer))) {  // wide field, print the string as is
+          append(string, string_size);
+          continue;
+        }
+        break;
+      }
+      case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c': {
+        value = next();
+        bool is_signed = spec.conversion == 'd' || spec.conversion == 'i';
+        long long number = static_cast<long long>(value);
+        unsigned long long unsigned_number = value;
+        if (spec.length[0] == '\0' || spec.conversion == 'c') {  // int
+          number = static_cast<int>(value);
+          unsigned_number = static_cast<unsigned>(value);
+        } else if (strcmp(spec.length, "hh") == 0) {
+          number = static_cast<signed char>(value);
+          unsigned_number = static_cast<unsigned char>(value);
+        } else if (strcmp(spec.length, "h") == 0) {
+          number = static_cast<short>(value);
+          unsigned_number = static_cast<unsigned short>(value);
+        }
+        if (spec.conversion == 'c') {
+          conversion[size++] = 'c';
+          conversion[size] = '\0';
+          length = snprintf(buffer, sizeof(buffer), conversion, static_cast<int>(number));
+        } else {
+          conversion[size++] = 'l';
+          conversion[size++] = 'l';
+          conversion[size++] = spec.conversion;
+          conversion[size] = '\0';
+          length = is_signed ? snprintf(buffer, sizeof(buffer), conversion, number)
+                             : snprintf(buffer, sizeof(buffer), conversion, unsigned_number);
+        }
+        break;
+      }
+      case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+        value = next();
+        double number;
+        memcpy(&number, &value, sizeof(number));
+        conversion[size++] = spec.conversion;
+        conversion[size] = '\0';
+        length = snprintf(buffer, sizeof(buffer), conversion, number);
+        break;
+      }
+      case 'p':
+        value = next();
+        conversion[size++] = 'p';
+        conversion[size] = '\0';
+        length = snprintf(buffer, sizeof(buffer), conversion, reinterpret_cast<void*>(static_cast<uintptr_t>(value)));
+        break;
+      default:  // %n and unknown conversions print nothing
+        continue;
+    }
+    append(buffer, std::min(std::max(length, 0), static_cast<int>(sizeof(buffer) - 1)));
+  }
+  for (const char* c = text; *c != '\0'; ++c) {
+    append(c, 1);
+    if (c[0] == '%' && c[1] == '%') {
+      ++c;
+    }
+  }
+}
+
+// compile-time check of the format by printf, then a record for the background thread
+#define LOG_ASYNC(level, format, ...) \
+  do { \
+    if (false) { \
+      printf(format, ##__VA_ARGS__); \
+    } \
+    if (AsyncLog::isEnabled(level)) { \
+      AsyncLog::instance().log(level, format, ##__VA_ARGS__); \
+    } \
+  } while (false)
+
+#endif  // ASYNCLOG__H__
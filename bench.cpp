@@ -0,0 +1,407 @@
+/**
+ * Microbenchmarks of the server's hot paths.
+ *
+ *   cmake --preset release && cmake --build --preset release && ./build/release/bench
+ *   ./bench [--seconds=S] [--json] [--baseline=FILE] [--filter=PREFIX]
+ *
+ * Text parsing (text/): a buffer of legacy frames "<id>@@<login>##<text>\0" is cut and parsed by
+ *   legacy  - Message::parse as it used to be, two strstr() and copies into 8- and 64-byte arrays
+ *   memmem  - memchr() for the NUL, memmem() for each delimiter, the decoder before textscan.h
+ *   scalar, sse2, avx2 - the one-pass scanners of textscan.h
+ *   decoder - FrameDecoder fed by PROTOCOL_READ_SIZE reads, with the scanner it picks itself
+ * binary/decoder - the same for binary frames
+ * raw/ - a message written into a frame (what Message::raw was): text, binary, binary into a pooled buffer
+ * size/ - its exact frame size computed beforehand (what Message::size was)
+ * log/ - a record below the level, a record to the asynchronous logger, a debug record if compiled in
+ * fanout/ - Server::sendMessage's own work for N peers: the frame serialized once, then queued for every
+ *   peer under its mutex and its queue gathered for a write (latency delivery) or so every 32 messages
+ *   (batched); the write itself is left out, it takes everything at once. fanout.cpp measures the rest
+ *
+ * Every result is ns per operation; --json prints JSON lines, and a saved run given as --baseline gets
+ * the change in percent next to each result.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+#include "benchreport.h"
+#include "buffer.h"
+#include "logger.h"
+#include "message.h"
+#include "outbound.h"
+#include "protocol.h"
+#include "textscan.h"
+
+#define BENCH_MESSAGES 1024  // messages a pass of the raw/, size/ and log/ benchmarks goes through
+#define BENCH_FANOUT_BATCH 32  // messages between the flushes of the batched fan-out
+
+static double g_seconds = 0.5;  // per measurement
+static volatile size_t g_sink;  // results go here, so that nothing is optimized away
+static BenchReport g_report;
+static std::string g_filter;  // prefix of the names of the benchmarks to run
+
+/* Старый разбор текстовых кадров, для сравнения */
+// --------------------------------------------------------------------------------------------------------------------
+static Message legacyParse(char* raw) {  // Message::parse of the original message.h
+  char* id_str = strstr(raw, "@@");
+  int id_len = id_str - raw;
+  char id_buf[8];
+  memset(id_buf, 0, 8);
+  strncpy(id_buf, raw, id_len);
+  int id = std::atoi(id_buf);
+
+  char* text = strstr(raw, "##");
+  char login[64];
+  memset(login, 0, 64);
+  strncpy(login, raw + id_len + 2, text - raw - id_len - 2);
+
+  Message message;
+  message.id = id;
+  message.login = std::string(login);
+  message.text = std::string(text + 2);
+  return message;
+}
+
+static bool memmemParse(Slice raw, MessageView* view) {  // MessageView::fromText before textscan.h
+  const char* end = raw.data + raw.size;
+  const char* id_end = static_cast<const char*>(memmem(raw.data, raw.size, "@@", 2));
+  if (id_end == nullptr || id_end == raw.data || id_end - raw.data > 10) {
+    return false;
+  }
+  view->id = std::atoi(raw.data);
+  const char* login = id_end + 2;
+  const char* login_end = static_cast<const char*>(memmem(login, end - login, "##", 2));
+  if (login_end == nullptr) {
+    return false;
+  }
+  view->login = Slice(login, login_end - login);
+  view->text = Slice(login_end + 2, end - login_end - 2);
+  return true;
+}
+
+/* Измерения */
+// --------------------------------------------------------------------------------------------------------------------
+static std::string makeText(size_t text_size) {
+  std::string text;
+  while (text.size() < text_size) {
+    text += "the server message is deployed tomorrow, build green @ 5 # ok ";
+  }
+  text.resize(text_size);
+  return text;
+}
+
+// frames of text_size bytes of text each, about 1 MB of them
+static std::vector<char> makeFrames(size_t text_size, size_t* count) {
+  std::string text = makeText(text_size);
+  std::vector<char> buffer;
+  *count = 0;
+  for (int id = 1; buffer.size() < (1 << 20); ++id, ++*count) {
+    std::string frame = std::to_string(id) + "@@login" + std::to_string(id % 100) + "##" + text;
+    buffer.insert(buffer.end(), frame.begin(), frame.end());
+    buffer.push_back('\0');
+  }
+  return buffer;
+}
+
+// runs pass(), count operations over bytes bytes (0 - not a throughput), for g_seconds and reports ns per operation
+template <typename Pass>
+static void measure(const std::string& name, size_t text_size, size_t peers, size_t bytes, size_t count, Pass pass) {
+  if (name.compare(0, g_filter.size(), g_filter) != 0) {
+    return;
+  }
+  typedef std::chrono::steady_clock Clock;
+  size_t passes = 0;
+  Clock::time_point start = Clock::now();
+  double elapsed = 0;
+  do {
+    g_sink = pass();
+    ++passes;
+    elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (elapsed < g_seconds);
+  double ns = elapsed * 1e9 / (passes * count);
+  std::vector<std::pair<const char*, double>> values = { { "ns_per_op", ns }, { "ops_per_s", 1e9 / ns } };
+  if (bytes > 0) {
+    values.push_back({ "gb_per_s", passes * bytes / elapsed / 1e9 });
+  }
+  g_report.add(name, text_size, peers, values);
+}
+
+static size_t scanAll(TextScanFunction scan, const std::vector<char>& buffer) {
+  size_t sum = 0;
+  const char* data = buffer.data();
+  const char* end = data + buffer.size();
+  while (data < end) {
+    TextMarks marks;
+    size_t nul = scan(data, end - data, &marks);
+    MessageView view;
+    if (MessageView::fromText(Slice(data, nul), marks, &view)) {
+      sum += view.id + view.login.size + view.text.size;
+    }
+    data += nul + 1;
+  }
+  return sum;
+}
+
+static void benchText(size_t text_size) {
+  size_t count = 0;
+  std::vector<char> buffer = makeFrames(text_size, &count);
+  size_t bytes = buffer.size();
+
+  if (text_size < 4096) {  // the 64-byte login array is safe here, the original read buffer was 4 KB
+    measure("text/legacy", text_size, 0, bytes, count, [&]() {
+      size_t sum = 0;
+      for (char* data = buffer.data(); data < buffer.data() + bytes; data += strlen(data) + 1) {
+        Message message = legacyParse(data);
+        sum += message.id + message.login.size() + message.text.size();
+      }
+      return sum;
+    });
+  }
+  measure("text/memmem", text_size, 0, bytes, count, [&]() {
+    size_t sum = 0;
+    const char* data = buffer.data();
+    const char* end = data + bytes;
+    while (data < end) {
+      const char* nul = static_cast<const char*>(memchr(data, '\0', end - data));
+      MessageView view;
+      if (memmemParse(Slice(data, nul - data), &view)) {
+        sum += view.id + view.login.size + view.text.size;
+      }
+      data = nul + 1;
+    }
+    return sum;
+  });
+  measure("text/scalar", text_size, 0, bytes, count, [&]() { return scanAll(scanTextScalar, buffer); });
+#ifdef TEXTSCAN_SIMD
+  measure("text/sse2", text_size, 0, bytes, count, [&]() { return scanAll(scanTextSse2, buffer); });
+  if (__builtin_cpu_supports("avx2")) {
+    measure("text/avx2", text_size, 0, bytes, count, [&]() { return scanAll(scanTextAvx2, buffer); });
+  }
+#endif
+  measure("text/decoder", text_size, 0, bytes, count, [&]() {
+    size_t sum = 0;
+    FrameDecoder decoder;
+    for (size_t offset = 0; offset < bytes; offset += PROTOCOL_READ_SIZE) {
+      size_t size = std::min<size_t>(PROTOCOL_READ_SIZE, bytes - offset);
+      memcpy(decoder.prepare(size), buffer.data() + offset, size);
+      decoder.commit(size);
+      Frame frame;
+      MessageView view;
+      while (decoder.next(&frame) == FrameDecoder::FRAME) {
+        if (MessageView::fromFrame(frame, &view)) {
+          sum += view.id + view.login.size + view.text.size;
+        }
+      }
+    }
+    return sum;
+  });
+}
+
+// the same for binary frames, about 1 MB of them
+static void benchBinary(size_t text_size) {
+  std::string text = makeText(text_size);
+  std::string buffer;
+  size_t count = 0;
+  for (int id = 1; buffer.size() < (1 << 20); ++id, ++count) {
+    std::string login = "login" + std::to_string(id % 100);
+    Message message;
+    message.id = id;
+    message.login = login;
+    message.text = text;
+    encodeBinary(MessageView(message), buffer);
+  }
+  measure("binary/decoder", text_size, 0, buffer.size(), count, [&]() {
+    size_t sum = 0;
+    FrameDecoder decoder;
+    for (size_t offset = 0; offset < buffer.size(); offset += PROTOCOL_READ_SIZE) {
+      size_t size = std::min<size_t>(PROTOCOL_READ_SIZE, buffer.size() - offset);
+      memcpy(decoder.prepare(size), buffer.data() + offset, size);
+      decoder.commit(size);
+      Frame frame;
+      MessageView view;
+      while (decoder.next(&frame) == FrameDecoder::FRAME) {
+        if (MessageView::fromFrame(frame, &view)) {
+          sum += view.id + view.login.size + view.text.size;
+        }
+      }
+    }
+    return sum;
+  });
+}
+
+// messages with the same text and different ids and logins
+static std::vector<MessageView> makeMessages(const std::string& text, std::vector<std::string>* logins) {
+  logins->clear();
+  for (int i = 0; i < 100; ++i) {
+    logins->push_back("login" + std::to_string(i));
+  }
+  std::vector<MessageView> messages(BENCH_MESSAGES);
+  for (size_t i = 0; i < messages.size(); ++i) {
+    messages[i].id = static_cast<int>(i * 7919 % 1000000);
+    messages[i].login = Slice((*logins)[i % logins->size()]);
+    messages[i].text = Slice(text);
+  }
+  return messages;
+}
+
+static void benchSerialize(size_t text_size) {
+  std::string text = makeText(text_size);
+  std::vector<std::string> logins;
+  std::vector<MessageView> messages = makeMessages(text, &logins);
+  std::vector<char> out(binarySize(messages[0]) + 64);
+
+  measure("raw/text", text_size, 0, 0, messages.size(), [&]() {
+    size_t sum = 0;
+    for (const MessageView& message : messages) {
+      sum += writeText(message, out.data()) - out.data();
+    }
+    return sum;
+  });
+  measure("raw/binary", text_size, 0, 0, messages.size(), [&]() {
+    size_t sum = 0;
+    for (const MessageView& message : messages) {
+      sum += writeBinary(message, out.data()) - out.data();
+    }
+    return sum;
+  });
+  measure("raw/pooled", text_size, 0, 0, messages.size(), [&]() {  // as Server::serialize does it
+    size_t sum = 0;
+    for (const MessageView& message : messages) {
+      BufferRef frame = BufferPool::instance().acquire(binarySize(message));
+      writeBinary(message, frame->data());
+      sum += frame->size();
+    }
+    return sum;
+  });
+  measure("size/text", text_size, 0, 0, messages.size(), [&]() {
+    size_t sum = 0;
+    for (const MessageView& message : messages) {
+      sum += textSize(message);
+    }
+    return sum;
+  });
+  measure("size/binary", text_size, 0, 0, messages.size(), [&]() {
+    size_t sum = 0;
+    for (const MessageView& message : messages) {
+      sum += binarySize(message);
+    }
+    return sum;
+  });
+}
+
+// the logger's cost to the calling thread, records go to /dev/null
+static void benchLogger(size_t text_size) {
+  std::string text = makeText(text_size);
+  std::vector<std::string> logins;
+  std::vector<MessageView> messages = makeMessages(text, &logins);
+  AsyncLog::instance().open("/dev/null");
+
+  AsyncLog::setLevel(LOG_WARNING);
+  measure("log/filtered", text_size, 0, 0, messages.size(), [&]() {
+    for (const MessageView& message : messages) {
+      OUT("Message{id=%i, login=%.*s, text=%.*s}", message.id, (int) message.login.size, message.login.data,
+          (int) message.text.size, message.text.data);
+    }
+    return messages.size();
+  });
+  AsyncLog::setLevel(LOG_TRACE);
+  measure("log/async", text_size, 0, 0, messages.size(), [&]() {  // dropped when the writer falls behind, as in Server
+    for (const MessageView& message : messages) {
+      OUT("Message{id=%i, login=%.*s, text=%.*s}", message.id, (int) message.login.size, message.login.data,
+          (int) message.text.size, message.text.data);
+    }
+    return messages.size();
+  });
+#if ENABLED_LOGGING
+  measure("log/debug", text_size, 0, 0, messages.size(), [&]() {
+    for (const MessageView& message : messages) {
+      DBG("Message from peer %i: %zu bytes", message.id, message.text.size);
+    }
+    return messages.size();
+  });
+#endif
+}
+
+// Server::sendMessage's work for peers peers, without the registry and the reactors
+static void benchFanout(size_t text_size, size_t peers) {
+  struct Peer {
+    std::mutex mutex;
+    OutboundQueue outbound;
+
+    Peer(int socket, const OutboundConfig& config, OutboundStats* stats): outbound(socket, config, stats) {}
+  };
+  std::string text = makeText(text_size);
+  std::vector<std::string> logins;
+  std::vector<MessageView> messages = makeMessages(text, &logins);
+  OutboundConfig config;
+  OutboundStats stats;
+  std::vector<std::unique_ptr<Peer>> recipients;
+  for (size_t i = 0; i < peers; ++i) {
+    recipients.emplace_back(new Peer(-1, config, &stats));
+  }
+  size_t count = std::max<size_t>(1, 4096 / peers);  // messages per pass, a pass is a few thousand copies
+
+  for (bool is_batched : { false, true }) {
+    measure(is_batched ? "fanout/batched" : "fanout/latency", text_size, peers, 0, count, [&]() {
+      size_t sum = 0;
+      for (size_t i = 0; i < count; ++i) {
+        const MessageView& message = messages[i % messages.size()];
+        BufferRef frame = BufferPool::instance().acquire(binarySize(message));
+        writeBinary(message, frame->data());
+        bool is_flushed = !is_batched || (i + 1) % BENCH_FANOUT_BATCH == 0 || i + 1 == count;
+        for (auto& peer : recipients) {
+          std::lock_guard<std::mutex> lock(peer->mutex);
+          peer->outbound.push(frame);
+          if (is_flushed) {
+            iovec parts[OUTBOUND_MAX_IOV];
+            sum += peer->outbound.gather(parts, OUTBOUND_MAX_IOV);
+            peer->outbound.complete(peer->outbound.bytes());
+          }
+        }
+      }
+      return sum;
+    });
+  }
+}
+
+/* Main */
+// --------------------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--seconds=", 10) == 0) {
+      g_seconds = atof(argv[i] + 10);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      g_report.setJson(true);
+    } else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+      if (!g_report.loadBaseline(argv[i] + 11)) {
+        printf("No results in baseline %s\n", argv[i] + 11);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+      g_filter = argv[i] + 9;
+    } else {
+      printf("Usage: %s [--seconds=S] [--json] [--baseline=FILE] [--filter=PREFIX]\n", argv[0]);
+      return 1;
+    }
+  }
+  for (size_t text_size : { 16, 64, 256, 1024, 4096 }) {
+    benchText(text_size);
+    benchBinary(text_size);
+  }
+  for (size_t text_size : { 16, 256, 4096 }) {
+    benchSerialize(text_size);
+    benchLogger(text_size);
+  }
+  for (size_t text_size : { 64, 1024 }) {
+    for (size_t peers : { 1, 10, 100, 1000 }) {
+      benchFanout(text_size, peers);
+    }
+  }
+  return 0;
+}
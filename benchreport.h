@@ -0,0 +1,128 @@
+#ifndef BENCHREPORT__H__
+#define BENCHREPORT__H__
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Results of the benchmarks (bench.cpp, fanout.cpp): one per name, text size and peer count, with a
+ * few named values, the first of them the one compared. Printed as a table or as JSON lines, e.g.
+ *
+ *   {"name":"fanout/latency","size":64,"peers":100,"ns_per_op":8123.4,"ops_per_s":123103.0}
+ *
+ * A report saved from one commit is a baseline for the next: the same results get the change of
+ * their first value in percent.
+ */
+class BenchReport {
+public:
+  BenchReport(): m_is_json(false) {}
+
+  void setJson(bool is_json) { m_is_json = is_json; }
+  bool loadBaseline(const std::string& path);  // JSON lines of an earlier run
+
+  void add(const std::string& name, size_t size, size_t peers, const std::vector<std::pair<const char*, double>>& values);
+
+private:
+  struct Entry {
+    std::string name;
+    size_t size;
+    size_t peers;
+    double value;  // the first one
+  };
+
+  bool m_is_json;
+  std::vector<Entry> m_baseline;
+
+  const Entry* find(const std::string& name, size_t size, size_t peers) const;
+  static bool readNumber(const std::string& line, const char* key, double* value);
+};
+
+// ----------------------------------------------
+inline bool BenchReport::loadBaseline(const std::string& path) {
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t name = line.find("\"name\":\"");
+    size_t end = name == std::string::npos ? name : line.find('"', name + 8);
+    size_t values = line.find("\"peers\":");
+    double size = 0, peers = 0;
+    if (end == std::string::npos || values == std::string::npos || !readNumber(line, "size", &size) ||
+        !readNumber(line, "peers", &peers)) {
+      continue;
+    }
+    size_t colon = line.find(':', line.find(',', values) + 1);  // the first value after peers
+    if (colon == std::string::npos) {
+      continue;
+    }
+    Entry entry;
+    entry.name = line.substr(name + 8, end - name - 8);
+    entry.size = static_cast<size_t>(size);
+    entry.peers = static_cast<size_t>(peers);
+    entry.value = std::strtod(line.c_str() + colon + 1, nullptr);
+    m_baseline.push_back(entry);
+  }
+  return !m_baseline.empty();
+}
+
+inline void BenchReport::add(const std::string& name, size_t size, size_t peers,
+                             const std::vector<std::pair<const char*, double>>& values) {
+  const Entry* base = values.empty() ? nullptr : find(name, size, peers);
+  std::string line;
+  char part[128];
+  if (m_is_json) {
+    snprintf(part, sizeof(part), "{\"name\":\"%s\",\"size\":%zu,\"peers\":%zu", name.c_str(), size, peers);
+    line = part;
+    for (auto& it : values) {
+      snprintf(part, sizeof(part), ",\"%s\":%.3f", it.first, it.second);
+      line += part;
+    }
+    if (base != nullptr && base->value != 0) {
+      snprintf(part, sizeof(part), ",\"baseline\":%.3f,\"change_pct\":%.1f", base->value,
+               100.0 * (values[0].second - base->value) / base->value);
+      line += part;
+    }
+    printf("%s}\n", line.c_str());
+    return;
+  }
+  snprintf(part, sizeof(part), "%-20s %6zu B", name.c_str(), size);
+  line = part;
+  if (peers > 0) {
+    snprintf(part, sizeof(part), " %6zu peers", peers);
+    line += part;
+  }
+  for (auto& it : values) {
+    snprintf(part, sizeof(part), "  %s %.2f", it.first, it.second);
+    line += part;
+  }
+  if (base != nullptr && base->value != 0) {
+    snprintf(part, sizeof(part), "  (%+.1f%% of %.2f)", 100.0 * (values[0].second - base->value) / base->value, base->value);
+    line += part;
+  }
+  printf("%s\n", line.c_str());
+}
+
+inline const BenchReport::Entry* BenchReport::find(const std::string& name, size_t size, size_t peers) const {
+  for (const Entry& entry : m_baseline) {
+    if (entry.name == name && entry.size == size && entry.peers == peers) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+inline bool BenchReport::readNumber(const std::string& line, const char* key, double* value) {
+  std::string pattern = std::string("\"") + key + "\":";
+  size_t position = line.find(pattern);
+  if (position == std::string::npos) {
+    return false;
+  }
+  *value = std::strtod(line.c_str() + position + pattern.size(), nullptr);
+  return true;
+}
+
+#endif  // BENCHREPORT__H__
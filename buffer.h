@@ -0,0 +1,242 @@
+#ifndef BUFFER__H__
+#define BUFFER__H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#define BUFFER_SIZE_CLASSES 6
+#define BUFFER_MIN_CLASS_SIZE 128  // classes are 128, 512, 2K, 8K, 32K, 128K bytes
+#define BUFFER_LOCAL_LIMIT 256     // buffers of one class kept by one thread
+#define BUFFER_BATCH 64            // buffers moved between thread cache and shared pool at once
+
+class BufferPool;
+
+/**
+ * Serialized frame shared by every peer it is sent to. Written once right after acquire(),
+ * immutable afterwards, goes back to the pool when the last reference is gone.
+ */
+class Buffer {
+  friend class BufferPool;
+  friend class BufferRef;
+
+public:
+  char* data() { return reinterpret_cast<char*>(this + 1); }
+  const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+  size_t size() const { return m_size; }
+  size_t capacity() const { return m_capacity; }
+  void setSize(size_t size) { m_size = size; }
+
+private:
+  std::atomic<int> m_references;
+  uint32_t m_size;
+  uint32_t m_capacity;
+  int m_size_class;  // -1 for oversized buffers that bypass the pool
+};
+
+/* Intrusive reference to a pooled buffer */
+// --------------------------------------------------------------------------------------------------------------------
+class BufferRef {
+public:
+  BufferRef(): m_buffer(nullptr) {}
+  explicit BufferRef(Buffer* buffer): m_buffer(buffer) {}  // adopts the reference from acquire()
+  BufferRef(const BufferRef& other): m_buffer(other.m_buffer) { retain(); }
+  BufferRef(BufferRef&& other): m_buffer(other.m_buffer) { other.m_buffer = nullptr; }
+  ~BufferRef() { reset(); }
+
+  BufferRef& operator = (const BufferRef& other) {
+    if (m_buffer != other.m_buffer) {
+      reset();
+      m_buffer = other.m_buffer;
+      retain();
+    }
+    return *this;
+  }
+
+  BufferRef& operator = (BufferRef&& other) {
+    if (this != &other) {
+      reset();
+      m_buffer = other.m_buffer;
+      other.m_buffer = nullptr;
+    }
+    return *this;
+  }
+
+  void reset();
+
+  Buffer* get() const { return m_buffer; }
+  Buffer* operator -> () const { return m_buffer; }
+  explicit operator bool () const { return m_buffer != nullptr; }
+
+  const char* data() const { return m_buffer->data(); }
+  size_t size() const { return m_buffer->size(); }
+
+private:
+  Buffer* m_buffer;
+
+  void retain() {
+    if (m_buffer != nullptr) {
+      m_buffer->m_references.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+};
+
+/**
+ * Size-classed free lists of buffers. Each thread keeps its own cache and exchanges buffers with
+ * the shared lists in batches, so in steady state acquire/release never allocate and take the lock
+ * at most once per BUFFER_BATCH buffers. A thread that mostly releases (a connection's writer in
+ * threads mode) hands its buffers back as soon as it has a batch; otherwise hundreds of such threads
+ * would each sit on BUFFER_LOCAL_LIMIT of them while the producers keep allocating new ones.
+ */
+class BufferPool {
+public:
+  static BufferPool& instance();
+
+  BufferRef acquire(size_t size);
+  void release(Buffer* buffer);
+
+  long heapAllocations() const { return m_heap_allocations.load(std::memory_order_relaxed); }
+  long reused() const { return m_reused.load(std::memory_order_relaxed); }
+
+private:
+  struct LocalCache {
+    std::vector<Buffer*> lists[BUFFER_SIZE_CLASSES];
+    size_t acquired[BUFFER_SIZE_CLASSES];  // since the last batch was given back
+
+    LocalCache();
+    ~LocalCache();
+  };
+
+  std::mutex m_mutex;
+  std::vector<Buffer*> m_free[BUFFER_SIZE_CLASSES];  // guarded by m_mutex
+  std::atomic<long> m_heap_allocations;
+  std::atomic<long> m_reused;
+
+  BufferPool(): m_heap_allocations(0), m_reused(0) {}
+  ~BufferPool();
+
+  static LocalCache& localCache();
+  static int sizeClass(size_t size);
+  static size_t classCapacity(int size_class) { return static_cast<size_t>(BUFFER_MIN_CLASS_SIZE) << (2 * size_class); }
+  Buffer* allocate(size_t capacity, int size_class);
+};
+
+inline void BufferRef::reset() {
+  if (m_buffer != nullptr && m_buffer->m_references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    BufferPool::instance().release(m_buffer);
+  }
+  m_buffer = nullptr;
+}
+
+// ----------------------------------------------
+inline BufferPool& BufferPool::instance() {
+  static BufferPool pool;
+  return pool;
+}
+
+inline BufferPool::~BufferPool() {
+  for (auto& list : m_free) {
+    for (Buffer* buffer : list) {
+      buffer->~Buffer();
+      free(buffer);
+    }
+  }
+}
+
+inline BufferPool::LocalCache::LocalCache() {
+  for (int i = 0; i < BUFFER_SIZE_CLASSES; ++i) {
+    lists[i].reserve(BUFFER_LOCAL_LIMIT + 1);
+    acquired[i] = 0;
+  }
+}
+
+inline BufferPool::LocalCache::~LocalCache() {  // thread exit: hand everything to the shared lists
+  BufferPool& pool = instance();
+  std::lock_guard<std::mutex> lock(pool.m_mutex);
+  for (int i = 0; i < BUFFER_SIZE_CLASSES; ++i) {
+    pool.m_free[i].insert(pool.m_free[i].end(), lists[i].begin(), lists[i].end());
+  }
+}
+
+inline BufferPool::LocalCache& BufferPool::localCache() {
+  static thread_local LocalCache cache;
+  return cache;
+}
+
+inline int BufferPool::sizeClass(size_t size) {
+  for (int i = 0; i < BUFFER_SIZE_CLASSES; ++i) {
+    if (size <= classCapacity(i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+inline Buffer* BufferPool::allocate(size_t capacity, int size_class) {
+  m_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  void* memory = malloc(sizeof(Buffer) + capacity);
+  if (memory == nullptr) {
+    throw std::bad_alloc();
+  }
+  Buffer* buffer = new (memory) Buffer();
+  buffer->m_capacity = static_cast<uint32_t>(capacity);
+  buffer->m_size_class = size_class;
+  return buffer;
+}
+
+// ----------------------------------------------
+inline BufferRef BufferPool::acquire(size_t size) {
+  int size_class = sizeClass(size);
+  Buffer* buffer = nullptr;
+  if (size_class < 0) {
+    buffer = allocate(size, -1);
+  } else {
+    LocalCache& cache = localCache();
+    std::vector<Buffer*>& local = cache.lists[size_class];
+    ++cache.acquired[size_class];
+    if (local.empty()) {  // refill from the shared list
+      std::lock_guard<std::mutex> lock(m_mutex);
+      std::vector<Buffer*>& shared = m_free[size_class];
+      size_t count = std::min(shared.size(), static_cast<size_t>(BUFFER_BATCH));
+      local.insert(local.end(), shared.end() - count, shared.end());
+      shared.resize(shared.size() - count);
+    }
+    if (local.empty()) {
+      buffer = allocate(classCapacity(size_class), size_class);
+    } else {
+      buffer = local.back();
+      local.pop_back();
+      m_reused.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  buffer->m_references.store(1, std::memory_order_relaxed);
+  buffer->m_size = static_cast<uint32_t>(size);
+  return BufferRef(buffer);
+}
+
+inline void BufferPool::release(Buffer* buffer) {
+  if (buffer->m_size_class < 0) {
+    buffer->~Buffer();
+    free(buffer);
+    return;
+  }
+  LocalCache& cache = localCache();
+  int size_class = buffer->m_size_class;
+  std::vector<Buffer*>& local = cache.lists[size_class];
+  local.push_back(buffer);
+  // producer and consumer threads differ: give a batch back, right away if this one hardly acquires
+  size_t limit = cache.acquired[size_class] >= BUFFER_BATCH ? BUFFER_LOCAL_LIMIT : BUFFER_BATCH - 1;
+  if (local.size() > limit) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<Buffer*>& shared = m_free[size_class];
+    shared.insert(shared.end(), local.end() - BUFFER_BATCH, local.end());
+    local.resize(local.size() - BUFFER_BATCH);
+    cache.acquired[size_class] = 0;
+  }
+}
+
+#endif  // BUFFER__H__
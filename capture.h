@@ -0,0 +1,284 @@
+#ifndef CAPTURE__H__
+#define CAPTURE__H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "logger.h"
+#include "protocol.h"
+
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_HEADER_SIZE 16  // magic, then the wall clock time capture started at, ns
+#define CAPTURE_RECORD_SIZE 17  // time, peer, kind and size ahead of a record's bytes
+#define CAPTURE_FLUSH_BYTES (256 * 1024)  // the writer's thread is woken up once this much is pending
+#define CAPTURE_FLUSH_MS 100
+#define CAPTURE_MAX_PENDING_BYTES (64 * 1024 * 1024)  // records beyond it are dropped rather than waited for
+
+enum CaptureKind : uint8_t {
+  CAPTURE_OPEN = 1,   // a connection accepted, no bytes
+  CAPTURE_FRAME = 2,  // a frame as it came in, compressed or not
+  CAPTURE_CLOSE = 3,
+  CAPTURE_GAP = 4     // records of the connection were dropped from here on, its stream can't be replayed
+};
+
+struct CaptureRecord {
+  int64_t time_ns;  // since capture started
+  int peer;         // Server's id of the connection
+  CaptureKind kind;
+  Slice data;
+};
+
+/**
+ * Traffic capture: what every connection sent, frame by frame, with the time Server got to each frame.
+ *
+ * File layout, little-endian: "CHATCAP1", int64 wall clock ns of the start, then records of int64 ns
+ * since the start, int32 peer id, uint8 kind, uint32 size and that many bytes. Frames are recorded as
+ * they were received, deflated ones included, so a replay feeds a server exactly the same streams.
+ *
+ * Any thread records: the record is appended to a pending buffer under a mutex, and the capture's own
+ * thread writes whatever is pending with one write(). A disk slower than the traffic costs dropped
+ * records, counted, never a stalled event loop. A connection that lost a record gets a CAPTURE_GAP
+ * ahead of its next record that makes it into the file, so a replay leaves out its broken stream.
+ * The file is readable by the server's user only, it holds everything the clients sent.
+ */
+class CaptureWriter {
+public:
+  explicit CaptureWriter(const std::string& path);  // throws CaptureException
+  ~CaptureWriter();
+
+  void record(CaptureKind kind, int peer, Slice data = Slice());
+
+  uint64_t records() const;
+  uint64_t dropped() const;
+
+private:
+  int m_file;
+  int64_t m_start;  // steady clock, ns
+  mutable std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::string m_pending;  // guarded by m_mutex
+  uint64_t m_records;     // ... as well
+  uint64_t m_dropped;     // ... as well
+  std::unordered_set<int> m_gaps;  // peers whose records were dropped since the last one written, ... as well
+  bool m_is_stopped;      // ... as well
+  std::thread m_thread;
+
+  static int64_t now();
+  void append(CaptureKind kind, int peer, Slice data, int64_t time_ns);  // under m_mutex
+  void run();
+  bool writeAll(const std::string& data);
+
+  CaptureWriter(const CaptureWriter&) = delete;
+  CaptureWriter& operator = (const CaptureWriter&) = delete;
+};
+
+/* Reads a capture file through a read-only mapping, records in the order they were written */
+// --------------------------------------------------------------------------------------------------------------------
+class CaptureReader {
+public:
+  explicit CaptureReader(const std::string& path);  // throws CaptureException
+  ~CaptureReader();
+
+  bool next(CaptureRecord* record);  // false at the end, or at a record cut short by a crash
+  void rewind() { m_offset = CAPTURE_HEADER_SIZE; }
+  int64_t startedAt() const { return m_started_at; }  // wall clock, ns
+  size_t size() const { return m_size; }
+
+private:
+  const char* m_data;
+  size_t m_size;
+  size_t m_offset;
+  int64_t m_started_at;
+
+  CaptureReader(const CaptureReader&) = delete;
+  CaptureReader& operator = (const CaptureReader&) = delete;
+};
+
+struct CaptureException {};
+
+// ----------------------------------------------
+inline CaptureWriter::CaptureWriter(const std::string& path)
+  : m_start(now()), m_records(0), m_dropped(0), m_is_stopped(false) {
+  m_file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (m_file >= 0) {
+    fchmod(m_file, 0600);  // a file that was there keeps its mode otherwise
+  }
+  if (m_file < 0) {
+    ERR("Failed to open capture file %s: %s", path.c_str(), strerror(errno));
+    throw CaptureException();
+  }
+  std::string header(CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+  timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  int64_t started_at = wall.tv_sec * 1000000000LL + wall.tv_nsec;
+  header.append(reinterpret_cast<const char*>(&started_at), sizeof(started_at));
+  if (!writeAll(header)) {
+    ERR("Failed to write capture file %s: %s", path.c_str(), strerror(errno));
+    close(m_file);
+    throw CaptureException();
+  }
+  m_thread = std::thread(&CaptureWriter::run, this);
+}
+
+inline CaptureWriter::~CaptureWriter() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_is_stopped = true;
+  }
+  m_ready.notify_one();
+  m_thread.join();  // writes what is still pending
+  close(m_file);
+}
+
+inline int64_t CaptureWriter::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void CaptureWriter::record(CaptureKind kind, int peer, Slice data) {
+  bool is_full = false;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_pending.size() + CAPTURE_RECORD_SIZE + data.size > CAPTURE_MAX_PENDING_BYTES) {
+      ++m_dropped;
+      m_gaps.insert(peer);
+      return;
+    }
+    size_t before = m_pending.size();
+    int64_t time_ns = now() - m_start;  // taken under the lock, so the file is in time order
+    for (int it : m_gaps) {  // a few bytes each, beyond the limit if need be
+      append(CAPTURE_GAP, it, Slice(), time_ns);
+    }
+    m_gaps.clear();
+    append(kind, peer, data, time_ns);
+    ++m_records;
+    is_full = m_pending.size() >= CAPTURE_FLUSH_BYTES && before < CAPTURE_FLUSH_BYTES;
+  }
+  if (is_full) {  // once, when the buffer crosses the threshold
+    m_ready.notify_one();
+  }
+}
+
+inline void CaptureWriter::append(CaptureKind kind, int peer, Slice data, int64_t time_ns) {
+  char header[CAPTURE_RECORD_SIZE];
+  int32_t id = peer;
+  uint32_t size = static_cast<uint32_t>(data.size);
+  memcpy(header, &time_ns, sizeof(time_ns));
+  memcpy(header + 8, &id, sizeof(id));
+  header[12] = static_cast<char>(kind);
+  memcpy(header + 13, &size, sizeof(size));
+  m_pending.append(header, CAPTURE_RECORD_SIZE);
+  m_pending.append(data.data, data.size);
+}
+
+inline uint64_t CaptureWriter::records() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_records;
+}
+
+inline uint64_t CaptureWriter::dropped() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_dropped;
+}
+
+inline void CaptureWriter::run() {
+  std::string writing;
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    m_ready.wait_for(lock, std::chrono::milliseconds(CAPTURE_FLUSH_MS),
+                     [this]() { return m_is_stopped || m_pending.size() >= CAPTURE_FLUSH_BYTES; });
+    bool is_stopped = m_is_stopped;
+    writing.clear();
+    writing.swap(m_pending);
+    lock.unlock();
+    if (!writing.empty() && !writeAll(writing)) {
+      ERR("Failed to write capture file: %s", strerror(errno));
+    }
+    lock.lock();
+    if (is_stopped) {
+      break;
+    }
+  }
+}
+
+inline bool CaptureWriter::writeAll(const std::string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t result = write(m_file, data.data() + written, data.size() - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    written += result;
+  }
+  return true;
+}
+
+/* Чтение файла записи трафика */
+// --------------------------------------------------------------------------------------------------------------------
+inline CaptureReader::CaptureReader(const std::string& path)
+  : m_data(nullptr), m_size(0), m_offset(CAPTURE_HEADER_SIZE), m_started_at(0) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    ERR("Failed to open capture file %s: %s", path.c_str(), strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw CaptureException();
+  }
+  m_size = info.st_size;
+  void* data = m_size >= CAPTURE_HEADER_SIZE ? mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);  // the mapping keeps the file
+  if (data == MAP_FAILED) {
+    ERR("Failed to map capture file %s", path.c_str());
+    throw CaptureException();
+  }
+  m_data = static_cast<const char*>(data);
+  if (memcmp(m_data, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+    ERR("Not a capture file: %s", path.c_str());
+    munmap(const_cast<char*>(m_data), m_size);
+    throw CaptureException();
+  }
+  madvise(const_cast<char*>(m_data), m_size, MADV_SEQUENTIAL);
+  memcpy(&m_started_at, m_data + CAPTURE_MAGIC_SIZE, sizeof(m_started_at));
+}
+
+inline CaptureReader::~CaptureReader() {
+  munmap(const_cast<char*>(m_data), m_size);
+}
+
+inline bool CaptureReader::next(CaptureRecord* record) {
+  if (m_size - m_offset < CAPTURE_RECORD_SIZE) {
+    return false;
+  }
+  const char* header = m_data + m_offset;
+  int32_t peer = 0;
+  uint32_t size = 0;
+  memcpy(&record->time_ns, header, sizeof(record->time_ns));
+  memcpy(&peer, header + 8, sizeof(peer));
+  memcpy(&size, header + 13, sizeof(size));
+  if (m_size - m_offset - CAPTURE_RECORD_SIZE < size) {
+    return false;
+  }
+  record->peer = peer;
+  record->kind = static_cast<CaptureKind>(header[12]);
+  record->data = Slice(header + CAPTURE_RECORD_SIZE, size);
+  m_offset += CAPTURE_RECORD_SIZE + size;
+  return true;
+}
+
+#endif  // CAPTURE__H__
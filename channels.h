@@ -0,0 +1,167 @@
+#ifndef CHANNELS__H__
+#define CHANNELS__H__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "protocol.h"
+
+struct SliceHash {
+  size_t operator () (const Slice& slice) const {
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+    for (size_t i = 0; i < slice.size; ++i) {
+      hash = (hash ^ static_cast<unsigned char>(slice.data[i])) * 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash);
+  }
+};
+
+struct SliceEqual {
+  bool operator () (const Slice& lhs, const Slice& rhs) const {
+    return lhs.size == rhs.size && memcmp(lhs.data, rhs.data, lhs.size) == 0;
+  }
+};
+
+/**
+ * Channel name -> subscribers, so a channel message costs O(channel size) instead of O(all peers).
+ *
+ * Membership is stored twice, in the channel's dense member array and in the item's own list of
+ * subscriptions, each side remembering its position on the other one; join, leave and dropping
+ * all subscriptions of a disconnected item are O(1) per channel via swap-remove. Lookups take
+ * a Slice and do not allocate. Not thread-safe, the owner serializes access.
+ */
+template <typename T>
+class ChannelIndex {
+public:
+  struct Channel;
+
+  struct Subscription {  // item's side, T keeps a std::vector<Subscription> named subscriptions
+    Channel* channel;
+    size_t position;  // in channel->members
+    uint64_t since;   // the owner's mark of when it joined
+  };
+
+  struct Member {
+    T* item;
+    int key;
+    size_t subscription;  // position in item->subscriptions
+  };
+
+  struct Channel {
+    std::string name;
+    std::vector<Member> members;
+  };
+
+  ChannelIndex() {}
+  ~ChannelIndex();
+
+  bool join(T* item, int key, Slice name, uint64_t since = 0);  // false if already subscribed
+  bool leave(T* item, Slice name);          // false if not subscribed
+  void leaveAll(T* item);
+
+  template <typename Function>
+  size_t forEach(Slice name, Function function) const;  // function(int key, T& item), returns members count
+
+  size_t size() const { return m_channels.size(); }
+
+private:
+  std::unordered_map<Slice, Channel*, SliceHash, SliceEqual> m_channels;  // keys point into Channel::name
+
+  void unsubscribe(T* item, size_t subscription);
+
+  ChannelIndex(const ChannelIndex&) = delete;
+  ChannelIndex& operator = (const ChannelIndex&) = delete;
+};
+
+// ----------------------------------------------
+template <typename T>
+ChannelIndex<T>::~ChannelIndex() {
+  for (auto& it : m_channels) {
+    delete it.second;
+  }
+}
+
+template <typename T>
+bool ChannelIndex<T>::join(T* item, int key, Slice name, uint64_t since) {
+  Channel* channel = nullptr;
+  auto it = m_channels.find(name);
+  if (it == m_channels.end()) {
+    channel = new Channel();
+    channel->name = name.str();
+    m_channels.emplace(Slice(channel->name), channel);
+  } else {
+    channel = it->second;
+    for (auto& subscription : item->subscriptions) {
+      if (subscription.channel == channel) {
+        return false;
+      }
+    }
+  }
+  channel->members.push_back(Member{item, key, item->subscriptions.size()});
+  item->subscriptions.push_back(Subscription{channel, channel->members.size() - 1, since});
+  return true;
+}
+
+template <typename T>
+bool ChannelIndex<T>::leave(T* item, Slice name) {
+  SliceEqual equal;
+  for (size_t i = 0; i < item->subscriptions.size(); ++i) {
+    if (equal(Slice(item->subscriptions[i].channel->name), name)) {
+      unsubscribe(item, i);
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename T>
+void ChannelIndex<T>::leaveAll(T* item) {
+  while (!item->subscriptions.empty()) {
+    unsubscribe(item, item->subscriptions.size() - 1);
+  }
+}
+
+template <typename T>
+void ChannelIndex<T>::unsubscribe(T* item, size_t subscription) {
+  Subscription removed = item->subscriptions[subscription];
+  Channel* channel = removed.channel;
+
+  // swap-remove from the channel, fix the moved member's back reference
+  channel->members[removed.position] = channel->members.back();
+  channel->members.pop_back();
+  if (removed.position < channel->members.size()) {
+    Member& moved = channel->members[removed.position];
+    moved.item->subscriptions[moved.subscription].position = removed.position;
+  }
+
+  // swap-remove from the item, fix the moved subscription's back reference
+  item->subscriptions[subscription] = item->subscriptions.back();
+  item->subscriptions.pop_back();
+  if (subscription < item->subscriptions.size()) {
+    Subscription& moved = item->subscriptions[subscription];
+    moved.channel->members[moved.position].subscription = subscription;
+  }
+
+  if (channel->members.empty()) {
+    m_channels.erase(Slice(channel->name));
+    delete channel;
+  }
+}
+
+template <typename T>
+template <typename Function>
+size_t ChannelIndex<T>::forEach(Slice name, Function function) const {
+  auto it = m_channels.find(name);
+  if (it == m_channels.end()) {
+    return 0;
+  }
+  const std::vector<Member>& members = it->second->members;
+  for (const Member& member : members) {
+    function(member.key, *member.item);
+  }
+  return members.size();
+}
+
+#endif  // CHANNELS__H__
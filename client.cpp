@@ -1,7 +1,11 @@
-#include <chrono>
+#include <atomic>
+#include <condition_variable>
 #include <ctime>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -9,10 +13,22 @@
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include "compression.h"
+#include "loadgen.h"
 #include "logger.h"
 #include "message.h"
+#include "protocol.h"
+#include "render.h"
+#include "replay.h"
+#include "resume.h"
+#include "shmring.h"
+
+#define RECONNECT_MIN_DELAY_MS 100    // backoff of the first attempt, doubled by every next one
+#define RECONNECT_MAX_DELAY_MS 10000
 
 /* Объявление класса Клиента */
 // --------------------------------------------------------------------------------------------------------------------
@@ -25,40 +41,129 @@ public:
   void run();
 
 private:
-  int m_id;
-  int m_socket;
+  std::atomic<int> m_id;  // kept when a session is resumed after a reconnect
+  int m_socket;  // replaced by receiver thread only, senders take m_socket_mutex
+  std::unique_ptr<ShmChannel> m_channel;  // frames go through shared memory instead, replaced with m_socket
+  std::mutex m_socket_mutex;
+  std::atomic<int> m_protocol;  // wire format version agreed with Server, 0 - legacy text
+  std::atomic<int> m_compression;  // agreed with Server, set by receiver thread
+  Deflater m_deflater;  // this connection's stream to Server, guarded by m_socket_mutex
+  Inflater m_inflater;  // Server's frames, each compressed on its own
+  std::string m_inflated;
+  FrameDecoder m_decoder;
+  SequenceWindow m_sequences;  // of the messages seen, to resume from and drop those seen twice, receiver thread only
+  std::string m_resume_token;  // Server's secret of this session, receiver thread only
+  bool m_is_resuming;  // HELLO with the previous id is sent, receiver thread only
+  Renderer m_renderer;  // terminal output
   std::string m_ip_address;
   std::string m_port;
+  std::string m_unix_path;  // Server on the same host: its unix socket instead of the port
+  std::string m_shm_path;   // ... or a shared memory channel set up over this one, preferred
 
   bool m_is_connected;
-  bool m_is_stopped;
+  std::atomic<bool> m_is_stopped;
+  std::mutex m_stop_mutex;
+  std::condition_variable m_stop_signal;  // wakes up a reconnect backoff
+  std::thread m_receiver;
+  std::mt19937 m_random;
 
   std::string m_name;
 
   bool readConfiguration(const std::string& config_file);
+  bool connectToServer();
+  bool handshake(bool is_resuming);
   void receiverThread();
+  void reconnect();
   void end();
 
-  Message getMessage(int socket, bool* is_closed);
-  void sendMessage(const Message& message) const;
+  bool getFrame(Frame* frame, bool* is_closed, bool is_hello = false);
+  bool waitChannel();
+  bool write(const std::string& raw);  // under m_socket_mutex
+  bool sendFrame(const std::string& raw);
+  void sendMessage(const Message& message);
+  bool handleCommand(const std::string& line, Message* message);
 };
 
 struct ClientException {};
 
+// "IP: <address>" and "Port: <port>" lines, then optional "Unix: <socket path>" and "Shm: <socket path>"
+static bool readConfiguration(const std::string& config_file, std::string* ip_address, std::string* port,
+                              std::string* unix_path, std::string* shm_path) {
+  bool result = true;
+  std::fstream fs;
+  fs.open(config_file, std::fstream::in);
+
+  if (fs.is_open()) {
+    std::string line;
+    // ip address
+    std::getline(fs, line);
+    int i1 = line.find_first_of(' ');
+    *ip_address = line.substr(i1 + 1);
+    DBG("IP address: %s", ip_address->c_str());
+    // port
+    std::getline(fs, line);
+    int i2 = line.find_first_of(' ');
+    *port = line.substr(i2 + 1);
+    DBG("Port: %s", port->c_str());
+    // local transports
+    while (std::getline(fs, line)) {
+      size_t space = line.find_first_of(' ');
+      if (line.find("Unix:") == 0 && space != std::string::npos) {
+        *unix_path = line.substr(space + 1);
+        DBG("Unix socket: %s", unix_path->c_str());
+      } else if (line.find("Shm:") == 0 && space != std::string::npos) {
+        *shm_path = line.substr(space + 1);
+        DBG("Shared memory socket: %s", shm_path->c_str());
+      }
+    }
+    fs.close();
+  } else {
+    ERR("Failed to open configure file: %s", config_file.c_str());
+    result = false;
+  }
+  return result;
+}
+
 /* Реализация всех функций-членов класса Клиента */
 // --------------------------------------------------------------------------------------------------------------------
 Client::Client(const std::string& name, const std::string& config_file)
-  : m_id(-1), m_socket(-1), m_ip_address(""), m_port("http"), m_is_connected(false), m_is_stopped(false), m_name(name) {
+  : m_id(-1), m_socket(-1), m_protocol(0), m_compression(COMPRESSION_NONE), m_deflater(true), m_inflater(false), m_is_resuming(false), m_ip_address(""), m_port("http"), m_is_connected(false), m_is_stopped(false), m_random(std::random_device()()), m_name(name) {
   if (!readConfiguration(config_file)) {
     throw ClientException();
   }
 }
 
 Client::~Client() {
+  m_renderer.stop();  // shows what is left
 }
 
 // ----------------------------------------------
 void Client::init() {
+  m_is_connected = connectToServer();
+}
+
+bool Client::connectToServer() {
+  if (!m_shm_path.empty() || !m_unix_path.empty()) {  // on the same host, no TCP
+    bool is_shm = !m_shm_path.empty();
+    int connected = connectLocal(is_shm ? m_shm_path : m_unix_path);
+    std::unique_ptr<ShmChannel> channel;
+    if (connected >= 0 && is_shm) {
+      channel.reset(ShmChannel::receiveSetup(connected));
+      if (!channel) {
+        close(connected);
+        connected = -1;
+      }
+    }
+    if (connected < 0) {
+      ERR("Failed to connect to Server at %s", (is_shm ? m_shm_path : m_unix_path).c_str());
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(m_socket_mutex);
+    m_socket = connected;
+    m_channel = std::move(channel);
+    return true;
+  }
+
   // prepare address structure
   addrinfo hints;
   addrinfo* server_info;
@@ -70,31 +175,35 @@ void Client::init() {
   int status = getaddrinfo(m_ip_address.c_str(), m_port.c_str(), &hints, &server_info);
   if (status != 0) {
     ERR("Failed to prepare address structure: %s", gai_strerror(status));  // see error message
-    throw ClientException();
+    return false;
   }
 
   // establish connection
   addrinfo* ptr = server_info;
+  int connected = -1;
 
   for (; ptr != nullptr; ptr = ptr->ai_next) {  // loop through all the results
-    if ((m_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    if ((connected = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
       continue;  // failed to get connection socket
     }
-    if (connect(m_socket, server_info->ai_addr, server_info->ai_addrlen) == -1) {
-      close(m_socket);
+    if (connect(connected, ptr->ai_addr, ptr->ai_addrlen) == -1) {
+      close(connected);
       continue;  // failed to connect to a particular server
     }
     break;  // connect to the first particular server we can
   }
 
+  freeaddrinfo(server_info);  // release address stucture and remove from linked list
+
   if (ptr == nullptr) {
     ERR("Failed to connect to Server");
-    m_is_connected = false;
-  } else {
-    m_is_connected = true;
+    return false;
   }
-
-  freeaddrinfo(server_info);  // release address stucture and remove from linked list
+  int enable = 1;  // one message per typed line, nothing to coalesce
+  setsockopt(connected, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  std::lock_guard<std::mutex> lock(m_socket_mutex);
+  m_socket = connected;
+  return true;
 }
 
 // ----------------------------------------------
@@ -104,138 +213,414 @@ void Client::run() {
     throw ClientException();
   }
 
-  // receive id of this peer from Server
-  char buffer[64];
-  memset(buffer, 0, 64);
-  int read_bytes = recv(m_socket, buffer, MESSAGE_SIZE, 0);
-  if (read_bytes <= 0) {
-    DBG("Connection closed: failed to receive hello from Server");
+  m_renderer.start();
+  if (!handshake(false)) {
     end();
     return;
   }
-  m_id = std::atoi(buffer);
-  printf("Server has assigned id to this peer: %i\n", m_id);
-
-  std::thread t(&Client::receiverThread, this);
-  t.detach();
+  m_receiver = std::thread(&Client::receiverThread, this);
 
   Message message;
-  message.id = m_id;
   message.login = m_name;
 
-  std::ostringstream oss;
   while (!m_is_stopped && getline(std::cin, message.text)) {
     if (message.text == "!exit") {
-      m_is_stopped = true;
-      return;
+      break;
     }
+    if (handleCommand(message.text, &message)) {
+      continue;
+    }
+    message.id = m_id;
     sendMessage(message);
   }
+  end();
 }
 
-// ----------------------------------------------
-bool Client::readConfiguration(const std::string& config_file) {
-  bool result = true;
-  std::fstream fs;
-  fs.open(config_file, std::fstream::in);
+// the greeting of a new connection; resuming - ask Server for the session of the previous one
+bool Client::handshake(bool is_resuming) {
+  // receive id of this peer from Server
+  Frame hello;
+  bool is_closed = false;
+  int id = -1;
+  int server_version = 0;
+  if (!getFrame(&hello, &is_closed, true) || hello.type != FRAME_TEXT || !parseTextHello(hello.payload, &id, &server_version)) {
+    DBG("Connection closed: failed to receive hello from Server");
+    return false;
+  }
+  m_is_resuming = is_resuming && server_version >= 1;
+  if (!m_is_resuming) {
+    m_id = id;
+    m_renderer.system("Server has assigned id to this peer: " + std::to_string(id));
+  }
 
-  if (fs.is_open()) {
-    std::string line;
-    // ip address
-    std::getline(fs, line);
-    int i1 = line.find_first_of(' ');
-    m_ip_address = line.substr(i1 + 1);
-    DBG("IP address: %s", m_ip_address.c_str());
-    // port
-    std::getline(fs, line);
-    int i2 = line.find_first_of(' ');
-    m_port = line.substr(i2 + 1);
-    DBG("Port: %s", m_port.c_str());
-    fs.close();
-  } else {
-    ERR("Failed to open configure file: %s", config_file.c_str());
-    result = false;
+  // switch to binary frames if Server supports them, its answer is handled by receiver thread
+  m_protocol = std::min(server_version, PROTOCOL_VERSION);
+  if (m_protocol >= 1) {
+    std::string request;
+    encodeHello(request, m_protocol, m_is_resuming ? m_id.load() : -1, COMPRESSION_DEFLATE,
+                m_is_resuming ? m_sequences.watermark() : 0, m_is_resuming ? Slice(m_resume_token) : Slice());
+    sendFrame(request);
+    DBG("Requested protocol version %i", m_protocol.load());
   }
-  return result;
+  return true;
+}
+
+// ----------------------------------------------
+bool Client::readConfiguration(const std::string& config_file) {
+  return ::readConfiguration(config_file, &m_ip_address, &m_port, &m_unix_path, &m_shm_path);
 }
 
 // ----------------------------------------------
 void Client::receiverThread() {
   while (!m_is_stopped) {
     // peers' messages
-    Message message = getMessage(m_socket, &m_is_stopped);
-
-    std::chrono::time_point<std::chrono::system_clock> end = std::chrono::system_clock::now();
-    std::time_t end_time = std::chrono::system_clock::to_time_t(end);
-    std::string timestamp(std::ctime(&end_time));
-    int i1 = timestamp.find_last_of('\n');
-    timestamp = timestamp.substr(0, i1);
-
-    printf("\e[5;00;33m%s\e[m :: \e[5;01;37m%s\e[m: %s\n", timestamp.c_str(), message.login.c_str(), message.text.c_str());
+    Frame frame;
+    bool is_closed = false;
+    if (!getFrame(&frame, &is_closed)) {
+      if (!m_is_stopped) {
+        reconnect();
+      }
+      continue;
+    }
+    if ((frame.flags & FRAME_FLAG_COMPRESSED) && !decompressFrame(m_inflater, &frame, &m_inflated)) {
+      ERR("Broken compressed frame[%zu bytes] from Server", frame.payload.size);
+      continue;
+    }
+    if (frame.type == FRAME_HELLO) {
+      int version = 0;
+      int compression = COMPRESSION_NONE;
+      int id = -1;
+      Slice token;
+      readHello(frame, &version, &compression, &id, nullptr, &token);
+      m_resume_token = token.str();  // a new one with every hello
+      m_compression = compression;
+      DBG("Server has confirmed protocol version %i, compression %i", version, compression);
+      if (m_is_resuming && id == m_id) {
+        m_renderer.system("Reconnected, missed messages follow");
+      } else if (m_is_resuming) {
+        m_id = id;
+        m_sequences.reset();
+        m_renderer.system("Reconnected, the session has expired, new id: " + std::to_string(id));
+      }
+      m_is_resuming = false;
+      continue;
+    }
+    uint8_t tag = 0;
+    uint32_t count = 0;
+    if (frame.type == FRAME_HISTORY && readHistory(frame, &tag, &count)) {
+      m_renderer.system(std::to_string(count) + " messages from history");  // end of a replay
+      continue;
+    }
+    MessageView message;
+    if (!MessageView::fromFrame(frame, &message)) {
+      FAT("ParseException on frame[type %i, %zu bytes]: %.*s", frame.type, frame.payload.size, (int) frame.payload.size, frame.payload.data);
+      continue;
+    }
+    if (!(frame.flags & FRAME_FLAG_HISTORY) && !m_sequences.add(message.sequence)) {
+      continue;  // sent again after a reconnect, but it had come before the connection was lost
+    }
+    m_renderer.message(message.channel, message.login, message.text, frame.flags & FRAME_FLAG_HISTORY);
   }  // while loop ending
+}
 
-  end();
+// until connected again or stopped, with randomized exponential backoff: clients dropped together
+// by a server restart don't all come back at the same moment
+void Client::reconnect() {
+  {
+    std::lock_guard<std::mutex> lock(m_socket_mutex);
+    close(m_socket);
+    m_socket = -1;
+    m_channel.reset();
+    m_compression = COMPRESSION_NONE;
+    m_deflater.reset();
+  }
+  m_renderer.system("Connection to Server lost, reconnecting...");
+  for (int attempt = 0; !m_is_stopped; ++attempt) {
+    m_decoder = FrameDecoder();
+    int limit = std::min(RECONNECT_MAX_DELAY_MS, RECONNECT_MIN_DELAY_MS << std::min(attempt, 16));
+    int delay = std::uniform_int_distribution<int>(0, limit)(m_random);
+    {
+      std::unique_lock<std::mutex> lock(m_stop_mutex);
+      if (m_stop_signal.wait_for(lock, std::chrono::milliseconds(delay), [this]() { return m_is_stopped.load(); })) {
+        return;
+      }
+    }
+    if (!connectToServer()) {
+      continue;
+    }
+    if (handshake(true)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(m_socket_mutex);
+    close(m_socket);
+    m_socket = -1;
+    m_channel.reset();
+  }
 }
 
 // ----------------------------------------------
 void Client::end() {
   DBG("Client closing...");
-  m_is_stopped = true;  // stop background receiver thread if any
-  close(m_socket);
+  {
+    std::lock_guard<std::mutex> lock(m_stop_mutex);
+    m_is_stopped = true;  // stop background receiver thread if any
+  }
+  m_stop_signal.notify_all();
+  {
+    std::lock_guard<std::mutex> lock(m_socket_mutex);
+    if (m_socket >= 0) {
+      shutdown(m_socket, SHUT_RDWR);  // wakes up its recv()
+    }
+  }
+  if (m_receiver.joinable()) {
+    m_receiver.join();
+  }
+  if (m_socket >= 0) {
+    close(m_socket);
+    m_socket = -1;
+  }
+  m_channel.reset();
 }
 
 // ----------------------------------------------
-Message Client::getMessage(int socket, bool* is_closed) {
-  char buffer[MESSAGE_SIZE];
-  memset(buffer, 0, MESSAGE_SIZE);
-  int read_bytes = recv(socket, buffer, MESSAGE_SIZE, 0);
-  if (read_bytes <= 0) {
-    if (read_bytes == -1) {
-      ERR("get response error: %s", strerror(errno));
-    } else if (read_bytes == 0) {
-      printf("\e[5;00;31mSystem: Server shutdown\e[m\n");
-    }
-    DBG("Connection closed");
-    *is_closed = true;
-    return Message::EMPTY;
-  }
-  try {
+// is_hello: Server's "<id>;v<n>" ends with NUL, but a legacy Server sends a bare "<id>" and nothing after it,
+// so without a version what the first read has brought is the whole hello
+bool Client::getFrame(Frame* frame, bool* is_closed, bool is_hello) {
+  bool is_read = false;
+  while (true) {
+    FrameDecoder::Status status = m_decoder.next(frame);
+    if (status == FrameDecoder::FRAME) {
+      return true;
+    }
+    if (status == FrameDecoder::BROKEN) {
+      ERR("Broken stream from Server");
+      *is_closed = true;
+      return false;
+    }
+    if (is_hello && is_read && m_decoder.pending().str().find(';') == std::string::npos &&
+        m_decoder.nextUnterminated(frame)) {
+      return true;
+    }
+
+    char* buffer = m_decoder.prepare(PROTOCOL_READ_SIZE);
+    int read_bytes = 0;
+    if (m_channel) {
+      read_bytes = m_channel->read(buffer, PROTOCOL_READ_SIZE);
+      if (read_bytes == 0 && waitChannel()) {
+        continue;
+      }
+    } else {
+      read_bytes = recv(m_socket, buffer, PROTOCOL_READ_SIZE, 0);
+    }
+    if (read_bytes <= 0) {
+      if (read_bytes == -1) {
+        ERR("get response error: %s", strerror(errno));
+      }
+      DBG("Connection closed");
+      *is_closed = true;
+      return false;
+    }
     DBG("Raw response[%i bytes]: %.*s", read_bytes, (int) read_bytes, buffer);
-    return Message::parse(buffer);
-  } catch (ParseException exception) {
-    FAT("ParseException on raw response[%i bytes]: %.*s", read_bytes, (int) read_bytes, buffer);
-    return Message::EMPTY;
+    m_decoder.commit(read_bytes);
+    is_read = true;
+  }
+}
+
+// the ring is empty: until Server writes into it, false - Server has closed the connection
+bool Client::waitChannel() {
+  if (!m_channel->sleepUntilData()) {
+    return true;
+  }
+  pollfd descriptors[2] = { { m_channel->event(), POLLIN, 0 }, { m_socket, POLLIN, 0 } };
+  if (poll(descriptors, 2, -1) < 0) {
+    return errno == EINTR;
+  }
+  if (descriptors[0].revents & POLLIN) {
+    m_channel->clearEvent();
+  }
+  return descriptors[1].revents == 0 || m_channel->available() > 0;  // nothing comes over the socket but its end
+}
+
+bool Client::write(const std::string& raw) {
+  if (m_socket < 0) {
+    return false;
+  }
+  if (m_channel) {
+    return m_channel->writeAll(raw.data(), raw.size(), m_socket);
+  }
+  return send(m_socket, raw.data(), raw.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(raw.size());
+}
+
+bool Client::sendFrame(const std::string& raw) {
+  std::lock_guard<std::mutex> lock(m_socket_mutex);
+  return write(raw);
+}
+
+void Client::sendMessage(const Message& message) {
+  if (!message.channel.empty() && m_protocol < 1) {  // reconnected to a legacy Server since "!to"
+    m_renderer.system("Server does not support channels, the message is not sent");
+    return;
+  }
+  std::string raw;
+  encodeMessage(MessageView(message), m_protocol, raw);
+  bool is_sent = false;
+  {
+    std::lock_guard<std::mutex> lock(m_socket_mutex);
+    std::string compressed;
+    if (m_socket >= 0 && m_compression != COMPRESSION_NONE && compressFrame(m_deflater, Slice(raw), compressed)) {
+      raw.swap(compressed);
+    }
+    is_sent = write(raw);
+  }
+  if (!is_sent) {
+    m_renderer.system("Not connected, the message is not sent");
+  }
+}
+
+// "!join <channel>", "!leave <channel>", "!to <channel>" (later messages go there), "!to" - to everybody,
+// "!history <count>" - last messages, "!since <seconds>" - messages of the last seconds
+bool Client::handleCommand(const std::string& line, Message* message) {
+  if (line.empty() || line[0] != '!') {
+    return false;
+  }
+  size_t space = line.find(' ');
+  std::string command = line.substr(0, space);
+  std::string channel = space == std::string::npos ? "" : line.substr(space + 1);
+
+  bool is_history = command == "!history" || command == "!since";
+  if (command != "!to" && command != "!join" && command != "!leave" && !is_history) {
+    return false;  // an ordinary message that happens to start with '!'
+  }
+  if (m_protocol < 1 && (command != "!to" || !channel.empty())) {  // a legacy text frame goes to everybody
+    m_renderer.system(std::string("Server does not support ") + (is_history ? "history" : "channels"));
+    return true;
+  }
+  if (command == "!to") {
+    message->channel = channel;
+    return true;
+  }
+  if (is_history) {
+    int value = std::atoi(channel.c_str());
+    if (value <= 0) {
+      m_renderer.system(command + " needs a positive number");
+      return true;
+    }
+    std::string raw;
+    if (command == "!history") {
+      encodeHistory(raw, FIELD_LAST, value);
+    } else {
+      encodeHistory(raw, FIELD_SINCE, static_cast<uint32_t>(std::time(nullptr) - value));
+    }
+    sendFrame(raw);
+    return true;
+  }
+  if (channel.empty()) {
+    m_renderer.system(command + " needs a channel name");
+    return true;
   }
+  std::string raw;
+  encodeChannelCommand(raw, command == "!join" ? FRAME_JOIN : FRAME_LEAVE, channel);
+  sendFrame(raw);
+  return true;
 }
 
-void Client::sendMessage(const Message& message) const {
-  size_t size = message.size() + 1;
-  char* raw = new char[size];
-  memset(raw, 0, size);
-  message.raw(raw);
-  send(m_socket, raw, size, 0);
-  delete [] raw;  raw = nullptr;
+/* Генератор нагрузки */
+// --------------------------------------------------------------------------------------------------------------------
+static int runBenchmark(int argc, char** argv) {
+  BenchConfig config;
+  std::string config_file = "local.cfg";
+  for (int i = 2; i < argc; ++i) {
+    std::string option(argv[i]);
+    size_t dash = option.find('-', 2);
+    if (option.find("--config=") == 0) {
+      config_file = option.substr(9);
+    } else if (option.find("--sessions=") == 0) {
+      config.sessions = std::atoi(option.c_str() + 11);
+    } else if (option.find("--senders=") == 0) {
+      config.senders = std::atoi(option.c_str() + 10);
+    } else if (option.find("--rate=") == 0) {
+      config.rate = std::atof(option.c_str() + 7);
+    } else if (option.find("--size=") == 0) {  // N or MIN-MAX
+      config.min_size = std::atol(option.c_str() + 7);
+      config.max_size = dash == std::string::npos ? config.min_size : std::atol(option.c_str() + dash + 1);
+    } else if (option.find("--duration=") == 0) {
+      config.duration_s = std::atoi(option.c_str() + 11);
+    } else if (option.find("--threads=") == 0) {
+      config.threads = std::atoi(option.c_str() + 10);
+    } else if (option == "--text") {
+      config.protocol = 0;
+    } else if (option == "--compress") {
+      config.compression = true;
+    } else if (option.find("--mux=") == 0) {
+      config.mux = std::atoi(option.c_str() + 6);
+    } else {
+      printf("Usage: %s --bench [--config=FILE] [--sessions=N] [--senders=N] [--rate=MSG_PER_S] "
+             "[--size=N|MIN-MAX] [--duration=S] [--threads=N] [--text] [--compress] [--mux=N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (config.sessions < 2 ||
+      !readConfiguration(config_file, &config.ip_address, &config.port, &config.unix_path, &config.shm_path)) {
+    return 1;
+  }
+  LoadGenerator generator(config);
+  return generator.run() ? 0 : 1;
+}
+
+/* Воспроизведение записанного трафика */
+// --------------------------------------------------------------------------------------------------------------------
+static int runReplay(int argc, char** argv) {
+  ReplayConfig config;
+  std::string config_file = "local.cfg";
+  for (int i = 1; i < argc; ++i) {
+    std::string option(argv[i]);
+    if (option.find("--replay=") == 0) {
+      config.capture_path = option.substr(9);
+    } else if (option.find("--config=") == 0) {
+      config_file = option.substr(9);
+    } else if (option == "--speed=max") {
+      config.speed = 0;
+    } else if (option.find("--speed=") == 0) {
+      config.speed = std::atof(option.c_str() + 8);
+    } else if (option.find("--threads=") == 0) {
+      config.threads = std::atoi(option.c_str() + 10);
+    } else if (option.find("--report=") == 0) {
+      config.report_path = option.substr(9);
+    } else if (option.find("--baseline=") == 0) {
+      config.baseline_path = option.substr(11);
+    } else {
+      printf("Usage: %s --replay=CAPTURE_FILE [--config=FILE] [--speed=N|max] [--threads=N] [--report=FILE] "
+             "[--baseline=FILE]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (!readConfiguration(config_file, &config.ip_address, &config.port, &config.unix_path, &config.shm_path)) {
+    return 1;
+  }
+  Replayer replayer(config);
+  return replayer.run() ? 0 : 1;
 }
 
 /* Точка входа в программу */
 // --------------------------------------------------------------------------------------------------------------------
 int main(int argc, char** argv) {
+  if (argc >= 2 && std::string(argv[1]) == "--bench") {
+    return runBenchmark(argc, argv);
+  }
+  if (argc >= 2 && std::string(argv[1]).find("--replay=") == 0) {
+    return runReplay(argc, argv);
+  }
+
   // read name
   std::string name = "user";
   if (argc >= 2) {
-    char buffer[64];
-    memset(buffer, 0, 64);
-    strncpy(buffer, argv[1], strlen(argv[1]));
-    name = std::string(buffer);
+    name = std::string(argv[1]);
   }
 
   // read configuration
   std::string config_file = "local.cfg";
   if (argc >= 3) {
-    char buffer[64];
-    memset(buffer, 0, 64);
-    strncpy(buffer, argv[1], strlen(argv[2]));
-    config_file = std::string(buffer);
+    config_file = std::string(argv[2]);
   }
   DBG("Configuration from file: %s", config_file.c_str());
 
@@ -0,0 +1,158 @@
+#ifndef COMPRESSION__H__
+#define COMPRESSION__H__
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <zlib.h>
+#include "protocol.h"
+
+#define COMPRESSION_MIN_BYTES 128  // smaller payloads go out as they are, deflate can't win much there
+#define COMPRESSION_WINDOW_BITS 15
+#define COMPRESSION_MEM_LEVEL 8
+
+/**
+ * Deflate of frame payloads, the scheme of WebSocket permessage-deflate (RFC 7692): a compressed
+ * payload is raw deflate data ended with a sync flush, without the flush's trailing 00 00 ff ff.
+ *
+ * A streaming context keeps its window from one payload to the next, so repeated logins and phrases
+ * become back-references, and the other side has to inflate every compressed payload in order.
+ * Without it every payload stands alone: compressed once, it can go to any number of recipients.
+ * Neither class is thread-safe.
+ */
+class Deflater {
+public:
+  explicit Deflater(bool is_streaming);
+  ~Deflater() { deflateEnd(&m_stream); }
+
+  bool compress(Slice payload, std::string& out);  // appends the compressed payload to out
+  void reset() { deflateReset(&m_stream); }  // a new stream, e.g. for a new connection
+  bool isStreaming() const { return m_is_streaming; }
+
+private:
+  z_stream m_stream;
+  bool m_is_streaming;
+
+  Deflater(const Deflater&) = delete;
+  Deflater& operator = (const Deflater&) = delete;
+};
+
+class Inflater {
+public:
+  explicit Inflater(bool is_streaming);
+  ~Inflater() { inflateEnd(&m_stream); }
+
+  bool decompress(Slice payload, std::string* out);  // false on corrupt data or a payload over the frame limit
+
+private:
+  z_stream m_stream;
+  bool m_is_streaming;
+
+  bool inflateInto(Slice input, std::string* out);
+
+  Inflater(const Inflater&) = delete;
+  Inflater& operator = (const Inflater&) = delete;
+};
+
+// ----------------------------------------------
+inline Deflater::Deflater(bool is_streaming): m_is_streaming(is_streaming) {
+  memset(&m_stream, 0, sizeof(m_stream));
+  deflateInit2(&m_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -COMPRESSION_WINDOW_BITS, COMPRESSION_MEM_LEVEL,
+               Z_DEFAULT_STRATEGY);  // negative window bits - raw deflate, no zlib header
+}
+
+inline bool Deflater::compress(Slice payload, std::string& out) {
+  size_t start = out.size();
+  size_t written = start;
+  m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(payload.data));
+  m_stream.avail_in = static_cast<uInt>(payload.size);
+  int status = Z_OK;
+  do {  // a sync flush is complete once deflate() leaves room in the output
+    out.resize(std::max(out.size() * 2, written + payload.size / 2 + 64));
+    m_stream.next_out = reinterpret_cast<Bytef*>(&out[written]);
+    m_stream.avail_out = static_cast<uInt>(out.size() - written);
+    status = deflate(&m_stream, Z_SYNC_FLUSH);
+    written = out.size() - m_stream.avail_out;
+  } while (status == Z_OK && m_stream.avail_out == 0);
+  if (!m_is_streaming) {
+    deflateReset(&m_stream);
+  }
+  if ((status != Z_OK && status != Z_BUF_ERROR) || written < start + 4) {
+    out.resize(start);
+    return false;
+  }
+  out.resize(written - 4);  // the 00 00 ff ff of the sync flush, the other side knows it is there
+  return true;
+}
+
+inline Inflater::Inflater(bool is_streaming): m_is_streaming(is_streaming) {
+  memset(&m_stream, 0, sizeof(m_stream));
+  inflateInit2(&m_stream, -COMPRESSION_WINDOW_BITS);
+}
+
+inline bool Inflater::decompress(Slice payload, std::string* out) {
+  static const char tail[4] = { 0, 0, static_cast<char>(0xff), static_cast<char>(0xff) };
+  out->clear();
+  bool result = inflateInto(payload, out) && inflateInto(Slice(tail, sizeof(tail)), out);
+  if (!m_is_streaming) {
+    inflateReset(&m_stream);
+  }
+  return result;
+}
+
+inline bool Inflater::inflateInto(Slice input, std::string* out) {
+  m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data));
+  m_stream.avail_in = static_cast<uInt>(input.size);
+  while (true) {
+    size_t used = out->size();
+    if (used >= PROTOCOL_MAX_FRAME_SIZE) {
+      return false;  // a bomb or a broken stream
+    }
+    out->resize(std::min<size_t>(std::max<size_t>(used * 2, 4096), PROTOCOL_MAX_FRAME_SIZE));
+    m_stream.next_out = reinterpret_cast<Bytef*>(&(*out)[used]);
+    m_stream.avail_out = static_cast<uInt>(out->size() - used);
+    int status = inflate(&m_stream, Z_SYNC_FLUSH);
+    out->resize(out->size() - m_stream.avail_out);
+    if (status != Z_OK && status != Z_BUF_ERROR && status != Z_STREAM_END) {
+      return false;
+    }
+    if (m_stream.avail_out > 0) {  // input is used up and nothing is left to flush
+      return m_stream.avail_in == 0 || status == Z_STREAM_END;
+    }
+  }
+}
+
+/* Compressed frames */
+// --------------------------------------------------------------------------------------------------------------------
+// the frame with its payload deflated and FRAME_FLAG_COMPRESSED set, appended to out; false - send it as it is
+inline bool compressFrame(Deflater& deflater, Slice frame, std::string& out) {
+  if (frame.size < PROTOCOL_HEADER_SIZE + COMPRESSION_MIN_BYTES || static_cast<uint8_t>(frame.data[0]) != PROTOCOL_MAGIC) {
+    return false;
+  }
+  size_t start = out.size();
+  out.append(frame.data, PROTOCOL_HEADER_SIZE);
+  if (!deflater.compress(Slice(frame.data + PROTOCOL_HEADER_SIZE, frame.size - PROTOCOL_HEADER_SIZE), out)) {
+    out.resize(start);
+    return false;
+  }
+  // a streaming context has taken the payload in already, it has to go compressed even if larger
+  if (!deflater.isStreaming() && out.size() - start >= frame.size) {
+    out.resize(start);
+    return false;
+  }
+  out[start + 3] = static_cast<char>(out[start + 3] | FRAME_FLAG_COMPRESSED);
+  writeUint32(static_cast<uint32_t>(out.size() - start - PROTOCOL_HEADER_SIZE), &out[start + 4]);
+  return true;
+}
+
+// payload of a compressed frame, inflated into out; the frame points there afterwards
+inline bool decompressFrame(Inflater& inflater, Frame* frame, std::string* out) {
+  if (!inflater.decompress(frame->payload, out)) {
+    return false;
+  }
+  frame->flags &= ~FRAME_FLAG_COMPRESSED;
+  frame->payload = Slice(*out);
+  return true;
+}
+
+#endif  // COMPRESSION__H__
@@ -0,0 +1,296 @@
+/**
+ * Fan-out through a real Server process, peers on socketpairs instead of TCP connections.
+ *
+ *   ./fanout [--server=PATH] [--modes=threads,epoll,uring] [--peers=10,100,1000] [--sizes=64,1024]
+ *            [--messages=N] [--window=N] [--json] [--baseline=FILE]
+ *
+ * For every mode, peer count and text size a server is started with --handoff, and this process
+ * poses as the one it replaces: it hands over one end of a socketpair per peer (handoff.h), so the
+ * server adopts them as binary peers without a hello and serves them from the first byte. The first
+ * peer sends --messages messages, keeping at most --window of them in flight, the others read every
+ * copy. A message's text starts with the time it was sent, latency is from then to its copy being
+ * decoded. The kernel's part is a unix socket write and read per copy, no TCP stack, so the numbers
+ * are mostly Server::sendMessage and the event loops.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "benchreport.h"
+#include "handoff.h"
+#include "histogram.h"
+#include "protocol.h"
+
+#ifndef FANOUT_SERVER_PATH
+#define FANOUT_SERVER_PATH "./server"
+#endif
+#define FANOUT_LOGIN "fanout"
+#define FANOUT_MAX_EVENTS 256
+#define FANOUT_START_TIMEOUT_MS 5000  // for the server to connect to the handoff socket
+#define FANOUT_IDLE_TIMEOUT_MS 5000   // no copy for this long ends a run
+
+struct FanoutConfig {
+  std::string server = FANOUT_SERVER_PATH;
+  std::vector<std::string> modes = { "threads", "epoll" };
+  std::vector<size_t> peers = { 10, 100, 1000 };
+  std::vector<size_t> sizes = { 64, 1024 };
+  size_t messages = 2000;  // per run
+  size_t window = 16;      // messages whose copies are not all in yet
+};
+
+struct Receiver {
+  int socket;
+  FrameDecoder decoder;
+
+  Receiver(): socket(-1) {}
+};
+
+static BenchReport g_report;
+
+static int64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename T>
+static std::vector<T> parseList(const std::string& list, T (*parse)(const std::string&)) {
+  std::vector<T> values;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) {
+      values.push_back(parse(item));
+    }
+  }
+  return values;
+}
+
+/* Запуск сервера и передача ему пиров */
+// --------------------------------------------------------------------------------------------------------------------
+// the server's process, -1 on failure; peers' own ends of the socketpairs go to sockets
+static std::string handoffPath() {
+  return "/tmp/fanout-" + std::to_string(getpid()) + ".handoff";
+}
+
+static pid_t startServer(const FanoutConfig& config, const std::string& mode, size_t peers, std::vector<int>* sockets) {
+  std::string path = handoffPath();
+  int listener = listenHandoff(path);
+  if (listener < 0) {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    std::string mode_option = "--mode=" + mode;
+    std::string handoff_option = "--handoff=" + path;
+    execl(config.server.c_str(), config.server.c_str(), "0", mode_option.c_str(), handoff_option.c_str(),
+          "--log-level=error", static_cast<char*>(nullptr));
+    _exit(127);
+  }
+
+  pollfd descriptor = { listener, POLLIN, 0 };
+  int successor = pid > 0 && poll(&descriptor, 1, FANOUT_START_TIMEOUT_MS) > 0 ? accept(listener, nullptr, nullptr) : -1;
+  close(listener);
+  if (successor < 0) {
+    unlink(path.c_str());
+    printf("Server %s did not start\n", config.server.c_str());
+    if (pid > 0) {
+      kill(pid, SIGKILL);
+      waitpid(pid, nullptr, 0);
+    }
+    return -1;
+  }
+
+  HandoffState state;
+  state.last_id = static_cast<int>(peers) + 1;
+  for (size_t i = 0; i < peers; ++i) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+      printf("Failed to create socketpair %zu: %s\n", i, strerror(errno));
+      break;
+    }
+    sockets->push_back(pair[0]);
+    HandoffPeer peer;
+    peer.id = static_cast<int>(i) + 1;
+    peer.socket = pair[1];
+    peer.protocol = PROTOCOL_VERSION;
+    state.peers.push_back(peer);
+  }
+  bool is_handed_over = state.peers.size() == peers && sendHandoff(successor, state);
+  close(successor);
+  for (auto& it : state.peers) {
+    close(it.socket);  // the server has its own descriptors of them now
+  }
+  if (!is_handed_over) {
+    printf("Failed to hand %zu peers over to the server\n", peers);
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    unlink(path.c_str());
+    return -1;
+  }
+  return pid;
+}
+
+static void stopServer(pid_t pid) {
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+  unlink(handoffPath().c_str());  // the server listens there for its own successor
+}
+
+/* Один прогон */
+// --------------------------------------------------------------------------------------------------------------------
+static bool run(const FanoutConfig& config, const std::string& mode, size_t peers, size_t size) {
+  std::vector<int> sockets;
+  pid_t pid = startServer(config, mode, peers, &sockets);
+  if (pid < 0) {
+    for (int it : sockets) {
+      close(it);
+    }
+    return false;
+  }
+
+  int sender = sockets[0];  // peer 1, its own messages don't come back to it
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  std::vector<Receiver> receivers(peers - 1);
+  for (size_t i = 0; i < receivers.size(); ++i) {
+    receivers[i].socket = sockets[i + 1];
+    fcntl(receivers[i].socket, F_SETFL, fcntl(receivers[i].socket, F_GETFL, 0) | O_NONBLOCK);
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = i;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, receivers[i].socket, &event);
+  }
+
+  std::string padding(size, 'x');
+  LatencyHistogram latency;
+  size_t expected = config.messages * receivers.size();
+  size_t copies = 0;
+  size_t sent = 0;
+  int64_t start = now();
+  int64_t last_copy = start;
+  epoll_event events[FANOUT_MAX_EVENTS];
+  while (copies < expected && now() - last_copy < FANOUT_IDLE_TIMEOUT_MS * 1000000LL) {
+    while (sent < config.messages && copies + config.window * receivers.size() >= (sent + 1) * receivers.size()) {
+      Message message;
+      message.id = 1;
+      message.login = FANOUT_LOGIN;
+      message.text = std::to_string(now()) + ":";
+      message.text += padding.substr(0, size - std::min(size, message.text.size()));
+      std::string raw;
+      encodeMessage(MessageView(message), PROTOCOL_VERSION, raw);
+      if (!handoffWriteAll(sender, raw.data(), raw.size())) {
+        printf("Failed to send: %s\n", strerror(errno));
+        sent = config.messages;
+        break;
+      }
+      ++sent;
+    }
+
+    int ready = epoll_wait(epoll_fd, events, FANOUT_MAX_EVENTS, 1);
+    for (int i = 0; i < ready; ++i) {
+      Receiver& receiver = receivers[events[i].data.u64];
+      while (true) {
+        char* buffer = receiver.decoder.prepare(PROTOCOL_READ_SIZE);
+        ssize_t read_bytes = recv(receiver.socket, buffer, PROTOCOL_READ_SIZE, 0);
+        if (read_bytes <= 0) {
+          break;  // EAGAIN, or closed: its copies are missing from the report
+        }
+        receiver.decoder.commit(read_bytes);
+        Frame frame;
+        MessageView view;
+        int64_t current = now();
+        while (receiver.decoder.next(&frame) == FrameDecoder::FRAME) {
+          if (MessageView::fromFrame(frame, &view) && view.login.str() == FANOUT_LOGIN) {
+            int64_t sent_at = std::strtoll(std::string(view.text.data, std::min<size_t>(view.text.size, 20)).c_str(), nullptr, 10);
+            latency.record(static_cast<uint64_t>(std::max<int64_t>(0, current - sent_at)));
+            ++copies;
+            last_copy = current;
+          }
+        }
+      }
+    }
+  }
+  double seconds = std::max(1e-9, (last_copy - start) / 1e9);
+
+  close(epoll_fd);
+  for (int it : sockets) {
+    close(it);
+  }
+  stopServer(pid);
+
+  g_report.add("fanout/" + mode, size, peers, {
+    { "copies_per_s", copies / seconds },
+    { "ns_per_message", seconds * 1e9 / std::max<size_t>(1, sent) },
+    { "latency_p50_us", latency.percentile(50) / 1e3 },
+    { "latency_p99_us", latency.percentile(99) / 1e3 },
+    { "latency_max_us", latency.max() / 1e3 },
+    { "lost_pct", expected == 0 ? 0.0 : 100.0 * (expected - copies) / expected }
+  });
+  return true;
+}
+
+/* Main */
+// --------------------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+  FanoutConfig config;
+  auto toSize = [](const std::string& item) { return static_cast<size_t>(std::atol(item.c_str())); };
+  auto toString = [](const std::string& item) { return item; };
+  for (int i = 1; i < argc; ++i) {
+    std::string option(argv[i]);
+    if (option.find("--server=") == 0) {
+      config.server = option.substr(9);
+    } else if (option.find("--modes=") == 0) {
+      config.modes = parseList<std::string>(option.substr(8), toString);
+    } else if (option.find("--peers=") == 0) {
+      config.peers = parseList<size_t>(option.substr(8), toSize);
+    } else if (option.find("--sizes=") == 0) {
+      config.sizes = parseList<size_t>(option.substr(8), toSize);
+    } else if (option.find("--messages=") == 0) {
+      config.messages = std::atol(option.c_str() + 11);
+    } else if (option.find("--window=") == 0) {
+      config.window = std::max(1L, std::atol(option.c_str() + 9));
+    } else if (option == "--json") {
+      g_report.setJson(true);
+    } else if (option.find("--baseline=") == 0) {
+      if (!g_report.loadBaseline(option.substr(11))) {
+        printf("No results in baseline %s\n", option.c_str() + 11);
+        return 1;
+      }
+    } else {
+      printf("Usage: %s [--server=PATH] [--modes=threads,epoll,uring] [--peers=10,100,1000] [--sizes=64,1024]\n"
+             "       [--messages=N] [--window=N] [--json] [--baseline=FILE]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  rlimit limit;  // a peer is two descriptors here and one in the server
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  bool result = true;
+  for (const std::string& mode : config.modes) {
+    for (size_t peers : config.peers) {
+      for (size_t size : config.sizes) {
+        result = run(config, mode, std::max<size_t>(2, peers), size) && result;
+      }
+    }
+  }
+  return result ? 0 : 1;
+}
@@ -0,0 +1,602 @@
+#ifndef FEDERATION__H__
+#define FEDERATION__H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "logger.h"
+#include "metrics.h"
+#include "outbound.h"
+#include "protocol.h"
+
+#define FEDERATION_NODE_SHIFT 24             // peer ids of node N start at N << FEDERATION_NODE_SHIFT
+#define FEDERATION_MAX_NODE 127
+#define FEDERATION_MAX_QUEUED_BYTES (64 * 1024 * 1024)  // per link, newer messages are dropped beyond
+#define FEDERATION_RECONNECT_MIN_MS 100      // doubled by every failed attempt
+#define FEDERATION_RECONNECT_MAX_MS 5000
+#define FEDERATION_CONNECT_TIMEOUT_MS 1000
+
+struct FederationException {};
+
+struct FederationNode {
+  int number;
+  std::string host;
+  std::string port;  // of its links
+};
+
+struct FederationConfig {
+  int node;  // this process, 0 - no federation
+  std::vector<FederationNode> nodes;  // all of them, this one included
+
+  FederationConfig(): node(0) {}
+
+  bool isEnabled() const { return node > 0; }
+  const FederationNode* find(int number) const;
+  bool read(const std::string& path);  // "Node: <number> <host>:<port>" lines, the format of local.cfg
+};
+
+bool resolveNode(const FederationNode& node, const char* port, sockaddr_in* address);  // its host's first IPv4 address
+bool isNodeAddress(const FederationNode& node, in_addr address);  // one of its host's addresses
+
+/**
+ * Persistent connection to another node, this node's messages go there. A thread of its own takes
+ * everything queued since its previous write and sends it with gather-writes of up to OUTBOUND_MAX_IOV
+ * frames, so the link batches by itself under load and adds no delay when idle. The frames are the
+ * binary buffers the local peers get, queueing one is a reference count increment. A broken connection
+ * is re-established with exponential backoff; frames not fully written go out again on the new one,
+ * and while the node is away up to FEDERATION_MAX_QUEUED_BYTES wait for it.
+ */
+class FederationLink {
+public:
+  FederationLink(const FederationNode& node, const FederationNode& local);
+  ~FederationLink() { stop(); }
+
+  void start();
+  void stop();
+  void push(const BufferRef& frame);  // any thread
+
+  const FederationNode& node() const { return m_node; }
+  bool isConnected() const { return m_is_connected.load(std::memory_order_relaxed); }
+
+  std::atomic<long> messages;  // written to the link
+  std::atomic<long> bytes;
+  std::atomic<long> writes;
+  std::atomic<long> dropped;   // the queue was full
+  std::atomic<long> connects;
+
+private:
+  FederationNode m_node;
+  FederationNode m_local;  // links go out from its host's address, the one the other node expects
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::vector<BufferRef> m_queue;  // guarded by m_mutex
+  size_t m_queued_bytes;           // ... as well
+  bool m_is_stopped;               // ... as well
+  int m_socket;                    // replaced by the link's thread under m_mutex
+  std::atomic<bool> m_is_connected;
+  std::thread m_thread;
+
+  // link's thread only
+  std::vector<BufferRef> m_sending;
+  size_t m_sent;    // frames of m_sending fully written
+  size_t m_offset;  // bytes of the next one written
+
+  void run();
+  int connectToNode() const;
+  bool writeSending(int socket);
+};
+
+/**
+ * Mesh of server processes, every node linked to every other one. Messages of a node's own peers are
+ * forwarded over its links; messages that come in over links are delivered to local peers only, so
+ * a message crosses the mesh once and every peer of every node gets it, as from a single server.
+ * Peer ids carry the node number, so they stay unique across the mesh.
+ *
+ * A node listens on its own host's address only and takes a link for the node it claims to be only
+ * from that node's host in the federation file. Links that ended are closed and their threads joined
+ * when the next one is accepted, so a node that keeps reconnecting costs nothing more.
+ */
+class Federation {
+public:
+  typedef std::function<void (const MessageView&)> Relay;
+
+  Federation(const FederationConfig& config, Relay relay);
+  ~Federation() { stop(); }
+
+  void start();  // links and the listener for other nodes' links
+  void interrupt();  // async-signal-safe, stop() does the rest
+  void stop();
+  void forward(const BufferRef& frame);  // a local peer's message, any thread
+
+  int firstId() const { return m_config.node << FEDERATION_NODE_SHIFT; }
+  std::string stats() const;
+
+private:
+  struct Inbound {  // link of another node, read by a thread of its own
+    int socket;
+    in_addr address;  // where it comes from
+    int node;  // from its hello, 0 - not yet
+    std::atomic<long> messages;
+    std::atomic<long> bytes;
+    std::atomic<bool> is_done;  // its thread has ended, the link can be closed
+    std::thread thread;
+
+    Inbound(int socket, in_addr address): socket(socket), address(address), node(0), messages(0), bytes(0), is_done(false) {}
+  };
+
+  FederationConfig m_config;
+  Relay m_relay;
+  std::vector<std::unique_ptr<FederationLink>> m_links;
+  int m_listen_socket;
+  std::atomic<bool> m_is_stopped;
+  std::thread m_accept_thread;
+  mutable std::mutex m_inbound_mutex;
+  std::vector<std::unique_ptr<Inbound>> m_inbound;  // guarded by m_inbound_mutex
+  long m_closed_messages[FEDERATION_MAX_NODE + 1];  // of the links closed, per node, ... as well
+  long m_closed_bytes[FEDERATION_MAX_NODE + 1];     // ... as well
+
+  void acceptLinks();  // other thread
+  void closeFinished();  // under m_inbound_mutex
+  void readLink(Inbound* inbound);  // other thread
+};
+
+/* Конфигурация */
+// --------------------------------------------------------------------------------------------------------------------
+inline const FederationNode* FederationConfig::find(int number) const {
+  for (auto& it : nodes) {
+    if (it.number == number) {
+      return &it;
+    }
+  }
+  return nullptr;
+}
+
+inline bool FederationConfig::read(const std::string& path) {
+  std::ifstream fs(path);
+  if (!fs.is_open()) {
+    ERR("Failed to open federation file: %s", path.c_str());
+    return false;
+  }
+  std::string line;
+  while (std::getline(fs, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    char host[256];
+    int number = 0;
+    int port = 0;
+    if (sscanf(line.c_str(), "Node: %d %255[^:]:%d", &number, host, &port) != 3 || number < 1 ||
+        number > FEDERATION_MAX_NODE || port <= 0 || find(number) != nullptr) {
+      ERR("Bad line in federation file %s: %s", path.c_str(), line.c_str());
+      return false;
+    }
+    nodes.push_back(FederationNode{number, host, std::to_string(port)});
+  }
+  if (find(node) == nullptr) {
+    ERR("Node %i is not in federation file %s", node, path.c_str());
+    return false;
+  }
+  return true;
+}
+
+inline bool resolveNode(const FederationNode& node, const char* port, sockaddr_in* address) {
+  addrinfo hints;
+  addrinfo* info = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(node.host.c_str(), port, &hints, &info) != 0) {
+    ERR("Failed to resolve node %i at %s", node.number, node.host.c_str());
+    return false;
+  }
+  memcpy(address, info->ai_addr, sizeof(*address));
+  freeaddrinfo(info);
+  return true;
+}
+
+inline bool isNodeAddress(const FederationNode& node, in_addr address) {
+  addrinfo hints;
+  addrinfo* info = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(node.host.c_str(), nullptr, &hints, &info) != 0) {
+    return false;
+  }
+  bool is_found = false;
+  for (addrinfo* it = info; it != nullptr && !is_found; it = it->ai_next) {
+    is_found = reinterpret_cast<sockaddr_in*>(it->ai_addr)->sin_addr.s_addr == address.s_addr;
+  }
+  freeaddrinfo(info);
+  return is_found;
+}
+
+/* Исходящая связь с другим узлом */
+// --------------------------------------------------------------------------------------------------------------------
+inline FederationLink::FederationLink(const FederationNode& node, const FederationNode& local)
+  : messages(0), bytes(0), writes(0), dropped(0), connects(0), m_node(node), m_local(local),
+    m_queued_bytes(0), m_is_stopped(false), m_socket(-1), m_is_connected(false), m_sent(0), m_offset(0) {}
+
+inline void FederationLink::start() {
+  m_thread = std::thread(&FederationLink::run, this);
+}
+
+inline void FederationLink::stop() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_is_stopped = true;
+    if (m_socket >= 0) {
+      shutdown(m_socket, SHUT_RDWR);  // a write blocked on a stuck node fails
+    }
+  }
+  m_ready.notify_one();
+  if (m_thread.joinable()) {
+    m_thread.join();
+  }
+}
+
+inline void FederationLink::push(const BufferRef& frame) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_queued_bytes + frame.size() > FEDERATION_MAX_QUEUED_BYTES) {
+      ++dropped;
+      return;
+    }
+    m_queue.push_back(frame);
+    m_queued_bytes += frame.size();
+    if (m_queue.size() > 1) {
+      return;  // the link's thread is awake already
+    }
+  }
+  m_ready.notify_one();
+}
+
+inline void FederationLink::run() {
+  int delay_ms = FEDERATION_RECONNECT_MIN_MS;
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (!m_is_stopped) {
+    if (m_socket < 0) {
+      lock.unlock();
+      int socket = connectToNode();
+      lock.lock();
+      if (socket < 0) {
+        m_ready.wait_for(lock, std::chrono::milliseconds(delay_ms), [this]() { return m_is_stopped; });
+        delay_ms = std::min(delay_ms * 2, FEDERATION_RECONNECT_MAX_MS);
+        continue;
+      }
+      m_socket = socket;
+      m_is_connected = true;
+      delay_ms = FEDERATION_RECONNECT_MIN_MS;
+      ++connects;
+      INF("Linked to node %i at %s:%s", m_node.number, m_node.host.c_str(), m_node.port.c_str());
+    }
+    if (m_sent == m_sending.size()) {  // everything queued meanwhile is the next batch
+      m_ready.wait(lock, [this]() { return !m_queue.empty() || m_is_stopped; });
+      if (m_is_stopped) {
+        break;
+      }
+      m_sending.clear();
+      m_sending.swap(m_queue);
+      m_queued_bytes = 0;
+      m_sent = 0;
+    }
+    int socket = m_socket;
+    lock.unlock();
+    bool is_written = writeSending(socket);
+    lock.lock();
+    if (!is_written) {
+      WRN("Link to node %i is broken, reconnecting", m_node.number);
+      close(m_socket);
+      m_socket = -1;
+      m_is_connected = false;
+      m_offset = 0;  // the partly written frame goes out again as a whole
+    }
+  }
+  if (m_socket >= 0) {
+    close(m_socket);
+    m_socket = -1;
+  }
+  m_is_connected = false;
+}
+
+inline int FederationLink::connectToNode() const {
+  sockaddr_in local;
+  sockaddr_in remote;
+  if (!resolveNode(m_local, "0", &local) || !resolveNode(m_node, m_node.port.c_str(), &remote)) {
+    return -1;
+  }
+  int socket = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  timeval timeout = { FEDERATION_CONNECT_TIMEOUT_MS / 1000, (FEDERATION_CONNECT_TIMEOUT_MS % 1000) * 1000 };
+  setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));  // bounds connect() as well
+  bool is_connected = socket >= 0 && bind(socket, reinterpret_cast<sockaddr*>(&local), sizeof(local)) == 0 &&
+                      connect(socket, reinterpret_cast<sockaddr*>(&remote), sizeof(remote)) == 0;
+  if (!is_connected) {
+    if (socket >= 0) {
+      close(socket);
+    }
+    return -1;
+  }
+  timeout = { 0, 0 };
+  setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  int enable = 1;
+  setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));  // batches are made here
+
+  std::string hello;
+  encodeHello(hello, PROTOCOL_VERSION, m_local.number);  // on a link the id is the node number
+  if (send(socket, hello.data(), hello.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(hello.size())) {
+    close(socket);
+    return -1;
+  }
+  return socket;
+}
+
+inline bool FederationLink::writeSending(int socket) {
+  // a node that went away while the link was idle: the first write would still be taken by the kernel
+  pollfd descriptor = { socket, POLLRDHUP, 0 };
+  if (poll(&descriptor, 1, 0) > 0) {
+    return false;
+  }
+  while (m_sent < m_sending.size()) {
+    iovec parts[OUTBOUND_MAX_IOV];
+    size_t total = 0;
+    for (; total < OUTBOUND_MAX_IOV && m_sent + total < m_sending.size(); ++total) {
+      const BufferRef& frame = m_sending[m_sent + total];
+      size_t skip = total == 0 ? m_offset : 0;
+      parts[total].iov_base = const_cast<char*>(frame.data() + skip);
+      parts[total].iov_len = frame.size() - skip;
+    }
+    msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = parts;
+    header.msg_iovlen = total;
+    ssize_t result = sendmsg(socket, &header, MSG_NOSIGNAL);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    ++writes;
+    bytes += result;
+    Metrics::add(COUNTER_LINK_BYTES_OUT, result);
+    size_t written = result;
+    long completed = 0;
+    while (written > 0) {
+      size_t rest = m_sending[m_sent].size() - m_offset;
+      if (written < rest) {
+        m_offset += written;
+        break;
+      }
+      written -= rest;
+      m_offset = 0;
+      m_sending[m_sent++].reset();
+      ++completed;
+    }
+    messages += completed;
+    Metrics::add(COUNTER_LINK_MESSAGES_OUT, completed);
+  }
+  return true;
+}
+
+/* Федерация */
+// --------------------------------------------------------------------------------------------------------------------
+inline Federation::Federation(const FederationConfig& config, Relay relay)
+  : m_config(config), m_relay(relay), m_listen_socket(-1), m_is_stopped(false) {
+  memset(m_closed_messages, 0, sizeof(m_closed_messages));
+  memset(m_closed_bytes, 0, sizeof(m_closed_bytes));
+  const FederationNode* self = m_config.find(m_config.node);
+  for (auto& it : m_config.nodes) {
+    if (it.number != m_config.node) {
+      m_links.emplace_back(new FederationLink(it, *self));
+    }
+  }
+
+  sockaddr_in address;
+  if (!resolveNode(*self, self->port.c_str(), &address)) {
+    throw FederationException();
+  }
+  m_listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int enable = 1;
+  setsockopt(m_listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  if (m_listen_socket < 0 || bind(m_listen_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+      listen(m_listen_socket, SOMAXCONN) < 0) {
+    ERR("Failed to listen for links of other nodes at %s:%s: %s", self->host.c_str(), self->port.c_str(), strerror(errno));
+    if (m_listen_socket >= 0) {
+      close(m_listen_socket);
+    }
+    throw FederationException();
+  }
+}
+
+inline void Federation::start() {
+  m_accept_thread = std::thread(&Federation::acceptLinks, this);
+  for (auto& it : m_links) {
+    it->start();
+  }
+}
+
+inline void Federation::interrupt() {
+  m_is_stopped = true;
+  if (m_listen_socket >= 0) {
+    shutdown(m_listen_socket, SHUT_RDWR);  // wakes up blocking accept()
+  }
+}
+
+inline void Federation::stop() {
+  interrupt();
+  if (m_accept_thread.joinable()) {
+    m_accept_thread.join();
+  }
+  for (auto& it : m_links) {
+    it->stop();
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_inbound_mutex);
+    for (auto& it : m_inbound) {
+      shutdown(it->socket, SHUT_RDWR);
+    }
+  }
+  for (auto& it : m_inbound) {  // nobody adds to the list anymore, it stays for the final stats
+    if (it->thread.joinable()) {
+      it->thread.join();
+      close(it->socket);
+    }
+  }
+  if (m_listen_socket >= 0) {
+    close(m_listen_socket);
+    m_listen_socket = -1;
+  }
+}
+
+inline void Federation::forward(const BufferRef& frame) {
+  for (auto& it : m_links) {
+    it->push(frame);
+  }
+}
+
+inline void Federation::acceptLinks() {
+  while (!m_is_stopped) {
+    sockaddr_in address;
+    socklen_t address_size = sizeof(address);
+    int socket = accept4(m_listen_socket, reinterpret_cast<sockaddr*>(&address), &address_size, SOCK_CLOEXEC);
+    if (socket < 0) {
+      if (!m_is_stopped && errno != EINTR) {
+        ERR("Failed to accept a link: %s", strerror(errno));
+      }
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(m_inbound_mutex);
+    if (m_is_stopped) {
+      close(socket);
+      break;
+    }
+    closeFinished();
+    m_inbound.emplace_back(new Inbound(socket, address.sin_addr));
+    Inbound* inbound = m_inbound.back().get();
+    inbound->thread = std::thread(&Federation::readLink, this, inbound);
+  }
+}
+
+// the other node's hello, then its peers' messages
+inline void Federation::readLink(Inbound* inbound) {
+  FrameDecoder decoder;
+  while (!m_is_stopped) {
+    char* buffer = decoder.prepare(PROTOCOL_READ_SIZE);
+    ssize_t read_bytes = recv(inbound->socket, buffer, PROTOCOL_READ_SIZE, 0);
+    if (read_bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (read_bytes <= 0) {
+      break;
+    }
+    decoder.commit(read_bytes);
+    inbound->bytes += read_bytes;
+    Metrics::add(COUNTER_LINK_BYTES_IN, read_bytes);
+
+    Frame frame;
+    FrameDecoder::Status status;
+    while ((status = decoder.next(&frame)) == FrameDecoder::FRAME) {
+      if (inbound->node == 0) {
+        int version = 0;
+        int compression = COMPRESSION_NONE;
+        int node = 0;
+        if (!readHello(frame, &version, &compression, &node) || node == m_config.node || m_config.find(node) == nullptr) {
+          ERR("Link from an unknown node %i, closing it", node);
+          status = FrameDecoder::BROKEN;
+          break;
+        }
+        if (!isNodeAddress(*m_config.find(node), inbound->address)) {
+          ERR("Link of node %i from %s, not its host, closing it", node, inet_ntoa(inbound->address));
+          status = FrameDecoder::BROKEN;
+          break;
+        }
+        inbound->node = node;
+        INF("Node %i linked to this one", node);
+        continue;
+      }
+      MessageView message;
+      if (frame.type != FRAME_MESSAGE || !MessageView::fromFrame(frame, &message)) {
+        Metrics::add(COUNTER_PARSE_FAILURES);
+        continue;
+      }
+      ++inbound->messages;
+      Metrics::add(COUNTER_LINK_MESSAGES_IN);
+      m_relay(message);
+    }
+    if (status == FrameDecoder::BROKEN) {
+      break;
+    }
+  }
+  if (inbound->node != 0) {
+    WRN("Link from node %i is closed", inbound->node);
+  }
+  shutdown(inbound->socket, SHUT_RDWR);  // closed with the next link accepted or by stop(), the node reconnects
+  inbound->is_done = true;
+}
+
+inline void Federation::closeFinished() {
+  size_t kept = 0;
+  for (auto& it : m_inbound) {
+    if (!it->is_done) {
+      m_inbound[kept++] = std::move(it);
+      continue;
+    }
+    it->thread.join();  // has ended already
+    close(it->socket);
+    m_closed_messages[it->node] += it->messages.load();
+    m_closed_bytes[it->node] += it->bytes.load();
+  }
+  m_inbound.resize(kept);
+}
+
+// one line per node: this node's link to it and its link to this one
+inline std::string Federation::stats() const {
+  std::string out;
+  char line[512];
+  snprintf(line, sizeof(line), "Federation: node %i of %zu\n", m_config.node, m_config.nodes.size());
+  out += line;
+  for (auto& link : m_links) {
+    long messages_in = 0;
+    long bytes_in = 0;
+    {
+      std::lock_guard<std::mutex> lock(m_inbound_mutex);
+      messages_in = m_closed_messages[link->node().number];
+      bytes_in = m_closed_bytes[link->node().number];
+      for (auto& it : m_inbound) {
+        if (it->node == link->node().number) {
+          messages_in += it->messages.load();
+          bytes_in += it->bytes.load();
+        }
+      }
+    }
+    snprintf(line, sizeof(line), "  node %i (%s:%s): link %s, %li connects, out %li messages %li bytes in %li writes, "
+             "%li dropped; in %li messages %li bytes\n", link->node().number, link->node().host.c_str(),
+             link->node().port.c_str(), link->isConnected() ? "up" : "down", link->connects.load(), link->messages.load(),
+             link->bytes.load(), link->writes.load(), link->dropped.load(), messages_in, bytes_in);
+    out += line;
+  }
+  return out;
+}
+
+#endif  // FEDERATION__H__
@@ -0,0 +1,465 @@
+#ifndef HANDOFF__H__
+#define HANDOFF__H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "logger.h"
+#include "protocol.h"
+
+#define HANDOFF_VERSION 3
+#define HANDOFF_MAX_FDS 64           // descriptors per sendmsg, the kernel takes up to 253
+#define HANDOFF_ACK_TIMEOUT_MS 10000  // how long the old process waits for the new one to confirm
+
+struct HandoffPeer {
+  int id;
+  int socket;
+  int protocol;
+  uint64_t accepted_sequence;
+  uint64_t first_sequence;  // of its session
+  std::string token;  // ... and its secret
+  std::vector<std::string> channels;
+  std::vector<uint64_t> joined;  // the first message each of the channels was joined for
+  std::string received;  // read from the socket and not handled yet
+  std::string unsent;    // queued for the peer and not written yet
+
+  HandoffPeer(): id(0), socket(-1), protocol(0), accepted_sequence(0), first_sequence(0) {}
+};
+
+struct HandoffSession {  // parked, waiting for its client to come back
+  int id;
+  uint64_t first_sequence;
+  uint64_t next_sequence;
+  int64_t deadline;  // steady clock, ns: the same clock in both processes
+  std::string token;
+  std::vector<std::string> channels;
+  std::vector<uint64_t> joined;
+
+  HandoffSession(): id(0), first_sequence(0), next_sequence(0), deadline(0) {}
+};
+
+struct HandoffMessage {  // of the resume ring
+  uint64_t sequence;
+  int sender_id;
+  size_t channel_size;  // the channel is in the frame at PROTOCOL_CHANNEL_OFFSET
+  std::string frame;
+
+  HandoffMessage(): sequence(0), sender_id(0), channel_size(0) {}
+};
+
+/**
+ * Everything a server process passes to the one that replaces it: listening sockets, live peers with
+ * what was read from them and what was queued for them, parked sessions and recent messages.
+ */
+struct HandoffState {
+  int last_id;
+  uint64_t next_sequence;
+  std::vector<int> listen_sockets;
+  std::vector<HandoffPeer> peers;
+  std::vector<HandoffSession> sessions;
+  std::vector<HandoffMessage> recent;  // oldest first
+
+  HandoffState(): last_id(0), next_sequence(1) {}
+};
+
+/**
+ * Restart without reconnects. A server started with --handoff=PATH first connects to PATH: if a server
+ * listens there, the running one stops its event loops and passes its state over this unix socket,
+ * descriptors as SCM_RIGHTS. The new process keeps serving the same sockets, the old one exits without
+ * shutting any of them down. Then the new one listens on PATH for its own successor.
+ *
+ * The stream is a sequence of parts: | body size (4) | descriptor count (4) | body |, descriptors
+ * attached to the part header. The first part is the server state with the listening sockets, the
+ * rest carry up to HANDOFF_MAX_FDS peers each. The receiver answers with one byte once it has them all.
+ */
+class HandoffWriter {
+public:
+  void putInt(uint64_t value) { m_data.append(reinterpret_cast<const char*>(&value), sizeof(value)); }
+  void putBytes(Slice bytes) {
+    putInt(bytes.size);
+    m_data.append(bytes.data, bytes.size);
+  }
+  void putStrings(const std::vector<std::string>& strings);
+  void putInts(const std::vector<uint64_t>& values);
+
+  std::string& data() { return m_data; }
+
+private:
+  std::string m_data;  // host byte order, both ends are the same machine
+};
+
+class HandoffReader {
+public:
+  explicit HandoffReader(const std::string& data): m_next(data.data()), m_end(data.data() + data.size()) {}
+
+  bool getInt(uint64_t* value);
+  bool getBytes(std::string* bytes);
+  bool getStrings(std::vector<std::string>* strings);
+  bool getInts(std::vector<uint64_t>* values);
+
+private:
+  const char* m_next;
+  const char* m_end;
+};
+
+// ----------------------------------------------
+inline void HandoffWriter::putStrings(const std::vector<std::string>& strings) {
+  putInt(strings.size());
+  for (auto& it : strings) {
+    putBytes(Slice(it));
+  }
+}
+
+inline void HandoffWriter::putInts(const std::vector<uint64_t>& values) {
+  putInt(values.size());
+  for (uint64_t it : values) {
+    putInt(it);
+  }
+}
+
+inline bool HandoffReader::getInt(uint64_t* value) {
+  if (m_end - m_next < static_cast<ptrdiff_t>(sizeof(*value))) {
+    return false;
+  }
+  memcpy(value, m_next, sizeof(*value));
+  m_next += sizeof(*value);
+  return true;
+}
+
+inline bool HandoffReader::getBytes(std::string* bytes) {
+  uint64_t size = 0;
+  if (!getInt(&size) || static_cast<uint64_t>(m_end - m_next) < size) {
+    return false;
+  }
+  bytes->assign(m_next, size);
+  m_next += size;
+  return true;
+}
+
+inline bool HandoffReader::getStrings(std::vector<std::string>* strings) {
+  uint64_t count = 0;
+  if (!getInt(&count) || count > static_cast<uint64_t>(m_end - m_next)) {
+    return false;
+  }
+  strings->resize(count);
+  for (auto& it : *strings) {
+    if (!getBytes(&it)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool HandoffReader::getInts(std::vector<uint64_t>* values) {
+  uint64_t count = 0;
+  if (!getInt(&count) || count > static_cast<uint64_t>(m_end - m_next) / sizeof(uint64_t)) {
+    return false;
+  }
+  values->resize(count);
+  for (auto& it : *values) {
+    getInt(&it);
+  }
+  return true;
+}
+
+/* Передача частей потока */
+// --------------------------------------------------------------------------------------------------------------------
+inline bool handoffWriteAll(int socket, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = send(socket, data, size, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+inline bool handoffReadAll(int socket, char* data, size_t size) {
+  while (size > 0) {
+    ssize_t read_bytes = recv(socket, data, size, 0);
+    if (read_bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (read_bytes <= 0) {
+      return false;
+    }
+    data += read_bytes;
+    size -= read_bytes;
+  }
+  return true;
+}
+
+inline bool handoffSendPart(int socket, const std::string& body, const int* fds, size_t fd_count) {
+  uint32_t header[2] = { static_cast<uint32_t>(body.size()), static_cast<uint32_t>(fd_count) };
+  iovec part = { header, sizeof(header) };
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  if (fd_count > 0) {
+    memset(control, 0, sizeof(control));
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    cmsghdr* rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(rights), fds, sizeof(int) * fd_count);
+  }
+  ssize_t sent;
+  while ((sent = sendmsg(socket, &message, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+  if (sent < 0) {
+    return false;
+  }
+  // the descriptors went with the first byte, the rest of the header may follow on its own
+  return handoffWriteAll(socket, reinterpret_cast<char*>(header) + sent, sizeof(header) - sent) &&
+         handoffWriteAll(socket, body.data(), body.size());
+}
+
+inline bool handoffReceivePart(int socket, std::string* body, std::vector<int>* fds) {
+  uint32_t header[2] = { 0, 0 };
+  iovec part = { header, sizeof(header) };
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t read_bytes;
+  while ((read_bytes = recvmsg(socket, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {}
+  if (read_bytes <= 0) {
+    return false;
+  }
+  size_t first = fds->size();
+  for (cmsghdr* it = CMSG_FIRSTHDR(&message); it != nullptr; it = CMSG_NXTHDR(&message, it)) {
+    if (it->cmsg_level == SOL_SOCKET && it->cmsg_type == SCM_RIGHTS) {
+      size_t count = (it->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      fds->resize(fds->size() + count);
+      memcpy(&(*fds)[fds->size() - count], CMSG_DATA(it), sizeof(int) * count);
+    }
+  }
+  if (!handoffReadAll(socket, reinterpret_cast<char*>(header) + read_bytes, sizeof(header) - read_bytes)) {
+    return false;
+  }
+  if ((message.msg_flags & MSG_CTRUNC) || fds->size() - first != header[1]) {
+    ERR("Handoff part lost its descriptors: %zu of %u", fds->size() - first, header[1]);
+    return false;
+  }
+  body->resize(header[0]);
+  return handoffReadAll(socket, &(*body)[0], body->size());
+}
+
+/* Передача состояния */
+// --------------------------------------------------------------------------------------------------------------------
+// old process: everything, then waits for the new one to confirm; false - it goes on serving its peers
+inline bool sendHandoff(int socket, const HandoffState& state) {
+  HandoffWriter writer;
+  writer.putInt(HANDOFF_VERSION);
+  writer.putInt(state.last_id);
+  writer.putInt(state.next_sequence);
+  writer.putInt(state.peers.size());
+  writer.putInt(state.sessions.size());
+  for (auto& it : state.sessions) {
+    writer.putInt(it.id);
+    writer.putInt(it.first_sequence);
+    writer.putInt(it.next_sequence);
+    writer.putInt(it.deadline);
+    writer.putBytes(Slice(it.token));
+    writer.putStrings(it.channels);
+    writer.putInts(it.joined);
+  }
+  writer.putInt(state.recent.size());
+  for (auto& it : state.recent) {
+    writer.putInt(it.sequence);
+    writer.putInt(it.sender_id);
+    writer.putInt(it.channel_size);
+    writer.putBytes(Slice(it.frame));
+  }
+  if (!handoffSendPart(socket, writer.data(), state.listen_sockets.data(), state.listen_sockets.size())) {
+    return false;
+  }
+
+  for (size_t first = 0; first < state.peers.size(); first += HANDOFF_MAX_FDS) {
+    size_t count = std::min<size_t>(HANDOFF_MAX_FDS, state.peers.size() - first);
+    int fds[HANDOFF_MAX_FDS];
+    writer.data().clear();
+    for (size_t i = 0; i < count; ++i) {
+      const HandoffPeer& peer = state.peers[first + i];
+      fds[i] = peer.socket;
+      writer.putInt(peer.id);
+      writer.putInt(peer.protocol);
+      writer.putInt(peer.accepted_sequence);
+      writer.putInt(peer.first_sequence);
+      writer.putBytes(Slice(peer.token));
+      writer.putStrings(peer.channels);
+      writer.putInts(peer.joined);
+      writer.putBytes(Slice(peer.received));
+      writer.putBytes(Slice(peer.unsent));
+    }
+    if (!handoffSendPart(socket, writer.data(), fds, count)) {
+      return false;
+    }
+  }
+
+  pollfd descriptor = { socket, POLLIN, 0 };
+  char ack = 0;
+  return poll(&descriptor, 1, HANDOFF_ACK_TIMEOUT_MS) > 0 && recv(socket, &ack, 1, 0) == 1;
+}
+
+// new process: descriptors it got are in state even if the rest was broken, so that they can be closed;
+// confirmed separately, once the new process is ready to serve them
+inline bool receiveHandoff(int socket, HandoffState* state) {
+  std::string body;
+  if (!handoffReceivePart(socket, &body, &state->listen_sockets)) {
+    return false;
+  }
+  HandoffReader reader(body);
+  uint64_t version = 0, last_id = 0, peers = 0, sessions = 0, recent = 0;
+  if (!reader.getInt(&version) || version != HANDOFF_VERSION || !reader.getInt(&last_id) ||
+      !reader.getInt(&state->next_sequence) || !reader.getInt(&peers) || !reader.getInt(&sessions)) {
+    ERR("Unknown handoff state, version %llu", (unsigned long long) version);
+    return false;
+  }
+  state->last_id = static_cast<int>(last_id);
+  for (uint64_t i = 0; i < sessions; ++i) {
+    HandoffSession session;
+    uint64_t id = 0, deadline = 0;
+    if (!reader.getInt(&id) || !reader.getInt(&session.first_sequence) || !reader.getInt(&session.next_sequence) ||
+        !reader.getInt(&deadline) || !reader.getBytes(&session.token) || !reader.getStrings(&session.channels) ||
+        !reader.getInts(&session.joined) || session.joined.size() != session.channels.size()) {
+      return false;
+    }
+    session.id = static_cast<int>(id);
+    session.deadline = static_cast<int64_t>(deadline);
+    state->sessions.push_back(std::move(session));
+  }
+  if (!reader.getInt(&recent)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < recent; ++i) {
+    HandoffMessage message;
+    uint64_t sender_id = 0, channel_size = 0;
+    if (!reader.getInt(&message.sequence) || !reader.getInt(&sender_id) || !reader.getInt(&channel_size) ||
+        !reader.getBytes(&message.frame)) {
+      return false;
+    }
+    message.sender_id = static_cast<int>(sender_id);
+    message.channel_size = channel_size;
+    state->recent.push_back(std::move(message));
+  }
+
+  std::vector<int> fds;
+  while (state->peers.size() < peers) {
+    fds.clear();
+    if (!handoffReceivePart(socket, &body, &fds) || fds.empty()) {
+      for (int it : fds) {
+        close(it);
+      }
+      return false;
+    }
+    HandoffReader peers_reader(body);
+    for (int it : fds) {
+      HandoffPeer peer;
+      peer.socket = it;
+      state->peers.push_back(std::move(peer));
+    }
+    for (size_t i = state->peers.size() - fds.size(); i < state->peers.size(); ++i) {
+      HandoffPeer& peer = state->peers[i];
+      uint64_t id = 0, protocol = 0;
+      if (!peers_reader.getInt(&id) || !peers_reader.getInt(&protocol) || !peers_reader.getInt(&peer.accepted_sequence) ||
+          !peers_reader.getInt(&peer.first_sequence) || !peers_reader.getBytes(&peer.token) ||
+          !peers_reader.getStrings(&peer.channels) || !peers_reader.getInts(&peer.joined) ||
+          peer.joined.size() != peer.channels.size() || !peers_reader.getBytes(&peer.received) ||
+          !peers_reader.getBytes(&peer.unsent)) {
+        return false;
+      }
+      peer.id = static_cast<int>(id);
+      peer.protocol = static_cast<int>(protocol);
+    }
+  }
+  return true;
+}
+
+// new process: the old one stops for good, false - it has given up waiting and serves its peers itself
+inline bool confirmHandoff(int socket) {
+  char ack = 1;
+  return send(socket, &ack, 1, MSG_NOSIGNAL) == 1;
+}
+
+// ----------------------------------------------
+inline bool handoffAddress(const std::string& path, sockaddr_un* address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address->sun_path)) {
+    ERR("Handoff socket path is too long: %s", path.c_str());
+    return false;
+  }
+  strncpy(address->sun_path, path.c_str(), sizeof(address->sun_path) - 1);
+  return true;
+}
+
+// the sockets of every client go over it: only a process of the same user may be on the other end
+inline bool handoffIsTrusted(int socket) {
+  ucred credentials;
+  socklen_t size = sizeof(credentials);
+  if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0) {
+    ERR("Failed to get handoff peer's credentials: %s", strerror(errno));
+    return false;
+  }
+  if (credentials.uid != geteuid()) {
+    ERR("Handoff refused to process %i of user %u", (int) credentials.pid, (unsigned) credentials.uid);
+    return false;
+  }
+  return true;
+}
+
+// the running server at path, -1 - there is none
+inline int connectHandoff(const std::string& path) {
+  sockaddr_un address;
+  if (!handoffAddress(path, &address)) {
+    return -1;
+  }
+  int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket >= 0 && connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+    close(socket);
+    socket = -1;
+  }
+  return socket;
+}
+
+// for the next process, -1 on failure
+inline int listenHandoff(const std::string& path) {
+  sockaddr_un address;
+  if (!handoffAddress(path, &address)) {
+    return -1;
+  }
+  int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(path.c_str());  // left by a previous run or by the process this one replaced
+  if (socket < 0 || fchmod(socket, 0600) < 0 ||  // the file is created with the socket's mode, whatever the umask allows
+      bind(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || chmod(path.c_str(), 0600) < 0 ||
+      listen(socket, 1) < 0) {
+    ERR("Failed to open handoff socket %s: %s", path.c_str(), strerror(errno));
+    if (socket >= 0) {
+      close(socket);
+    }
+    return -1;
+  }
+  return socket;
+}
+
+#endif  // HANDOFF__H__
@@ -0,0 +1,109 @@
+#ifndef HISTOGRAM__H__
+#define HISTOGRAM__H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#define HISTOGRAM_SUB_BITS 7  // 128 linear sub-buckets per power of two, values are within 1%
+
+/**
+ * Log-linear histogram of non-negative values (nanoseconds, bytes), the layout of HdrHistogram:
+ * values below 2^SUB_BITS are counted exactly, larger ones in 2^SUB_BITS buckets per power of two.
+ * Recording is an increment, percentiles walk ~7k counters. Not thread-safe, record into one
+ * histogram per thread and merge, or into an AtomicHistogram (metrics.h).
+ */
+class LatencyHistogram {
+public:
+  LatencyHistogram(): m_counts(bucketCount(), 0), m_count(0), m_sum(0), m_max(0) {}
+
+  void record(uint64_t value) {
+    ++m_counts[bucket(value)];
+    ++m_count;
+    m_sum += value;
+    m_max = std::max(m_max, value);
+  }
+
+  void merge(const LatencyHistogram& other);
+  void merge(const std::atomic<uint64_t>* counts, uint64_t sum, uint64_t max);  // of a concurrent recorder
+  void reset();
+
+  uint64_t percentile(double percent) const;  // highest value of the bucket holding that rank
+  uint64_t count() const { return m_count; }
+  uint64_t max() const { return m_max; }
+  double mean() const { return m_count == 0 ? 0.0 : static_cast<double>(m_sum) / m_count; }
+
+  static size_t bucketCount() { return (64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS; }
+  static size_t bucket(uint64_t value);
+
+private:
+  std::vector<uint64_t> m_counts;
+  uint64_t m_count;
+  uint64_t m_sum;
+  uint64_t m_max;
+
+  static uint64_t highest(size_t bucket);
+};
+
+// ----------------------------------------------
+inline size_t LatencyHistogram::bucket(uint64_t value) {
+  if (value < (1ULL << HISTOGRAM_SUB_BITS)) {
+    return static_cast<size_t>(value);
+  }
+  int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  size_t sub = static_cast<size_t>(value >> shift) - (1ULL << HISTOGRAM_SUB_BITS);
+  return (static_cast<size_t>(shift + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+inline uint64_t LatencyHistogram::highest(size_t bucket) {
+  size_t group = bucket >> HISTOGRAM_SUB_BITS;
+  uint64_t sub = bucket & ((1ULL << HISTOGRAM_SUB_BITS) - 1);
+  if (group == 0) {
+    return sub;
+  }
+  int shift = static_cast<int>(group) - 1;
+  return (((1ULL << HISTOGRAM_SUB_BITS) + sub) << shift) + ((1ULL << shift) - 1);
+}
+
+inline void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (size_t i = 0; i < m_counts.size(); ++i) {
+    m_counts[i] += other.m_counts[i];
+  }
+  m_count += other.m_count;
+  m_sum += other.m_sum;
+  m_max = std::max(m_max, other.m_max);
+}
+
+inline void LatencyHistogram::merge(const std::atomic<uint64_t>* counts, uint64_t sum, uint64_t max) {
+  for (size_t i = 0; i < m_counts.size(); ++i) {
+    uint64_t count = counts[i].load(std::memory_order_relaxed);
+    m_counts[i] += count;
+    m_count += count;
+  }
+  m_sum += sum;
+  m_max = std::max(m_max, max);
+}
+
+inline void LatencyHistogram::reset() {
+  std::fill(m_counts.begin(), m_counts.end(), 0);
+  m_count = m_sum = m_max = 0;
+}
+
+inline uint64_t LatencyHistogram::percentile(double percent) const {
+  if (m_count == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(percent / 100.0 * m_count + 0.5);
+  rank = std::max<uint64_t>(1, std::min(rank, m_count));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < m_counts.size(); ++i) {
+    seen += m_counts[i];
+    if (seen >= rank) {
+      return std::min(highest(i), m_max);
+    }
+  }
+  return m_max;
+}
+
+#endif  // HISTOGRAM__H__
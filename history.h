@@ -0,0 +1,374 @@
+#ifndef HISTORY__H__
+#define HISTORY__H__
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "logger.h"
+#include "protocol.h"
+
+#define HISTORY_MAGIC 0x54534948u      // "HIST"
+#define HISTORY_INDEX_INTERVAL 64      // records between two sparse index entries
+#define HISTORY_REPLAY_CHUNK (32 * 1024)
+
+struct HistoryConfig {
+  std::string directory;  // empty - no history
+  size_t segment_bytes;
+  size_t max_bytes;       // of all segments, the oldest ones are deleted first
+  int max_age_s;          // segments whose last message is older are deleted, 0 - no limit
+
+  HistoryConfig(): segment_bytes(64 * 1024 * 1024), max_bytes(1024 * 1024 * 1024), max_age_s(0) {}
+};
+
+// header of a stored frame, the frame follows padded to 8 bytes
+struct HistoryRecord {
+  uint32_t magic;
+  uint32_t size;  // of the frame
+  uint64_t sequence;
+  int64_t time_ms;  // wall clock, never decreases within the log
+};
+
+inline size_t historySpan(size_t frame_size) {
+  return sizeof(HistoryRecord) + ((frame_size + 7) & ~static_cast<size_t>(7));
+}
+
+/* One memory-mapped file of the log, named after its first sequence number */
+// --------------------------------------------------------------------------------------------------------------------
+struct HistorySegment {
+  struct IndexEntry {
+    uint64_t sequence;
+    int64_t time_ms;
+    size_t offset;
+  };
+
+  std::string path;
+  char* data;
+  size_t capacity;  // mapped bytes
+  size_t size;      // used bytes, guarded by the log's mutex
+  uint64_t first_sequence;
+  uint64_t last_sequence;  // first_sequence - 1 while empty
+  int64_t last_time_ms;
+  std::vector<IndexEntry> index;  // every HISTORY_INDEX_INTERVAL-th record, guarded by the log's mutex
+
+  HistorySegment(): data(nullptr), capacity(0), size(0), first_sequence(0), last_sequence(0), last_time_ms(0) {}
+  ~HistorySegment() {
+    if (data != nullptr) {
+      munmap(data, capacity);
+    }
+  }
+
+  void add(const HistoryRecord& record, size_t offset) {
+    if ((record.sequence - first_sequence) % HISTORY_INDEX_INTERVAL == 0) {
+      index.push_back(IndexEntry{record.sequence, record.time_ms, offset});
+    }
+    last_sequence = record.sequence;
+    last_time_ms = record.time_ms;
+    size = offset + historySpan(record.size);
+  }
+
+  size_t find(uint64_t sequence, int64_t time_ms) const;  // offset of the first record at or after both
+};
+
+inline size_t HistorySegment::find(uint64_t sequence, int64_t time_ms) const {
+  // the last indexed record before the target, then a short scan; both keys never decrease
+  auto it = std::lower_bound(index.begin(), index.end(), IndexEntry{sequence, time_ms, 0},
+                             [](const IndexEntry& entry, const IndexEntry& target) {
+                               return entry.sequence < target.sequence || entry.time_ms < target.time_ms;
+                             });
+  size_t offset = it == index.begin() ? 0 : (it - 1)->offset;
+  while (offset < size) {
+    HistoryRecord record;
+    memcpy(&record, data + offset, sizeof(record));
+    if (record.sequence >= sequence && record.time_ms >= time_ms) {
+      break;
+    }
+    offset += historySpan(record.size);
+  }
+  return offset;
+}
+
+/* Stored frames of a replay, taken as they were when it started */
+// --------------------------------------------------------------------------------------------------------------------
+class HistoryCursor {
+  friend class HistoryLog;
+
+public:
+  HistoryCursor(): m_segment(0), m_offset(0), m_count(0) {}
+
+  BufferRef next(size_t max_bytes);  // next frames back to back, flagged as history; empty at the end
+  size_t count() const { return m_count; }  // frames returned so far
+
+private:
+  std::vector<std::shared_ptr<HistorySegment>> m_segments;  // a deleted segment lives on until replayed
+  std::vector<size_t> m_ends;  // used bytes of each segment when the replay started
+  size_t m_segment;
+  size_t m_offset;
+  size_t m_count;
+};
+
+inline BufferRef HistoryCursor::next(size_t max_bytes) {
+  BufferRef chunk;
+  size_t used = 0;
+  while (m_segment < m_segments.size()) {
+    if (m_offset >= m_ends[m_segment]) {
+      ++m_segment;
+      m_offset = 0;
+      continue;
+    }
+    const char* data = m_segments[m_segment]->data + m_offset;
+    HistoryRecord record;
+    memcpy(&record, data, sizeof(record));
+    if (!chunk) {
+      chunk = BufferPool::instance().acquire(std::max(max_bytes, static_cast<size_t>(record.size)));
+    }
+    if (used + record.size > chunk->capacity()) {
+      break;
+    }
+    // stored as it went out, only the flags byte of the header changes
+    memcpy(chunk->data() + used, data + sizeof(record), record.size);
+    chunk->data()[used + 3] |= FRAME_FLAG_HISTORY;
+    used += record.size;
+    m_offset += historySpan(record.size);
+    ++m_count;
+  }
+  if (chunk) {
+    chunk->setSize(used);
+  }
+  return chunk;
+}
+
+/**
+ * Append-only log of broadcast frames, kept in memory-mapped segment files of segment_bytes each.
+ * A frame is stored exactly as it went out (binary wire format), so a replay copies runs of frames
+ * into send buffers without parsing them. Each segment has a sparse in-memory index by sequence
+ * number and time, rebuilt by scanning the files on start; a torn record at the end of the last
+ * segment is where appending continues. Whole segments are deleted when the log outgrows
+ * max_bytes or their messages are older than max_age_s. Durability is the page cache's: nothing
+ * is synced explicitly.
+ */
+class HistoryLog {
+public:
+  explicit HistoryLog(const HistoryConfig& config);
+
+  void append(const char* frame, size_t size);  // thread-safe
+
+  // replay of the last count frames, or of frames sent at or after time_ms
+  void last(size_t count, HistoryCursor* cursor);
+  void since(int64_t time_ms, HistoryCursor* cursor);
+
+  uint64_t lastSequence();
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+private:
+  HistoryConfig m_config;
+  std::mutex m_mutex;
+  std::deque<std::shared_ptr<HistorySegment>> m_segments;  // oldest first
+  uint64_t m_next_sequence;
+  int64_t m_last_time_ms;
+  size_t m_total_bytes;
+
+  bool open(const std::string& path, uint64_t first_sequence, size_t capacity, bool is_new);
+  void recover(HistorySegment& segment);
+  void rotate(size_t frame_size);
+  void retire();
+  void select(uint64_t sequence, int64_t time_ms, HistoryCursor* cursor);
+};
+
+struct HistoryException {};
+
+// ----------------------------------------------
+inline HistoryLog::HistoryLog(const HistoryConfig& config)
+  : m_config(config), m_next_sequence(1), m_last_time_ms(0), m_total_bytes(0) {
+  mkdir(m_config.directory.c_str(), 0755);
+  DIR* directory = opendir(m_config.directory.c_str());
+  if (directory == nullptr) {
+    ERR("Failed to open history directory %s: %s", m_config.directory.c_str(), strerror(errno));
+    throw HistoryException();
+  }
+  std::vector<uint64_t> sequences;
+  while (dirent* entry = readdir(directory)) {
+    char* end = nullptr;
+    uint64_t sequence = strtoull(entry->d_name, &end, 10);
+    if (sequence > 0 && end != entry->d_name && strcmp(end, ".log") == 0) {
+      sequences.push_back(sequence);
+    }
+  }
+  closedir(directory);
+  std::sort(sequences.begin(), sequences.end());
+
+  for (uint64_t sequence : sequences) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%020llu.log", (unsigned long long) sequence);
+    struct stat info;
+    std::string path = m_config.directory + name;
+    if (stat(path.c_str(), &info) != 0 || info.st_size == 0 || !open(path, sequence, info.st_size, false)) {
+      continue;
+    }
+    HistorySegment& segment = *m_segments.back();
+    recover(segment);
+    if (segment.last_sequence < segment.first_sequence) {  // nothing valid in it
+      unlink(path.c_str());
+      m_segments.pop_back();
+      continue;
+    }
+    m_next_sequence = segment.last_sequence + 1;
+    m_last_time_ms = segment.last_time_ms;
+    m_total_bytes += segment.size;
+  }
+  DBG("History: %zu segments, next message #%llu", m_segments.size(), (unsigned long long) m_next_sequence);
+}
+
+inline bool HistoryLog::open(const std::string& path, uint64_t first_sequence, size_t capacity, bool is_new) {
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    ERR("Failed to open history segment %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  // blocks are taken now: a full disk is this error rather than SIGBUS on a write into a sparse mapping
+  int error = is_new ? posix_fallocate(fd, 0, capacity) : 0;
+  if (error != 0) {
+    ERR("Failed to allocate history segment %s: %s", path.c_str(), strerror(error));
+    close(fd);
+    unlink(path.c_str());
+    return false;
+  }
+  void* data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);  // the mapping keeps the file
+  if (data == MAP_FAILED) {
+    ERR("Failed to map history segment %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  std::shared_ptr<HistorySegment> segment = std::make_shared<HistorySegment>();
+  segment->path = path;
+  segment->data = static_cast<char*>(data);
+  segment->capacity = capacity;
+  segment->first_sequence = first_sequence;
+  segment->last_sequence = first_sequence - 1;
+  m_segments.push_back(segment);
+  return true;
+}
+
+inline void HistoryLog::recover(HistorySegment& segment) {
+  size_t offset = 0;
+  uint64_t expected = segment.first_sequence;
+  while (offset + sizeof(HistoryRecord) <= segment.capacity) {
+    HistoryRecord record;
+    memcpy(&record, segment.data + offset, sizeof(record));
+    if (record.magic != HISTORY_MAGIC || record.sequence != expected ||
+        offset + historySpan(record.size) > segment.capacity || record.size < PROTOCOL_HEADER_SIZE) {
+      break;  // end of the segment, or a record torn by a crash
+    }
+    segment.add(record, offset);
+    offset = segment.size;
+    ++expected;
+  }
+}
+
+// ----------------------------------------------
+inline void HistoryLog::append(const char* frame, size_t size) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  size_t span = historySpan(size);
+  if (m_segments.empty() || m_segments.back()->size + span > m_segments.back()->capacity) {
+    rotate(size);
+    if (m_segments.empty() || m_segments.back()->size + span > m_segments.back()->capacity) {
+      return;  // could not open a segment, already reported
+    }
+  }
+  HistorySegment& segment = *m_segments.back();
+  HistoryRecord record;
+  record.magic = HISTORY_MAGIC;
+  record.size = static_cast<uint32_t>(size);
+  record.sequence = m_next_sequence++;
+  record.time_ms = m_last_time_ms = std::max(m_last_time_ms, now());
+  memcpy(segment.data + segment.size + sizeof(record), frame, size);
+  memcpy(segment.data + segment.size, &record, sizeof(record));
+  segment.add(record, segment.size);
+  m_total_bytes += span;
+
+  if (m_config.max_age_s > 0 && m_segments.size() > 1 &&
+      m_segments.front()->last_time_ms < record.time_ms - m_config.max_age_s * 1000LL) {
+    retire();
+  }
+}
+
+inline void HistoryLog::rotate(size_t frame_size) {
+  if (!m_segments.empty()) {  // give the unused tail of the full segment back to the file system
+    HistorySegment& full = *m_segments.back();
+    if (truncate(full.path.c_str(), full.size) != 0) {
+      WRN("Failed to truncate history segment %s: %s", full.path.c_str(), strerror(errno));
+    }
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "/%020llu.log", (unsigned long long) m_next_sequence);
+  size_t capacity = std::max(m_config.segment_bytes, historySpan(frame_size));
+  capacity = (capacity + 4095) & ~static_cast<size_t>(4095);
+  if (open(m_config.directory + name, m_next_sequence, capacity, true)) {
+    retire();
+  }
+}
+
+inline void HistoryLog::retire() {
+  int64_t oldest = m_config.max_age_s > 0 ? m_last_time_ms - m_config.max_age_s * 1000LL : INT64_MIN;
+  while (m_segments.size() > 1 && (m_total_bytes > m_config.max_bytes || m_segments.front()->last_time_ms < oldest)) {
+    HistorySegment& segment = *m_segments.front();
+    DBG("History: deleting segment %s", segment.path.c_str());
+    unlink(segment.path.c_str());  // mapped until the last replay of it is done
+    m_total_bytes -= segment.size;
+    m_segments.pop_front();
+  }
+}
+
+// ----------------------------------------------
+inline void HistoryLog::last(size_t count, HistoryCursor* cursor) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  uint64_t first = m_next_sequence > count ? m_next_sequence - count : 1;
+  select(first, INT64_MIN, cursor);
+}
+
+inline void HistoryLog::since(int64_t time_ms, HistoryCursor* cursor) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  select(0, time_ms, cursor);
+}
+
+inline uint64_t HistoryLog::lastSequence() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_next_sequence - 1;
+}
+
+inline void HistoryLog::select(uint64_t sequence, int64_t time_ms, HistoryCursor* cursor) {
+  cursor->m_segments.clear();
+  cursor->m_ends.clear();
+  cursor->m_segment = 0;
+  cursor->m_count = 0;
+  for (auto& segment : m_segments) {
+    if (segment->last_sequence < sequence || segment->last_time_ms < time_ms ||
+        segment->last_sequence < segment->first_sequence) {
+      continue;  // entirely before the start, or empty
+    }
+    if (cursor->m_segments.empty()) {
+      cursor->m_offset = segment->find(sequence, time_ms);
+    }
+    cursor->m_segments.push_back(segment);
+    cursor->m_ends.push_back(segment->size);
+  }
+}
+
+#endif  // HISTORY__H__
@@ -0,0 +1,602 @@
+#ifndef LOADGEN__H__
+#define LOADGEN__H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "compression.h"
+#include "histogram.h"
+#include "logger.h"
+#include "protocol.h"
+#include "shmring.h"
+
+#define BENCH_LOGIN "bench"
+#define BENCH_MAX_EVENTS 256
+#define BENCH_TICK_MS 1
+#define BENCH_DRAIN_MS 2000  // waiting for messages still in flight after the last send
+#define BENCH_READY_TIMEOUT_MS 10000  // for every session to be done with hello, or to fail
+#define BENCH_CHANNEL_FLAG (1ULL << 63)  // epoll tag of a connection's shared memory channel event
+
+struct BenchConfig {
+  std::string ip_address;
+  std::string port;
+  std::string unix_path;  // connect over the server's unix socket instead
+  std::string shm_path;   // ... or over shared memory channels set up through this one
+  int sessions = 1000;
+  int senders = 10;          // first sessions send, all of them receive
+  double rate = 1000;        // messages per second, all senders together
+  size_t min_size = 64;      // text sizes, uniformly distributed
+  size_t max_size = 64;
+  int duration_s = 10;
+  int threads = 2;
+  int protocol = PROTOCOL_VERSION;  // 0 - legacy text frames
+  bool compression = false;  // ask Server for deflated frames
+  int mux = 0;               // logical sessions per connection, 0 - a connection per session
+
+  int connections() const { return mux > 0 ? (sessions + mux - 1) / mux : sessions; }
+  const char* transport() const { return !shm_path.empty() ? "shm" : !unix_path.empty() ? "unix" : "tcp"; }
+};
+
+/**
+ * Headless load generator: opens many sessions to Server from a few epoll threads, lets some of them
+ * send at a fixed total rate and timestamps every copy the others receive. A message text starts with
+ * the time it was due to be sent, so a generator falling behind its schedule is counted as latency
+ * rather than hidden (no coordinated omission). With mux the sessions are logical ones opened over
+ * fewer connections, the way a gateway multiplexes its users, and a ROUTE frame counts once per session.
+ */
+class LoadGenerator {
+public:
+  explicit LoadGenerator(const BenchConfig& config);
+
+  bool run();  // false if sessions failed to connect
+
+private:
+  struct Session {  // a connection, and a session unless it carries logical ones
+    int socket;
+    int id;
+    int protocol;
+    int mux;  // logical sessions it carries, numbered from 1
+    std::vector<int> mux_ids;  // ... their peer ids, by number - 1
+    int mux_opened;
+    bool is_ready;   // hello exchange is over, logical sessions are open
+    bool is_failed;  // closed or refused before it was ready
+    bool is_closed;
+    FrameDecoder decoder;
+    std::unique_ptr<Deflater> deflater;  // compression agreed with Server
+    std::unique_ptr<ShmChannel> channel;  // frames go through shared memory, the socket only tells it is closed
+    std::string outbox;  // not yet accepted by the socket
+    size_t outbox_offset;
+
+    Session(): socket(-1), id(-1), protocol(0), mux(0), mux_opened(0), is_ready(false), is_failed(false), is_closed(false), outbox_offset(0) {}
+
+    int count() const { return std::max(mux, 1); }  // of the sessions it stands for
+  };
+
+  struct Sender {
+    size_t position;  // in sessions
+    uint32_t number;  // of the logical session, 0 - the connection itself
+  };
+
+  struct Worker {
+    std::vector<Session> sessions;
+    std::vector<Sender> senders;
+    LatencyHistogram latency;     // nanoseconds
+    std::unique_ptr<Inflater> inflater;  // Server's compressed frames, each on its own
+    std::string inflated;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t bytes_received;
+    int closed;
+
+    Worker(): sent(0), received(0), bytes_received(0), closed(0) {}
+  };
+
+  BenchConfig m_config;
+  std::vector<Worker> m_workers;
+  std::atomic<int> m_ready;       // sessions done with hello
+  std::atomic<int> m_failed;      // ... and those that never will be
+  std::atomic<int> m_phase;       // Phase
+  std::atomic<int64_t> m_start;   // steady clock, ns, when sending starts
+
+  enum Phase { CONNECTING, SENDING, DRAINING, STOPPED };
+
+  static int64_t now();
+  bool connectSessions();
+  int connectOne(const addrinfo* server_info, std::unique_ptr<ShmChannel>* channel);
+  void runWorker(Worker& worker);
+  void receive(Worker& worker, Session& session);
+  void fail(Session& session);
+  void handleFrame(Worker& worker, Session& session, const Frame& frame);
+  void countMessage(Worker& worker, const Frame& frame, size_t copies);
+  void sendNext(Worker& worker, Session& session, uint32_t number, int64_t due, std::mt19937& random);
+  void write(Session& session, const std::string& data);
+  void report(double seconds) const;
+};
+
+// ----------------------------------------------
+inline LoadGenerator::LoadGenerator(const BenchConfig& config)
+  : m_config(config), m_ready(0), m_failed(0), m_phase(CONNECTING), m_start(0) {
+  m_config.mux = std::max(0, std::min(m_config.mux, m_config.sessions));
+  m_config.threads = std::max(1, std::min(m_config.threads, m_config.connections()));
+  m_config.senders = std::max(1, std::min(m_config.senders, m_config.sessions));
+  m_config.max_size = std::max(m_config.min_size, m_config.max_size);
+  m_workers.resize(m_config.threads);
+}
+
+inline int64_t LoadGenerator::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline bool LoadGenerator::run() {
+  // every session is a descriptor
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  if (!connectSessions()) {
+    return false;
+  }
+
+  std::vector<std::thread> threads;
+  for (Worker& worker : m_workers) {
+    threads.emplace_back(&LoadGenerator::runWorker, this, std::ref(worker));
+  }
+  int64_t deadline = now() + BENCH_READY_TIMEOUT_MS * 1000000LL;
+  while (m_ready.load() + m_failed.load() < m_config.sessions && now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  int ready = m_ready.load();
+  if (ready < m_config.sessions) {
+    int failed = m_failed.load();
+    printf("%i of %i sessions not ready: %i failed, %i timed out\n", m_config.sessions - ready, m_config.sessions,
+           failed, std::max(0, m_config.sessions - ready - failed));
+  }
+  if (ready == 0) {
+    m_phase.store(STOPPED);
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    for (Worker& worker : m_workers) {
+      for (Session& session : worker.sessions) {
+        close(session.socket);
+      }
+    }
+    return false;
+  }
+  printf("%i sessions connected over %i %s connections, sending for %i s\n", ready, m_config.connections(),
+         m_config.transport(), m_config.duration_s);
+
+  int64_t start = now();
+  m_start.store(start);
+  m_phase.store(SENDING);
+  std::this_thread::sleep_for(std::chrono::seconds(m_config.duration_s));
+  int64_t stop = now();
+  m_phase.store(DRAINING);
+  std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_DRAIN_MS));
+  m_phase.store(STOPPED);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  report((stop - start) / 1e9);
+  for (Worker& worker : m_workers) {
+    for (Session& session : worker.sessions) {
+      close(session.socket);
+    }
+  }
+  return true;
+}
+
+inline bool LoadGenerator::connectSessions() {
+  addrinfo hints;
+  addrinfo* server_info = nullptr;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  int status = m_config.unix_path.empty() && m_config.shm_path.empty() ?
+               getaddrinfo(m_config.ip_address.c_str(), m_config.port.c_str(), &hints, &server_info) : 0;
+  if (status != 0) {
+    ERR("Failed to prepare address structure: %s", gai_strerror(status));
+    return false;
+  }
+
+  bool result = true;
+  for (int i = 0; i < m_config.connections(); ++i) {
+    Worker& worker = m_workers[i % m_workers.size()];
+    std::unique_ptr<ShmChannel> channel;
+    int s = connectOne(server_info, &channel);
+    if (s == -1) {
+      printf("Failed to connect connection %i: %s\n", i, strerror(errno));
+      result = false;
+      break;
+    }
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+    worker.sessions.emplace_back();
+    Session& session = worker.sessions.back();
+    session.socket = s;
+    session.channel = std::move(channel);
+    if (m_config.mux == 0) {
+      if (i < m_config.senders) {
+        worker.senders.push_back(Sender{ worker.sessions.size() - 1, 0 });
+      }
+      continue;
+    }
+    int first = i * m_config.mux;  // of its logical sessions, the first ones in order send
+    session.mux = std::min(m_config.mux, m_config.sessions - first);
+    session.mux_ids.assign(session.mux, -1);
+    for (int number = 1; number <= session.mux && first + number - 1 < m_config.senders; ++number) {
+      worker.senders.push_back(Sender{ worker.sessions.size() - 1, static_cast<uint32_t>(number) });
+    }
+  }
+  if (server_info != nullptr) {
+    freeaddrinfo(server_info);
+  }
+
+  if (!result) {
+    for (Worker& worker : m_workers) {
+      for (Session& session : worker.sessions) {
+        close(session.socket);
+      }
+    }
+  }
+  return result;
+}
+
+// the configured transport, -1 on failure
+inline int LoadGenerator::connectOne(const addrinfo* server_info, std::unique_ptr<ShmChannel>* channel) {
+  if (!m_config.shm_path.empty()) {
+    int s = connectLocal(m_config.shm_path);
+    if (s != -1) {
+      channel->reset(ShmChannel::receiveSetup(s));
+      if (!*channel) {
+        close(s);
+        s = -1;
+      }
+    }
+    return s;
+  }
+  if (!m_config.unix_path.empty()) {
+    return connectLocal(m_config.unix_path);
+  }
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s == -1 || connect(s, server_info->ai_addr, server_info->ai_addrlen) == -1) {
+    if (s != -1) {
+      close(s);
+    }
+    return -1;
+  }
+  int enable = 1;  // messages leave when they are due, the latency measured is the server's
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  return s;
+}
+
+// ----------------------------------------------
+inline void LoadGenerator::runWorker(Worker& worker) {
+  int epoll_fd = epoll_create1(0);
+  for (size_t i = 0; i < worker.sessions.size(); ++i) {
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = i;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker.sessions[i].socket, &event);
+    if (worker.sessions[i].channel) {  // data to read or room to write
+      event.data.u64 = i | BENCH_CHANNEL_FLAG;
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker.sessions[i].channel->event(), &event);
+    }
+  }
+
+  // this worker's share of the rate, evenly spaced
+  double rate = m_config.rate * worker.senders.size() / m_config.senders;
+  int64_t interval = rate > 0 ? static_cast<int64_t>(1e9 / rate) : 0;
+  int64_t next_due = 0;
+  size_t next_sender = 0;
+  std::mt19937 random(std::random_device{}());
+
+  epoll_event events[BENCH_MAX_EVENTS];
+  while (m_phase.load() != STOPPED) {
+    int count = epoll_wait(epoll_fd, events, BENCH_MAX_EVENTS, BENCH_TICK_MS);
+    for (int i = 0; i < count; ++i) {
+      Session& session = worker.sessions[events[i].data.u64 & ~BENCH_CHANNEL_FLAG];
+      if (events[i].data.u64 & BENCH_CHANNEL_FLAG) {
+        session.channel->clearEvent();
+        if (!session.outbox.empty()) {
+          write(session, std::string());
+        }
+        receive(worker, session);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        write(session, std::string());
+        if (session.outbox.empty()) {
+          epoll_event event;
+          event.events = EPOLLIN;
+          event.data.u64 = events[i].data.u64;
+          epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session.socket, &event);
+        }
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        receive(worker, session);
+        if (session.is_closed) {
+          epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session.socket, nullptr);
+          if (session.channel) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session.channel->event(), nullptr);
+          }
+        }
+      }
+    }
+
+    if (m_phase.load() != SENDING || interval == 0 || worker.senders.empty()) {
+      continue;
+    }
+    if (next_due == 0) {
+      next_due = m_start.load();
+    }
+    for (int64_t current = now(); next_due <= current; next_due += interval) {
+      const Sender& sender = worker.senders[next_sender++ % worker.senders.size()];
+      size_t position = sender.position;
+      Session& session = worker.sessions[position];
+      if (session.is_closed || session.is_failed) {
+        continue;
+      }
+      sendNext(worker, session, sender.number, next_due, random);
+      if (!session.outbox.empty() && !session.channel) {  // socket is full, write the rest when it drains
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.u64 = position;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session.socket, &event);
+      }
+    }
+  }
+  close(epoll_fd);
+}
+
+inline void LoadGenerator::receive(Worker& worker, Session& session) {
+  while (!session.is_closed) {
+    char* buffer = session.decoder.prepare(PROTOCOL_READ_SIZE);
+    ssize_t read_bytes = 0;
+    if (session.channel) {
+      read_bytes = session.channel->read(buffer, PROTOCOL_READ_SIZE);
+      if (read_bytes == 0) {
+        if (!session.channel->sleepUntilData()) {
+          continue;  // written meanwhile
+        }
+        char end;  // nothing comes over the socket but its end
+        read_bytes = recv(session.socket, &end, 1, MSG_DONTWAIT);
+      }
+    } else {
+      read_bytes = recv(session.socket, buffer, PROTOCOL_READ_SIZE, 0);
+    }
+    if (read_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (read_bytes <= 0) {
+      DBG("Session %i closed: %s", session.id, read_bytes == 0 ? "by Server" : strerror(errno));
+      session.is_closed = true;
+      ++worker.closed;
+      fail(session);  // unless it was ready
+      return;
+    }
+    session.decoder.commit(read_bytes);
+    worker.bytes_received += read_bytes;
+
+    Frame frame;
+    FrameDecoder::Status status;
+    while ((status = session.decoder.next(&frame)) == FrameDecoder::FRAME) {
+      if (frame.flags & FRAME_FLAG_COMPRESSED) {
+        if (!worker.inflater) {
+          worker.inflater.reset(new Inflater(false));
+        }
+        if (!decompressFrame(*worker.inflater, &frame, &worker.inflated)) {
+          ERR("Broken compressed frame in session %i", session.id);
+          continue;
+        }
+      }
+      handleFrame(worker, session, frame);
+    }
+    if (status == FrameDecoder::BROKEN) {
+      ERR("Broken stream from Server in session %i", session.id);
+      session.is_closed = true;
+      ++worker.closed;
+      fail(session);
+      return;
+    }
+  }
+}
+
+// don't wait for a session that won't be ready
+inline void LoadGenerator::fail(Session& session) {
+  if (!session.is_ready && !session.is_failed) {
+    session.is_failed = true;
+    m_failed += session.count();
+  }
+}
+
+inline void LoadGenerator::handleFrame(Worker& worker, Session& session, const Frame& frame) {
+  if (session.id < 0) {  // text hello with the id and Server's version
+    int server_version = 0;
+    if (frame.type != FRAME_TEXT || !parseTextHello(frame.payload, &session.id, &server_version)) {
+      ERR("Failed to receive hello from Server");
+      fail(session);
+      return;
+    }
+    session.protocol = std::min(server_version, m_config.protocol);
+    if (session.mux > 0 && session.protocol < 1) {
+      ERR("Server can't multiplex sessions: no binary protocol");
+      fail(session);
+    } else if (session.protocol >= 1) {
+      std::string request;
+      encodeHello(request, session.protocol, -1, m_config.compression ? COMPRESSION_DEFLATE : COMPRESSION_NONE);
+      write(session, request);
+    } else {
+      session.is_ready = true;
+      ++m_ready;
+    }
+    return;
+  }
+  if (frame.type == FRAME_HELLO) {
+    int version = 0;
+    int compression = COMPRESSION_NONE;
+    if (readHello(frame, &version, &compression) && compression == COMPRESSION_DEFLATE) {
+      session.deflater.reset(new Deflater(true));
+    }
+    if (session.mux == 0) {
+      session.is_ready = true;
+      ++m_ready;
+      return;
+    }
+    std::string request;  // commands are never compressed, Server reads them either way
+    for (int number = 1; number <= session.mux; ++number) {
+      encodeSession(request, FRAME_OPEN, number);
+    }
+    write(session, request);
+    return;
+  }
+  if (frame.type == FRAME_OPEN) {
+    uint32_t number = 0;
+    int id = -1;
+    if (readOpened(frame, &number, &id) && number >= 1 && number <= session.mux_ids.size() && session.mux_ids[number - 1] < 0) {
+      session.mux_ids[number - 1] = id;
+      if (++session.mux_opened == session.mux) {
+        session.is_ready = true;
+        m_ready += session.mux;
+      }
+    }
+    return;
+  }
+  if (frame.type == FRAME_CLOSE && !session.is_ready) {  // an OPEN refused, e.g. beyond Server's --max-sessions
+    uint32_t number = 0;
+    readSession(frame, &number);
+    ERR("Server refused logical session %u in connection %i", number, session.id);
+    fail(session);
+    return;
+  }
+  if (frame.type == FRAME_ROUTE) {
+    Slice sessions;
+    Frame routed;
+    if (!readRoute(frame, &sessions, &routed)) {
+      ERR("Malformed route in connection %i", session.id);
+      return;
+    }
+    if (routed.flags & FRAME_FLAG_COMPRESSED) {
+      if (!worker.inflater) {
+        worker.inflater.reset(new Inflater(false));
+      }
+      if (!decompressFrame(*worker.inflater, &routed, &worker.inflated)) {
+        ERR("Broken compressed frame in connection %i", session.id);
+        return;
+      }
+    }
+    countMessage(worker, routed, sessions.size / 4);
+    return;
+  }
+  countMessage(worker, frame, 1);
+}
+
+inline void LoadGenerator::countMessage(Worker& worker, const Frame& frame, size_t copies) {
+  MessageView message;
+  if (!MessageView::fromFrame(frame, &message) || message.login.size != strlen(BENCH_LOGIN) ||
+      memcmp(message.login.data, BENCH_LOGIN, message.login.size) != 0) {
+    return;  // somebody else's traffic
+  }
+  int64_t due = std::strtoll(std::string(message.text.data, std::min<size_t>(message.text.size, 20)).c_str(), nullptr, 10);
+  if (due > 0) {
+    uint64_t latency = static_cast<uint64_t>(std::max<int64_t>(0, now() - due));
+    for (size_t i = 0; i < copies; ++i) {
+      worker.latency.record(latency);
+    }
+    worker.received += copies;
+  }
+}
+
+// number: of the logical session sending, 0 - the connection itself
+inline void LoadGenerator::sendNext(Worker& worker, Session& session, uint32_t number, int64_t due, std::mt19937& random) {
+  std::uniform_int_distribution<size_t> sizes(m_config.min_size, m_config.max_size);
+  Message message;
+  message.id = number == 0 ? session.id : session.mux_ids[number - 1];
+  message.login = BENCH_LOGIN;
+  static const char* words[] = { "the", "server", "message", "hello", "and", "channel", "latency", "ok", "is",
+                                 "we", "deploy", "tomorrow", "build", "green", "thanks", "queue", "what", "about" };
+  std::uniform_int_distribution<size_t> choice(0, sizeof(words) / sizeof(words[0]) - 1);
+  size_t size = sizes(random);
+  message.text = std::to_string(due) + ":";
+  while (message.text.size() < size) {  // chat-like text rather than one repeated byte, for compression's sake
+    message.text += ' ';
+    message.text += words[choice(random)];
+  }
+  message.text.resize(std::max(message.text.find(':') + 1, size));
+
+  std::string raw;
+  encodeMessage(MessageView(message), session.protocol, raw);
+  if (number != 0) {
+    appendSession(raw, 0, number);
+  }
+  std::string compressed;
+  if (session.deflater && compressFrame(*session.deflater, Slice(raw), compressed)) {
+    raw.swap(compressed);
+  }
+  write(session, raw);
+  ++worker.sent;
+}
+
+inline void LoadGenerator::write(Session& session, const std::string& data) {
+  if (session.outbox_offset == session.outbox.size()) {
+    session.outbox.clear();
+    session.outbox_offset = 0;
+  }
+  session.outbox += data;
+  while (session.outbox_offset < session.outbox.size()) {
+    const char* pending = session.outbox.data() + session.outbox_offset;
+    size_t size = session.outbox.size() - session.outbox_offset;
+    ssize_t sent = session.channel ? static_cast<ssize_t>(session.channel->write(pending, size)) : send(session.socket, pending, size, MSG_NOSIGNAL);
+    if (sent == 0 && session.channel && !session.channel->sleepUntilRoom()) {
+      continue;  // read meanwhile
+    }
+    if (sent <= 0) {
+      return;  // EAGAIN waits for EPOLLOUT or the channel's event, errors show up as a closed session on receive
+    }
+    session.outbox_offset += sent;
+  }
+  session.outbox.clear();
+  session.outbox_offset = 0;
+}
+
+inline void LoadGenerator::report(double seconds) const {
+  LatencyHistogram latency;
+  uint64_t sent = 0, received = 0, bytes = 0;
+  int closed = 0;
+  for (const Worker& worker : m_workers) {
+    latency.merge(worker.latency);
+    sent += worker.sent;
+    received += worker.received;
+    bytes += worker.bytes_received;
+    closed += worker.closed;
+  }
+  uint64_t expected = sent * std::max(0, m_ready.load() - 1);  // everybody ready but the sender
+  printf("Sessions: %i over %i %s connections (%i senders, %i connections closed by Server), %.1f s\n", m_ready.load(),
+         m_config.connections(), m_config.transport(), m_config.senders, closed, seconds);
+  printf("Sent: %llu messages, %.0f msg/s\n", (unsigned long long) sent, sent / seconds);
+  printf("Received: %llu of %llu copies (%.3f%% lost), %.0f msg/s, %.1f MB/s\n", (unsigned long long) received,
+         (unsigned long long) expected, expected == 0 ? 0.0 : 100.0 * (expected - std::min(expected, received)) / expected,
+         received / seconds, bytes / seconds / 1e6);
+  printf("Fan-out latency, us: mean %.1f, p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n", latency.mean() / 1e3,
+         latency.percentile(50) / 1e3, latency.percentile(99) / 1e3, latency.percentile(99.9) / 1e3, latency.max() / 1e3);
+}
+
+#endif  // LOADGEN__H__
@@ -157,24 +157,30 @@
   #define SYS_SUGGEST COLOR_OPEN SYS_COLOR SYS_STRING __FILE__ COLON LINE PROMPT_SUGGEST
   #define TTY_SUGGEST COLOR_OPEN TTY_COLOR TTY_STRING __FILE__ COLON LINE PROMPT_SUGGEST
 
+  #include "asynclog.h"
+
+  // records are formatted and written by AsyncLog's thread, levels can be lowered at run time
+  #define LOG_PREFIXED(level, suggest, fmt, ...) LOG_ASYNC(level, (suggest #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__)
+
+  // program output without a prefix, e.g. chat messages on Server's console
+  #define OUT(fmt, ...) LOG_ASYNC(LOG_INFO, fmt NEWLINE, ##__VA_ARGS__)
+
 #if ENABLED_LOGGING
-  #include <iostream>
-
-  #define FAT(fmt, ...) printf((FAT_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
-  #define CRT(fmt, ...) printf((CRT_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
-  #define ERR(fmt, ...) printf((ERR_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
-  #define WRN(fmt, ...) printf((WRN_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
-  #define INF(fmt, ...) printf((INF_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
-  #define DBG(fmt, ...) printf((DBG_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
-  #define VER(fmt, ...) printf((VER_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
-  #define TRC(fmt, ...) printf((TRC_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
-  #define MSG(fmt, ...) printf((MSG_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
-  #define SYS(fmt, ...) printf((SYS_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
-  #define TTY(fmt, ...) printf((TTY_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
+  #define FAT(fmt, ...) LOG_PREFIXED(LOG_FATAL, FAT_SUGGEST, fmt, ##__VA_ARGS__);
+  #define CRT(fmt, ...) LOG_PREFIXED(LOG_CRITICAL, CRT_SUGGEST, fmt, ##__VA_ARGS__);
+  #define ERR(fmt, ...) LOG_PREFIXED(LOG_ERROR, ERR_SUGGEST, fmt, ##__VA_ARGS__);
+  #define WRN(fmt, ...) LOG_PREFIXED(LOG_WARNING, WRN_SUGGEST, fmt, ##__VA_ARGS__);
+  #define INF(fmt, ...) LOG_PREFIXED(LOG_INFO, INF_SUGGEST, fmt, ##__VA_ARGS__);
+  #define DBG(fmt, ...) LOG_PREFIXED(LOG_DEBUG, DBG_SUGGEST, fmt, ##__VA_ARGS__);
+  #define VER(fmt, ...) LOG_PREFIXED(LOG_VERBOSE, VER_SUGGEST, fmt, ##__VA_ARGS__);
+  #define TRC(fmt, ...) LOG_PREFIXED(LOG_TRACE, TRC_SUGGEST, fmt, ##__VA_ARGS__);
+  #define MSG(fmt, ...) LOG_PREFIXED(LOG_TRACE, MSG_SUGGEST, fmt, ##__VA_ARGS__);
+  #define SYS(fmt, ...) LOG_PREFIXED(LOG_INFO, SYS_SUGGEST, fmt, ##__VA_ARGS__);
+  #define TTY(fmt, ...) LOG_PREFIXED(LOG_INFO, TTY_SUGGEST, fmt, ##__VA_ARGS__);
 
 #else
 
-  #define FAT(fmt, ...) printf((FAT_SUGGEST #fmt PROMPT_CLOSE), __LINE__, ##__VA_ARGS__); std::cout << std::flush;
+  #define FAT(fmt, ...) LOG_PREFIXED(LOG_FATAL, FAT_SUGGEST, fmt, ##__VA_ARGS__);
   #define CRT(fmt, ...)
   #define ERR(fmt, ...)
   #define WRN(fmt, ...)
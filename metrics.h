@@ -0,0 +1,186 @@
+#ifndef METRICS__H__
+#define METRICS__H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include "histogram.h"
+
+#define METRICS_MAX_STRIPES 16
+
+enum Counter {
+  COUNTER_ACCEPTED,        // connections
+  COUNTER_CLOSED,
+  COUNTER_MESSAGES_IN,     // chat messages received from peers
+  COUNTER_MESSAGES_OUT,    // copies of them queued to recipients
+  COUNTER_BYTES_IN,
+  COUNTER_BYTES_OUT,       // accepted by the kernel
+  COUNTER_SEND_ERRORS,     // writes that failed and closed the peer
+  COUNTER_PARSE_FAILURES,  // malformed frames and broken streams
+  COUNTER_SESSIONS_RESUMED,
+  COUNTER_MESSAGES_RESUMED,  // missed while disconnected and sent after resumption
+  COUNTER_MESSAGES_MISSED,   // ... already gone from the ring by then
+  COUNTER_LINK_MESSAGES_IN,  // from other nodes of the federation
+  COUNTER_LINK_MESSAGES_OUT,  // ... to them, one copy per link
+  COUNTER_LINK_BYTES_IN,
+  COUNTER_LINK_BYTES_OUT,
+  COUNTER_PEERS_TAKEN_OVER,  // live connections passed on by the process this one replaced
+  COUNTER_PEERS_HANDED_OVER,  // ... and passed on by this one to its replacement
+  COUNTER_INGRESS_DELAYS,   // times a peer over its rate limit was not read until its tokens refilled
+  COUNTER_FRAMES_REJECTED,  // ... frames of such peers dropped instead
+  COUNTER_MUX_OPENED,  // logical sessions of multiplexed connections
+  COUNTER_MUX_CLOSED,
+  COUNTER_MUX_REFUSED,  // ... not opened, the connection had --max-sessions of them
+  COUNTER_MUX_ROUTES,  // ROUTE frames queued, one per multiplexed connection a message goes to
+  COUNTER_COUNT
+};
+
+enum HistogramId {
+  HISTOGRAM_FANOUT_NS,     // queueing one message to all its local recipients
+  HISTOGRAM_QUEUE_BYTES,   // peer's outbound queue when it is flushed
+  HISTOGRAM_BATCH_FRAMES,  // ... and its frames, written together
+  HISTOGRAM_COUNT
+};
+
+/* Histogram for many writers, the bucket layout of LatencyHistogram */
+// --------------------------------------------------------------------------------------------------------------------
+class AtomicHistogram {
+public:
+  AtomicHistogram(): m_counts(new std::atomic<uint64_t>[LatencyHistogram::bucketCount()]), m_sum(0), m_max(0) {
+    for (size_t i = 0; i < LatencyHistogram::bucketCount(); ++i) {
+      m_counts[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void record(uint64_t value) {
+    m_counts[LatencyHistogram::bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = m_max.load(std::memory_order_relaxed);
+    while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+  }
+
+  void addTo(LatencyHistogram* histogram) const {  // not a consistent snapshot, close enough while recording
+    histogram->merge(m_counts.get(), m_sum.load(std::memory_order_relaxed), m_max.load(std::memory_order_relaxed));
+  }
+
+private:
+  std::unique_ptr<std::atomic<uint64_t>[]> m_counts;
+  std::atomic<uint64_t> m_sum;
+  std::atomic<uint64_t> m_max;
+};
+
+/**
+ * Server-wide counters and histograms. Updates are relaxed atomic adds into one of a few stripes,
+ * a thread picks its stripe once, so reactor threads don't share cache lines and thousands of
+ * connection threads don't need thousands of copies. Nothing is summed until somebody reads.
+ */
+class Metrics {
+public:
+  static Metrics& instance();
+
+  static void add(Counter counter, uint64_t value = 1) {
+    instance().local().counters[counter].fetch_add(value, std::memory_order_relaxed);
+  }
+  static void record(HistogramId histogram, uint64_t value) {
+    instance().local().histograms[histogram].record(value);
+  }
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  uint64_t total(Counter counter) const;
+  LatencyHistogram histogram(HistogramId histogram) const;
+  std::string format() const;  // "name value" lines
+
+private:
+  struct Stripe {
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    AtomicHistogram histograms[HISTOGRAM_COUNT];
+    char padding[64];  // off the next stripe's cache lines
+
+    Stripe() {
+      for (auto& counter : counters) {
+        counter.store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  std::unique_ptr<Stripe[]> m_stripes;
+  size_t m_stripe_count;
+  std::atomic<size_t> m_next_stripe;
+
+  Metrics();
+  Stripe& local() {
+    static thread_local size_t stripe = m_next_stripe.fetch_add(1, std::memory_order_relaxed) % m_stripe_count;
+    return m_stripes[stripe];
+  }
+
+  Metrics(const Metrics&) = delete;
+  Metrics& operator = (const Metrics&) = delete;
+};
+
+// ----------------------------------------------
+inline Metrics::Metrics()
+  : m_stripe_count(std::max(1u, std::min(std::thread::hardware_concurrency(), static_cast<unsigned>(METRICS_MAX_STRIPES)))),
+    m_next_stripe(0) {
+  m_stripes.reset(new Stripe[m_stripe_count]);
+}
+
+inline Metrics& Metrics::instance() {
+  static Metrics metrics;
+  return metrics;
+}
+
+inline uint64_t Metrics::total(Counter counter) const {
+  uint64_t total = 0;
+  for (size_t i = 0; i < m_stripe_count; ++i) {
+    total += m_stripes[i].counters[counter].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+inline LatencyHistogram Metrics::histogram(HistogramId histogram) const {
+  LatencyHistogram result;
+  for (size_t i = 0; i < m_stripe_count; ++i) {
+    m_stripes[i].histograms[histogram].addTo(&result);
+  }
+  return result;
+}
+
+inline std::string Metrics::format() const {
+  static const char* counters[] = { "connections_accepted", "connections_closed", "messages_in", "messages_out",
+                                    "bytes_in", "bytes_out", "send_errors", "parse_failures",
+                                    "sessions_resumed", "messages_resumed", "messages_missed",
+                                    "link_messages_in", "link_messages_out", "link_bytes_in", "link_bytes_out",
+                                    "peers_taken_over", "peers_handed_over", "ingress_delays", "frames_rejected",
+                                    "mux_sessions_opened", "mux_sessions_closed", "mux_sessions_refused", "mux_routes_out" };
+  static const char* histograms[] = { "fanout_us", "queue_bytes", "batch_frames" };
+  static const double scales[] = { 1e3, 1.0, 1.0 };  // fan-out is recorded in ns
+
+  std::string out;
+  char line[256];
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    snprintf(line, sizeof(line), "%s %llu\n", counters[i], (unsigned long long) total(static_cast<Counter>(i)));
+    out += line;
+  }
+  snprintf(line, sizeof(line), "connections_open %lld\n",
+           (long long) (total(COUNTER_ACCEPTED) + total(COUNTER_PEERS_TAKEN_OVER)) -
+           (long long) (total(COUNTER_CLOSED) + total(COUNTER_PEERS_HANDED_OVER)));
+  out += line;
+  for (int i = 0; i < HISTOGRAM_COUNT; ++i) {
+    LatencyHistogram value = histogram(static_cast<HistogramId>(i));
+    double scale = scales[i];
+    snprintf(line, sizeof(line), "%s count %llu mean %.1f p50 %.1f p99 %.1f p999 %.1f max %.1f\n", histograms[i],
+             (unsigned long long) value.count(), value.mean() / scale, value.percentile(50) / scale,
+             value.percentile(99) / scale, value.percentile(99.9) / scale, value.max() / scale);
+    out += line;
+  }
+  return out;
+}
+
+#endif  // METRICS__H__
@@ -0,0 +1,346 @@
+#ifndef OUTBOUND__H__
+#define OUTBOUND__H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "buffer.h"
+#include "logger.h"
+#include "shmring.h"
+
+#define OUTBOUND_MAX_IOV 64
+
+/* What to do when a peer does not keep up with its outbound traffic */
+// --------------------------------------------------------------------------------------------------------------------
+enum class OverflowPolicy {
+  DROP_OLDEST,  // forget the oldest queued messages to make room
+  DISCONNECT,   // close the slow consumer
+  BLOCK         // sender waits for the peer (up to block_timeout_ms), then disconnects it; threads mode only
+};
+
+/* When queued frames are written */
+// --------------------------------------------------------------------------------------------------------------------
+enum class DeliveryMode {
+  LATENCY,    // TCP_NODELAY, frames are flushed as soon as they are queued
+  THROUGHPUT  // a peer's frames are coalesced for up to batch_delay_us or batch_bytes and written together
+};
+
+struct OutboundConfig {
+  size_t max_bytes;  // per-peer queue limit
+  OverflowPolicy policy;
+  int block_timeout_ms;
+  DeliveryMode delivery;
+  int batch_delay_us;  // throughput mode: how long the first frame of a batch may wait
+  size_t batch_bytes;  // ... and how much makes a batch full
+
+  OutboundConfig()
+    : max_bytes(1024 * 1024), policy(OverflowPolicy::DROP_OLDEST), block_timeout_ms(1000),
+      delivery(DeliveryMode::LATENCY), batch_delay_us(200), batch_bytes(16 * 1024) {}
+
+  bool isBatching() const { return delivery == DeliveryMode::THROUGHPUT; }
+};
+
+struct OutboundStats {
+  std::atomic<long> throttled_peers;     // peers whose queue did not fit into the kernel right now
+  std::atomic<long> throttle_events;     // how many times a peer became throttled
+  std::atomic<long> dropped_messages;
+  std::atomic<long> disconnected_peers;  // slow consumers closed by policy
+  std::atomic<long> blocked_sends;       // sends that had to wait for the peer
+  std::atomic<long> writes;              // gather-write syscalls
+  std::atomic<long> written_messages;    // messages completed by them
+
+  OutboundStats()
+    : throttled_peers(0), throttle_events(0), dropped_messages(0), disconnected_peers(0), blocked_sends(0),
+      writes(0), written_messages(0) {}
+};
+
+/**
+ * Bounded queue of serialized frames waiting to be written to one peer. Frames are written with
+ * a single gather-write (sendmsg with up to OUTBOUND_MAX_IOV parts, i.e. writev that never blocks
+ * and never raises SIGPIPE). Frames are shared buffers, queueing one is a reference count increment;
+ * the ring only grows, so a warmed-up queue does not allocate. Not thread-safe, the owner serializes
+ * access.
+ *
+ * Writes can also be asynchronous (io_uring): gather() hands out the front frames, they stay queued
+ * and can't be dropped until complete() reports how much the kernel took; meanwhile flush() does nothing.
+ *
+ * A peer on a shared memory channel has its frames copied into the channel's ring instead, the
+ * same way; when the ring is full the queue is throttled until the client has read from it.
+ *
+ * The queue does not decide when to flush. In throughput mode the owner asks isBatchDue(): frames
+ * queued since the queue was last empty form a batch that is due when it is full or old enough.
+ */
+class OutboundQueue {
+public:
+  enum Status { DRAINED, PENDING, FAILED };
+
+  OutboundQueue(int socket, const OutboundConfig& config, OutboundStats* stats)
+    : m_socket(socket), m_head(0), m_count(0), m_offset(0), m_bytes(0), m_writing(0), m_gathered(0),
+      m_config(config), m_stats(stats), m_channel(nullptr),
+      m_is_throttled(false), m_batch_start(0) {}
+  ~OutboundQueue() { setThrottled(false); }
+
+  bool push(const BufferRef& frame);  // false - the peer has to be disconnected
+  Status flush();
+
+  int gather(iovec* parts, int max);  // starts an asynchronous write of the front frames
+  Status complete(ssize_t result);    // its result, bytes written or -errno
+  bool isWriting() const { return m_writing > 0; }
+  void setChannel(ShmChannel* channel) { m_channel = channel; }  // writes go to its ring instead of the socket
+
+  bool empty() const { return m_count == 0; }
+  size_t bytes() const { return m_bytes; }
+  size_t frames() const { return m_count; }
+  bool isThrottled() const { return m_is_throttled; }
+  void copyUnsent(std::string* out);  // the bytes still to be written, in order
+
+  int64_t batchDeadline() const { return m_batch_start + m_config.batch_delay_us * 1000LL; }  // steady clock, ns
+  bool isBatchDue(int64_t now) const { return m_bytes >= m_config.batch_bytes || now >= batchDeadline(); }
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+private:
+  int m_socket;
+  std::vector<BufferRef> m_ring;
+  size_t m_head;    // index of the front frame in m_ring
+  size_t m_count;   // frames in m_ring
+  size_t m_offset;  // bytes of the front frame already written
+  size_t m_bytes;   // total unwritten bytes
+  size_t m_writing;  // front frames given to an asynchronous write
+  size_t m_gathered;  // ... and their bytes
+  const OutboundConfig& m_config;
+  OutboundStats* m_stats;
+  ShmChannel* m_channel;
+  bool m_is_throttled;
+  int64_t m_batch_start;  // when the first of the queued frames was pushed
+
+  BufferRef& at(size_t i) { return m_ring[(m_head + i) & (m_ring.size() - 1)]; }
+  void popFront();
+  int fill(iovec* parts, int max);
+  void consume(size_t sent);
+  bool waitWritable(size_t size);
+  void setThrottled(bool is_throttled);
+};
+
+inline void OutboundQueue::popFront() {
+  m_ring[m_head].reset();
+  m_head = (m_head + 1) & (m_ring.size() - 1);
+  --m_count;
+}
+
+inline bool OutboundQueue::push(const BufferRef& frame) {
+  size_t size = frame.size();
+  if (m_bytes + size > m_config.max_bytes && flush() == FAILED) {  // the kernel may have room already
+    return false;
+  }
+  if (m_bytes + size > m_config.max_bytes) {
+    switch (m_config.policy) {
+      case OverflowPolicy::DROP_OLDEST: {
+        // frames partially written or being written can't be dropped, the stream would be corrupted
+        size_t pinned = std::max(m_writing, m_offset > 0 ? size_t(1) : size_t(0));
+        size_t pinned_bytes = pinned > 0 ? at(0).size() - m_offset : 0;
+        for (size_t i = 1; i < pinned; ++i) {
+          pinned_bytes += at(i).size();
+        }
+        if (pinned_bytes + size > m_config.max_bytes) {  // would not fit even alone: it goes, the queue stays
+          ++m_stats->dropped_messages;
+          return true;
+        }
+        while (m_bytes + size > m_config.max_bytes) {
+          m_bytes -= at(pinned).size();  // the oldest droppable one, pinned frames move over it
+          for (size_t i = pinned; i > 0; --i) {
+            at(i) = std::move(at(i - 1));
+          }
+          popFront();
+          ++m_stats->dropped_messages;
+        }
+        break;
+      }
+      case OverflowPolicy::DISCONNECT:
+        ++m_stats->disconnected_peers;
+        return false;
+      case OverflowPolicy::BLOCK:
+        ++m_stats->blocked_sends;
+        if (!waitWritable(size)) {
+          ++m_stats->disconnected_peers;
+          return false;
+        }
+        break;
+    }
+  }
+  if (m_count == m_ring.size()) {  // grow the ring, capacity stays a power of two
+    std::vector<BufferRef> ring(m_ring.empty() ? 16 : m_ring.size() * 2);
+    for (size_t i = 0; i < m_count; ++i) {
+      ring[i] = std::move(at(i));
+    }
+    m_ring.swap(ring);
+    m_head = 0;
+  }
+  if (m_count == 0 && m_config.isBatching()) {
+    m_batch_start = now();
+  }
+  m_ring[(m_head + m_count) & (m_ring.size() - 1)] = frame;
+  ++m_count;
+  m_bytes += size;
+  return true;
+}
+
+inline int OutboundQueue::fill(iovec* parts, int max) {
+  int total = 0;
+  for (; static_cast<size_t>(total) < m_count && total < max; ++total) {
+    const BufferRef& frame = at(total);
+    size_t skip = total == 0 ? m_offset : 0;
+    parts[total].iov_base = const_cast<char*>(frame.data() + skip);
+    parts[total].iov_len = frame.size() - skip;
+  }
+  return total;
+}
+
+inline void OutboundQueue::consume(size_t sent) {
+  m_bytes -= sent;
+  while (sent > 0) {  // pop fully written frames
+    size_t rest = at(0).size() - m_offset;
+    if (sent < rest) {
+      m_offset += sent;
+      break;
+    }
+    sent -= rest;
+    m_offset = 0;
+    popFront();
+    ++m_stats->written_messages;
+  }
+}
+
+inline OutboundQueue::Status OutboundQueue::flush() {
+  if (m_writing > 0) {
+    return PENDING;  // completes asynchronously
+  }
+  while (m_count > 0) {
+    iovec parts[OUTBOUND_MAX_IOV];
+    int total = fill(parts, OUTBOUND_MAX_IOV);
+    if (m_channel != nullptr) {
+      size_t written = m_channel->write(parts, total);
+      if (written == 0) {
+        if (m_channel->isBroken()) {
+          ERR("send error: shared memory ring is broken");
+          return FAILED;
+        }
+        if (m_channel->sleepUntilRoom()) {  // the client wakes the owner when it has read
+          setThrottled(true);
+          return PENDING;
+        }
+        continue;
+      }
+      ++m_stats->writes;
+      consume(written);
+      continue;
+    }
+
+    msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = parts;
+    header.msg_iovlen = total;
+    ssize_t sent = sendmsg(m_socket, &header, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        setThrottled(true);
+        return PENDING;
+      }
+      ERR("send error: %s", strerror(errno));
+      return FAILED;
+    }
+    ++m_stats->writes;
+    consume(sent);
+  }
+  setThrottled(false);
+  return DRAINED;
+}
+
+inline int OutboundQueue::gather(iovec* parts, int max) {
+  int total = fill(parts, max);
+  m_writing = total;
+  m_gathered = 0;
+  for (int i = 0; i < total; ++i) {
+    m_gathered += parts[i].iov_len;
+  }
+  return total;
+}
+
+inline OutboundQueue::Status OutboundQueue::complete(ssize_t result) {
+  size_t gathered = m_gathered;
+  m_writing = 0;
+  m_gathered = 0;
+  if (result < 0) {
+    ERR("send error: %s", strerror(static_cast<int>(-result)));
+    return FAILED;
+  }
+  ++m_stats->writes;
+  consume(result);
+  setThrottled(static_cast<size_t>(result) < gathered);  // the kernel took only a part
+  return m_count > 0 ? PENDING : DRAINED;
+}
+
+inline void OutboundQueue::copyUnsent(std::string* out) {
+  out->clear();
+  out->reserve(m_bytes);
+  for (size_t i = 0; i < m_count; ++i) {
+    const BufferRef& frame = at(i);
+    size_t skip = i == 0 ? m_offset : 0;
+    out->append(frame.data() + skip, frame.size() - skip);
+  }
+}
+
+// ----------------------------------------------
+inline bool OutboundQueue::waitWritable(size_t size) {
+  if (m_writing > 0) {
+    return false;  // the owner's event loop completes the write, it can't be waited for here
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_config.block_timeout_ms);
+  while (m_bytes > 0 && m_bytes + size > m_config.max_bytes) {
+    if (flush() == FAILED) {
+      return false;
+    }
+    if (m_bytes == 0 || m_bytes + size <= m_config.max_bytes) {
+      break;
+    }
+    int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (timeout <= 0) {
+      return false;
+    }
+    pollfd descriptor = { m_socket, POLLOUT, 0 };
+    if (m_channel != nullptr) {  // its event belongs to the owner's loop, the ring is looked at every millisecond
+      descriptor.fd = -1;
+      timeout = 1;
+    }
+    if (poll(&descriptor, 1, timeout) < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline void OutboundQueue::setThrottled(bool is_throttled) {
+  if (is_throttled == m_is_throttled) {
+    return;
+  }
+  m_is_throttled = is_throttled;
+  if (is_throttled) {
+    ++m_stats->throttled_peers;
+    ++m_stats->throttle_events;
+  } else {
+    --m_stats->throttled_peers;
+  }
+}
+
+#endif  // OUTBOUND__H__
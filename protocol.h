@@ -0,0 +1,777 @@
+#ifndef PROTOCOL__H__
+#define PROTOCOL__H__
+
+/**
+ * Wire format.
+ *
+ * Legacy text frame (version 0), NUL-terminated:
+ *
+ *   <id>@@<login>##<text>\0
+ *
+ * Binary frame (version >= 1), header is 8 bytes:
+ *
+ *   | magic (1) | version (1) | type (1) | flags (1) | payload length (4, big-endian) | payload |
+ *
+ * Payload is a sequence of typed fields, unknown tags are skipped:
+ *
+ *   | tag (1) | value length (4, big-endian) | value |
+ *
+ * Integer fields are 4 bytes big-endian. The magic byte never starts a text frame (those begin with
+ * a digit), so the decoder tells both kinds apart frame by frame and one stream may carry both.
+ *
+ * Negotiation: server greets with text frame "<id>;v<max version>" (legacy clients only read the id),
+ * a binary-capable client answers with HELLO frame carrying its version, server replies with HELLO
+ * frame carrying the agreed version and the id and from then on sends binary frames to that peer.
+ *
+ * Channels: a binary peer subscribes with JOIN and unsubscribes with LEAVE frames, both carrying
+ * the channel name. A message with a channel field goes to that channel's subscribers only, without
+ * one - to everybody. Text frames have no channel.
+ *
+ * History: a binary peer asks for earlier messages to everybody with a HISTORY frame carrying either
+ * LAST (count) or SINCE (unix time, seconds). Server replays the stored MESSAGE frames with the
+ * HISTORY flag set, possibly interleaved with live ones, and ends with a HISTORY frame whose LAST
+ * field is the number of frames replayed.
+ *
+ * Compression: a client that can inflate adds COMPRESSION to its HELLO, the server's HELLO carries it
+ * back if the server agreed. From then on either side may send frames with the COMPRESSED flag, their
+ * payload deflated (see compression.h). Client's frames share one deflate stream per connection,
+ * server's are compressed each on its own, so that one broadcast is compressed once for everybody.
+ *
+ * Resumption: the server numbers every message it sends out, binary MESSAGE frames carry the number
+ * in a SEQUENCE field (8 bytes, big-endian). A client that lost its connection reconnects and adds
+ * ID (its previous id) and SEQUENCE (the last number it has seen) to its HELLO. If the server still
+ * keeps that session, its HELLO answers with the same id, restores the channels and sends the missed
+ * messages it still has; otherwise it answers with the new id from the text greeting.
+ *
+ * Federation: a link between two server nodes carries binary frames only. The connecting node starts
+ * with a HELLO frame whose ID field is its node number, then sends MESSAGE frames of its peers.
+ *
+ * Multiplexing: one binary connection may carry many logical sessions, e.g. the users of a gateway.
+ * OPEN with SESSION (a number the client picks, not 0) opens one, the server answers with OPEN carrying
+ * SESSION and ID, the session's peer id. Frames of a session (MESSAGE, JOIN, LEAVE) carry its SESSION
+ * field, CLOSE with SESSION ends it. Once a connection has opened a session it gets no broadcasts of
+ * its own: whatever its sessions receive comes in ROUTE frames, SESSIONS (recipients' numbers, 4 bytes
+ * each) and FRAME (one whole frame, possibly compressed), one ROUTE per connection for a broadcast
+ * however many of its sessions it goes to.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include "logger.h"
+#include "message.h"
+#include "textscan.h"
+
+#define PROTOCOL_VERSION 1
+#define PROTOCOL_MAGIC 0xC5
+#define PROTOCOL_HEADER_SIZE 8
+#define PROTOCOL_FIELD_HEADER_SIZE 5
+#define PROTOCOL_MAX_FRAME_SIZE (16 * 1024 * 1024)
+#define PROTOCOL_READ_SIZE 16384
+
+enum FrameType : uint8_t {
+  FRAME_TEXT = 0,  // legacy "id@@login##text"
+  FRAME_HELLO = 1,
+  FRAME_MESSAGE = 2,
+  FRAME_JOIN = 3,
+  FRAME_LEAVE = 4,
+  FRAME_HISTORY = 5,
+  FRAME_OPEN = 6,
+  FRAME_CLOSE = 7,
+  FRAME_ROUTE = 8
+};
+
+enum FrameFlag : uint8_t {
+  FRAME_FLAG_HISTORY = 0x01,    // replayed from the history log
+  FRAME_FLAG_COMPRESSED = 0x02  // payload is deflated
+};
+
+enum Compression : uint8_t {
+  COMPRESSION_NONE = 0,
+  COMPRESSION_DEFLATE = 1
+};
+
+enum FieldTag : uint8_t {
+  FIELD_ID = 1,
+  FIELD_LOGIN = 2,
+  FIELD_TEXT = 3,
+  FIELD_VERSION = 4,
+  FIELD_CHANNEL = 5,
+  FIELD_LAST = 6,
+  FIELD_SINCE = 7,
+  FIELD_COMPRESSION = 8,
+  FIELD_SEQUENCE = 9,
+  FIELD_SESSION = 10,
+  FIELD_SESSIONS = 11,
+  FIELD_FRAME = 12,
+  FIELD_TOKEN = 13
+};
+
+/* Non-owning view into a buffer */
+// --------------------------------------------------------------------------------------------------------------------
+struct Slice {
+  const char* data;
+  size_t size;
+
+  Slice(): data(nullptr), size(0) {}
+  Slice(const char* data, size_t size): data(data), size(size) {}
+  Slice(const std::string& str): data(str.data()), size(str.size()) {}
+
+  bool empty() const { return size == 0; }
+  std::string str() const { return std::string(data, size); }
+};
+
+inline std::ostream& operator << (std::ostream& out, const Slice& slice) {
+  out.write(slice.data, slice.size);
+  return out;
+}
+
+/* Frame and message views, valid until the decoder they came from is refilled */
+// --------------------------------------------------------------------------------------------------------------------
+struct Frame {
+  uint8_t version;  // 0 for legacy text frames
+  uint8_t type;
+  uint8_t flags;
+  Slice payload;
+  TextMarks marks;  // text frames from FrameDecoder: their delimiters, found while looking for the NUL
+};
+
+struct MessageView {
+  int id;
+  uint64_t sequence;  // assigned by Server, 0 - none
+  Slice channel;  // empty - to everybody
+  Slice login;
+  Slice text;
+
+  MessageView(): id(0), sequence(0) {}
+  MessageView(const Message& message)
+    : id(message.id), sequence(message.sequence), channel(message.channel), login(message.login), text(message.text) {}
+
+  static bool fromFrame(const Frame& frame, MessageView* view);
+  static bool fromText(Slice raw, MessageView* view);
+  static bool fromText(Slice raw, const TextMarks& marks, MessageView* view);  // marks of all of raw
+
+  Message toMessage() const;
+};
+
+inline std::ostream& operator << (std::ostream& out, const MessageView& msg) {
+  out << "Message{id=" << msg.id;
+  if (!msg.channel.empty()) {
+    out << ", channel=" << msg.channel;
+  }
+  out << ", login=" << msg.login << ", text=" << msg.text << "}";
+  return out;
+}
+
+/* Field access */
+// --------------------------------------------------------------------------------------------------------------------
+inline uint32_t readUint32(const char* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return ntohl(value);
+}
+
+inline uint64_t readUint64(const char* data) {
+  return (static_cast<uint64_t>(readUint32(data)) << 32) | readUint32(data + 4);
+}
+
+inline void appendUint32(std::string& out, uint32_t value) {
+  value = htonl(value);
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+class FieldReader {
+public:
+  explicit FieldReader(Slice payload): m_data(payload.data), m_left(payload.size), m_is_broken(false) {}
+
+  bool next(uint8_t* tag, Slice* value);  // false at the end of payload or on a truncated field
+  bool isBroken() const { return m_is_broken; }
+
+private:
+  const char* m_data;
+  size_t m_left;
+  bool m_is_broken;
+};
+
+inline bool FieldReader::next(uint8_t* tag, Slice* value) {
+  if (m_left == 0) {
+    return false;
+  }
+  if (m_left < PROTOCOL_FIELD_HEADER_SIZE) {
+    m_is_broken = true;
+    return false;
+  }
+  uint32_t length = readUint32(m_data + 1);
+  if (length > m_left - PROTOCOL_FIELD_HEADER_SIZE) {
+    m_is_broken = true;
+    return false;
+  }
+  *tag = static_cast<uint8_t>(m_data[0]);
+  *value = Slice(m_data + PROTOCOL_FIELD_HEADER_SIZE, length);
+  m_data += PROTOCOL_FIELD_HEADER_SIZE + length;
+  m_left -= PROTOCOL_FIELD_HEADER_SIZE + length;
+  return true;
+}
+
+inline bool readIntField(Slice value, int* result) {
+  if (value.size != 4) {
+    return false;
+  }
+  *result = static_cast<int>(readUint32(value.data));
+  return true;
+}
+
+inline bool readUint64Field(Slice value, uint64_t* result) {
+  if (value.size != 8) {
+    return false;
+  }
+  *result = readUint64(value.data);
+  return true;
+}
+
+/* Encoding */
+// --------------------------------------------------------------------------------------------------------------------
+inline size_t beginFrame(std::string& out, uint8_t type, uint8_t flags = 0) {
+  size_t start = out.size();
+  out.push_back(static_cast<char>(PROTOCOL_MAGIC));
+  out.push_back(static_cast<char>(PROTOCOL_VERSION));
+  out.push_back(static_cast<char>(type));
+  out.push_back(static_cast<char>(flags));
+  appendUint32(out, 0);  // payload length, patched by endFrame()
+  return start;
+}
+
+inline void endFrame(std::string& out, size_t start) {
+  uint32_t length = htonl(static_cast<uint32_t>(out.size() - start - PROTOCOL_HEADER_SIZE));
+  memcpy(&out[start + 4], &length, sizeof(length));
+}
+
+inline void appendField(std::string& out, uint8_t tag, Slice value) {
+  out.push_back(static_cast<char>(tag));
+  appendUint32(out, static_cast<uint32_t>(value.size));
+  out.append(value.data, value.size);
+}
+
+inline void appendIntField(std::string& out, uint8_t tag, int value) {
+  out.push_back(static_cast<char>(tag));
+  appendUint32(out, 4);
+  appendUint32(out, static_cast<uint32_t>(value));
+}
+
+inline void appendUint64Field(std::string& out, uint8_t tag, uint64_t value) {
+  out.push_back(static_cast<char>(tag));
+  appendUint32(out, 8);
+  appendUint32(out, static_cast<uint32_t>(value >> 32));
+  appendUint32(out, static_cast<uint32_t>(value));
+}
+
+inline size_t decimalLength(int value) {
+  unsigned magnitude = value < 0 ? 0u - static_cast<unsigned>(value) : static_cast<unsigned>(value);
+  size_t length = value < 0 ? 2 : 1;
+  while (magnitude >= 10) {
+    magnitude /= 10;
+    ++length;
+  }
+  return length;
+}
+
+inline char* writeDecimal(int value, char* out) {
+  unsigned magnitude = value < 0 ? 0u - static_cast<unsigned>(value) : static_cast<unsigned>(value);
+  if (value < 0) {
+    *out++ = '-';
+  }
+  char* end = out + decimalLength(static_cast<int>(magnitude));
+  char* p = end;
+  do {
+    *--p = static_cast<char>('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude != 0);
+  return end;
+}
+
+inline char* writeUint32(uint32_t value, char* out) {
+  value = htonl(value);
+  memcpy(out, &value, sizeof(value));
+  return out + sizeof(value);
+}
+
+inline char* writeUint64(uint64_t value, char* out) {
+  out = writeUint32(static_cast<uint32_t>(value >> 32), out);
+  return writeUint32(static_cast<uint32_t>(value), out);
+}
+
+inline char* writeField(uint8_t tag, Slice value, char* out) {
+  *out++ = static_cast<char>(tag);
+  out = writeUint32(static_cast<uint32_t>(value.size), out);
+  memcpy(out, value.data, value.size);
+  return out + value.size;
+}
+
+// exact sizes, so that a frame can be written straight into a preallocated buffer
+inline size_t textSize(const MessageView& message) {
+  return decimalLength(message.id) + 2 + message.login.size + 2 + message.text.size + 1;
+}
+
+inline size_t binarySize(const MessageView& message) {
+  return PROTOCOL_HEADER_SIZE + (PROTOCOL_FIELD_HEADER_SIZE + 4) +
+         (message.channel.empty() ? 0 : PROTOCOL_FIELD_HEADER_SIZE + message.channel.size) +
+         (PROTOCOL_FIELD_HEADER_SIZE + message.login.size) + (PROTOCOL_FIELD_HEADER_SIZE + message.text.size) +
+         (message.sequence == 0 ? 0 : PROTOCOL_FIELD_HEADER_SIZE + 8);
+}
+
+// the channel field follows the id, so its value sits at a fixed offset of a binary message frame
+#define PROTOCOL_CHANNEL_OFFSET (PROTOCOL_HEADER_SIZE + (PROTOCOL_FIELD_HEADER_SIZE + 4) + PROTOCOL_FIELD_HEADER_SIZE)
+
+inline char* writeText(const MessageView& message, char* out) {
+  out = writeDecimal(message.id, out);
+  *out++ = '@';
+  *out++ = '@';
+  memcpy(out, message.login.data, message.login.size);
+  out += message.login.size;
+  *out++ = '#';
+  *out++ = '#';
+  memcpy(out, message.text.data, message.text.size);
+  out += message.text.size;
+  *out++ = '\0';
+  return out;
+}
+
+inline char* writeBinary(const MessageView& message, char* out) {
+  char* start = out;
+  *out++ = static_cast<char>(PROTOCOL_MAGIC);
+  *out++ = static_cast<char>(PROTOCOL_VERSION);
+  *out++ = static_cast<char>(FRAME_MESSAGE);
+  *out++ = 0;
+  out += 4;  // payload length, known at the end
+  *out++ = static_cast<char>(FIELD_ID);
+  out = writeUint32(4, out);
+  out = writeUint32(static_cast<uint32_t>(message.id), out);
+  if (!message.channel.empty()) {
+    out = writeField(FIELD_CHANNEL, message.channel, out);
+  }
+  out = writeField(FIELD_LOGIN, message.login, out);
+  out = writeField(FIELD_TEXT, message.text, out);
+  if (message.sequence != 0) {  // last, so that the channel's offset does not depend on it
+    *out++ = static_cast<char>(FIELD_SEQUENCE);
+    out = writeUint32(8, out);
+    out = writeUint64(message.sequence, out);
+  }
+  writeUint32(static_cast<uint32_t>(out - start - PROTOCOL_HEADER_SIZE), start + 4);
+  return out;
+}
+
+inline void encodeText(const MessageView& message, std::string& out) {
+  size_t start = out.size();
+  out.resize(start + textSize(message));
+  writeText(message, &out[start]);
+}
+
+inline void encodeBinary(const MessageView& message, std::string& out) {
+  size_t start = out.size();
+  out.resize(start + binarySize(message));
+  writeBinary(message, &out[start]);
+}
+
+inline void encodeMessage(const MessageView& message, int version, std::string& out) {
+  if (version >= 1) {
+    encodeBinary(message, out);
+  } else {
+    encodeText(message, out);
+  }
+}
+
+inline void encodeChannelCommand(std::string& out, uint8_t type, Slice channel) {  // FRAME_JOIN or FRAME_LEAVE
+  size_t start = beginFrame(out, type);
+  appendField(out, FIELD_CHANNEL, channel);
+  endFrame(out, start);
+}
+
+// a request (count of the last messages, or unix time in seconds) and the end of its replay (count)
+inline void encodeHistory(std::string& out, uint8_t tag, uint32_t value) {  // FIELD_LAST or FIELD_SINCE
+  size_t start = beginFrame(out, FRAME_HISTORY);
+  appendIntField(out, tag, static_cast<int>(value));
+  endFrame(out, start);
+}
+
+// id: assigned (server) or to resume (client), -1 - none; sequence: the last message seen before a reconnect;
+// token: the server's secret of the session (its answer) or proof of owning it (a client resuming it)
+inline void encodeHello(std::string& out, int version, int id, int compression = COMPRESSION_NONE, uint64_t sequence = 0,
+                        Slice token = Slice()) {
+  size_t start = beginFrame(out, FRAME_HELLO);
+  appendIntField(out, FIELD_VERSION, version);
+  if (id >= 0) {
+    appendIntField(out, FIELD_ID, id);
+  }
+  if (compression != COMPRESSION_NONE) {
+    appendIntField(out, FIELD_COMPRESSION, compression);
+  }
+  if (sequence != 0) {
+    appendUint64Field(out, FIELD_SEQUENCE, sequence);
+  }
+  if (!token.empty()) {
+    appendField(out, FIELD_TOKEN, token);
+  }
+  endFrame(out, start);
+}
+
+// FRAME_OPEN or FRAME_CLOSE of a logical session; id: assigned (server's OPEN), -1 - none
+inline void encodeSession(std::string& out, uint8_t type, uint32_t session, int id = -1) {
+  size_t start = beginFrame(out, type);
+  appendIntField(out, FIELD_SESSION, static_cast<int>(session));
+  if (id >= 0) {
+    appendIntField(out, FIELD_ID, id);
+  }
+  endFrame(out, start);
+}
+
+// marks a frame already in out (from start on) as sent by a logical session
+inline void appendSession(std::string& out, size_t start, uint32_t session) {
+  appendIntField(out, FIELD_SESSION, static_cast<int>(session));
+  endFrame(out, start);
+}
+
+inline size_t routeSize(size_t sessions, size_t frame_size) {
+  return PROTOCOL_HEADER_SIZE + (PROTOCOL_FIELD_HEADER_SIZE + 4 * sessions) + (PROTOCOL_FIELD_HEADER_SIZE + frame_size);
+}
+
+// ROUTE of one whole frame to sessions of a connection, routeSize() bytes
+inline char* writeRoute(const uint32_t* sessions, size_t count, Slice frame, char* out) {
+  *out++ = static_cast<char>(PROTOCOL_MAGIC);
+  *out++ = static_cast<char>(PROTOCOL_VERSION);
+  *out++ = static_cast<char>(FRAME_ROUTE);
+  *out++ = 0;
+  out = writeUint32(static_cast<uint32_t>(routeSize(count, frame.size) - PROTOCOL_HEADER_SIZE), out);
+  *out++ = static_cast<char>(FIELD_SESSIONS);
+  out = writeUint32(static_cast<uint32_t>(4 * count), out);
+  for (size_t i = 0; i < count; ++i) {
+    out = writeUint32(sessions[i], out);
+  }
+  return writeField(FIELD_FRAME, frame, out);
+}
+
+// "<id>;v<max version>", read by both legacy (atoi) and binary-capable clients
+inline std::string textHello(int id) {
+  std::string hello = std::to_string(id) + ";v" + std::to_string(PROTOCOL_VERSION);
+  hello.push_back('\0');
+  return hello;
+}
+
+inline bool parseTextHello(Slice raw, int* id, int* version) {
+  std::string hello = raw.str();
+  *id = std::atoi(hello.c_str());
+  *version = 0;
+  size_t i = hello.find(";v");
+  if (i != std::string::npos) {
+    *version = std::atoi(hello.c_str() + i + 2);
+  }
+  return !hello.empty() && hello[0] >= '0' && hello[0] <= '9';
+}
+
+/* Decoding */
+// --------------------------------------------------------------------------------------------------------------------
+inline bool MessageView::fromText(Slice raw, MessageView* view) {
+  TextMarks marks;
+  scanText(raw.data, raw.size, &marks);
+  return fromText(raw, marks, view);
+}
+
+inline bool MessageView::fromText(Slice raw, const TextMarks& marks, MessageView* view) {
+  if (marks.id_end == TEXTSCAN_NONE || marks.id_end == 0 || marks.id_end > 10 || marks.login_end == TEXTSCAN_NONE) {
+    return false;
+  }
+  const char* id_end = raw.data + marks.id_end;
+  long id = 0;
+  for (const char* p = raw.data; p < id_end; ++p) {
+    if (*p < '0' || *p > '9') {
+      return false;
+    }
+    id = id * 10 + (*p - '0');
+  }
+  if (id > 0x7fffffff) {
+    return false;
+  }
+  const char* login = id_end + 2;
+  const char* login_end = raw.data + marks.login_end;
+  view->id = static_cast<int>(id);
+  view->login = Slice(login, login_end - login);
+  view->text = Slice(login_end + 2, raw.data + raw.size - login_end - 2);
+  return true;
+}
+
+inline bool MessageView::fromFrame(const Frame& frame, MessageView* view) {
+  if (frame.type == FRAME_TEXT) {
+    if (frame.marks.scanned != frame.payload.size) {  // not cut by FrameDecoder
+      return fromText(frame.payload, view);
+    }
+    return fromText(frame.payload, frame.marks, view);
+  }
+  if (frame.type != FRAME_MESSAGE) {
+    return false;
+  }
+  bool has_id = false;
+  FieldReader reader(frame.payload);
+  uint8_t tag;
+  Slice value;
+  while (reader.next(&tag, &value)) {
+    switch (tag) {
+      case FIELD_ID:      has_id = readIntField(value, &view->id); break;
+      case FIELD_SEQUENCE: readUint64Field(value, &view->sequence); break;
+      case FIELD_CHANNEL: view->channel = value; break;
+      case FIELD_LOGIN:   view->login = value; break;
+      case FIELD_TEXT:    view->text = value; break;
+      default: break;  // unknown field from a newer peer
+    }
+  }
+  return has_id && !reader.isBroken();
+}
+
+inline Message MessageView::toMessage() const {
+  Message message;
+  message.id = id;
+  message.sequence = sequence;
+  message.channel = channel.str();
+  message.login = login.str();
+  message.text = text.str();
+  return message;
+}
+
+// channel name of a FRAME_JOIN or FRAME_LEAVE frame
+inline bool readChannelCommand(const Frame& frame, Slice* channel) {
+  if (frame.type != FRAME_JOIN && frame.type != FRAME_LEAVE) {
+    return false;
+  }
+  bool has_channel = false;
+  FieldReader reader(frame.payload);
+  uint8_t tag;
+  Slice value;
+  while (reader.next(&tag, &value)) {
+    if (tag == FIELD_CHANNEL) {
+      *channel = value;
+      has_channel = true;
+    }
+  }
+  return has_channel && !channel->empty() && !reader.isBroken();
+}
+
+// absent fields are left as they are
+inline bool readHello(const Frame& frame, int* version, int* compression, int* id = nullptr, uint64_t* sequence = nullptr,
+                      Slice* token = nullptr) {
+  if (frame.type != FRAME_HELLO) {
+    return false;
+  }
+  FieldReader reader(frame.payload);
+  uint8_t tag;
+  Slice value;
+  while (reader.next(&tag, &value)) {
+    if (tag == FIELD_VERSION) {
+      readIntField(value, version);
+    } else if (tag == FIELD_COMPRESSION) {
+      readIntField(value, compression);
+    } else if (tag == FIELD_ID && id != nullptr) {
+      readIntField(value, id);
+    } else if (tag == FIELD_SEQUENCE && sequence != nullptr) {
+      readUint64Field(value, sequence);
+    } else if (tag == FIELD_TOKEN && token != nullptr) {
+      *token = value;
+    }
+  }
+  return !reader.isBroken();
+}
+
+inline bool readHistory(const Frame& frame, uint8_t* tag, uint32_t* value) {
+  if (frame.type != FRAME_HISTORY) {
+    return false;
+  }
+  bool has_value = false;
+  FieldReader reader(frame.payload);
+  uint8_t field;
+  Slice raw;
+  while (reader.next(&field, &raw)) {
+    int number = 0;
+    if ((field == FIELD_LAST || field == FIELD_SINCE) && readIntField(raw, &number)) {
+      *tag = field;
+      *value = static_cast<uint32_t>(number);
+      has_value = true;
+    }
+  }
+  return has_value && !reader.isBroken();
+}
+
+// SESSION of a frame sent by a logical session, false - the connection's own frame
+inline bool readSession(const Frame& frame, uint32_t* session) {
+  FieldReader reader(frame.payload);
+  uint8_t tag;
+  Slice value;
+  int number = 0;
+  while (reader.next(&tag, &value)) {
+    if (tag == FIELD_SESSION) {
+      readIntField(value, &number);
+    }
+  }
+  *session = static_cast<uint32_t>(number);
+  return number != 0 && !reader.isBroken();
+}
+
+// OPEN from the server: the session and its peer id
+inline bool readOpened(const Frame& frame, uint32_t* session, int* id) {
+  if (frame.type != FRAME_OPEN) {
+    return false;
+  }
+  int number = 0;
+  *id = -1;
+  FieldReader reader(frame.payload);
+  uint8_t tag;
+  Slice value;
+  while (reader.next(&tag, &value)) {
+    if (tag == FIELD_SESSION) {
+      readIntField(value, &number);
+    } else if (tag == FIELD_ID) {
+      readIntField(value, id);
+    }
+  }
+  *session = static_cast<uint32_t>(number);
+  return number != 0 && *id >= 0 && !reader.isBroken();
+}
+
+// recipients (4 bytes each, readUint32) and the routed frame, its payload still compressed if flagged so
+inline bool readRoute(const Frame& frame, Slice* sessions, Frame* routed) {
+  if (frame.type != FRAME_ROUTE) {
+    return false;
+  }
+  Slice inner;
+  FieldReader reader(frame.payload);
+  uint8_t tag;
+  Slice value;
+  while (reader.next(&tag, &value)) {
+    if (tag == FIELD_SESSIONS) {
+      *sessions = value;
+    } else if (tag == FIELD_FRAME) {
+      inner = value;
+    }
+  }
+  if (reader.isBroken() || sessions->size % 4 != 0 || inner.size < PROTOCOL_HEADER_SIZE ||
+      static_cast<uint8_t>(inner.data[0]) != PROTOCOL_MAGIC ||
+      readUint32(inner.data + 4) != inner.size - PROTOCOL_HEADER_SIZE) {
+    return false;
+  }
+  routed->version = static_cast<uint8_t>(inner.data[1]);
+  routed->type = static_cast<uint8_t>(inner.data[2]);
+  routed->flags = static_cast<uint8_t>(inner.data[3]);
+  routed->payload = Slice(inner.data + PROTOCOL_HEADER_SIZE, inner.size - PROTOCOL_HEADER_SIZE);
+  return true;
+}
+
+/**
+ * Accumulates bytes of one connection and cuts them into frames. Handles frames split across reads
+ * and several frames per read; frames point into the internal buffer and stay valid until the next
+ * call to prepare(). A text frame is searched once, vectorized (textscan.h): the bytes of a partial
+ * one are not looked at again when more arrive, and its delimiters come along with the frame.
+ */
+class FrameDecoder {
+public:
+  enum Status { FRAME, NEED_MORE, BROKEN };
+
+  explicit FrameDecoder(size_t max_frame_size = PROTOCOL_MAX_FRAME_SIZE)
+    : m_begin(0), m_end(0), m_frame_begin(0), m_max_frame_size(max_frame_size) {}
+
+  char* prepare(size_t size);  // room for at least size more bytes
+  void commit(size_t size) { m_end += size; }
+  Status next(Frame* frame);
+  bool nextUnterminated(Frame* frame);  // what is buffered of a text frame, as if its NUL had come
+  void unget() { m_begin = m_frame_begin; }  // the frame next() has just returned comes again
+
+  size_t buffered() const { return m_end - m_begin; }
+  Slice pending() const { return Slice(m_buffer.data() + m_begin, m_end - m_begin); }  // not cut into frames yet
+  Slice last() const { return Slice(m_buffer.data() + m_frame_begin, m_begin - m_frame_begin); }  // raw bytes of the frame next() has just returned
+
+private:
+  std::vector<char> m_buffer;
+  size_t m_begin;    // first unconsumed byte
+  size_t m_end;      // end of received data
+  size_t m_frame_begin;  // of the last frame returned
+  TextMarks m_text;  // of a partial text frame
+  size_t m_max_frame_size;
+};
+
+inline char* FrameDecoder::prepare(size_t size) {
+  if (m_begin == m_end) {
+    m_begin = m_end = 0;
+  }
+  if (m_buffer.size() - m_end < size) {
+    if (m_begin > 0) {  // move the partial frame to the front
+      memmove(&m_buffer[0], &m_buffer[m_begin], m_end - m_begin);
+      m_end -= m_begin;
+      m_begin = 0;
+    }
+    if (m_buffer.size() - m_end < size) {
+      m_buffer.resize(std::max(m_buffer.size() * 2, m_end + size));
+    }
+  }
+  return &m_buffer[m_end];
+}
+
+inline FrameDecoder::Status FrameDecoder::next(Frame* frame) {
+  size_t available = m_end - m_begin;
+  if (available == 0) {
+    return NEED_MORE;
+  }
+  const char* data = &m_buffer[m_begin];
+
+  if (static_cast<uint8_t>(data[0]) != PROTOCOL_MAGIC) {  // legacy text frame up to NUL
+    size_t nul = scanText(data, available, &m_text);
+    if (nul == available) {
+      return available > m_max_frame_size ? BROKEN : NEED_MORE;
+    }
+    frame->version = 0;
+    frame->type = FRAME_TEXT;
+    frame->flags = 0;
+    frame->payload = Slice(data, nul);
+    frame->marks = m_text;
+    m_frame_begin = m_begin;
+    m_begin += nul + 1;
+    m_text.reset();
+    return FRAME;
+  }
+
+  if (available < PROTOCOL_HEADER_SIZE) {
+    return NEED_MORE;
+  }
+  uint32_t length = readUint32(data + 4);
+  if (length > m_max_frame_size || data[1] == 0) {
+    return BROKEN;
+  }
+  if (available < PROTOCOL_HEADER_SIZE + length) {
+    return NEED_MORE;
+  }
+  frame->version = static_cast<uint8_t>(data[1]);
+  frame->type = static_cast<uint8_t>(data[2]);
+  frame->flags = static_cast<uint8_t>(data[3]);
+  frame->payload = Slice(data + PROTOCOL_HEADER_SIZE, length);
+  m_frame_begin = m_begin;
+  m_begin += PROTOCOL_HEADER_SIZE + length;
+  return FRAME;
+}
+
+// for peers that don't terminate a text frame at all: a legacy Server's hello is a bare "<id>"
+inline bool FrameDecoder::nextUnterminated(Frame* frame) {
+  size_t available = m_end - m_begin;
+  if (available == 0 || static_cast<uint8_t>(m_buffer[m_begin]) == PROTOCOL_MAGIC) {
+    return false;
+  }
+  scanText(&m_buffer[m_begin], available, &m_text);
+  frame->version = 0;
+  frame->type = FRAME_TEXT;
+  frame->flags = 0;
+  frame->payload = Slice(&m_buffer[m_begin], available);
+  frame->marks = m_text;
+  m_frame_begin = m_begin;
+  m_begin = m_end;
+  m_text.reset();
+  return true;
+}
+
+#endif  // PROTOCOL__H__
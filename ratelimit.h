@@ -0,0 +1,77 @@
+#ifndef RATELIMIT__H__
+#define RATELIMIT__H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+enum class LimitPolicy {
+  DELAY,  // the peer is not read until it has tokens again, TCP slows its client down
+  REJECT  // frames over the limit are read and dropped
+};
+
+struct RateLimitConfig {
+  uint32_t rate;   // frames per second per peer, 0 - no limit
+  uint32_t burst;  // frames a peer that was quiet may send at once, 0 - a second's worth
+  LimitPolicy policy;
+
+  RateLimitConfig(): rate(0), burst(0), policy(LimitPolicy::DELAY) {}
+
+  bool isEnabled() const { return rate > 0; }
+};
+
+/**
+ * Ingress limit of one peer: every frame it sends takes a token, tokens come back at rate per second
+ * and up to burst of them are kept. Only the thread receiving from the peer takes tokens, so the
+ * bucket itself needs no lock; the limit is an atomic, the admin may change it from its own thread
+ * and the next frame is measured against the new one.
+ */
+class TokenBucket {
+public:
+  TokenBucket(): m_limit(0), m_tokens(0), m_refilled(0) {}
+
+  void setLimit(uint32_t rate, uint32_t burst);  // 0 - no limit
+  bool isLimited() const { return (m_limit.load(std::memory_order_relaxed) >> 32) > 0; }
+
+  bool take(int64_t now);  // one frame, false - no token left; steady clock, ns
+  int64_t readyAt() const;  // when the next token is there
+
+private:
+  std::atomic<uint64_t> m_limit;  // rate << 32 | burst
+  double m_tokens;
+  int64_t m_refilled;  // when m_tokens was brought up to date, 0 - never, the bucket is full
+};
+
+// ----------------------------------------------
+inline void TokenBucket::setLimit(uint32_t rate, uint32_t burst) {
+  if (burst == 0) {
+    burst = std::max<uint32_t>(rate, 1);
+  }
+  m_limit.store(static_cast<uint64_t>(rate) << 32 | burst, std::memory_order_relaxed);
+}
+
+inline bool TokenBucket::take(int64_t now) {
+  uint64_t limit = m_limit.load(std::memory_order_relaxed);
+  uint32_t rate = limit >> 32;
+  if (rate == 0) {
+    return true;
+  }
+  double burst = static_cast<uint32_t>(limit);
+  m_tokens = m_refilled == 0 ? burst : std::min(burst, m_tokens + (now - m_refilled) * 1e-9 * rate);
+  m_refilled = now;
+  if (m_tokens < 1) {
+    return false;
+  }
+  m_tokens -= 1;
+  return true;
+}
+
+inline int64_t TokenBucket::readyAt() const {
+  uint32_t rate = m_limit.load(std::memory_order_relaxed) >> 32;
+  if (rate == 0 || m_tokens >= 1) {
+    return m_refilled;
+  }
+  return m_refilled + static_cast<int64_t>((1 - m_tokens) * 1e9 / rate) + 1000;  // a microsecond late rather than early
+}
+
+#endif  // RATELIMIT__H__
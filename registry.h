@@ -0,0 +1,234 @@
+#ifndef REGISTRY__H__
+#define REGISTRY__H__
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#define REGISTRY_CHUNK_BITS 12                       // 4096 slots per chunk
+#define REGISTRY_CHUNK_SIZE (1 << REGISTRY_CHUNK_BITS)
+#define REGISTRY_MAX_CHUNKS 1024                     // up to 4M entries
+#define REGISTRY_RETIRE_BATCH 64                     // removed entries reclaimed at once
+
+/**
+ * Set of live entries (peers) for read-mostly fan-out.
+ *
+ * Entries sit in fixed chunks of slots that never move, so readers walk them without locks while
+ * writers add and remove. Each slot keeps the key next to the pointer: filtering a fan-out by key
+ * touches only the dense slot array, not the entries. Add and remove are O(1) under the writers'
+ * mutex; a removed entry is retired and deleted only after every reader that could have seen it
+ * has left its ReadGuard (two-counter epoch scheme, like SRCU). Reclamation runs in batches,
+ * so its cost is amortized over REGISTRY_RETIRE_BATCH removals. Deleter lets entries that are
+ * also referenced elsewhere outlive their removal.
+ */
+template <typename T, typename Deleter = std::default_delete<T>>
+class Registry {
+public:
+  class ReadGuard {
+  public:
+    explicit ReadGuard(const Registry& registry): m_counter(registry.enter()) {}
+    ~ReadGuard() { m_counter->fetch_sub(1, std::memory_order_release); }
+
+  private:
+    std::atomic<long>* m_counter;
+
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator = (const ReadGuard&) = delete;
+  };
+
+  Registry();
+  ~Registry();  // deletes everything still registered or retired
+
+  size_t add(T* item, int key);  // takes ownership, returns slot index
+  void remove(size_t slot);      // item is deleted once no reader can see it, never call under ReadGuard
+  void reclaim();                // wait for readers and delete all retired items now
+  void setKey(size_t slot, int key);  // in place, a concurrent reader sees the old key or the new one
+
+  T* at(size_t slot) const;  // this slot's item or nullptr, under ReadGuard or by the item's owner
+  size_t size() const { return m_size.load(std::memory_order_relaxed); }
+
+  template <typename Function>
+  void forEach(Function function) const;  // function(int key, T& item)
+
+private:
+  struct Slot {
+    std::atomic<T*> item;
+    std::atomic<int> key;  // relaxed, published by item
+  };
+
+  struct Retired {
+    T* item;
+    size_t slot;
+  };
+
+  std::atomic<Slot*> m_chunks[REGISTRY_MAX_CHUNKS];
+  std::atomic<size_t> m_high_water;  // slots ever used, readers scan [0, m_high_water)
+  std::atomic<size_t> m_size;
+
+  // readers announce themselves in the counter of the current epoch, each on its own cache line
+  std::atomic<unsigned> m_epoch;
+  struct Counter {
+    std::atomic<long> value;
+    char padding[64 - sizeof(std::atomic<long>)];
+  };
+  mutable Counter m_readers[2];
+
+  std::mutex m_mutex;  // writers
+  std::vector<size_t> m_free_slots;
+  std::vector<Retired> m_retired;
+
+  std::atomic<long>* enter() const;
+  void synchronize();
+  Slot& slot(size_t index) const {
+    return m_chunks[index >> REGISTRY_CHUNK_BITS].load(std::memory_order_acquire)[index & (REGISTRY_CHUNK_SIZE - 1)];
+  }
+};
+
+// ----------------------------------------------
+template <typename T, typename Deleter>
+Registry<T, Deleter>::Registry(): m_high_water(0), m_size(0), m_epoch(0) {
+  for (auto& it : m_chunks) {
+    it.store(nullptr, std::memory_order_relaxed);
+  }
+  m_readers[0].value.store(0);
+  m_readers[1].value.store(0);
+}
+
+template <typename T, typename Deleter>
+Registry<T, Deleter>::~Registry() {
+  size_t end = m_high_water.load();
+  for (size_t i = 0; i < end; ++i) {
+    Deleter()(slot(i).item.load());
+  }
+  for (auto& it : m_retired) {
+    Deleter()(it.item);
+  }
+  for (auto& it : m_chunks) {
+    delete [] it.load();
+  }
+}
+
+template <typename T, typename Deleter>
+size_t Registry<T, Deleter>::add(T* item, int key) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  size_t index;
+  if (!m_free_slots.empty()) {
+    index = m_free_slots.back();
+    m_free_slots.pop_back();
+  } else {
+    index = m_high_water.load(std::memory_order_relaxed);
+    size_t chunk = index >> REGISTRY_CHUNK_BITS;
+    if (chunk >= REGISTRY_MAX_CHUNKS) {
+      throw std::length_error("Registry is full");
+    }
+    if (m_chunks[chunk].load(std::memory_order_relaxed) == nullptr) {
+      Slot* slots = new Slot[REGISTRY_CHUNK_SIZE];
+      for (size_t i = 0; i < REGISTRY_CHUNK_SIZE; ++i) {
+        slots[i].item.store(nullptr, std::memory_order_relaxed);
+        slots[i].key.store(-1, std::memory_order_relaxed);
+      }
+      m_chunks[chunk].store(slots, std::memory_order_release);
+    }
+  }
+  Slot& target = slot(index);
+  target.key.store(key, std::memory_order_relaxed);
+  target.item.store(item, std::memory_order_release);  // publishes the key as well
+  if (index == m_high_water.load(std::memory_order_relaxed)) {
+    m_high_water.store(index + 1, std::memory_order_release);
+  }
+  m_size.fetch_add(1, std::memory_order_relaxed);
+  return index;
+}
+
+template <typename T, typename Deleter>
+void Registry<T, Deleter>::remove(size_t index) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Slot& target = slot(index);
+  T* item = target.item.exchange(nullptr, std::memory_order_acq_rel);
+  if (item == nullptr) {
+    return;
+  }
+  m_size.fetch_sub(1, std::memory_order_relaxed);
+  m_retired.push_back(Retired{item, index});
+  if (m_retired.size() >= REGISTRY_RETIRE_BATCH) {
+    synchronize();
+    for (auto& it : m_retired) {
+      Deleter()(it.item);
+      m_free_slots.push_back(it.slot);  // reusable only now: a late reader could still be looking at it
+    }
+    m_retired.clear();
+  }
+}
+
+template <typename T, typename Deleter>
+void Registry<T, Deleter>::reclaim() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_retired.empty()) {
+    return;
+  }
+  synchronize();
+  for (auto& it : m_retired) {
+    Deleter()(it.item);
+    m_free_slots.push_back(it.slot);
+  }
+  m_retired.clear();
+}
+
+template <typename T, typename Deleter>
+void Registry<T, Deleter>::setKey(size_t index, int key) {
+  slot(index).key.store(key, std::memory_order_relaxed);
+}
+
+template <typename T, typename Deleter>
+T* Registry<T, Deleter>::at(size_t index) const {
+  if (index >= m_high_water.load(std::memory_order_acquire)) {
+    return nullptr;
+  }
+  return slot(index).item.load(std::memory_order_acquire);
+}
+
+template <typename T, typename Deleter>
+template <typename Function>
+void Registry<T, Deleter>::forEach(Function function) const {
+  ReadGuard guard(*this);
+  size_t end = m_high_water.load(std::memory_order_acquire);
+  for (size_t base = 0; base < end; base += REGISTRY_CHUNK_SIZE) {
+    Slot* slots = m_chunks[base >> REGISTRY_CHUNK_BITS].load(std::memory_order_acquire);
+    size_t count = std::min(static_cast<size_t>(REGISTRY_CHUNK_SIZE), end - base);
+    for (size_t i = 0; i < count; ++i) {
+      T* item = slots[i].item.load(std::memory_order_acquire);
+      if (item != nullptr) {
+        function(slots[i].key.load(std::memory_order_relaxed), *item);
+      }
+    }
+  }
+}
+
+// ----------------------------------------------
+template <typename T, typename Deleter>
+std::atomic<long>* Registry<T, Deleter>::enter() const {
+  while (true) {
+    unsigned epoch = m_epoch.load();
+    std::atomic<long>& counter = m_readers[epoch & 1].value;
+    counter.fetch_add(1);
+    if (m_epoch.load() == epoch) {  // registered before any writer could have flipped past us
+      return &counter;
+    }
+    counter.fetch_sub(1, std::memory_order_release);
+  }
+}
+
+template <typename T, typename Deleter>
+void Registry<T, Deleter>::synchronize() {  // writers' mutex is held
+  unsigned epoch = m_epoch.load();
+  m_epoch.store(epoch + 1);  // new readers go to the other counter and can't see retired items
+  while (m_readers[epoch & 1].value.load(std::memory_order_acquire) != 0) {
+    std::this_thread::yield();
+  }
+}
+
+#endif  // REGISTRY__H__
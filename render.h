@@ -0,0 +1,205 @@
+#ifndef RENDER__H__
+#define RENDER__H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <unistd.h>
+#include "protocol.h"
+
+#define RENDER_FRAME_MS 16       // terminal is written at most this often
+#define RENDER_MAX_QUEUED 8192   // lines waiting for the next frame, newer ones are skipped and counted
+#define RENDER_MAX_LINES 256     // lines written per frame, older ones of a burst collapse into a count
+
+/**
+ * Terminal output of Client, off the network reader's thread. The reader copies a message into a
+ * queue and goes back to the socket; a render thread takes everything queued at most once per frame,
+ * formats it into one buffer and writes it with a single write(2). Timestamps are formatted once per
+ * second. A slow terminal never stalls the reader: a burst beyond RENDER_MAX_LINES per frame shows
+ * as its last lines and a count, and lines that don't fit into the queue are counted and skipped.
+ * Queued lines keep their strings, so a warmed-up queue does not allocate.
+ */
+class Renderer {
+public:
+  Renderer(): m_count(0), m_skipped(0), m_is_stopped(false), m_cached_second(-1) {}
+  ~Renderer() { stop(); }
+
+  void start();
+  void stop();  // writes whatever is queued
+
+  void message(Slice channel, Slice login, Slice text, bool is_history);
+  void system(const std::string& text);
+
+private:
+  struct Line {
+    bool is_system;
+    bool is_history;
+    time_t time;
+    std::string channel;
+    std::string login;
+    std::string text;
+  };
+
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::vector<Line> m_queue;  // first m_count are queued, guarded by m_mutex
+  size_t m_count;
+  size_t m_skipped;           // guarded by m_mutex
+  bool m_is_stopped;          // guarded by m_mutex
+  std::thread m_thread;
+
+  // render thread only
+  std::vector<Line> m_drained;
+  time_t m_cached_second;
+  std::string m_cached_time;
+  std::string m_out;
+
+  Line* push();  // under m_mutex, nullptr - the queue is full
+  void run();
+  void render(size_t count, size_t skipped);
+  const std::string& timestamp(time_t time);
+  void write();
+};
+
+// ----------------------------------------------
+inline void Renderer::start() {
+  m_thread = std::thread(&Renderer::run, this);
+}
+
+inline void Renderer::stop() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_is_stopped = true;
+  }
+  m_ready.notify_one();
+  if (m_thread.joinable()) {
+    m_thread.join();
+  }
+}
+
+inline Renderer::Line* Renderer::push() {
+  if (m_count == RENDER_MAX_QUEUED) {
+    ++m_skipped;
+    return nullptr;
+  }
+  if (m_count == m_queue.size()) {
+    m_queue.emplace_back();
+  }
+  if (m_count++ == 0) {
+    m_ready.notify_one();  // the render thread sleeps only on an empty queue
+  }
+  return &m_queue[m_count - 1];
+}
+
+inline void Renderer::message(Slice channel, Slice login, Slice text, bool is_history) {
+  time_t now = time(nullptr);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Line* line = push();
+  if (line != nullptr) {
+    line->is_system = false;
+    line->is_history = is_history;
+    line->time = now;
+    line->channel.assign(channel.data, channel.size);
+    line->login.assign(login.data, login.size);
+    line->text.assign(text.data, text.size);
+  }
+}
+
+inline void Renderer::system(const std::string& text) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Line* line = push();
+  if (line != nullptr) {
+    line->is_system = true;
+    line->text = text;
+  }
+}
+
+inline void Renderer::run() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    m_ready.wait(lock, [this]() { return m_count > 0 || m_skipped > 0 || m_is_stopped; });
+    bool is_stopped = m_is_stopped;
+    size_t count = m_count;
+    size_t skipped = m_skipped;
+    m_queue.swap(m_drained);  // the queue keeps the strings of two frames ago
+    m_count = 0;
+    m_skipped = 0;
+    lock.unlock();
+
+    render(count, skipped);
+    write();
+    if (is_stopped) {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(RENDER_FRAME_MS));  // what comes meanwhile is one frame
+    lock.lock();
+  }
+}
+
+inline void Renderer::render(size_t count, size_t skipped) {
+  m_out.clear();
+  size_t first = count > RENDER_MAX_LINES ? count - RENDER_MAX_LINES : 0;
+  if (first + skipped > 0) {
+    char summary[96];
+    snprintf(summary, sizeof(summary), "\e[5;00;31mSystem: %zu messages not shown\e[m\n", first + skipped);
+    m_out += summary;
+  }
+  for (size_t i = first; i < count; ++i) {
+    const Line& line = m_drained[i];
+    if (line.is_system) {
+      m_out += "\e[5;00;31mSystem: ";
+      m_out += line.text;
+      m_out += "\e[m\n";
+      continue;
+    }
+    m_out += "\e[5;00;33m";
+    m_out += timestamp(line.time);
+    m_out += "\e[m :: ";
+    if (line.is_history) {
+      m_out += "(history) ";
+    }
+    if (!line.channel.empty()) {
+      m_out += '[';
+      m_out += line.channel;
+      m_out += "] ";
+    }
+    m_out += "\e[5;01;37m";
+    m_out += line.login;
+    m_out += "\e[m: ";
+    m_out += line.text;
+    m_out += '\n';
+  }
+}
+
+inline const std::string& Renderer::timestamp(time_t time) {
+  if (time != m_cached_second) {
+    char buffer[32];
+    ctime_r(&time, buffer);  // "Sun Oct 18 05:29:43 2026\n"
+    m_cached_time.assign(buffer, strcspn(buffer, "\n"));
+    m_cached_second = time;
+  }
+  return m_cached_time;
+}
+
+inline void Renderer::write() {
+  size_t written = 0;
+  while (written < m_out.size()) {
+    ssize_t result = ::write(STDOUT_FILENO, m_out.data() + written, m_out.size() - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return;  // the terminal is gone, nothing to show things on
+    }
+    written += result;
+  }
+}
+
+#endif  // RENDER__H__
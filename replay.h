@@ -0,0 +1,576 @@
+#ifndef REPLAY__H__
+#define REPLAY__H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "capture.h"
+#include "compression.h"
+#include "histogram.h"
+#include "logger.h"
+#include "protocol.h"
+#include "shmring.h"
+
+#define REPLAY_MAX_EVENTS 256
+#define REPLAY_TICK_MS 10
+#define REPLAY_DRAIN_MS 2000  // waiting for copies still in flight after the last frame is sent
+#define REPLAY_SEND_WAIT_MS 100  // a socket that takes nothing for this long is checked for being closed
+#define REPLAY_SHARDS 64  // of the send times, so receivers rarely wait for each other
+#define REPLAY_CHANNEL_TAG 1ULL  // low bit of an epoll tag: the connection's shared memory channel event
+
+struct ReplayConfig {
+  std::string capture_path;
+  std::string ip_address;
+  std::string port;
+  std::string unix_path;  // replay over the server's unix socket instead
+  std::string shm_path;   // ... or over shared memory channels set up through this one
+  double speed = 1;       // of the captured timeline, 0 - as fast as the server takes it
+  int threads = 2;        // receiving
+  std::string report_path;    // the report's "name value" lines are written there as well
+  std::string baseline_path;  // ... of an earlier run, to print the differences to it
+
+  const char* transport() const { return !shm_path.empty() ? "shm" : !unix_path.empty() ? "unix" : "tcp"; }
+};
+
+/**
+ * Replays a capture file (capture.h) against a server: a connection is opened for every captured one
+ * when it was accepted, sends its frames byte for byte when they were received, scaled by the speed,
+ * and is shut down when it was closed, or where the capture lost some of its records - at any other
+ * speed than 1x only after the copies still on their way to it had time to come, the way they would
+ * have at 1x. Compressed streams, hellos and multiplexed sessions go out as recorded, so the server
+ * under test gets the same work, and the server's ids repeat as long as it starts afresh in the same
+ * configuration.
+ *
+ * The copies the connections receive are matched to the message sent by its login and text: latency
+ * is from the moment the frame was due, so a replay falling behind the timeline shows as latency, and
+ * the report is a list of "name value" lines two runs against different builds can be compared by.
+ */
+class Replayer {
+public:
+  explicit Replayer(const ReplayConfig& config);
+
+  bool run();  // false if the capture can't be read or the server can't be reached
+
+private:
+  struct Worker;
+
+  struct Connection {
+    int peer;  // captured id
+    int socket;
+    int id;    // given by the server under test, receiving thread only
+    std::atomic<bool> is_closed;  // set by the receiving thread
+    std::atomic<bool> is_shut;  // CLOSE is replayed, set by the sending thread
+    FrameDecoder decoder;  // received bytes, receiving thread only
+    std::unique_ptr<ShmChannel> channel;
+    std::unique_ptr<Inflater> inflater;  // the captured stream to the server, sending thread only
+    Worker* worker;
+
+    Connection(): peer(0), socket(-1), id(-1), is_closed(false), is_shut(false), worker(nullptr) {}
+  };
+
+  struct Worker {
+    int epoll;
+    LatencyHistogram latency;  // nanoseconds
+    Inflater inflater;  // the server's frames, each compressed on its own
+    std::string inflated;
+    uint64_t received;  // copies of messages
+    uint64_t matched;   // ... that were sent in this replay
+    uint64_t bytes_received;
+    uint64_t renumbered;  // connections that got another id than in the capture
+    int closed;           // by the server
+    int64_t last_received;
+
+    Worker(): epoll(-1), inflater(false), received(0), matched(0), bytes_received(0), renumbered(0), closed(0), last_received(0) {}
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, int64_t> sent;  // message key -> when it was last due
+  };
+
+  ReplayConfig m_config;
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::unordered_map<int, std::unique_ptr<Connection>> m_connections;  // by captured id, sending thread only
+  std::unordered_set<int> m_gaps;  // captured ids whose streams lost records, left out from there on, ... as well
+  Shard m_shards[REPLAY_SHARDS];
+  std::atomic<bool> m_is_stopped;
+  addrinfo* m_server_info;
+  FrameDecoder m_frames;  // cuts the captured ones, sending thread only
+  std::string m_inflated;
+  LatencyHistogram m_lag;  // of sends behind the timeline
+  uint64_t m_frames_sent;
+  uint64_t m_bytes_sent;
+  uint64_t m_messages_sent;
+
+  static int64_t now();
+  static uint64_t key(const MessageView& message);
+  Connection* open(int peer);
+  void send(Connection& connection, Slice data, int64_t due);
+  bool writeAll(Connection& connection, Slice data);
+  void runWorker(Worker& worker);
+  void receive(Worker& worker, Connection& connection);
+  void handleFrame(Worker& worker, Connection& connection, const Frame& frame);
+  void countMessage(Worker& worker, const Frame& frame, size_t copies);
+  void report(double seconds, double timeline_seconds) const;
+};
+
+// ----------------------------------------------
+inline Replayer::Replayer(const ReplayConfig& config)
+  : m_config(config), m_is_stopped(false), m_server_info(nullptr), m_frames_sent(0), m_bytes_sent(0), m_messages_sent(0) {
+  m_config.threads = std::max(1, m_config.threads);
+  m_config.speed = std::max(0.0, m_config.speed);
+  for (int i = 0; i < m_config.threads; ++i) {
+    m_workers.emplace_back(new Worker());
+  }
+}
+
+inline int64_t Replayer::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t Replayer::key(const MessageView& message) {
+  uint64_t hash = 14695981039346656037ULL;  // FNV-1a of login, a separator and text
+  for (const Slice& part : { message.login, Slice("\0", 1), message.text }) {
+    for (size_t i = 0; i < part.size; ++i) {
+      hash = (hash ^ static_cast<unsigned char>(part.data[i])) * 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+inline bool Replayer::run() {
+  std::unique_ptr<CaptureReader> capture;
+  try {
+    capture.reset(new CaptureReader(m_config.capture_path));
+  } catch (const CaptureException&) {
+    return false;
+  }
+  rlimit limit;  // every captured connection is a descriptor
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  if (m_config.unix_path.empty() && m_config.shm_path.empty()) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(m_config.ip_address.c_str(), m_config.port.c_str(), &hints, &m_server_info);
+    if (status != 0) {
+      ERR("Failed to prepare address structure: %s", gai_strerror(status));
+      return false;
+    }
+  }
+
+  std::vector<std::thread> threads;
+  for (auto& worker : m_workers) {
+    worker->epoll = epoll_create1(0);
+    threads.emplace_back(&Replayer::runWorker, this, std::ref(*worker));
+  }
+  char speed[32];
+  if (m_config.speed > 0) {
+    snprintf(speed, sizeof(speed), "%gx speed", m_config.speed);
+  } else {
+    snprintf(speed, sizeof(speed), "max speed");
+  }
+  printf("Replaying %s (%.1f MB) at %s over %s connections\n", m_config.capture_path.c_str(), capture->size() / 1e6,
+         speed, m_config.transport());
+
+  bool result = true;
+  std::vector<Connection*> closing;  // at the end of the replay
+  int64_t start = now();
+  int64_t timeline_ns = 0;
+  CaptureRecord record;
+  while (result && capture->next(&record)) {
+    timeline_ns = record.time_ns;
+    int64_t due = m_config.speed > 0 ? start + static_cast<int64_t>(record.time_ns / m_config.speed) : now();
+    int64_t wait = due - now();
+    if (wait > 0) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+    }
+    if (m_gaps.count(record.peer) != 0) {
+      continue;
+    }
+    auto it = m_connections.find(record.peer);
+    Connection* connection = it != m_connections.end() ? it->second.get() : nullptr;
+    if (record.kind == CAPTURE_GAP) {  // the rest of its stream would not make sense to the server
+      printf("Captured peer %i lost records, left out from %.3f s on\n", record.peer, record.time_ns / 1e9);
+      m_gaps.insert(record.peer);
+      record.kind = CAPTURE_CLOSE;
+    }
+    if (record.kind == CAPTURE_OPEN || (record.kind == CAPTURE_FRAME && connection == nullptr)) {
+      if (connection == nullptr && (connection = open(record.peer)) == nullptr) {  // a frame without OPEN: connected before capture started
+        printf("Failed to connect captured peer %i: %s\n", record.peer, strerror(errno));
+        result = false;
+        break;
+      }
+    }
+    if (record.kind == CAPTURE_FRAME) {
+      send(*connection, record.data, due);
+    } else if (record.kind == CAPTURE_CLOSE && connection != nullptr && !connection->is_shut) {
+      connection->is_shut = true;  // sends nothing more
+      if (m_config.speed == 1) {
+        shutdown(connection->socket, SHUT_RDWR);  // the receiving thread sees it end
+      } else {
+        closing.push_back(connection);
+      }
+    }
+  }
+  int64_t stop = now();
+  std::this_thread::sleep_for(std::chrono::milliseconds(REPLAY_DRAIN_MS));
+  for (Connection* connection : closing) {
+    shutdown(connection->socket, SHUT_RDWR);
+  }
+  m_is_stopped = true;
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  int64_t last = stop;
+  for (const auto& worker : m_workers) {
+    last = std::max(last, worker->last_received);
+    close(worker->epoll);
+  }
+  if (result) {
+    report((last - start) / 1e9, timeline_ns / 1e9);
+  }
+  for (auto& it : m_connections) {
+    close(it.second->socket);
+  }
+  if (m_server_info != nullptr) {
+    freeaddrinfo(m_server_info);
+  }
+  return result;
+}
+
+// the configured transport, nullptr on failure
+inline Replayer::Connection* Replayer::open(int peer) {
+  std::unique_ptr<Connection> connection(new Connection());
+  connection->peer = peer;
+  int s = -1;
+  if (!m_config.shm_path.empty()) {
+    s = connectLocal(m_config.shm_path);
+    if (s != -1) {
+      connection->channel.reset(ShmChannel::receiveSetup(s));
+      if (!connection->channel) {
+        close(s);
+        s = -1;
+      }
+    }
+  } else if (!m_config.unix_path.empty()) {
+    s = connectLocal(m_config.unix_path);
+  } else {
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s != -1 && connect(s, m_server_info->ai_addr, m_server_info->ai_addrlen) == -1) {
+      close(s);
+      s = -1;
+    } else if (s != -1) {
+      int enable = 1;  // frames leave when they are due, the latency measured is the server's
+      setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+  }
+  if (s == -1) {
+    return nullptr;
+  }
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+  connection->socket = s;
+  connection->worker = m_workers[m_connections.size() % m_workers.size()].get();
+
+  Connection* result = connection.get();
+  m_connections[peer] = std::move(connection);
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = reinterpret_cast<uint64_t>(result);
+  epoll_ctl(result->worker->epoll, EPOLL_CTL_ADD, s, &event);
+  if (result->channel) {
+    event.data.u64 = reinterpret_cast<uint64_t>(result) | REPLAY_CHANNEL_TAG;
+    epoll_ctl(result->worker->epoll, EPOLL_CTL_ADD, result->channel->event(), &event);
+  }
+  return result;
+}
+
+inline void Replayer::send(Connection& connection, Slice data, int64_t due) {
+  if (connection.is_shut || connection.is_closed.load(std::memory_order_relaxed)) {
+    return;
+  }
+  Frame frame;  // a message's send time is known before any copy of it can come back
+  memcpy(m_frames.prepare(data.size), data.data, data.size);
+  m_frames.commit(data.size);
+  if (m_frames.next(&frame) == FrameDecoder::FRAME) {
+    bool is_readable = true;
+    if (frame.flags & FRAME_FLAG_COMPRESSED) {  // inflated all the same, the next frames depend on it
+      if (!connection.inflater) {
+        connection.inflater.reset(new Inflater(true));
+      }
+      is_readable = decompressFrame(*connection.inflater, &frame, &m_inflated);
+    }
+    MessageView message;
+    if (is_readable && MessageView::fromFrame(frame, &message)) {
+      Shard& shard = m_shards[key(message) % REPLAY_SHARDS];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.sent[key(message)] = due;
+      ++m_messages_sent;
+    }
+  }
+  if (m_frames.buffered() > 0) {  // a record is one frame, whatever else it holds is not carried over
+    m_frames = FrameDecoder();
+  }
+
+  int64_t current = now();
+  m_lag.record(static_cast<uint64_t>(std::max<int64_t>(0, current - due)));
+  if (writeAll(connection, data)) {
+    ++m_frames_sent;
+    m_bytes_sent += data.size;
+  }
+}
+
+// blocks until the server takes all of data, false - the connection is gone
+inline bool Replayer::writeAll(Connection& connection, Slice data) {
+  if (connection.channel) {
+    return connection.channel->writeAll(data.data, data.size, connection.socket);
+  }
+  size_t written = 0;
+  while (written < data.size) {
+    ssize_t sent = ::send(connection.socket, data.data + written, data.size - written, MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (connection.is_closed.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      pollfd descriptor = { connection.socket, POLLOUT, 0 };
+      poll(&descriptor, 1, REPLAY_SEND_WAIT_MS);
+      continue;
+    }
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    written += sent;
+  }
+  return true;
+}
+
+// ----------------------------------------------
+inline void Replayer::runWorker(Worker& worker) {
+  epoll_event events[REPLAY_MAX_EVENTS];
+  while (!m_is_stopped.load()) {
+    int count = epoll_wait(worker.epoll, events, REPLAY_MAX_EVENTS, REPLAY_TICK_MS);
+    for (int i = 0; i < count; ++i) {
+      Connection& connection = *reinterpret_cast<Connection*>(events[i].data.u64 & ~REPLAY_CHANNEL_TAG);
+      if (events[i].data.u64 & REPLAY_CHANNEL_TAG) {
+        connection.channel->clearEvent();
+      }
+      receive(worker, connection);
+      if (connection.is_closed.load(std::memory_order_relaxed)) {
+        epoll_ctl(worker.epoll, EPOLL_CTL_DEL, connection.socket, nullptr);
+        if (connection.channel) {
+          epoll_ctl(worker.epoll, EPOLL_CTL_DEL, connection.channel->event(), nullptr);
+        }
+      }
+    }
+  }
+}
+
+inline void Replayer::receive(Worker& worker, Connection& connection) {
+  while (!connection.is_closed.load(std::memory_order_relaxed)) {
+    char* buffer = connection.decoder.prepare(PROTOCOL_READ_SIZE);
+    ssize_t read_bytes = 0;
+    if (connection.channel) {
+      read_bytes = connection.channel->read(buffer, PROTOCOL_READ_SIZE);
+      if (read_bytes == 0) {
+        if (!connection.channel->sleepUntilData()) {
+          continue;  // written meanwhile
+        }
+        char end;  // nothing comes over the socket but its end
+        read_bytes = recv(connection.socket, &end, 1, MSG_DONTWAIT);
+      }
+    } else {
+      read_bytes = recv(connection.socket, buffer, PROTOCOL_READ_SIZE, 0);
+    }
+    if (read_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (read_bytes <= 0) {
+      DBG("Replayed peer %i closed: %s", connection.peer, read_bytes == 0 ? "by Server" : strerror(errno));
+      connection.is_closed = true;
+      worker.closed += connection.is_shut ? 0 : 1;
+      return;
+    }
+    connection.decoder.commit(read_bytes);
+    worker.bytes_received += read_bytes;
+
+    Frame frame;
+    FrameDecoder::Status status;
+    while ((status = connection.decoder.next(&frame)) == FrameDecoder::FRAME) {
+      if (frame.flags & FRAME_FLAG_COMPRESSED) {
+        if (!decompressFrame(worker.inflater, &frame, &worker.inflated)) {
+          ERR("Broken compressed frame to replayed peer %i", connection.peer);
+          continue;
+        }
+      }
+      handleFrame(worker, connection, frame);
+    }
+    if (status == FrameDecoder::BROKEN) {
+      ERR("Broken stream from Server to replayed peer %i", connection.peer);
+      connection.is_closed = true;
+      ++worker.closed;
+      return;
+    }
+  }
+}
+
+inline void Replayer::handleFrame(Worker& worker, Connection& connection, const Frame& frame) {
+  if (connection.id < 0) {  // text hello, the captured frames answer it
+    int version = 0;
+    if (frame.type == FRAME_TEXT && parseTextHello(frame.payload, &connection.id, &version) && connection.id != connection.peer) {
+      ++worker.renumbered;
+    }
+    return;
+  }
+  if (frame.flags & FRAME_FLAG_HISTORY) {
+    return;  // stored before the replay
+  }
+  if (frame.type == FRAME_ROUTE) {
+    Slice sessions;
+    Frame routed;
+    if (!readRoute(frame, &sessions, &routed)) {
+      ERR("Malformed route to replayed peer %i", connection.peer);
+      return;
+    }
+    if ((routed.flags & FRAME_FLAG_COMPRESSED) && !decompressFrame(worker.inflater, &routed, &worker.inflated)) {
+      ERR("Broken compressed frame to replayed peer %i", connection.peer);
+      return;
+    }
+    countMessage(worker, routed, sessions.size / 4);
+    return;
+  }
+  countMessage(worker, frame, 1);
+}
+
+inline void Replayer::countMessage(Worker& worker, const Frame& frame, size_t copies) {
+  MessageView message;
+  if (!MessageView::fromFrame(frame, &message)) {
+    return;
+  }
+  int64_t current = now();
+  int64_t due = 0;
+  {
+    Shard& shard = m_shards[key(message) % REPLAY_SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.sent.find(key(message));
+    due = it != shard.sent.end() ? it->second : 0;
+  }
+  worker.received += copies;
+  worker.last_received = current;
+  if (due > 0) {  // otherwise from a federated node or not from this replay
+    uint64_t latency = static_cast<uint64_t>(std::max<int64_t>(0, current - due));
+    for (size_t i = 0; i < copies; ++i) {
+      worker.latency.record(latency);
+    }
+    worker.matched += copies;
+  }
+}
+
+// ----------------------------------------------
+inline void Replayer::report(double seconds, double timeline_seconds) const {
+  LatencyHistogram latency;
+  uint64_t received = 0, matched = 0, bytes = 0, renumbered = 0;
+  int closed = 0;
+  for (const auto& worker : m_workers) {
+    latency.merge(worker->latency);
+    received += worker->received;
+    matched += worker->matched;
+    bytes += worker->bytes_received;
+    renumbered += worker->renumbered;
+    closed += worker->closed;
+  }
+  seconds = std::max(seconds, 1e-3);
+
+  std::vector<std::pair<std::string, double>> values = {
+    { "seconds", seconds },
+    { "captured_seconds", timeline_seconds },
+    { "connections", static_cast<double>(m_connections.size()) },
+    { "connections_closed_by_server", static_cast<double>(closed) },
+    { "connections_renumbered", static_cast<double>(renumbered) },
+    { "connections_left_out", static_cast<double>(m_gaps.size()) },
+    { "frames_sent", static_cast<double>(m_frames_sent) },
+    { "messages_sent", static_cast<double>(m_messages_sent) },
+    { "bytes_sent", static_cast<double>(m_bytes_sent) },
+    { "copies_received", static_cast<double>(received) },
+    { "copies_matched", static_cast<double>(matched) },
+    { "frames_per_s", m_frames_sent / seconds },
+    { "copies_per_s", received / seconds },
+    { "mb_per_s", bytes / seconds / 1e6 },
+    { "latency_mean_us", latency.mean() / 1e3 },
+    { "latency_p50_us", latency.percentile(50) / 1e3 },
+    { "latency_p99_us", latency.percentile(99) / 1e3 },
+    { "latency_p999_us", latency.percentile(99.9) / 1e3 },
+    { "latency_max_us", latency.max() / 1e3 },
+    { "send_lag_p99_us", m_lag.percentile(99) / 1e3 },
+    { "send_lag_max_us", m_lag.max() / 1e3 }
+  };
+
+  std::unordered_map<std::string, double> baseline;
+  if (!m_config.baseline_path.empty()) {
+    std::ifstream in(m_config.baseline_path);
+    std::string name;
+    double value = 0;
+    while (in >> name >> value) {
+      baseline[name] = value;
+    }
+    if (baseline.empty()) {
+      ERR("No report in baseline file %s", m_config.baseline_path.c_str());
+    }
+  }
+
+  std::string lines;
+  char line[256];
+  if (!baseline.empty()) {
+    printf("%-30s %14s %14s %9s\n", "", "baseline", "this run", "change");
+  }
+  for (const auto& it : values) {
+    snprintf(line, sizeof(line), "%s %.3f\n", it.first.c_str(), it.second);
+    lines += line;
+    auto base = baseline.find(it.first);
+    if (base == baseline.end()) {
+      printf("%-30s %14.3f\n", it.first.c_str(), it.second);
+    } else if (base->second != 0) {
+      printf("%-30s %14.3f %14.3f %+8.1f%%\n", it.first.c_str(), base->second, it.second,
+             100.0 * (it.second - base->second) / base->second);
+    } else {
+      printf("%-30s %14.3f %14.3f\n", it.first.c_str(), base->second, it.second);
+    }
+  }
+  if (!m_config.report_path.empty()) {
+    std::ofstream out(m_config.report_path);
+    out << lines;
+    if (!out) {
+      ERR("Failed to write report %s", m_config.report_path.c_str());
+    }
+  }
+}
+
+#endif  // REPLAY__H__
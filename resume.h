@@ -0,0 +1,229 @@
+#ifndef RESUME__H__
+#define RESUME__H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <sys/random.h>
+#include "buffer.h"
+#include "protocol.h"
+
+#define RESUME_READ_BATCH 64  // ring entries copied under one lock
+#define RESUME_TOKEN_SIZE 16
+#define RESUME_REORDER_WINDOW 1024  // sequence numbers, how far out of order messages may reach a client
+
+struct ResumeConfig {
+  size_t messages;  // ring capacity, 0 - no resumption
+  int window_s;     // how long a disconnected session waits for its client
+
+  ResumeConfig(): messages(0), window_s(30) {}
+
+  bool isEnabled() const { return messages > 0; }
+};
+
+// a session's secret: it is resumed by the client it was given to, not by whoever knows the id
+inline std::string makeResumeToken() {
+  std::string token(RESUME_TOKEN_SIZE, '\0');
+  size_t filled = 0;
+  while (filled < token.size()) {
+    ssize_t result = getrandom(&token[filled], token.size() - filled, 0);
+    if (result > 0) {
+      filled += result;
+    } else if (errno != EINTR) {
+      return std::string();  // no session can be resumed with it
+    }
+  }
+  return token;
+}
+
+// in constant time: how much of a guess is right is not told by how long the comparison takes
+inline bool isResumeToken(const std::string& token, Slice guess) {
+  if (token.empty() || guess.size != token.size()) {
+    return false;
+  }
+  unsigned char difference = 0;
+  for (size_t i = 0; i < token.size(); ++i) {
+    difference |= static_cast<unsigned char>(token[i] ^ guess.data[i]);
+  }
+  return difference == 0;
+}
+
+/**
+ * Sequence numbers of outgoing messages and the most recent of them, for clients that come back
+ * after losing their connection. A number is taken and the message stored under one short lock, so
+ * the ring is always in sequence order; the frame itself is shared, storing it is a reference count
+ * increment, and the oldest entry is simply overwritten. A resuming peer reads RESUME_READ_BATCH
+ * entries per lock as its outbound queue drains, so a reconnect storm costs every client the
+ * messages it missed and nothing more. Without a ring the numbers are a bare atomic counter.
+ */
+class ResumeRing {
+public:
+  struct Entry {
+    uint64_t sequence;
+    int sender_id;
+    Slice channel;  // points into frame, empty - to everybody
+    BufferRef frame;  // binary
+
+    Entry(): sequence(0), sender_id(0) {}
+    Entry(int sender_id, Slice channel, const BufferRef& frame)
+      : sequence(0), sender_id(sender_id), channel(channel), frame(frame) {}
+  };
+
+  explicit ResumeRing(size_t capacity);  // rounded up to a power of two
+
+  template <typename Serialize>
+  void append(Serialize serialize);  // serialize(sequence) -> Entry, called in sequence order
+
+  uint64_t next() const;  // number of the next message, numbers start at 1
+  void restart(uint64_t next);  // numbers continue from next, before any append
+  size_t read(uint64_t* from, uint64_t end, Entry* out, size_t max) const;  // kept entries of [*from, end), *from moves past them
+
+private:
+  std::vector<Entry> m_entries;
+  size_t m_mask;
+  std::atomic<uint64_t> m_next;
+  mutable std::mutex m_mutex;
+
+  ResumeRing(const ResumeRing&) = delete;
+  ResumeRing& operator = (const ResumeRing&) = delete;
+};
+
+// ----------------------------------------------
+inline ResumeRing::ResumeRing(size_t capacity): m_mask(0), m_next(1) {
+  if (capacity > 0) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    m_entries.resize(size);
+    m_mask = size - 1;
+  }
+}
+
+template <typename Serialize>
+void ResumeRing::append(Serialize serialize) {
+  if (m_entries.empty()) {
+    serialize(m_next.fetch_add(1, std::memory_order_relaxed));
+    return;
+  }
+  std::lock_guard<std::mutex> lock(m_mutex);
+  uint64_t sequence = m_next.load(std::memory_order_relaxed);
+  Entry& entry = m_entries[sequence & m_mask];
+  entry = serialize(sequence);
+  entry.sequence = sequence;
+  m_next.store(sequence + 1, std::memory_order_relaxed);
+}
+
+inline uint64_t ResumeRing::next() const {
+  if (m_entries.empty()) {
+    return m_next.load(std::memory_order_relaxed);
+  }
+  // under the lock: a peer registered before this call gets every message numbered from here on
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_next.load(std::memory_order_relaxed);
+}
+
+inline void ResumeRing::restart(uint64_t next) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_next.store(next, std::memory_order_relaxed);
+}
+
+inline size_t ResumeRing::read(uint64_t* from, uint64_t end, Entry* out, size_t max) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  uint64_t next = m_next.load(std::memory_order_relaxed);
+  uint64_t oldest = next > m_entries.size() ? next - m_entries.size() : 1;
+  *from = std::max(*from, oldest);  // the ones before are overwritten
+  end = std::min(end, next);
+  size_t count = 0;
+  for (; *from < end && count < max; ++*from) {
+    out[count++] = m_entries[*from & m_mask];
+  }
+  return count;
+}
+
+/**
+ * Client's record of the numbered messages it has seen. A message is numbered when it is sent and
+ * reaches a peer through one of several threads or reactors, so 12 may come before 11, and most numbers
+ * never come at all: they are for channels the client is not in. So the point to resume from is not the
+ * highest number seen but the one before the oldest missing of the last RESUME_REORDER_WINDOW: everything
+ * before it came or was not meant for this client. Messages sent again from there are known by their
+ * numbers and dropped.
+ */
+class SequenceWindow {
+public:
+  SequenceWindow();
+
+  bool add(uint64_t sequence);  // false - seen already
+  uint64_t watermark() const;   // every message up to it is seen or not meant for the client, 0 - none seen
+  void reset();                 // a new session, its numbers are not those seen
+
+private:
+  uint64_t m_first;  // the lowest seen in this session, nothing before it is asked for
+  uint64_t m_last;   // the highest seen
+  std::vector<uint64_t> m_seen;  // bits of (m_last - RESUME_REORDER_WINDOW, m_last]
+
+  bool isSeen(uint64_t sequence) const { return m_seen[(sequence / 64) % m_seen.size()] & (1ULL << (sequence % 64)); }
+  void setSeen(uint64_t sequence, bool is_seen);
+};
+
+// ----------------------------------------------
+inline SequenceWindow::SequenceWindow(): m_first(0), m_last(0), m_seen(RESUME_REORDER_WINDOW / 64, 0) {
+}
+
+inline bool SequenceWindow::add(uint64_t sequence) {
+  if (sequence == 0) {
+    return true;  // not numbered
+  }
+  if (m_last == 0) {
+    m_first = m_last = sequence;
+    setSeen(sequence, true);
+    return true;
+  }
+  if (sequence > m_last) {
+    for (uint64_t it = std::max(m_last + 1, sequence > RESUME_REORDER_WINDOW ? sequence - RESUME_REORDER_WINDOW + 1 : 1);
+         it < sequence; ++it) {
+      setSeen(it, false);  // out of the window with the oldest ones, now missing
+    }
+    setSeen(sequence, true);
+    m_last = sequence;
+    return true;
+  }
+  if (m_last - sequence >= RESUME_REORDER_WINDOW) {
+    return true;  // too old to tell, better twice than never
+  }
+  if (sequence >= m_first && isSeen(sequence)) {
+    return false;
+  }
+  m_first = std::min(m_first, sequence);
+  setSeen(sequence, true);
+  return true;
+}
+
+inline uint64_t SequenceWindow::watermark() const {
+  if (m_last == 0) {
+    return 0;
+  }
+  uint64_t oldest = m_last >= RESUME_REORDER_WINDOW ? std::max(m_first, m_last - RESUME_REORDER_WINDOW + 1) : m_first;
+  for (uint64_t it = oldest; it < m_last; ++it) {
+    if (!isSeen(it)) {
+      return it - 1;  // m_first is seen, so it is never 0 here
+    }
+  }
+  return m_last;
+}
+
+inline void SequenceWindow::reset() {
+  m_first = m_last = 0;
+  std::fill(m_seen.begin(), m_seen.end(), 0);
+}
+
+inline void SequenceWindow::setSeen(uint64_t sequence, bool is_seen) {
+  uint64_t& word = m_seen[(sequence / 64) % m_seen.size()];
+  word = is_seen ? word | (1ULL << (sequence % 64)) : word & ~(1ULL << (sequence % 64));
+}
+
+#endif  // RESUME__H__
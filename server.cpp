@@ -1,57 +1,462 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <ctime>
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include "buffer.h"
+#include "capture.h"
+#include "channels.h"
+#include "compression.h"
+#include "federation.h"
+#include "handoff.h"
+#include "history.h"
 #include "logger.h"
 #include "message.h"
+#include "metrics.h"
+#include "outbound.h"
+#include "protocol.h"
+#include "ratelimit.h"
+#include "registry.h"
+#include "resume.h"
+#include "shmring.h"
+#include "uring.h"
+
+#define EPOLL_MAX_EVENTS 256
+#define EPOLL_LISTENER_TAG 0  // epoll_event.data.u64 of the listening socket
+#define EPOLL_WAKEUP_TAG 1    // ... of the wakeup eventfd, peers are tagged with slot + EPOLL_PEER_TAG
+#define EPOLL_TIMER_TAG 2     // ... of the batch timer
+#define EPOLL_UNIX_TAG 3      // ... of the local listening sockets, shared by the reactors
+#define EPOLL_SHM_TAG 4
+#define EPOLL_PEER_TAG 5
+#define EPOLL_CHANNEL_FLAG (1ULL << 63)  // the tag of a peer with this bit set is of its shared memory channel's event
+#define URING_OP_BITS 8  // io_uring user_data is (slot << URING_OP_BITS) | UringOp
+#define REACTOR_TURN_FRAMES 32  // a peer's frames handled in a row before the next peer with frames waiting has its turn
+#define REACTOR_BACKLOG_BYTES (256 * 1024)  // uring: a peer with this much received and not handled is not read further
+#define ADMIN_REQUEST_WAIT_MS 100  // an admin client that sends nothing in this time gets the stats
+#define THREADS_FLUSH_INTERVAL_MS 100
+
+class Reactor;
+struct Peer;
+
+typedef ChannelIndex<Peer> PeerChannels;  // keyed by peer id
 
 struct Peer {
   int id;
   int socket;
+  size_t slot;                // position in the registry
+  std::atomic<int> protocol;  // wire format version agreed at hello, 0 - legacy text
+  std::atomic<int> compression;  // agreed at hello as well
+  FrameDecoder decoder;       // received bytes not yet cut into frames
+  OutboundQueue outbound;     // frames not yet accepted by the kernel
+  Reactor* reactor;           // owning event loop, nullptr in threads mode
+  std::vector<PeerChannels::Subscription> subscriptions;  // guarded like the channel index itself
+  std::unique_ptr<HistoryCursor> replay;  // history still to be sent, peer's own thread or reactor only
+  std::unique_ptr<Inflater> inflater;  // peer's deflate stream, receiving thread only
+  std::string inflated;  // payload of the last compressed frame received
+  uint64_t accepted_sequence;  // messages to everybody numbered from here on reach the peer live
+  uint64_t first_sequence;  // ... since its session began, nothing numbered before was meant for it
+  uint64_t resume_next;  // missed messages still to be sent after resumption, [resume_next, resume_end)
+  uint64_t resume_end;
+  std::string resume_token;  // given with its hello, asked for when its session is resumed; receiving thread only
+  TokenBucket limit;  // ingress rate, the admin may change it from its thread
+  bool is_limited;    // out of tokens: its frames wait in the decoder, its socket is not read; receiving thread only
+  std::unique_ptr<ShmChannel> channel;  // a local client's frames go through shared memory, the socket only tells it is gone
+
+  // multiplexing: a logical session is a peer without a socket of its own, its frames come and go over the carrier
+  Peer* carrier;     // nullptr - a connection; set before the session is registered
+  uint32_t session;  // its number on the carrier
+  std::unordered_map<uint32_t, Peer*> sessions;  // a carrier's open ones, receiving thread only
+  std::atomic<bool> is_gateway;  // has opened sessions: broadcasts reach them instead of the connection itself
+
+  // epoll and uring modes, owning reactor's thread only
+  bool is_dirty;    // has frames queued since the last flush
+  bool is_closing;  // will be closed at the end of the current loop iteration
+  bool is_ready;    // has frames or unread bytes left, waits for its next turn
+
+  // uring mode: the kernel works with these until the operations complete
+  int pending_ops;  // submitted and not completed yet, the peer is reclaimed when nothing is pending
+  bool is_receiving;  // a multishot receive is armed
+  msghdr send_header;
+  std::vector<iovec> send_parts;
+
+  // threads mode: outbound is shared between all the senders' threads
+  std::mutex mutex;
+  bool is_closed;  // guarded by mutex
+  std::atomic<int> references;  // the registry's and those of blocking fan-outs, see PeerRef
+
+  Peer(int id, int socket, const OutboundConfig& config, OutboundStats* stats, Reactor* reactor = nullptr)
+    : id(id), socket(socket), slot(0), protocol(0), compression(COMPRESSION_NONE), outbound(socket, config, stats), reactor(reactor),
+      accepted_sequence(0), first_sequence(0), resume_next(0), resume_end(0), is_limited(false), carrier(nullptr), session(0), is_gateway(false),
+      is_dirty(false), is_closing(false), is_ready(false), pending_ops(0), is_receiving(false), is_closed(false), references(1) {}
+  ~Peer() {  // by the registry, once no fan-out can reach this peer anymore
+    if (socket >= 0) {
+      close(socket);
+    }
+  }
+
+  bool isReplaying() const { return resume_next < resume_end || replay; }
+};
+
+struct PeerRelease {
+  void operator () (Peer* peer) const {
+    if (peer != nullptr && peer->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete peer;
+    }
+  }
+};
+
+typedef Registry<Peer, PeerRelease> PeerRegistry;  // keyed by peer id
+
+// keeps a peer, and a session's carrier, alive outside the registry's ReadGuard; taken under it
+class PeerRef {
+public:
+  explicit PeerRef(Peer& peer): m_peer(&peer) {
+    retain(m_peer);
+    retain(m_peer->carrier);
+  }
+  PeerRef(PeerRef&& other): m_peer(other.m_peer) { other.m_peer = nullptr; }
+  ~PeerRef() {
+    if (m_peer != nullptr) {
+      Peer* carrier = m_peer->carrier;
+      PeerRelease()(m_peer);
+      PeerRelease()(carrier);
+    }
+  }
+
+  Peer& operator * () const { return *m_peer; }
+
+private:
+  Peer* m_peer;
+
+  static void retain(Peer* peer) {
+    if (peer != nullptr) {
+      peer->references.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  PeerRef(const PeerRef&) = delete;
+  PeerRef& operator = (const PeerRef&) = delete;
+};
+
+// channel index of threads mode: fan-outs share it, join/leave/disconnect take it exclusively
+class ReadLock {
+public:
+  explicit ReadLock(pthread_rwlock_t& lock): m_lock(lock) { pthread_rwlock_rdlock(&m_lock); }
+  ~ReadLock() { pthread_rwlock_unlock(&m_lock); }
+
+private:
+  pthread_rwlock_t& m_lock;
+};
+
+class WriteLock {
+public:
+  explicit WriteLock(pthread_rwlock_t& lock): m_lock(lock) { pthread_rwlock_wrlock(&m_lock); }
+  ~WriteLock() { pthread_rwlock_unlock(&m_lock); }
+
+private:
+  pthread_rwlock_t& m_lock;
+};
+
+// one broadcast serialized once per wire format into pooled buffers shared by all recipients
+struct Outgoing {
+  int sender_id;
+  Slice channel;  // points into binary, empty - to everybody
+  BufferRef text;
+  BufferRef binary;
+  BufferRef compressed;  // binary with the payload deflated, empty - too small or compression is off
+
+  const BufferRef& forPeer(int version, int compression) const {
+    if (version < 1) {
+      return text;
+    }
+    return compression != COMPRESSION_NONE && compressed ? compressed : binary;
+  }
+};
+
+// recipients of one fan-out that are logical sessions: each carrier gets one ROUTE frame listing its sessions instead
+// of a copy per session; the fan-out's own thread only, carriers must stay registered until send()
+class Routes {
+public:
+  void add(Peer& session) { m_routes.emplace_back(session.carrier, session.session); }
+  template <typename Send>
+  void send(const Outgoing& outgoing, Send send);  // send(Peer& carrier, const BufferRef& route)
+
+private:
+  std::vector<std::pair<Peer*, uint32_t>> m_routes;
+  std::vector<uint32_t> m_sessions;  // of one carrier
+};
+
+static BufferRef routeFrame(const uint32_t* sessions, size_t count, const BufferRef& frame) {
+  BufferRef route = BufferPool::instance().acquire(routeSize(count, frame.size()));
+  writeRoute(sessions, count, Slice(frame.data(), frame.size()), route->data());
+  return route;
+}
+
+template <typename Send>
+void Routes::send(const Outgoing& outgoing, Send send) {
+  if (m_routes.empty()) {
+    return;
+  }
+  std::sort(m_routes.begin(), m_routes.end());  // a carrier's sessions next to each other
+  for (size_t i = 0; i < m_routes.size(); ) {
+    Peer* carrier = m_routes[i].first;
+    m_sessions.clear();
+    for (; i < m_routes.size() && m_routes[i].first == carrier; ++i) {
+      m_sessions.push_back(m_routes[i].second);
+    }
+    send(*carrier, routeFrame(m_sessions.data(), m_sessions.size(), outgoing.forPeer(carrier->protocol, carrier->compression)));
+    Metrics::add(COUNTER_MUX_ROUTES);
+  }
+  m_routes.clear();
+}
+
+/* Режим обработки соединений */
+// --------------------------------------------------------------------------------------------------------------------
+enum class ServerMode {
+  THREADS,  // one blocking thread per connection
+  EPOLL,    // edge-triggered event loops on non-blocking sockets, one per worker
+  URING     // the same event loops driven by io_uring completions, epoll if the kernel lacks io_uring
+};
+
+enum UringOp : uint8_t {
+  URING_OP_ACCEPT,
+  URING_OP_ACCEPT_UNIX,
+  URING_OP_ACCEPT_SHM,
+  URING_OP_WAKEUP,
+  URING_OP_TIMER,
+  URING_OP_RECV,
+  URING_OP_SEND,
+  URING_OP_CANCEL,
+  URING_OP_CANCEL_RECV,  // of a peer over its rate limit or behind with its frames
+  URING_OP_CHANNEL,  // poll of a shared memory channel's event
+  URING_OP_HANGUP    // ... and of its socket
+};
+
+struct ServerConfig {
+  int port;
+  ServerMode mode;
+  int workers;  // number of reactors in epoll and uring modes
+  OutboundConfig outbound;
+  std::string admin_path;  // unix socket that answers with the stats, empty - none
+  HistoryConfig history;
+  ResumeConfig resume;
+  FederationConfig federation;
+  std::string handoff_path;  // unix socket of restarts without reconnects, empty - none
+  std::string unix_path;  // unix socket local clients may connect to instead of the port, empty - none
+  std::string shm_path;   // ... and the one that sets up a shared memory channel for each of them
+  size_t shm_ring;        // bytes of each direction of a channel
+  RateLimitConfig limit;  // of every peer, the admin may change it for one of them
+  std::string capture_path;  // frames received are recorded there, empty - not recorded
+  bool compression;  // peers may ask for deflated frames
+  size_t max_sessions;  // logical sessions one connection may have open
 
-  Peer(int id, int socket): id(id), socket(socket) {}
+  ServerConfig()
+    : port(80), mode(ServerMode::THREADS), workers(1), shm_ring(SHM_DEFAULT_RING_SIZE), compression(false), max_sessions(1024) {}
 };
 
-static int lastId = 0;
+class Server;
+
+/* Объявление класса Реактора: цикл epoll или io_uring со своим слушающим сокетом и своими клиентами */
+// --------------------------------------------------------------------------------------------------------------------
+class Reactor {
+public:
+  Reactor(Server& server, int index, int listen_socket, bool use_uring);
+  ~Reactor();
+
+  void run();
+  void wakeup();
+
+  void deliver(const Outgoing& outgoing);  // to local peers, this reactor's thread only
+  void post(const Outgoing& outgoing);  // from other reactors' threads
+  void enqueue(Peer& peer, const BufferRef& frame);
+  void markClosing(Peer& peer);  // closed at the end of the current loop iteration
+  bool watch(Peer& peer);  // starts reading the peer's socket
+  void serveTurn(Peer& peer);  // handles up to REACTOR_TURN_FRAMES of its frames
+  void handOver(HandoffState* state);  // the loop has stopped: its peers and listening socket go to state
+  void resume();  // the handoff has failed: the loop is to run again over the peers it kept
+  PeerChannels& channels() { return m_channels; }  // this reactor's thread only
+  PeerRegistry& peers() { return m_peers; }  // changed by this reactor's thread only
+
+private:
+  Server& m_server;
+  int m_index;
+  int m_socket;
+  int m_epoll;
+  int m_wakeup;  // eventfd: inbox is not empty or server is stopping
+  int m_timer;   // timerfd: the earliest batch of a dirty peer is due
+  int64_t m_timer_deadline;  // when m_timer fires, 0 - disarmed
+  std::unique_ptr<Uring> m_uring;  // nullptr - epoll backend
+  PeerRegistry m_peers;  // this reactor's thread only
+  PeerChannels m_channels;  // subscriptions of this reactor's peers, this reactor's thread only
+  std::vector<Peer*> m_dirty;    // peers to flush at the end of the loop iteration
+  std::vector<Peer*> m_closing;  // peers to close at the end of the loop iteration
+  std::vector<Peer*> m_ready;    // peers to give another turn, round-robin, one per loop iteration
+  std::vector<Peer*> m_serving;  // ... swapped with m_ready for the turns of the current one
+  std::vector<Peer*> m_limited;  // peers not read until their tokens refill
+  Routes m_routes;  // of the fan-out in progress
+  bool m_is_cancelled;  // uring mode, handoff: the operations in flight were cancelled and have completed
+
+  std::mutex m_inbox_mutex;
+  std::vector<Outgoing> m_inbox;  // guarded by m_inbox_mutex
+  std::vector<Outgoing> m_inbox_drained;  // swapped with m_inbox, this reactor's thread only
+
+  void runEpoll();
+  void acceptPeers(int listen_socket, bool is_shm);
+  Peer* addPeer(int socket, bool is_shm);  // nullptr - its channel could not be set up
+  void schedule(Peer& peer);  // gets a turn at the end of the loop iteration
+  void serveReady();
+  void holdBack(Peer& peer);  // out of tokens
+  void stopReceiving(Peer& peer);
+  void releaseLimited();  // whose tokens have refilled
+  void flushPeer(Peer& peer);
+  void flushDirty();
+  void armTimer(int64_t deadline);
+  void closeMarked();
+  void drainInbox();
+
+  void armUring();  // multishot accepts and the polls of the wakeup and the timer
+  void runUring();
+  void onUringCompletion(const io_uring_cqe& cqe);
+  void onUringRecv(Peer& peer, const io_uring_cqe& cqe);
+  void onUringSend(Peer& peer, const io_uring_cqe& cqe);
+  void onUringChannel(Peer& peer, const io_uring_cqe& cqe);
+  void submitSend(Peer& peer);
+};
 
 /* Объявление класса Сервера */
 // --------------------------------------------------------------------------------------------------------------------
 class Server {
+  friend class Reactor;
+
+  struct Session {  // of a disconnected binary peer, kept for resume.window_s
+    std::vector<std::string> channels;
+    std::vector<uint64_t> joined;  // by channels, the first message each one was joined for
+    uint64_t first_sequence;  // the peer's: no client can ask for anything before it
+    uint64_t next_sequence;  // the first message it has missed, unless its client knows better
+    int64_t deadline;  // steady clock, ns
+    std::string token;  // the peer's resume_token
+  };
+
 public:
-  Server(int port_number);
+  Server(const ServerConfig& config);
   ~Server();
 
   void run();
   void stop();
 
 private:
-  bool m_is_stopped;
-  int m_socket;
-  std::vector<Peer> m_peers;
+  ServerConfig m_config;
+  std::atomic<bool> m_is_stopped;
+  std::vector<int> m_sockets;  // listening, one per reactor; threads mode accepts on all of them
+  int m_unix_socket;  // local listening ones, -1 - none; every reactor accepts on them
+  int m_shm_socket;
+  OutboundStats m_outbound_stats;
+  UringStats m_uring_stats;
+  std::atomic<int> m_last_id;
+  PeerRegistry m_peers;  // threads mode
+  PeerChannels m_channels;  // threads mode, guarded by m_channels_lock
+  mutable pthread_rwlock_t m_channels_lock;
+  std::vector<std::unique_ptr<Reactor>> m_reactors;
+  std::unique_ptr<HistoryLog> m_history;  // nullptr - messages are not stored
+  ResumeRing m_resume;  // sequence numbers and the recent messages
+  std::unique_ptr<Federation> m_federation;  // nullptr - a single server
+  std::unique_ptr<CaptureWriter> m_capture;  // nullptr - traffic is not recorded
+  mutable std::mutex m_sessions_mutex;
+  std::unordered_map<int, Session> m_sessions;  // by peer id, guarded by m_sessions_mutex
+  std::deque<std::pair<int64_t, int>> m_session_deadlines;  // ... and their expiry, oldest first
+  std::mutex m_batches_mutex;
+  std::condition_variable m_batches_ready;
+  std::vector<std::pair<int64_t, size_t>> m_batches;  // threads mode: deadlines and slots of peers' batches, oldest first
+  size_t m_batches_head;  // ... from here on; consumed ones are dropped in bulk, so the vector keeps its capacity
+  std::thread m_batch_thread;
+  int m_admin_socket;
+  std::thread m_admin_thread;
+  std::mutex m_threads_mutex;
+  std::condition_variable m_threads_done;
+  int m_threads;  // threads mode: peers' threads still running, guarded by m_threads_mutex
+  std::unique_ptr<HandoffState> m_taken_over;  // from the process this one replaced, until its peers are adopted
+  std::atomic<bool> m_is_handing_off;
+  int m_handoff_socket;     // the next process connects here
+  int m_successor;          // ... and is handed the state over this one
+  std::thread m_handoff_thread;
 
-  Message getMessage(int socket, bool* is_closed);
-  void sendMessage(const Message& message);
-  void sendHello(int socket);
+  ssize_t receive(Peer& peer);  // into the peer's decoder
+  bool handleReceived(Peer& peer, size_t* budget);  // up to budget frames buffered in the decoder, false on a broken stream
+  void handleFrame(Peer& peer, const Frame& frame);
+  void handleSessionFrame(Peer& peer, const Frame& frame, uint32_t number);  // OPEN, CLOSE or a frame of its session
+  void openSession(Peer& peer, uint32_t number);
+  void closeSession(Peer& session);  // its carrier's receiving thread
+  void closeSessions(Peer& peer);  // the carrier is gone
+  void sendMessage(const MessageView& message, bool is_relayed = false);
+  void subscribe(Peer& peer, Slice channel, bool is_join, uint64_t since);
+  void startReplay(Peer& peer, uint8_t tag, uint32_t value);
+  void pumpReplay(Peer& peer);  // as much history or missed messages as the peer's queue takes
+  void pumpResume(Peer& peer);
+  void parkSession(Peer& peer);  // peer's own thread or reactor
+  bool resumeSession(Peer& peer, int id, uint64_t last_sequence, Slice token);
+  void expireSessions(int64_t now);  // under m_sessions_mutex
+  size_t queuedBytes(Peer& peer);
+  ShmChannel* openChannel(int socket);  // for a client of m_shm_socket, nullptr on failure
+  void finishChannel(Peer& peer);  // its client is gone: what it has written is still handled
+  void sendHello(Peer& peer);
+  int nextId() { return m_last_id.fetch_add(1, std::memory_order_relaxed); }
+  void sendTo(Peer& peer, const BufferRef& frame);
+  OutboundQueue::Status flushLocked(Peer& peer);  // threads mode, under peer's mutex
+  void scheduleBatch(Peer& peer);  // threads mode, under peer's mutex
+  void flushBatches();  // other thread
 
-  void handleRequest(int socket);  // other thread
+  void handleRequest(Peer* peer);  // other thread
+  void startThread(Peer* peer);
+
+  void runThreads();
+  void createReactors();
+  void runReactors();
+  std::string stats() const;
+  void printStats() const;
+  void serveAdmin();  // other thread
+  std::string limitPeer(const std::string& request);  // "limit <peer id> <rate> [burst]", the admin's thread
+  void serveHandoff();  // other thread
+  bool handOver(HandoffState* state);  // the loops have stopped, false - the next process has not taken over
+  void resume();  // ... and then this one serves on
+  bool savePeer(Peer& peer, HandoffState* state);
+  Peer* adoptPeer(HandoffPeer& state, Reactor* reactor);  // registered, not yet read
+  void restore(const HandoffState& state);
+  void serialize(const MessageView& message, Outgoing* outgoing);
+  void broadcast(Reactor& origin, const MessageView& message);  // origin reactor's thread
+  void archive(const MessageView& message, const Outgoing& outgoing);
+  void relay(const MessageView& message);  // from another node, its link's thread
 };
 
 struct ServerException {};
 
 /* Реализация всех функций-членов класса Сервера */
 // --------------------------------------------------------------------------------------------------------------------
-Server::Server(int port_number)
-  : m_is_stopped(false) {
+static int openListenSocket(int port_number, bool reuse_port) {
   std::string port = std::to_string(port_number);
 
   // prepare address structure
@@ -70,15 +475,21 @@ Server::Server(int port_number)
   }
 
   // get a socket
-  m_socket = socket(server_info->ai_family, server_info->ai_socktype, server_info->ai_protocol);
+  int listen_socket = socket(server_info->ai_family, server_info->ai_socktype, server_info->ai_protocol);
 
-  if (m_socket < 0) {
+  if (listen_socket < 0) {
     ERR("Failed to open socket");
     throw ServerException();
   }
 
+  // several sockets on the same port, kernel balances incoming connections between them
+  if (reuse_port) {
+    int enable = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+  }
+
   // bind socket with address structure
-  if (bind(m_socket, server_info->ai_addr, server_info->ai_addrlen) < 0) {
+  if (bind(listen_socket, server_info->ai_addr, server_info->ai_addrlen) < 0) {
     ERR("Failed to bind socket to the address");
     throw ServerException();
   }
@@ -87,120 +498,2365 @@ Server::Server(int port_number)
 
   // when the socket of a type that promises reliable delivery still has untransmitted messages when it is closed
   linger linger_opt = { 1, 0 };  // timeout 0 seconds - close socket immediately
-  setsockopt(m_socket, SOL_SOCKET, SO_LINGER, &linger_opt, sizeof(linger_opt));
+  setsockopt(listen_socket, SOL_SOCKET, SO_LINGER, &linger_opt, sizeof(linger_opt));
 
   // listen for incoming connections
-  listen(m_socket, 20);
+  listen(listen_socket, SOMAXCONN);
+  return listen_socket;
+}
+
+static bool setNonBlocking(int socket, bool is_non_blocking = true) {
+  int flags = fcntl(socket, F_GETFL, 0);
+  return flags >= 0 && fcntl(socket, F_SETFL, is_non_blocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == 0;
+}
+
+// eventfd and timerfd: a non-blocking one that has nothing to read or no room is not an error
+static void readEvent(int fd) {
+  uint64_t value = 0;
+  if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    ERR("Failed to read event %i: %s", fd, strerror(errno));
+  }
+}
+
+static void signalEvent(int fd) {
+  uint64_t value = 1;
+  if (write(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    ERR("Failed to signal event %i: %s", fd, strerror(errno));
+  }
+}
+
+// latency mode: small frames go out now rather than wait for the ACK of the previous ones
+static void setDelivery(int socket, const OutboundConfig& config) {
+  if (!config.isBatching()) {
+    int enable = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  }
+}
+
+// and was when the message was numbered
+static bool isSubscribed(const Peer& peer, Slice channel, uint64_t sequence) {
+  SliceEqual equal;
+  for (auto& it : peer.subscriptions) {
+    if (equal(Slice(it.channel->name), channel)) {
+      return sequence >= it.since;
+    }
+  }
+  return false;
+}
+
+// admin and local clients' sockets
+static int openUnixSocket(const std::string& path, int backlog) {
+  sockaddr_un address;
+  if (!localAddress(path, &address)) {
+    throw ServerException();
+  }
+  int listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(path.c_str());  // left by a previous run
+  if (listen_socket < 0 || bind(listen_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+      listen(listen_socket, backlog) < 0) {
+    ERR("Failed to open unix socket %s: %s", path.c_str(), strerror(errno));
+    throw ServerException();
+  }
+  return listen_socket;
+}
+
+// path of a listening socket taken over, empty - a TCP one
+static std::string unixPath(int socket) {
+  sockaddr_un address;
+  socklen_t size = sizeof(address);
+  memset(&address, 0, sizeof(address));
+  if (getsockname(socket, reinterpret_cast<sockaddr*>(&address), &size) < 0 || address.sun_family != AF_UNIX) {
+    return std::string();
+  }
+  return std::string(address.sun_path);
+}
+
+Server::Server(const ServerConfig& config)
+  : m_config(config), m_is_stopped(false), m_unix_socket(-1), m_shm_socket(-1), m_last_id(0), m_resume(config.resume.messages), m_batches_head(0), m_admin_socket(-1),
+    m_threads(0), m_is_handing_off(false), m_handoff_socket(-1), m_successor(-1) {
+  pthread_rwlock_init(&m_channels_lock, nullptr);
+  if (m_config.workers < 1) {
+    m_config.workers = 1;
+  }
+  if (m_config.mode == ServerMode::URING && !Uring::isSupported()) {
+    ERR("io_uring with multishot receive is not available: %s, falling back to epoll", strerror(errno));
+    m_config.mode = ServerMode::EPOLL;
+  }
+  if (m_config.mode != ServerMode::THREADS && m_config.outbound.policy == OverflowPolicy::BLOCK) {
+    // a reactor waiting for one slow peer would stall all the others it serves
+    WRN("--overflow=block is not supported by event loops, slow consumers are disconnected instead");
+    m_config.outbound.policy = OverflowPolicy::DISCONNECT;
+  }
+
+  // a server that runs with the same handoff socket passes its sockets and steps down
+  int predecessor = m_config.handoff_path.empty() ? -1 : connectHandoff(m_config.handoff_path);
+  if (predecessor >= 0 && !handoffIsTrusted(predecessor)) {
+    close(predecessor);
+    throw ServerException();
+  }
+  if (predecessor >= 0) {
+    m_taken_over.reset(new HandoffState());
+    bool is_received = receiveHandoff(predecessor, m_taken_over.get());
+    if (!is_received) {
+      close(predecessor);
+      ERR("Failed to take over from the server at %s", m_config.handoff_path.c_str());
+      for (int it : m_taken_over->listen_sockets) {
+        close(it);
+      }
+      for (auto& it : m_taken_over->peers) {
+        close(it.socket);
+      }
+      throw ServerException();
+    }
+    for (int it : m_taken_over->listen_sockets) {
+      setNonBlocking(it, false);  // as if opened here, the epoll reactors make them non-blocking again
+      std::string path = unixPath(it);
+      if (path.empty()) {
+        m_sockets.push_back(it);
+      } else if (path == m_config.unix_path && m_unix_socket < 0) {
+        m_unix_socket = it;
+      } else if (path == m_config.shm_path && m_shm_socket < 0) {
+        m_shm_socket = it;
+      } else {
+        close(it);  // local clients are not served here any longer
+      }
+    }
+    INF("Took over %zu listening sockets, %zu peers and %zu sessions", m_sockets.size(), m_taken_over->peers.size(),
+        m_taken_over->sessions.size());
+  }
+  try {
+    if (m_sockets.empty()) {
+      m_sockets.push_back(openListenSocket(m_config.port, m_config.mode != ServerMode::THREADS && m_config.workers > 1));
+    }
+    if (!m_config.unix_path.empty() && m_unix_socket < 0) {
+      m_unix_socket = openUnixSocket(m_config.unix_path, SOMAXCONN);
+    }
+    if (!m_config.shm_path.empty() && m_shm_socket < 0) {
+      m_shm_socket = openUnixSocket(m_config.shm_path, SOMAXCONN);
+    }
+    if (m_config.mode == ServerMode::EPOLL) {  // shared by the reactors: whichever is woken may find the backlog taken
+      for (int it : { m_unix_socket, m_shm_socket }) {
+        if (it >= 0) {
+          setNonBlocking(it);
+        }
+      }
+    }
+    if (!m_config.history.directory.empty()) {
+      try {
+        m_history.reset(new HistoryLog(m_config.history));
+      } catch (const HistoryException&) {
+        throw ServerException();
+      }
+    }
+    if (!m_config.capture_path.empty()) {
+      try {
+        m_capture.reset(new CaptureWriter(m_config.capture_path));
+      } catch (const CaptureException&) {
+        throw ServerException();
+      }
+    }
+    if (m_config.federation.isEnabled()) {
+      try {
+        m_federation.reset(new Federation(m_config.federation, [this](const MessageView& message) { relay(message); }));
+      } catch (const FederationException&) {
+        throw ServerException();
+      }
+      m_last_id = m_federation->firstId();
+    }
+    if (m_taken_over) {
+      restore(*m_taken_over);
+    }
+    if (!m_config.admin_path.empty()) {
+      m_admin_socket = openUnixSocket(m_config.admin_path, 8);
+    }
+    if (!m_config.handoff_path.empty() && (m_handoff_socket = listenHandoff(m_config.handoff_path)) < 0) {
+      throw ServerException();
+    }
+  } catch (const ServerException&) {
+    if (predecessor >= 0) {
+      close(predecessor);  // unconfirmed: the previous process serves its peers on
+    }
+    throw;
+  }
+  if (predecessor >= 0) {  // only now: anything above may fail, and then nobody would serve them
+    bool is_confirmed = confirmHandoff(predecessor);
+    close(predecessor);
+    if (!is_confirmed) {
+      ERR("The server at %s has not waited for the handoff to finish", m_config.handoff_path.c_str());
+      throw ServerException();
+    }
+  }
 }
 
 Server::~Server() {
   if (!m_is_stopped) {
     stop();
   }
+  for (int it : m_sockets) {
+    close(it);
+  }
+  bool is_replaced = m_successor >= 0;  // the paths belong to the new process now
+  if (m_unix_socket >= 0) {
+    close(m_unix_socket);
+    if (!is_replaced) {
+      unlink(m_config.unix_path.c_str());
+    }
+  }
+  if (m_shm_socket >= 0) {
+    close(m_shm_socket);
+    if (!is_replaced) {
+      unlink(m_config.shm_path.c_str());
+    }
+  }
+  if (m_admin_socket >= 0) {
+    close(m_admin_socket);
+    if (!is_replaced) {
+      unlink(m_config.admin_path.c_str());
+    }
+  }
+  if (m_handoff_socket >= 0) {
+    close(m_handoff_socket);
+    if (!is_replaced) {
+      unlink(m_config.handoff_path.c_str());
+    }
+  }
+  if (m_successor >= 0) {
+    close(m_successor);
+  }
+  pthread_rwlock_destroy(&m_channels_lock);
 }
 
 // ----------------------------------------------
 void Server::run() {
+  if (m_config.mode != ServerMode::THREADS) {
+    createReactors();  // before the other threads, they look the reactors up
+  }
+  while (true) {  // once more after a handoff that has failed
+    if (m_admin_socket >= 0) {
+      m_admin_thread = std::thread(&Server::serveAdmin, this);
+    }
+    if (m_handoff_socket >= 0) {
+      m_handoff_thread = std::thread(&Server::serveHandoff, this);
+    }
+    switch (m_config.mode) {
+      case ServerMode::THREADS:
+        if (m_config.outbound.isBatching()) {
+          m_batch_thread = std::thread(&Server::flushBatches, this);
+        }
+        if (m_federation) {
+          m_federation->start();
+        }
+        runThreads();
+        if (m_federation) {
+          m_federation->stop();
+        }
+        if (m_batch_thread.joinable()) {
+          m_batch_thread.join();
+        }
+        break;
+      case ServerMode::EPOLL:
+      case ServerMode::URING:
+        runReactors();
+        break;
+    }
+    if (m_admin_thread.joinable()) {
+      m_admin_thread.join();
+    }
+    if (m_handoff_thread.joinable()) {
+      m_handoff_thread.join();
+    }
+    if (!m_is_handing_off) {
+      break;
+    }
+    HandoffState state;
+    for (auto& it : m_reactors) {
+      it->handOver(&state);
+    }
+    if (handOver(&state)) {
+      break;
+    }
+    resume();
+  }
+  m_reactors.clear();  // after the admin thread, it looks their peers up
+  printStats();
+}
+
+void Server::runThreads() {
+  std::vector<Peer*> adopted;
+  if (m_taken_over) {
+    for (auto& it : m_taken_over->peers) {
+      adopted.push_back(adoptPeer(it, nullptr));
+    }
+    m_taken_over.reset();
+  }
+  for (Peer* peer : adopted) {  // whatever they sent while the previous process was stopping
+    size_t budget = SIZE_MAX;
+    if (!handleReceived(*peer, &budget)) {
+      shutdown(peer->socket, SHUT_RDWR);
+    }
+    startThread(peer);
+  }
+
+  std::vector<pollfd> listeners;
+  for (int it : m_sockets) {
+    listeners.push_back({ it, POLLIN, 0 });
+  }
+  for (int it : { m_unix_socket, m_shm_socket }) {
+    if (it >= 0) {
+      listeners.push_back({ it, POLLIN, 0 });
+    }
+  }
   while (!m_is_stopped) {  // server loop
-    sockaddr_in peer_address_structure;
-    socklen_t peer_address_structure_size = sizeof(peer_address_structure);
+    // wait for pending connections; not in accept(): a handoff must not shut the listening socket down
+    if (poll(listeners.data(), listeners.size(), THREADS_FLUSH_INTERVAL_MS) <= 0) {
+      continue;
+    }
+    for (auto& it : listeners) {
+      if (!(it.revents & POLLIN)) {
+        continue;
+      }
+      sockaddr_storage peer_address_structure;
+      socklen_t peer_address_structure_size = sizeof(peer_address_structure);
 
-    // accept one pending connection, waits until a new connection comes
-    int peer_socket = accept(m_socket, reinterpret_cast<sockaddr*>(&peer_address_structure), &peer_address_structure_size);
-    if (peer_socket < 0) {
-      ERR("Failed to open new socket for data transfer");
-      continue;  // skip failed connection
+      // accept one pending connection
+      int peer_socket = accept(it.fd, reinterpret_cast<sockaddr*>(&peer_address_structure), &peer_address_structure_size);
+      if (peer_socket < 0) {
+        if (!m_is_stopped) {
+          ERR("Failed to open new socket for data transfer");
+        }
+        continue;  // skip failed connection
+      }
+      ShmChannel* channel = nullptr;
+      if (it.fd == m_shm_socket && (channel = openChannel(peer_socket)) == nullptr) {
+        close(peer_socket);
+        continue;
+      }
+
+      Metrics::add(COUNTER_ACCEPTED);
+      setDelivery(peer_socket, m_config.outbound);
+      int id = nextId();
+      Peer* peer = new Peer(id, peer_socket, m_config.outbound, &m_outbound_stats);
+      peer->channel.reset(channel);
+      peer->outbound.setChannel(channel);
+      peer->limit.setLimit(m_config.limit.rate, m_config.limit.burst);
+      peer->slot = m_peers.add(peer, id);
+      peer->accepted_sequence = peer->first_sequence = m_resume.next();
+      if (m_capture) {
+        m_capture->record(CAPTURE_OPEN, id);
+      }
+      sendHello(*peer);
+
+      // get incoming message
+      startThread(peer);
     }
+  }
+
+  // peers' threads use the registry, the channels and this object until they return
+  std::unique_lock<std::mutex> lock(m_threads_mutex);
+  m_threads_done.wait(lock, [this]() { return m_threads == 0; });
+}
 
-    m_peers.emplace_back(lastId, peer_socket);
-    sendHello(peer_socket);
-    ++lastId;
+void Server::createReactors() {
+  // reactors take over the listening sockets there are, extra ones open their own on the same port
+  int workers = std::max(m_config.workers, static_cast<int>(m_sockets.size()));
+  for (int i = 0; i < workers; ++i) {
+    int listen_socket = i < static_cast<int>(m_sockets.size()) ? m_sockets[i] : openListenSocket(m_config.port, true);
+    m_reactors.emplace_back(new Reactor(*this, i, listen_socket, m_config.mode == ServerMode::URING));
+  }
+  m_sockets.clear();  // owned by the reactors now
 
-    // get incoming message
-    std::thread t(&Server::handleRequest, this, peer_socket);
-    t.detach();
+  if (m_taken_over) {  // spread over the reactors, their loops don't run yet
+    std::vector<Peer*> adopted;
+    for (size_t i = 0; i < m_taken_over->peers.size(); ++i) {
+      Reactor& reactor = *m_reactors[i % m_reactors.size()];
+      Peer* peer = adoptPeer(m_taken_over->peers[i], &reactor);
+      if (reactor.watch(*peer)) {
+        adopted.push_back(peer);
+      }
+    }
+    m_taken_over.reset();
+    for (Peer* peer : adopted) {  // whatever they sent while the previous process was stopping
+      peer->reactor->serveTurn(*peer);
+    }
+    for (auto& it : m_reactors) {
+      it->wakeup();  // the first iteration flushes what was queued meanwhile
+    }
   }
 }
 
-// ----------------------------------------------
-void Server::stop() {
-  m_is_stopped = true;
-  close(m_socket);
+void Server::runReactors() {
+  if (m_federation) {
+    m_federation->start();  // relays messages of other nodes to m_reactors
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < m_reactors.size(); ++i) {
+    threads.emplace_back(&Reactor::run, m_reactors[i].get());
+  }
+  m_reactors[0]->run();  // on the calling thread
+  for (auto& it : threads) {
+    it.join();
+  }
+  if (m_federation) {
+    m_federation->stop();
+  }
 }
 
-// ----------------------------------------------
-Message Server::getMessage(int socket, bool* is_closed) {
-  char buffer[MESSAGE_SIZE];
-  memset(buffer, 0, MESSAGE_SIZE);
-  int read_bytes = recv(socket, buffer, MESSAGE_SIZE, 0);
-  if (read_bytes <= 0) {
-    if (read_bytes == -1) {
-      ERR("get request error: %s", strerror(errno));
+std::string Server::stats() const {
+  std::string out = Metrics::instance().format();
+  char line[512];
+  if (m_config.outbound.isBatching()) {
+    snprintf(line, sizeof(line), "Delivery: throughput, batches of up to %i us or %zu bytes\n",
+             m_config.outbound.batch_delay_us, m_config.outbound.batch_bytes);
+  } else {
+    snprintf(line, sizeof(line), "Delivery: latency\n");
+  }
+  out += line;
+  if (m_config.resume.isEnabled()) {
+    size_t sessions = 0;
+    {
+      std::lock_guard<std::mutex> lock(m_sessions_mutex);
+      sessions = m_sessions.size();
     }
-    DBG("Connection closed");
-    *is_closed = true;
-    return Message::EMPTY;
+    snprintf(line, sizeof(line), "Resume: last %zu messages, %zu sessions kept for up to %i s\n",
+             m_config.resume.messages, sessions, m_config.resume.window_s);
+    out += line;
   }
-  try {
-    DBG("Raw request[%i bytes]: %.*s", read_bytes, (int) read_bytes, buffer);
-    return Message::parse(buffer);
-  } catch (ParseException exception) {
-    FAT("ParseException on raw request[%i bytes]: %.*s", read_bytes, (int) read_bytes, buffer);
-    return Message::EMPTY;
+  if (m_config.limit.isEnabled()) {
+    snprintf(line, sizeof(line), "Rate limit: %u frames/s per peer, bursts of up to %u, frames over it are %s\n",
+             m_config.limit.rate, m_config.limit.burst != 0 ? m_config.limit.burst : m_config.limit.rate,
+             m_config.limit.policy == LimitPolicy::DELAY ? "delayed" : "rejected");
+    out += line;
   }
+  snprintf(line, sizeof(line), "Outbound: throttled peers %li (%li times), dropped messages %li, disconnected slow peers %li, "
+           "blocked sends %li, %li messages in %li writes\n",
+           m_outbound_stats.throttled_peers.load(), m_outbound_stats.throttle_events.load(),
+           m_outbound_stats.dropped_messages.load(), m_outbound_stats.disconnected_peers.load(),
+           m_outbound_stats.blocked_sends.load(), m_outbound_stats.written_messages.load(),
+           m_outbound_stats.writes.load());
+  out += line;
+  snprintf(line, sizeof(line), "Buffers: %li allocated, %li reused\n", BufferPool::instance().heapAllocations(),
+           BufferPool::instance().reused());
+  out += line;
+  if (m_federation) {
+    out += m_federation->stats();
+  }
+  if (m_capture) {
+    snprintf(line, sizeof(line), "Capture: %llu records to %s, %llu dropped\n",
+             (unsigned long long) m_capture->records(), m_config.capture_path.c_str(),
+             (unsigned long long) m_capture->dropped());
+    out += line;
+  }
+  if (m_config.mode == ServerMode::URING) {
+    snprintf(line, sizeof(line), "io_uring: %li operations submitted and %li completed in %li enters, "
+             "%li receive buffer shortages\n", m_uring_stats.submissions.load(), m_uring_stats.completions.load(),
+             m_uring_stats.enters.load(), m_uring_stats.buffer_shortages.load());
+    out += line;
+  }
+  return out;
 }
 
-void Server::sendMessage(const Message& message) {
-  size_t size = message.size() + 1;
-  char* raw = new char[size];
-  memset(raw, 0, size);
-  message.raw(raw);
+void Server::printStats() const {
+  printf("%s", stats().c_str());
+}
 
-  for (auto& it : m_peers) {
-    if (it.id != message.id) {
-      send(it.socket, raw, size, 0);
+// a line from an admin client, empty if it sends none in ADMIN_REQUEST_WAIT_MS
+static std::string readAdminRequest(int client) {
+  std::string request;
+  int64_t deadline = Metrics::now() + ADMIN_REQUEST_WAIT_MS * 1000000LL;
+  while (request.size() < 256 && request.find('\n') == std::string::npos) {
+    int64_t wait = deadline - Metrics::now();
+    pollfd descriptor = { client, POLLIN, 0 };
+    if (wait <= 0 || poll(&descriptor, 1, wait / 1000000 + 1) <= 0) {
+      break;
     }
+    char buffer[256];
+    ssize_t read_bytes = recv(client, buffer, sizeof(buffer), 0);
+    if (read_bytes <= 0) {
+      break;
+    }
+    request.append(buffer, read_bytes);
   }
+  return request;
+}
 
-  delete [] raw;  raw = nullptr;
+// one connection - one request; nothing is a snapshot of the stats, e.g. socat - UNIX-CONNECT:<path> </dev/null
+void Server::serveAdmin() {
+  while (!m_is_stopped) {
+    int client = accept(m_admin_socket, nullptr, nullptr);
+    if (client < 0) {
+      if (!m_is_stopped && errno != EINTR) {
+        ERR("Failed to accept admin connection: %s", strerror(errno));
+      }
+      continue;
+    }
+    std::string request = readAdminRequest(client);
+    std::string text = request.compare(0, 6, "limit ") == 0 ? limitPeer(request) : stats();
+    send(client, text.data(), text.size(), MSG_NOSIGNAL);
+    close(client);
+  }
 }
 
-void Server::sendHello(int socket) {
-  std::string id_str = std::to_string(lastId);
-  send(socket, id_str.c_str(), id_str.length(), 0);
+// for this connection only, 0 lifts the limit; the frame it is waiting with has been measured against the old one
+std::string Server::limitPeer(const std::string& request) {
+  int id = 0;
+  unsigned rate = 0;
+  unsigned burst = 0;
+  if (sscanf(request.c_str(), "limit %i %u %u", &id, &rate, &burst) < 2) {
+    return "Usage: limit <peer id> <frames per second, 0 - none> [burst]\n";
+  }
+  bool is_found = false;
+  auto apply = [&](int peer_id, Peer& peer) {
+    if (peer_id == id) {
+      (peer.carrier != nullptr ? *peer.carrier : peer).limit.setLimit(rate, burst);  // a session's frames come over its carrier
+      is_found = true;
+    }
+  };
+  if (m_reactors.empty()) {
+    m_peers.forEach(apply);
+  } else {
+    for (auto& it : m_reactors) {
+      it->peers().forEach(apply);
+    }
+  }
+  if (!is_found) {
+    return "No peer " + std::to_string(id) + "\n";
+  }
+  INF("Rate limit of peer %i set to %u frames/s, bursts of %u", id, rate, burst != 0 ? burst : rate);
+  return "OK\n";
 }
 
-// ----------------------------------------------
-void Server::handleRequest(int socket) {
+// the next process connects when it starts: this one stops serving and passes it everything
+void Server::serveHandoff() {
   while (!m_is_stopped) {
-    // peers' messages
-    bool is_closed = false;
-    Message message = getMessage(socket, &is_closed);
-    if (is_closed) {
-      DBG("Stopping peer thread...");
-      close(socket);
-      return;
+    int successor = accept4(m_handoff_socket, nullptr, nullptr, SOCK_CLOEXEC);
+    if (successor < 0) {
+      if (!m_is_stopped && errno != EINTR) {
+        ERR("Failed to accept handoff connection: %s", strerror(errno));
+      }
+      continue;
     }
-
-    if (message == Message::EMPTY) {
-      // ignore empty message
+    if (!handoffIsTrusted(successor)) {
+      close(successor);
       continue;
     }
+    INF("Handing over to the next process");
+    m_successor = successor;
+    m_is_handing_off = true;
+    stop();
+  }
+}
 
-    std::cout << message << std::endl;
-    sendMessage(message);
+bool Server::handOver(HandoffState* state) {
+  if (m_reactors.empty()) {  // threads mode, reactors have added theirs
+    state->listen_sockets = m_sockets;
+    m_peers.forEach([&](int /* id */, Peer& peer) {
+      if (peer.carrier == nullptr && !savePeer(peer, state)) {
+        parkSession(peer);  // closed with this process, its client comes back for the session
+      }
+    });
+  }
+  for (int it : { m_unix_socket, m_shm_socket }) {
+    if (it >= 0) {
+      state->listen_sockets.push_back(it);  // told apart from the port's by their paths
+    }
+  }
+  state->last_id = m_last_id;
+  state->next_sequence = m_resume.next();
+  {
+    std::lock_guard<std::mutex> lock(m_sessions_mutex);
+    expireSessions(Metrics::now());
+    for (auto& it : m_sessions) {
+      HandoffSession session;
+      session.id = it.first;
+      session.first_sequence = it.second.first_sequence;
+      session.next_sequence = it.second.next_sequence;
+      session.deadline = it.second.deadline;
+      session.token = it.second.token;
+      session.channels = it.second.channels;
+      session.joined = it.second.joined;
+      state->sessions.push_back(std::move(session));
+    }
+  }
+  ResumeRing::Entry batch[RESUME_READ_BATCH];
+  for (uint64_t from = 1; from < state->next_sequence; ) {
+    size_t count = m_resume.read(&from, state->next_sequence, batch, RESUME_READ_BATCH);
+    for (size_t i = 0; i < count; ++i) {
+      HandoffMessage message;
+      message.sequence = batch[i].sequence;
+      message.sender_id = batch[i].sender_id;
+      message.channel_size = batch[i].channel.size;
+      message.frame.assign(batch[i].frame.data(), batch[i].frame.size());
+      state->recent.push_back(std::move(message));
+    }
+  }
+
+  if (!sendHandoff(m_successor, *state)) {
+    ERR("Failed to hand over to the next process, serving on");
+    return false;
   }
+  Metrics::add(COUNTER_PEERS_HANDED_OVER, state->peers.size());
+  INF("Handed over %zu peers, %zu sessions and %zu recent messages", state->peers.size(), state->sessions.size(),
+      state->recent.size());
+  return true;
 }
 
-/* Точка входа в программу */
-// --------------------------------------------------------------------------------------------------------------------
-int main(int argc, char** argv) {
-  int port = 80;
-  if (argc > 1) {
-    port = std::atoi(argv[1]);
+// nothing of the peers was given away but copies: their sockets, queues and decoders are as they were
+void Server::resume() {
+  close(m_successor);
+  m_successor = -1;
+  m_is_handing_off = false;
+  m_is_stopped = false;
+
+  // stop() has shut these down, and the next process may have bound their paths before it failed
+  if (m_admin_socket >= 0) {
+    close(m_admin_socket);
+    m_admin_socket = -1;
+    try {
+      m_admin_socket = openUnixSocket(m_config.admin_path, 8);
+    } catch (const ServerException&) {
+      ERR("No admin socket any longer");
+    }
+  }
+  close(m_handoff_socket);
+  m_handoff_socket = listenHandoff(m_config.handoff_path);  // -1: no other attempt
+  for (int it : m_sockets) {  // the flags belong to the descriptions both processes had
+    setNonBlocking(it, false);
+  }
+  for (int it : { m_unix_socket, m_shm_socket }) {
+    if (it >= 0) {
+      setNonBlocking(it, m_config.mode == ServerMode::EPOLL);
+    }
+  }
+  if (m_federation) {  // its links were closed
+    m_federation.reset();
+    try {
+      m_federation.reset(new Federation(m_config.federation, [this](const MessageView& message) { relay(message); }));
+    } catch (const FederationException&) {
+      ERR("Federation is off until restart");
+    }
+  }
+
+  std::vector<Peer*> peers;  // threads mode
+  auto unpark = [&](int id, Peer& /* peer */) {  // still connected, the sessions handOver() has parked for them
+    std::lock_guard<std::mutex> lock(m_sessions_mutex);
+    m_sessions.erase(id);
+  };
+  for (auto& it : m_reactors) {
+    it->peers().forEach(unpark);
+    it->resume();
+  }
+  m_peers.forEach([&](int id, Peer& peer) {
+    unpark(id, peer);
+    if (peer.carrier == nullptr) {
+      peers.push_back(&peer);
+    }
+  });
+  for (Peer* peer : peers) {
+    startThread(peer);
+  }
+}
+
+// false - the peer can't continue in another process: its deflate stream or a replay is halfway through, it
+// carries sessions or its frames go through shared memory of this one
+bool Server::savePeer(Peer& peer, HandoffState* state) {
+  if (peer.compression != COMPRESSION_NONE || peer.isReplaying() || peer.is_gateway || peer.channel) {
+    return false;
+  }
+  HandoffPeer saved;
+  saved.id = peer.id;
+  saved.socket = peer.socket;
+  saved.protocol = peer.protocol;
+  saved.accepted_sequence = peer.accepted_sequence;
+  saved.first_sequence = peer.first_sequence;
+  saved.token = peer.resume_token;
+  for (auto& it : peer.subscriptions) {
+    saved.channels.push_back(it.channel->name);
+    saved.joined.push_back(it.since);
+  }
+  Slice received = peer.decoder.pending();
+  saved.received.assign(received.data, received.size);
+  peer.outbound.copyUnsent(&saved.unsent);
+  state->peers.push_back(std::move(saved));
+  return true;
+}
+
+Peer* Server::adoptPeer(HandoffPeer& state, Reactor* reactor) {
+  setNonBlocking(state.socket, m_config.mode == ServerMode::EPOLL);  // the previous process may have run in another mode
+  setDelivery(state.socket, m_config.outbound);
+  Peer* peer = new Peer(state.id, state.socket, m_config.outbound, &m_outbound_stats, reactor);
+  peer->limit.setLimit(m_config.limit.rate, m_config.limit.burst);
+  peer->slot = (reactor != nullptr ? reactor->peers() : m_peers).add(peer, state.id);
+  peer->protocol = state.protocol;
+  peer->accepted_sequence = state.accepted_sequence;
+  peer->first_sequence = state.first_sequence;
+  peer->resume_token = state.token;
+  for (size_t i = 0; i < state.channels.size(); ++i) {
+    subscribe(*peer, Slice(state.channels[i]), true, state.joined[i]);
+  }
+  if (!state.received.empty()) {
+    memcpy(peer->decoder.prepare(state.received.size()), state.received.data(), state.received.size());
+    peer->decoder.commit(state.received.size());
+  }
+  if (!state.unsent.empty()) {  // the stream goes on from the very byte the previous process stopped at
+    BufferRef frame = BufferPool::instance().acquire(state.unsent.size());
+    memcpy(frame->data(), state.unsent.data(), state.unsent.size());
+    sendTo(*peer, frame);
+  }
+  Metrics::add(COUNTER_PEERS_TAKEN_OVER);
+  return peer;
+}
+
+void Server::restore(const HandoffState& state) {
+  m_last_id = state.last_id;
+  m_resume.restart(state.recent.empty() ? state.next_sequence : state.recent.front().sequence);
+  for (auto& it : state.recent) {
+    BufferRef frame = BufferPool::instance().acquire(it.frame.size());
+    memcpy(frame->data(), it.frame.data(), it.frame.size());
+    Slice channel = it.channel_size == 0 ? Slice() : Slice(frame.data() + PROTOCOL_CHANNEL_OFFSET, it.channel_size);
+    m_resume.append([&](uint64_t /* sequence */) { return ResumeRing::Entry(it.sender_id, channel, frame); });
+  }
+  m_resume.restart(state.next_sequence);  // the same already, unless this ring is off
+
+  std::vector<HandoffSession> sessions = state.sessions;
+  std::sort(sessions.begin(), sessions.end(),
+            [](const HandoffSession& a, const HandoffSession& b) { return a.deadline < b.deadline; });
+  std::lock_guard<std::mutex> lock(m_sessions_mutex);
+  for (auto& it : sessions) {
+    Session session;
+    session.channels = it.channels;
+    session.joined = it.joined;
+    session.first_sequence = it.first_sequence;
+    session.next_sequence = it.next_sequence;
+    session.deadline = it.deadline;
+    session.token = it.token;
+    m_session_deadlines.emplace_back(it.deadline, it.id);
+    m_sessions[it.id] = std::move(session);
+  }
+}
+
+// ----------------------------------------------
+void Server::stop() {  // async-signal-safe
+  m_is_stopped = true;
+  for (auto& it : m_reactors) {
+    it->wakeup();
+  }
+  if (m_admin_socket >= 0) {
+    shutdown(m_admin_socket, SHUT_RDWR);  // wakes up blocking accept()
   }
-  Server server(port);
+  if (m_handoff_socket >= 0) {
+    shutdown(m_handoff_socket, SHUT_RDWR);
+  }
+  if (m_federation) {
+    m_federation->interrupt();
+  }
+}
+
+// ----------------------------------------------
+ssize_t Server::receive(Peer& peer) {
+  char* buffer = peer.decoder.prepare(PROTOCOL_READ_SIZE);
+  ssize_t read_bytes = 0;
+  if (peer.channel) {
+    read_bytes = peer.channel->read(buffer, PROTOCOL_READ_SIZE);
+    if (read_bytes == 0 && peer.channel->isBroken()) {
+      errno = EPROTO;  // its client has moved the positions out of the ring
+      return -1;
+    }
+    if (read_bytes == 0) {
+      errno = EAGAIN;  // as a non-blocking socket with nothing to read, its end is seen on the socket itself
+      return -1;
+    }
+  } else {
+    read_bytes = recv(peer.socket, buffer, PROTOCOL_READ_SIZE, 0);
+  }
+  if (read_bytes <= 0) {
+    return read_bytes;
+  }
+  peer.decoder.commit(read_bytes);
+  Metrics::add(COUNTER_BYTES_IN, read_bytes);
+  DBG("Raw request[%i bytes]: %.*s", (int) read_bytes, (int) read_bytes, buffer);
+  return read_bytes;
+}
+
+// stops early when the peer runs out of tokens under LimitPolicy::DELAY and sets is_limited
+bool Server::handleReceived(Peer& peer, size_t* budget) {
+  Frame frame;
+  FrameDecoder::Status status = FrameDecoder::NEED_MORE;
+  int64_t now = 0;
+  while (*budget > 0 && (status = peer.decoder.next(&frame)) == FrameDecoder::FRAME) {
+    bool is_allowed = true;
+    if (frame.type != FRAME_HELLO && peer.limit.isLimited()) {  // a hello is free, its client waits for the answer
+      now = now != 0 ? now : Metrics::now();
+      is_allowed = peer.limit.take(now);
+    }
+    if (!is_allowed && m_config.limit.policy == LimitPolicy::DELAY) {
+      peer.decoder.unget();
+      peer.is_limited = true;
+      Metrics::add(COUNTER_INGRESS_DELAYS);
+      return true;
+    }
+    --*budget;
+    if (m_capture) {  // as it came, before inflating: a replay feeds the same deflate stream
+      m_capture->record(CAPTURE_FRAME, peer.id, peer.decoder.last());
+    }
+    if ((frame.flags & FRAME_FLAG_COMPRESSED) &&
+        (!peer.inflater || !decompressFrame(*peer.inflater, &frame, &peer.inflated))) {
+      Metrics::add(COUNTER_PARSE_FAILURES);
+      FAT("Broken compressed frame[%zu bytes] from peer %i", frame.payload.size, peer.id);
+      return false;  // the rest of its deflate stream can't be read either
+    }
+    if (!is_allowed) {  // inflated all the same, the next frames depend on it
+      Metrics::add(COUNTER_FRAMES_REJECTED);
+      continue;
+    }
+    handleFrame(peer, frame);
+  }
+  if (status == FrameDecoder::BROKEN) {
+    Metrics::add(COUNTER_PARSE_FAILURES);
+    FAT("Broken stream from peer %i, %zu bytes buffered", peer.id, peer.decoder.buffered());
+    return false;
+  }
+  return true;
+}
+
+void Server::handleFrame(Peer& peer, const Frame& frame) {
+  bool is_session_command = frame.type == FRAME_OPEN || frame.type == FRAME_CLOSE;
+  if (frame.version > 0 && (is_session_command || peer.is_gateway.load(std::memory_order_relaxed))) {
+    uint32_t number = 0;
+    if (readSession(frame, &number) || is_session_command) {
+      handleSessionFrame(peer, frame, number);
+      return;
+    }
+  }
+
+  if (frame.type == FRAME_HELLO) {
+    int version = 0;
+    int compression = COMPRESSION_NONE;
+    int resume_id = -1;
+    uint64_t last_sequence = 0;
+    Slice token;
+    readHello(frame, &version, &compression, &resume_id, &last_sequence, &token);
+    version = std::max(0, std::min(version, PROTOCOL_VERSION));
+    if (!m_config.compression || version < 1 || compression != COMPRESSION_DEFLATE) {
+      compression = COMPRESSION_NONE;
+    } else if (!peer.inflater) {
+      peer.inflater.reset(new Inflater(true));
+    }
+    bool is_resumed = resume_id >= 0 && version >= 1 && resumeSession(peer, resume_id, last_sequence, token);
+    if (version >= 1 && m_config.resume.isEnabled()) {
+      peer.resume_token = makeResumeToken();  // a new one every time, the old one may have been seen
+    }
+    std::string hello;
+    encodeHello(hello, version, peer.id, compression, 0, Slice(peer.resume_token));
+    BufferRef reply = BufferPool::instance().acquire(hello.size());
+    memcpy(reply->data(), hello.data(), hello.size());
+    sendTo(peer, reply);
+    peer.protocol = version;
+    peer.compression = compression;
+    DBG("Peer %i speaks protocol version %i, compression %i", peer.id, version, compression);
+    if (is_resumed) {
+      pumpReplay(peer);  // after the hello, so that the client knows whose messages these are
+    }
+    return;
+  }
+
+  if (frame.type == FRAME_JOIN || frame.type == FRAME_LEAVE) {
+    Slice channel;
+    if (!readChannelCommand(frame, &channel)) {
+      Metrics::add(COUNTER_PARSE_FAILURES);
+      FAT("Malformed channel command[type %i, %zu bytes] from peer %i", frame.type, frame.payload.size, peer.id);
+      return;
+    }
+    subscribe(peer, channel, frame.type == FRAME_JOIN, m_resume.next());
+    return;
+  }
+
+  if (frame.type == FRAME_HISTORY) {
+    uint8_t tag = 0;
+    uint32_t value = 0;
+    if (!readHistory(frame, &tag, &value)) {
+      Metrics::add(COUNTER_PARSE_FAILURES);
+      FAT("Malformed history request[%zu bytes] from peer %i", frame.payload.size, peer.id);
+      return;
+    }
+    startReplay(peer, tag, value);
+    return;
+  }
+
+  MessageView message;
+  if (!MessageView::fromFrame(frame, &message)) {
+    Metrics::add(COUNTER_PARSE_FAILURES);
+    FAT("ParseException on frame[type %i, %zu bytes]: %.*s", frame.type, frame.payload.size, (int) frame.payload.size, frame.payload.data);
+    return;
+  }
+  if (message.login.empty() && message.text.empty()) {
+    return;  // ignore empty message
+  }
+  message.id = peer.id;  // from whoever sent it, whatever id its client wrote; a session's own for its frames
+  Metrics::add(COUNTER_MESSAGES_IN);
+
+  if (message.channel.empty()) {
+    OUT("Message{id=%i, login=%.*s, text=%.*s}", message.id, (int) message.login.size, message.login.data,
+        (int) message.text.size, message.text.data);
+  } else {
+    OUT("Message{id=%i, channel=%.*s, login=%.*s, text=%.*s}", message.id, (int) message.channel.size, message.channel.data,
+        (int) message.login.size, message.login.data, (int) message.text.size, message.text.data);
+  }
+  if (peer.reactor != nullptr) {
+    broadcast(*peer.reactor, message);
+  } else {
+    sendMessage(message);
+  }
+}
+
+// number: of the session, 0 - none or malformed
+void Server::handleSessionFrame(Peer& peer, const Frame& frame, uint32_t number) {
+  if (number == 0) {
+    Metrics::add(COUNTER_PARSE_FAILURES);
+    FAT("Malformed session command[type %i, %zu bytes] from peer %i", frame.type, frame.payload.size, peer.id);
+    return;
+  }
+  if (frame.type == FRAME_OPEN) {
+    openSession(peer, number);
+    return;
+  }
+  auto it = peer.sessions.find(number);
+  if (it == peer.sessions.end()) {
+    Metrics::add(COUNTER_PARSE_FAILURES);
+    FAT("Frame[type %i] for unknown session %u of peer %i", frame.type, number, peer.id);
+    return;
+  }
+  Peer& session = *it->second;
+  if (frame.type == FRAME_CLOSE) {
+    peer.sessions.erase(it);
+    closeSession(session);
+    if (peer.sessions.empty()) {  // broadcasts reach the connection itself again
+      peer.is_gateway.store(false, std::memory_order_relaxed);
+    }
+  } else if (frame.type == FRAME_MESSAGE || frame.type == FRAME_JOIN || frame.type == FRAME_LEAVE) {
+    handleFrame(session, frame);
+  } else {
+    DBG("Frame[type %i] of session %u of peer %i ignored: not per session", frame.type, number, peer.id);
+  }
+}
+
+// the session gets a peer id of its own and from now on the carrier only gets what its sessions do;
+// the OPEN has taken one of the carrier's tokens like any other frame, so its rate limit bounds these too
+void Server::openSession(Peer& peer, uint32_t number) {
+  if (peer.carrier != nullptr || peer.protocol < 1 || peer.sessions.count(number) != 0) {
+    Metrics::add(COUNTER_PARSE_FAILURES);
+    FAT("Peer %i can't open session %u: %s", peer.id, number, peer.protocol < 1 ? "no binary protocol" : "already open");
+    return;
+  }
+  if (peer.sessions.size() >= m_config.max_sessions) {  // refused with a CLOSE of that number
+    Metrics::add(COUNTER_MUX_REFUSED);
+    WRN("Peer %i can't open session %u: %zu open already", peer.id, number, peer.sessions.size());
+    std::string refused;
+    encodeSession(refused, FRAME_CLOSE, number);
+    BufferRef frame = BufferPool::instance().acquire(refused.size());
+    memcpy(frame->data(), refused.data(), refused.size());
+    sendTo(peer, frame);
+    return;
+  }
+  int id = nextId();
+  Peer* session = new Peer(id, -1, m_config.outbound, &m_outbound_stats, peer.reactor);
+  session->carrier = &peer;
+  session->session = number;
+  session->protocol = peer.protocol.load();
+  session->compression = peer.compression.load();
+  session->accepted_sequence = session->first_sequence = m_resume.next();
+  peer.is_gateway.store(true, std::memory_order_relaxed);
+  session->slot = (peer.reactor != nullptr ? peer.reactor->peers() : m_peers).add(session, id);
+  peer.sessions[number] = session;
+
+  std::string opened;
+  encodeSession(opened, FRAME_OPEN, number, id);
+  BufferRef frame = BufferPool::instance().acquire(opened.size());
+  memcpy(frame->data(), opened.data(), opened.size());
+  sendTo(peer, frame);
+  Metrics::add(COUNTER_MUX_OPENED);
+  DBG("Peer %i opened session %u as peer %i", peer.id, number, id);
+}
+
+void Server::closeSession(Peer& session) {
+  Metrics::add(COUNTER_MUX_CLOSED);
+  DBG("Session %u of peer %i closed", session.session, session.carrier->id);
+  if (session.reactor != nullptr) {
+    session.reactor->channels().leaveAll(&session);
+    session.reactor->peers().remove(session.slot);
+  } else {
+    if (!session.subscriptions.empty()) {
+      WriteLock lock(m_channels_lock);
+      m_channels.leaveAll(&session);
+    }
+    m_peers.remove(session.slot);  // freed once no fan-out can reach it or its carrier anymore
+  }
+}
+
+void Server::closeSessions(Peer& peer) {
+  for (auto& it : peer.sessions) {
+    closeSession(*it.second);
+  }
+  peer.sessions.clear();
+  peer.is_gateway.store(false, std::memory_order_relaxed);
+}
+
+void Server::sendMessage(const MessageView& message, bool is_relayed) {
+  int64_t start = Metrics::now();
+  Outgoing outgoing;
+  serialize(message, &outgoing);
+  archive(message, outgoing);
+  if (m_federation && !is_relayed) {
+    m_federation->forward(outgoing.binary);
+  }
+
+  static thread_local Routes routes;
+  static thread_local std::vector<PeerRef> blocked;  // BLOCK policy: recipients sent to after the guard is left
+  bool is_blocking = m_config.outbound.policy == OverflowPolicy::BLOCK;
+  uint64_t recipients = 0;
+  auto deliver = [&](Peer& peer) {
+    if (peer.carrier != nullptr) {
+      routes.add(peer);
+    } else {
+      sendTo(peer, outgoing.forPeer(peer.protocol, peer.compression));
+    }
+  };
+  {
+    PeerRegistry::ReadGuard guard(m_peers);  // the carriers of the routes stay until these are sent
+    auto send = [&](int id, Peer& peer) {
+      if (id == message.id || peer.is_gateway.load(std::memory_order_relaxed)) {
+        return;
+      }
+      if (is_blocking) {
+        blocked.emplace_back(peer);  // a send may wait for the peer, nobody else may wait for this one
+      } else {
+        deliver(peer);
+      }
+      ++recipients;
+    };
+    if (message.channel.empty()) {
+      m_peers.forEach(send);
+    } else {
+      ReadLock lock(m_channels_lock);
+      m_channels.forEach(message.channel, send);
+    }
+    if (!is_blocking) {
+      routes.send(outgoing, [this](Peer& carrier, const BufferRef& route) { sendTo(carrier, route); });
+    }
+  }
+  if (is_blocking) {
+    for (PeerRef& it : blocked) {
+      deliver(*it);
+    }
+    routes.send(outgoing, [this](Peer& carrier, const BufferRef& route) { sendTo(carrier, route); });
+    blocked.clear();
+  }
+  Metrics::add(COUNTER_MESSAGES_OUT, recipients);
+  Metrics::record(HISTOGRAM_FANOUT_NS, Metrics::now() - start);
+}
+
+// since: the first message numbered after the join, nothing in the channel before it is resumed
+void Server::subscribe(Peer& peer, Slice channel, bool is_join, uint64_t since) {
+  bool is_changed = false;
+  if (peer.reactor != nullptr) {
+    PeerChannels& channels = peer.reactor->channels();
+    is_changed = is_join ? channels.join(&peer, peer.id, channel, since) : channels.leave(&peer, channel);
+  } else {
+    WriteLock lock(m_channels_lock);
+    is_changed = is_join ? m_channels.join(&peer, peer.id, channel, since) : m_channels.leave(&peer, channel);
+  }
+  if (is_changed) {
+    DBG("Peer %i %s channel %.*s", peer.id, is_join ? "joined" : "left", (int) channel.size, channel.data);
+  }
+}
+
+// messages to everybody are stored as they go out, channel traffic is not
+void Server::archive(const MessageView& message, const Outgoing& outgoing) {
+  if (m_history && message.channel.empty()) {
+    m_history->append(outgoing.binary.data(), outgoing.binary.size());
+  }
+}
+
+void Server::startReplay(Peer& peer, uint8_t tag, uint32_t value) {
+  if (peer.protocol < 1 || peer.replay) {
+    return;  // stored frames are binary; one replay at a time
+  }
+  peer.replay.reset(new HistoryCursor());
+  if (m_history && tag == FIELD_LAST) {
+    m_history->last(value, peer.replay.get());
+  } else if (m_history) {
+    m_history->since(value * 1000LL, peer.replay.get());
+  }
+  DBG("Peer %i asked for history, %s %u", peer.id, tag == FIELD_LAST ? "last" : "since", value);
+  pumpReplay(peer);
+}
+
+void Server::pumpReplay(Peer& peer) {
+  pumpResume(peer);
+  while (peer.replay && peer.resume_next >= peer.resume_end) {
+    if (queuedBytes(peer) >= m_config.outbound.max_bytes / 2) {
+      return;  // the rest when the queue drains, live messages keep their room
+    }
+    BufferRef chunk = peer.replay->next(HISTORY_REPLAY_CHUNK);
+    if (!chunk) {
+      std::string end;
+      encodeHistory(end, FIELD_LAST, static_cast<uint32_t>(peer.replay->count()));
+      chunk = BufferPool::instance().acquire(end.size());
+      memcpy(chunk->data(), end.data(), end.size());
+      peer.replay.reset();
+    }
+    sendTo(peer, chunk);
+  }
+}
+
+// messages the peer missed while it was away, those that would have reached it and are still in the ring
+void Server::pumpResume(Peer& peer) {
+  ResumeRing::Entry batch[RESUME_READ_BATCH];
+  while (peer.resume_next < peer.resume_end) {
+    if (queuedBytes(peer) >= m_config.outbound.max_bytes / 2) {
+      return;
+    }
+    uint64_t from = peer.resume_next;
+    size_t count = m_resume.read(&peer.resume_next, peer.resume_end, batch, RESUME_READ_BATCH);
+    Metrics::add(COUNTER_MESSAGES_MISSED, peer.resume_next - from - count);
+    uint64_t resumed = 0;
+    for (size_t i = 0; i < count; ++i) {
+      ResumeRing::Entry& entry = batch[i];
+      // live messages to everybody have reached it since it was accepted, channel ones only after the
+      // channels were restored, and those from before it joined were never its; only the peer's own
+      // thread changes its list of channels
+      bool is_missed = entry.sender_id != peer.id &&
+                       (entry.channel.empty() ? entry.sequence < peer.accepted_sequence :
+                                                isSubscribed(peer, entry.channel, entry.sequence));
+      if (is_missed) {
+        sendTo(peer, entry.frame);
+        ++resumed;
+      }
+      entry.frame.reset();
+    }
+    Metrics::add(COUNTER_MESSAGES_RESUMED, resumed);
+  }
+}
+
+void Server::parkSession(Peer& peer) {
+  if (!m_config.resume.isEnabled() || peer.protocol < 1 || peer.resume_token.empty()) {
+    return;  // a legacy client can't come back for its session
+  }
+  Session session;
+  session.token = peer.resume_token;
+  for (auto& it : peer.subscriptions) {
+    session.channels.push_back(it.channel->name);
+    session.joined.push_back(it.since);
+  }
+  session.first_sequence = peer.first_sequence;
+  session.next_sequence = m_resume.next();
+  session.deadline = Metrics::now() + m_config.resume.window_s * 1000000000LL;
+
+  std::lock_guard<std::mutex> lock(m_sessions_mutex);
+  expireSessions(session.deadline - m_config.resume.window_s * 1000000000LL);
+  m_session_deadlines.emplace_back(session.deadline, peer.id);
+  m_sessions[peer.id] = std::move(session);
+}
+
+// the peer takes over the id, channels and missed messages of a parked session, if it knows the session's token
+bool Server::resumeSession(Peer& peer, int id, uint64_t last_sequence, Slice token) {
+  Session session;
+  {
+    std::lock_guard<std::mutex> lock(m_sessions_mutex);
+    expireSessions(Metrics::now());
+    auto it = m_sessions.find(id);
+    if (it == m_sessions.end()) {
+      DBG("Peer %i can't resume session %i: expired or unknown", peer.id, id);
+      return false;
+    }
+    if (!isResumeToken(it->second.token, token)) {
+      WRN("Peer %i can't resume session %i: wrong token", peer.id, id);
+      return false;
+    }
+    session = std::move(it->second);
+    m_sessions.erase(it);
+  }
+  (peer.reactor != nullptr ? peer.reactor->peers() : m_peers).setKey(peer.slot, id);
+  peer.id = id;
+  peer.first_sequence = session.first_sequence;
+  for (size_t i = 0; i < session.channels.size(); ++i) {
+    subscribe(peer, Slice(session.channels[i]), true, session.joined[i]);
+  }
+  // a client's number is only where it stopped reading: before the session began there was nothing for it
+  peer.resume_next = std::max(last_sequence != 0 ? last_sequence + 1 : session.next_sequence, session.first_sequence);
+  peer.resume_end = m_resume.next();  // later ones reach it live, channels included
+  Metrics::add(COUNTER_SESSIONS_RESUMED);
+  DBG("Peer resumed session %i from message %llu", id, (unsigned long long) peer.resume_next);
+  return true;
+}
+
+void Server::expireSessions(int64_t now) {
+  while (!m_session_deadlines.empty() && m_session_deadlines.front().first <= now) {
+    auto it = m_sessions.find(m_session_deadlines.front().second);
+    if (it != m_sessions.end() && it->second.deadline == m_session_deadlines.front().first) {
+      m_sessions.erase(it);  // not parked again meanwhile
+    }
+    m_session_deadlines.pop_front();
+  }
+}
+
+size_t Server::queuedBytes(Peer& peer) {
+  if (peer.reactor != nullptr) {
+    return peer.outbound.bytes();
+  }
+  std::lock_guard<std::mutex> lock(peer.mutex);
+  return peer.outbound.bytes();
+}
+
+ShmChannel* Server::openChannel(int socket) {
+  std::unique_ptr<ShmChannel> channel(ShmChannel::create(m_config.shm_ring));
+  if (!channel || !channel->sendSetup(socket)) {
+    ERR("Failed to set up shared memory channel for a local client");
+    return nullptr;
+  }
+  return channel.release();
+}
+
+void Server::finishChannel(Peer& peer) {
+  while (receive(peer) > 0) {}
+  size_t budget = SIZE_MAX;
+  handleReceived(peer, &budget);
+}
+
+void Server::sendHello(Peer& peer) {
+  std::string hello = textHello(peer.id);
+  if (peer.channel) {  // an empty ring takes it, the senders' writes into the ring are serialized as the flushes are
+    std::lock_guard<std::mutex> lock(peer.mutex);
+    peer.channel->write(hello.data(), hello.size());
+    return;
+  }
+  send(peer.socket, hello.data(), hello.size(), MSG_NOSIGNAL);
+}
+
+void Server::sendTo(Peer& peer, const BufferRef& frame) {
+  if (peer.carrier != nullptr) {
+    sendTo(*peer.carrier, routeFrame(&peer.session, 1, frame));
+    return;
+  }
+  if (peer.reactor != nullptr) {
+    peer.reactor->enqueue(peer, frame);
+    return;
+  }
+
+  // threads mode: whatever does not fit into the kernel now is flushed by the next sender or the peer's own thread
+  std::lock_guard<std::mutex> lock(peer.mutex);
+  if (peer.is_closed) {
+    return;
+  }
+  bool is_new_batch = peer.outbound.empty();
+  if (!peer.outbound.push(frame)) {
+    shutdown(peer.socket, SHUT_RDWR);  // peer's thread sees the end of stream and closes it
+    return;
+  }
+  if (m_config.outbound.isBatching() && !peer.outbound.isBatchDue(OutboundQueue::now())) {
+    if (is_new_batch) {
+      scheduleBatch(peer);
+    }
+    return;
+  }
+  if (flushLocked(peer) == OutboundQueue::FAILED) {
+    shutdown(peer.socket, SHUT_RDWR);
+  }
+}
+
+OutboundQueue::Status Server::flushLocked(Peer& peer) {
+  size_t queued = peer.outbound.bytes();
+  Metrics::record(HISTOGRAM_QUEUE_BYTES, queued);
+  Metrics::record(HISTOGRAM_BATCH_FRAMES, peer.outbound.frames());
+  OutboundQueue::Status status = peer.outbound.flush();
+  Metrics::add(COUNTER_BYTES_OUT, queued - peer.outbound.bytes());
+  if (status == OutboundQueue::FAILED) {
+    Metrics::add(COUNTER_SEND_ERRORS);
+  }
+  return status;
+}
+
+void Server::scheduleBatch(Peer& peer) {
+  std::lock_guard<std::mutex> lock(m_batches_mutex);
+  m_batches.emplace_back(peer.outbound.batchDeadline(), peer.slot);
+  if (m_batches.size() - m_batches_head == 1) {
+    m_batches_ready.notify_one();
+  }
+}
+
+// batches that neither filled up nor were flushed by the peer's own thread, in the order they are due
+void Server::flushBatches() {
+  std::unique_lock<std::mutex> lock(m_batches_mutex);
+  while (!m_is_stopped) {  // stop() can't notify from a signal handler, hence the bounded waits
+    if (m_batches_head == m_batches.size()) {
+      m_batches.clear();
+      m_batches_head = 0;
+      m_batches_ready.wait_for(lock, std::chrono::milliseconds(THREADS_FLUSH_INTERVAL_MS));
+      continue;
+    }
+    int64_t wait = m_batches[m_batches_head].first - OutboundQueue::now();
+    if (wait > 0) {
+      m_batches_ready.wait_for(lock, std::chrono::nanoseconds(wait));
+      continue;
+    }
+    size_t slot = m_batches[m_batches_head++].second;
+    if (m_batches_head >= 1024 && m_batches_head * 2 >= m_batches.size()) {  // never caught up lately
+      m_batches.erase(m_batches.begin(), m_batches.begin() + m_batches_head);
+      m_batches_head = 0;
+    }
+    lock.unlock();
+    {
+      PeerRegistry::ReadGuard guard(m_peers);
+      Peer* peer = m_peers.at(slot);  // gone or a newer peer in that slot: nothing or not yet due
+      if (peer != nullptr) {
+        std::lock_guard<std::mutex> peer_lock(peer->mutex);
+        if (!peer->is_closed && !peer->outbound.empty() && peer->outbound.isBatchDue(OutboundQueue::now()) &&
+            flushLocked(*peer) == OutboundQueue::FAILED) {
+          shutdown(peer->socket, SHUT_RDWR);
+        }
+      }
+    }
+    lock.lock();
+  }
+}
+
+void Server::serialize(const MessageView& message, Outgoing* outgoing) {
+  BufferPool& pool = BufferPool::instance();
+  outgoing->sender_id = message.id;
+  outgoing->text = pool.acquire(textSize(message));
+  writeText(message, outgoing->text->data());
+  m_resume.append([&](uint64_t sequence) {  // numbered and kept in one step, text frames have no number
+    MessageView numbered = message;
+    numbered.sequence = sequence;
+    outgoing->binary = pool.acquire(binarySize(numbered));
+    writeBinary(numbered, outgoing->binary->data());
+    outgoing->channel = message.channel.empty() ? Slice() :
+                        Slice(outgoing->binary.data() + PROTOCOL_CHANNEL_OFFSET, message.channel.size);
+    return ResumeRing::Entry(message.id, outgoing->channel, outgoing->binary);
+  });
+  if (m_config.compression) {  // once for all the recipients, so no context is carried between messages
+    static thread_local Deflater deflater(false);
+    static thread_local std::string compressed;
+    compressed.clear();
+    if (compressFrame(deflater, Slice(outgoing->binary->data(), outgoing->binary->size()), compressed)) {
+      outgoing->compressed = pool.acquire(compressed.size());
+      memcpy(outgoing->compressed->data(), compressed.data(), compressed.size());
+    }
+  }
+}
+
+void Server::broadcast(Reactor& origin, const MessageView& message) {
+  Outgoing outgoing;
+  serialize(message, &outgoing);
+  archive(message, outgoing);
+  if (m_federation) {
+    m_federation->forward(outgoing.binary);
+  }
+
+  origin.deliver(outgoing);
+  for (auto& it : m_reactors) {
+    if (it.get() != &origin) {
+      it->post(outgoing);
+    }
+  }
+}
+
+// numbered, stored and delivered here like a local peer's message, but not forwarded again
+void Server::relay(const MessageView& message) {
+  if (m_reactors.empty()) {
+    sendMessage(message, true);
+    return;
+  }
+  Outgoing outgoing;
+  serialize(message, &outgoing);
+  archive(message, outgoing);
+  for (auto& it : m_reactors) {
+    it->post(outgoing);
+  }
+}
+
+// ----------------------------------------------
+void Server::startThread(Peer* peer) {
+  std::lock_guard<std::mutex> lock(m_threads_mutex);
+  ++m_threads;
+  std::thread t(&Server::handleRequest, this, peer);
+  t.detach();
+}
+
+void Server::handleRequest(Peer* peer) {
+  bool is_gone = false;  // the peer closed the connection or broke the stream
+  size_t budget = SIZE_MAX;  // a thread of its own, the scheduler shares the CPU between the peers
+  while (!m_is_stopped) {
+    if (peer->isReplaying()) {
+      pumpReplay(*peer);
+    }
+    int timeout = THREADS_FLUSH_INTERVAL_MS;
+    if (peer->is_limited) {  // its socket is not read until its tokens refill
+      int64_t wait = peer->limit.readyAt() - Metrics::now();
+      if (wait <= 0) {
+        peer->is_limited = false;
+        if (!handleReceived(*peer, &budget)) {
+          is_gone = true;
+          break;
+        }
+        continue;
+      }
+      timeout = std::min<int64_t>(timeout, wait / 1000000 + 1);
+    }
+    if (peer->channel && !peer->is_limited) {  // its ring is read until it is empty, then its event is waited for
+      ssize_t read_bytes = receive(*peer);
+      if (read_bytes > 0) {
+        if (!handleReceived(*peer, &budget)) {
+          is_gone = true;
+          break;
+        }
+        continue;
+      }
+      if (errno == EPROTO) {
+        ERR("get request error: %s", strerror(errno));
+        is_gone = true;
+        break;
+      }
+      if (!peer->channel->sleepUntilData()) {
+        continue;
+      }
+    }
+    pollfd descriptors[2] = { { peer->socket, static_cast<short>(peer->is_limited ? 0 : POLLIN), 0 }, { -1, POLLIN, 0 } };
+    pollfd& descriptor = descriptors[0];
+    if (peer->channel) {
+      descriptor.events = POLLIN;  // nothing is sent over its socket: readable means the client is gone
+      descriptors[1].fd = peer->channel->event();
+    } else {
+      std::lock_guard<std::mutex> lock(peer->mutex);
+      if (peer->outbound.isThrottled() || (!peer->outbound.empty() && !m_config.outbound.isBatching())) {
+        descriptor.events |= POLLOUT;  // a batch being collected is not a backlog
+      }
+    }
+    if (poll(descriptors, peer->channel ? 2 : 1, timeout) <= 0) {
+      continue;
+    }
+
+    // backlog left by senders when the peer was throttled
+    if ((descriptor.revents & POLLOUT) || (descriptors[1].revents & POLLIN)) {
+      if (peer->channel) {
+        peer->channel->clearEvent();  // data or room: the ring is read on the next pass anyway
+      }
+      std::lock_guard<std::mutex> lock(peer->mutex);
+      if ((!peer->channel || !peer->outbound.empty()) && flushLocked(*peer) == OutboundQueue::FAILED) {
+        shutdown(peer->socket, SHUT_RDWR);
+      }
+    }
+    if (peer->channel && (descriptor.revents & (POLLIN | POLLHUP | POLLERR))) {
+      finishChannel(*peer);
+      is_gone = true;
+      break;
+    }
+
+    // peers' messages
+    if (descriptor.revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t read_bytes = receive(*peer);
+      if (read_bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (read_bytes <= 0) {
+        if (read_bytes == -1) {
+          ERR("get request error: %s", strerror(errno));
+        }
+        is_gone = true;
+        break;
+      }
+      if (!peer->is_limited && !handleReceived(*peer, &budget)) {
+        is_gone = true;
+        break;
+      }
+    }
+  }
+
+  DBG("Stopping peer thread...");
+  if (!m_is_handing_off || is_gone) {  // otherwise the peer stays registered as it is, the next process gets its socket
+    closeSessions(*peer);
+    parkSession(*peer);
+    if (!peer->subscriptions.empty()) {
+      WriteLock lock(m_channels_lock);
+      m_channels.leaveAll(peer);
+    }
+    {
+      std::lock_guard<std::mutex> lock(peer->mutex);
+      peer->is_closed = true;
+      shutdown(peer->socket, SHUT_RDWR);
+    }
+    m_peers.remove(peer->slot);  // socket is closed when no sender can reach it anymore
+    Metrics::add(COUNTER_CLOSED);
+    if (m_capture) {
+      m_capture->record(CAPTURE_CLOSE, peer->id);
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(m_threads_mutex);
+  --m_threads;
+  std::notify_all_at_thread_exit(m_threads_done, std::move(lock));  // runThreads() returns once nothing of this thread is left
+}
+
+/* Реализация всех функций-членов класса Реактора */
+// --------------------------------------------------------------------------------------------------------------------
+
+Reactor::Reactor(Server& server, int index, int listen_socket, bool use_uring)
+  : m_server(server), m_index(index), m_socket(listen_socket), m_epoll(-1), m_timer_deadline(0), m_is_cancelled(false) {
+  m_wakeup = eventfd(0, EFD_NONBLOCK);
+  m_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);  // the clock of std::chrono::steady_clock
+  if (use_uring) {
+    // sockets stay blocking: io_uring waits for readiness itself, O_NONBLOCK would only bounce EAGAIN back
+    m_uring.reset(new Uring(&m_server.m_uring_stats));
+    if (m_wakeup < 0 || m_timer < 0 || !m_uring->init(URING_ENTRIES) ||
+        !m_uring->provideBuffers(URING_BUFFER_COUNT, URING_BUFFER_SIZE, URING_BUFFER_GROUP)) {
+      ERR("Failed to set up io_uring for reactor #%i: %s", m_index, strerror(errno));
+      throw ServerException();
+    }
+    armUring();
+    return;
+  }
+
+  m_epoll = epoll_create1(0);
+  if (m_epoll < 0 || m_wakeup < 0 || m_timer < 0 || !setNonBlocking(m_socket)) {
+    ERR("Failed to set up epoll for reactor #%i: %s", m_index, strerror(errno));
+    throw ServerException();
+  }
+
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLET;
+  event.data.u64 = EPOLL_LISTENER_TAG;
+  epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_socket, &event);
+  event.events = EPOLLIN;
+  event.data.u64 = EPOLL_WAKEUP_TAG;
+  epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &event);
+  event.data.u64 = EPOLL_TIMER_TAG;
+  epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_timer, &event);
+  event.events = EPOLLIN | EPOLLEXCLUSIVE;  // a connection wakes one of the reactors, not all of them
+  if (m_server.m_unix_socket >= 0) {
+    event.data.u64 = EPOLL_UNIX_TAG;
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_server.m_unix_socket, &event);
+  }
+  if (m_server.m_shm_socket >= 0) {
+    event.data.u64 = EPOLL_SHM_TAG;
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_server.m_shm_socket, &event);
+  }
+}
+
+Reactor::~Reactor() {
+  m_uring.reset();  // before the peers: in-flight operations are cancelled
+  close(m_socket);
+  close(m_wakeup);
+  close(m_timer);
+  if (m_epoll >= 0) {
+    close(m_epoll);
+  }
+}
+
+void Reactor::armUring() {
+  m_uring->prepAccept(m_socket, URING_OP_ACCEPT);
+  if (m_server.m_unix_socket >= 0) {
+    m_uring->prepAccept(m_server.m_unix_socket, URING_OP_ACCEPT_UNIX);  // the kernel gives each connection to one reactor
+  }
+  if (m_server.m_shm_socket >= 0) {
+    m_uring->prepAccept(m_server.m_shm_socket, URING_OP_ACCEPT_SHM);
+  }
+  m_uring->prepPoll(m_wakeup, POLLIN, URING_OP_WAKEUP);
+  m_uring->prepPoll(m_timer, POLLIN, URING_OP_TIMER);
+}
+
+// ----------------------------------------------
+void Reactor::run() {
+  DBG("Reactor #%i started", m_index);
+  if (m_uring) {
+    runUring();
+  } else {
+    runEpoll();
+  }
+  DBG("Reactor #%i stopped", m_index);
+}
+
+void Reactor::runEpoll() {
+  epoll_event events[EPOLL_MAX_EVENTS];
+  while (!m_server.m_is_stopped) {  // server loop
+    int total = epoll_wait(m_epoll, events, EPOLL_MAX_EVENTS, m_ready.empty() ? -1 : 0);
+    if (total < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ERR("epoll_wait error: %s", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < total; ++i) {
+      uint64_t tag = events[i].data.u64;
+      if (tag == EPOLL_LISTENER_TAG) {
+        acceptPeers(m_socket, false);
+      } else if (tag == EPOLL_UNIX_TAG) {
+        acceptPeers(m_server.m_unix_socket, false);
+      } else if (tag == EPOLL_SHM_TAG) {
+        acceptPeers(m_server.m_shm_socket, true);
+      } else if (tag == EPOLL_WAKEUP_TAG) {
+        readEvent(m_wakeup);
+        drainInbox();
+      } else if (tag == EPOLL_TIMER_TAG) {
+        readEvent(m_timer);
+        m_timer_deadline = 0;  // flushDirty() flushes what is due and re-arms
+      } else {
+        Peer* peer = m_peers.at((tag & ~EPOLL_CHANNEL_FLAG) - EPOLL_PEER_TAG);
+        if (peer == nullptr || peer->is_closing) {
+          continue;
+        }
+        if (peer->channel) {
+          if (tag & EPOLL_CHANNEL_FLAG) {  // data to read or room to write
+            peer->channel->clearEvent();
+            schedule(*peer);
+            if (!peer->outbound.empty()) {
+              flushPeer(*peer);
+            }
+          } else {  // its socket is only ever closed
+            m_server.finishChannel(*peer);
+            markClosing(*peer);
+          }
+          continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+          schedule(*peer);
+        }
+        if ((events[i].events & EPOLLOUT) && !peer->is_closing) {
+          flushPeer(*peer);
+        }
+      }
+    }
+
+    // peers with something to read take turns, everything they enqueue goes out in one gather-write per peer
+    releaseLimited();
+    serveReady();
+    flushDirty();
+    closeMarked();
+  }
+}
+
+void Reactor::wakeup() {
+  signalEvent(m_wakeup);
+}
+
+// ----------------------------------------------
+void Reactor::deliver(const Outgoing& outgoing) {
+  int64_t start = Metrics::now();
+  uint64_t recipients = 0;
+  auto send = [&](int id, Peer& peer) {
+    if (id == outgoing.sender_id || peer.is_gateway.load(std::memory_order_relaxed)) {
+      return;
+    }
+    if (peer.carrier != nullptr) {
+      m_routes.add(peer);
+    } else {
+      enqueue(peer, outgoing.forPeer(peer.protocol, peer.compression));
+    }
+    ++recipients;
+  };
+  if (outgoing.channel.empty()) {
+    m_peers.forEach(send);
+  } else {
+    m_channels.forEach(outgoing.channel, send);  // local subscribers only
+  }
+  m_routes.send(outgoing, [this](Peer& carrier, const BufferRef& route) { enqueue(carrier, route); });
+  Metrics::add(COUNTER_MESSAGES_OUT, recipients);
+  Metrics::record(HISTOGRAM_FANOUT_NS, Metrics::now() - start);
+}
+
+void Reactor::post(const Outgoing& outgoing) {
+  bool was_empty = false;
+  {
+    std::lock_guard<std::mutex> lock(m_inbox_mutex);
+    was_empty = m_inbox.empty();
+    m_inbox.push_back(outgoing);
+  }
+  if (was_empty) {  // one wakeup per batch, the rest is picked up by the same drain
+    wakeup();
+  }
+}
+
+void Reactor::drainInbox() {
+  {
+    std::lock_guard<std::mutex> lock(m_inbox_mutex);
+    m_inbox_drained.swap(m_inbox);
+  }
+  for (auto& it : m_inbox_drained) {
+    deliver(it);
+  }
+  m_inbox_drained.clear();
+}
+
+// ----------------------------------------------
+void Reactor::acceptPeers(int listen_socket, bool is_shm) {
+  while (true) {  // edge-triggered: drain the whole backlog
+    sockaddr_storage peer_address_structure;
+    socklen_t peer_address_structure_size = sizeof(peer_address_structure);
+
+    int peer_socket = accept4(listen_socket, reinterpret_cast<sockaddr*>(&peer_address_structure), &peer_address_structure_size, SOCK_NONBLOCK);
+    if (peer_socket < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        ERR("Failed to open new socket for data transfer: %s", strerror(errno));
+      }
+      return;
+    }
+
+    Peer* peer = addPeer(peer_socket, is_shm);
+    if (peer != nullptr && watch(*peer)) {
+      m_server.sendHello(*peer);
+    }
+  }
+}
+
+Peer* Reactor::addPeer(int socket, bool is_shm) {
+  ShmChannel* channel = nullptr;
+  if (is_shm && (channel = m_server.openChannel(socket)) == nullptr) {
+    close(socket);
+    return nullptr;
+  }
+  Metrics::add(COUNTER_ACCEPTED);
+  setDelivery(socket, m_server.m_config.outbound);
+  int id = m_server.nextId();
+  Peer* peer = new Peer(id, socket, m_server.m_config.outbound, &m_server.m_outbound_stats, this);
+  peer->channel.reset(channel);
+  peer->outbound.setChannel(channel);
+  peer->limit.setLimit(m_server.m_config.limit.rate, m_server.m_config.limit.burst);
+  peer->slot = m_peers.add(peer, id);
+  peer->accepted_sequence = peer->first_sequence = m_server.m_resume.next();
+  if (m_server.m_capture) {
+    m_server.m_capture->record(CAPTURE_OPEN, id);
+  }
+  return peer;
+}
+
+bool Reactor::watch(Peer& peer) {
+  if (m_uring && peer.channel) {  // armed once, until the peer is closed
+    m_uring->prepPoll(peer.channel->event(), POLLIN, (peer.slot << URING_OP_BITS) | URING_OP_CHANNEL);
+    m_uring->prepPoll(peer.socket, POLLIN | POLLRDHUP, (peer.slot << URING_OP_BITS) | URING_OP_HANGUP);
+    peer.pending_ops += 2;
+    peer.is_receiving = true;
+    return true;
+  }
+  if (m_uring) {
+    m_uring->prepRecv(peer.socket, URING_BUFFER_GROUP, (peer.slot << URING_OP_BITS) | URING_OP_RECV);
+    ++peer.pending_ops;
+    peer.is_receiving = true;
+    return true;
+  }
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.u64 = peer.slot + EPOLL_PEER_TAG;
+  if (peer.channel) {
+    event.events = EPOLLRDHUP | EPOLLET;  // the socket only tells the client is gone
+  }
+  if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, peer.socket, &event) < 0) {
+    ERR("Failed to watch peer socket: %s", strerror(errno));
+    m_peers.remove(peer.slot);
+    return false;
+  }
+  if (peer.channel) {
+    event.events = EPOLLIN;
+    event.data.u64 = (peer.slot + EPOLL_PEER_TAG) | EPOLL_CHANNEL_FLAG;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, peer.channel->event(), &event) < 0) {
+      ERR("Failed to watch peer channel: %s", strerror(errno));
+      epoll_ctl(m_epoll, EPOLL_CTL_DEL, peer.socket, nullptr);
+      m_peers.remove(peer.slot);
+      return false;
+    }
+  }
+  return true;
+}
+
+// ----------------------------------------------
+/**
+ * A flooding peer must not hold the loop: every peer with frames waiting gets a turn of at most
+ * REACTOR_TURN_FRAMES of them per loop iteration, round-robin, and whatever it has left waits in
+ * its decoder or its socket for the next turn. The fan-out of a frame is done within its sender's
+ * turn, so the senders share the loop evenly however many frames each of them has sent.
+ */
+void Reactor::schedule(Peer& peer) {
+  if (!peer.is_ready && !peer.is_limited && !peer.is_closing) {
+    peer.is_ready = true;
+    m_ready.push_back(&peer);
+  }
+}
+
+void Reactor::serveReady() {
+  m_serving.swap(m_ready);  // peers whose turn is cut short are scheduled into m_ready again
+  for (Peer* peer : m_serving) {
+    peer->is_ready = false;
+    if (!peer->is_closing) {
+      serveTurn(*peer);
+    }
+  }
+  m_serving.clear();
+}
+
+void Reactor::serveTurn(Peer& peer) {
+  size_t budget = REACTOR_TURN_FRAMES;
+  while (true) {
+    if (!m_server.handleReceived(peer, &budget)) {
+      markClosing(peer);
+      return;
+    }
+    if (peer.is_limited) {
+      holdBack(peer);
+      return;
+    }
+    if (budget == 0) {
+      schedule(peer);
+      if (peer.decoder.buffered() >= REACTOR_BACKLOG_BYTES) {
+        stopReceiving(peer);  // until it catches up
+      }
+      return;
+    }
+    if (m_uring && !peer.channel) {
+      if (!peer.is_receiving) {
+        watch(peer);  // has caught up, the multishot receive brings the rest
+      }
+      return;
+    }
+    ssize_t read_bytes = m_server.receive(peer);  // edge-triggered: until the socket is drained or the turn is over
+    if (read_bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (read_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (peer.channel && !peer.channel->sleepUntilData()) {
+        continue;  // written meanwhile, the client won't signal it
+      }
+      return;
+    }
+    if (read_bytes <= 0) {
+      if (read_bytes == -1) {
+        ERR("get request error: %s", strerror(errno));
+      }
+      DBG("Connection closed");
+      markClosing(peer);
+      return;
+    }
+  }
+}
+
+// its socket is not read until the tokens refill, so TCP slows its client down
+void Reactor::holdBack(Peer& peer) {
+  stopReceiving(peer);
+  m_limited.push_back(&peer);
+  armTimer(peer.limit.readyAt());
+}
+
+// epoll doesn't read a socket unless the peer's turn goes on, io_uring receives until it is told otherwise
+void Reactor::stopReceiving(Peer& peer) {
+  if (m_uring && peer.is_receiving && !peer.channel) {  // a channel is not read unless the peer has its turn either
+    m_uring->prepCancel((peer.slot << URING_OP_BITS) | URING_OP_RECV, URING_OP_CANCEL_RECV);
+  }
+}
+
+void Reactor::releaseLimited() {
+  if (m_limited.empty()) {
+    return;
+  }
+  int64_t now = Metrics::now();
+  int64_t deadline = 0;
+  size_t kept = 0;
+  for (Peer* peer : m_limited) {
+    int64_t ready_at = peer->limit.readyAt();
+    if (ready_at > now) {
+      m_limited[kept++] = peer;
+      deadline = kept == 1 ? ready_at : std::min(deadline, ready_at);
+      continue;
+    }
+    peer->is_limited = false;
+    if (m_uring && !peer->is_receiving) {
+      watch(*peer);  // otherwise its cancelled receive hasn't completed yet and is re-armed when it does
+    }
+    schedule(*peer);
+  }
+  m_limited.resize(kept);
+  if (kept > 0) {
+    armTimer(deadline);
+  }
+}
+
+void Reactor::enqueue(Peer& peer, const BufferRef& frame) {
+  if (peer.is_closing) {
+    return;
+  }
+  if (!peer.outbound.push(frame)) {
+    markClosing(peer);  // slow consumer
+    return;
+  }
+  if (!peer.is_dirty) {
+    peer.is_dirty = true;
+    m_dirty.push_back(&peer);
+  }
+}
+
+void Reactor::flushPeer(Peer& peer) {
+  if (m_uring && !peer.channel) {
+    submitSend(peer);
+    return;
+  }
+  size_t queued = peer.outbound.bytes();
+  if (queued > 0) {  // not just EPOLLOUT of a peer with nothing to send
+    Metrics::record(HISTOGRAM_QUEUE_BYTES, queued);
+    Metrics::record(HISTOGRAM_BATCH_FRAMES, peer.outbound.frames());
+    OutboundQueue::Status status = peer.outbound.flush();
+    Metrics::add(COUNTER_BYTES_OUT, queued - peer.outbound.bytes());
+    if (status == OutboundQueue::FAILED) {
+      Metrics::add(COUNTER_SEND_ERRORS);
+      markClosing(peer);
+      return;
+    }
+  }
+  // PENDING: the rest goes out on EPOLLOUT, or when the client of a channel has read
+  if (peer.isReplaying()) {
+    m_server.pumpReplay(peer);  // refills the queue, flushed again by flushDirty()
+  }
+}
+
+void Reactor::flushDirty() {
+  bool is_batching = m_server.m_config.outbound.isBatching();
+  int64_t now = is_batching && !m_dirty.empty() ? OutboundQueue::now() : 0;
+  int64_t deadline = 0;
+  size_t kept = 0;
+  for (size_t i = 0; i < m_dirty.size(); ++i) {  // a replay may add peers while flushing
+    Peer* peer = m_dirty[i];
+    if (is_batching && !peer->is_closing && !peer->outbound.empty() && !peer->outbound.isBatchDue(now)) {
+      m_dirty[kept++] = peer;  // stays dirty until its batch fills up or times out
+      deadline = kept == 1 ? peer->outbound.batchDeadline() : std::min(deadline, peer->outbound.batchDeadline());
+      continue;
+    }
+    peer->is_dirty = false;
+    if (!peer->is_closing) {
+      flushPeer(*peer);
+    }
+  }
+  m_dirty.resize(kept);  // closing peers never stay, closeMarked() may release them
+  if (kept > 0) {
+    armTimer(deadline);
+  }
+}
+
+void Reactor::armTimer(int64_t deadline) {
+  if (m_timer_deadline != 0 && m_timer_deadline <= deadline) {
+    return;  // fires in time, whatever isn't due by then is re-armed
+  }
+  itimerspec value;
+  memset(&value, 0, sizeof(value));
+  value.it_value.tv_sec = deadline / 1000000000;
+  value.it_value.tv_nsec = deadline % 1000000000;
+  timerfd_settime(m_timer, TFD_TIMER_ABSTIME, &value, nullptr);
+  m_timer_deadline = deadline;
+}
+
+void Reactor::markClosing(Peer& peer) {
+  if (!peer.is_closing) {
+    peer.is_closing = true;
+    m_closing.push_back(&peer);
+  }
+}
+
+void Reactor::closeMarked() {
+  size_t kept = 0;
+  for (Peer* peer : m_closing) {
+    if (peer->is_ready) {
+      m_ready.erase(std::find(m_ready.begin(), m_ready.end(), peer));
+      peer->is_ready = false;
+    }
+    if (peer->is_limited) {
+      m_limited.erase(std::find(m_limited.begin(), m_limited.end(), peer));
+      peer->is_limited = false;
+    }
+    if (peer->pending_ops > 0) {  // the kernel still uses its buffers: make the operations end first
+      if (peer->channel && peer->is_receiving) {  // its polls stay armed otherwise
+        m_uring->prepCancel((peer->slot << URING_OP_BITS) | URING_OP_CHANNEL, URING_OP_CANCEL_RECV);
+        m_uring->prepCancel((peer->slot << URING_OP_BITS) | URING_OP_HANGUP, URING_OP_CANCEL_RECV);
+        peer->is_receiving = false;
+      }
+      shutdown(peer->socket, SHUT_RDWR);
+      m_closing[kept++] = peer;
+      continue;
+    }
+    if (!m_uring) {
+      epoll_ctl(m_epoll, EPOLL_CTL_DEL, peer->socket, nullptr);
+      if (peer->channel) {
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, peer->channel->event(), nullptr);
+      }
+    }
+    m_server.closeSessions(*peer);
+    m_server.parkSession(*peer);
+    m_channels.leaveAll(peer);
+    // the client sees the end of stream now; the descriptor itself is closed when the peer is reclaimed,
+    // so that a fan-out still holding the peer can't write into a socket that reused its number
+    shutdown(peer->socket, SHUT_RDWR);
+    m_peers.remove(peer->slot);  // O(1)
+    Metrics::add(COUNTER_CLOSED);
+    if (m_server.m_capture) {
+      m_server.m_capture->record(CAPTURE_CLOSE, peer->id);
+    }
+  }
+  m_closing.resize(kept);
+}
+
+// ----------------------------------------------
+void Reactor::runUring() {
+  while (!m_server.m_is_stopped) {  // server loop
+    // sends of the previous iteration, recycled buffers and re-armed receives go with the same enter
+    int result = m_uring->submitAndWait(m_ready.empty() ? 1 : 0);
+    if (result < 0 && result != -EINTR && result != -EAGAIN && result != -EBUSY) {
+      ERR("io_uring_enter error: %s", strerror(-result));
+      break;
+    }
+    m_uring->forEachCompletion([this](const io_uring_cqe& cqe) { onUringCompletion(cqe); });
+
+    releaseLimited();
+    serveReady();
+    flushDirty();
+    closeMarked();
+  }
+}
+
+void Reactor::onUringCompletion(const io_uring_cqe& cqe) {
+  uint8_t op = cqe.user_data & ((1 << URING_OP_BITS) - 1);
+  bool is_more = cqe.flags & IORING_CQE_F_MORE;  // multishot operation stays armed
+
+  switch (op) {
+    case URING_OP_ACCEPT:
+    case URING_OP_ACCEPT_UNIX:
+    case URING_OP_ACCEPT_SHM: {
+      Peer* peer = cqe.res >= 0 ? addPeer(cqe.res, op == URING_OP_ACCEPT_SHM) : nullptr;
+      if (peer != nullptr) {
+        m_server.sendHello(*peer);
+        if (!m_server.m_is_stopped) {  // otherwise it is closed or handed over as it is
+          watch(*peer);
+        }
+      } else if (cqe.res < 0 && !m_server.m_is_stopped) {
+        ERR("Failed to open new socket for data transfer: %s", strerror(-cqe.res));
+      }
+      if (!is_more && !m_server.m_is_stopped) {
+        int listen_socket = op == URING_OP_ACCEPT ? m_socket : op == URING_OP_ACCEPT_UNIX ? m_server.m_unix_socket : m_server.m_shm_socket;
+        m_uring->prepAccept(listen_socket, op);
+      }
+      return;
+    }
+    case URING_OP_WAKEUP: {
+      readEvent(m_wakeup);
+      drainInbox();
+      if (!is_more && !m_server.m_is_stopped) {
+        m_uring->prepPoll(m_wakeup, POLLIN, URING_OP_WAKEUP);
+      }
+      return;
+    }
+    case URING_OP_TIMER: {
+      readEvent(m_timer);
+      m_timer_deadline = 0;
+      if (!is_more && !m_server.m_is_stopped) {
+        m_uring->prepPoll(m_timer, POLLIN, URING_OP_TIMER);
+      }
+      return;
+    }
+    case URING_OP_CANCEL:
+      m_is_cancelled = true;
+      return;
+    case URING_OP_CANCEL_RECV:
+      return;  // the receive itself completes with -ECANCELED, or has completed already
+  }
+
+  Peer* peer = m_peers.at(cqe.user_data >> URING_OP_BITS);
+  if (peer == nullptr) {
+    ERR("Completion for a released peer slot %llu", (unsigned long long) (cqe.user_data >> URING_OP_BITS));
+    return;
+  }
+  if (op == URING_OP_RECV) {
+    onUringRecv(*peer, cqe);
+  } else if (op == URING_OP_SEND) {
+    onUringSend(*peer, cqe);
+  } else {
+    onUringChannel(*peer, cqe);
+  }
+}
+
+void Reactor::onUringRecv(Peer& peer, const io_uring_cqe& cqe) {
+  bool is_more = cqe.flags & IORING_CQE_F_MORE;
+  if (!is_more) {
+    --peer.pending_ops;
+    peer.is_receiving = false;
+  }
+  if (cqe.flags & IORING_CQE_F_BUFFER) {
+    uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe.res > 0 && !peer.is_closing) {
+      Metrics::add(COUNTER_BYTES_IN, cqe.res);
+      char* buffer = peer.decoder.prepare(cqe.res);
+      memcpy(buffer, m_uring->buffer(id), cqe.res);
+      peer.decoder.commit(cqe.res);
+      DBG("Raw request[%i bytes]: %.*s", cqe.res, cqe.res, buffer);
+      if (!m_server.m_is_stopped) {  // after a stop it stays for the next process
+        schedule(peer);
+      }
+    }
+    m_uring->recycleBuffer(id);
+  }
+
+  if (cqe.res == -ENOBUFS) {  // every provided buffer is taken, they are back once this batch is handled
+    ++m_server.m_uring_stats.buffer_shortages;
+  } else if (cqe.res == -ECANCELED) {
+    // by holdBack() or handOver()
+  } else if (cqe.res <= 0) {
+    if (cqe.res < 0 && cqe.res != -ECONNRESET && !peer.is_closing) {
+      ERR("get request error: %s", strerror(-cqe.res));
+    }
+    DBG("Connection closed");
+    markClosing(peer);
+    return;
+  }
+  if (!is_more && !peer.is_closing && !peer.is_limited && !m_server.m_is_stopped &&
+      peer.decoder.buffered() < REACTOR_BACKLOG_BYTES) {  // otherwise re-armed when its turn has caught up
+    watch(peer);
+  }
+}
+
+void Reactor::onUringSend(Peer& peer, const io_uring_cqe& cqe) {
+  --peer.pending_ops;
+  if (peer.is_closing) {
+    return;  // socket is shut down, the write fails or doesn't matter
+  }
+  if (cqe.res > 0) {
+    Metrics::add(COUNTER_BYTES_OUT, cqe.res);
+  }
+  OutboundQueue::Status status = peer.outbound.complete(cqe.res == -ECANCELED ? 0 : cqe.res);  // nothing was sent
+  if (status == OutboundQueue::FAILED) {
+    Metrics::add(COUNTER_SEND_ERRORS);
+    markClosing(peer);
+    return;
+  }
+  if (peer.isReplaying()) {
+    m_server.pumpReplay(peer);
+  }
+  if (status == OutboundQueue::PENDING && !m_server.m_is_stopped) {
+    submitSend(peer);  // the rest, or what was queued meanwhile
+  }
+}
+
+// the channel's event and the socket are polled instead of receiving: the frames are in shared memory
+void Reactor::onUringChannel(Peer& peer, const io_uring_cqe& cqe) {
+  uint8_t op = cqe.user_data & ((1 << URING_OP_BITS) - 1);
+  bool is_more = cqe.flags & IORING_CQE_F_MORE;
+  if (!is_more) {
+    --peer.pending_ops;
+  }
+  if (cqe.res <= 0 || peer.is_closing || m_server.m_is_stopped) {
+    return;  // cancelled: it is being closed or handed over
+  }
+  if (op == URING_OP_HANGUP) {
+    m_server.finishChannel(peer);
+    markClosing(peer);
+    return;
+  }
+  peer.channel->clearEvent();
+  schedule(peer);
+  if (!peer.outbound.empty()) {
+    flushPeer(peer);
+  }
+  if (!is_more) {
+    m_uring->prepPoll(peer.channel->event(), POLLIN, (peer.slot << URING_OP_BITS) | URING_OP_CHANNEL);
+    ++peer.pending_ops;
+  }
+}
+
+// ----------------------------------------------
+void Reactor::handOver(HandoffState* state) {
+  if (m_uring) {  // the kernel may hold received bytes not reaped yet and sends in flight: they all complete first
+    m_uring->prepCancelAll(URING_OP_CANCEL);
+    m_is_cancelled = false;
+    int pending_ops = 1;
+    while (!m_is_cancelled || pending_ops > 0) {
+      int result = m_uring->submitAndWait(1);
+      if (result < 0 && result != -EINTR && result != -EAGAIN && result != -EBUSY) {
+        ERR("io_uring_enter error: %s", strerror(-result));
+        break;
+      }
+      m_uring->forEachCompletion([this](const io_uring_cqe& cqe) { onUringCompletion(cqe); });
+      pending_ops = 0;
+      m_peers.forEach([&](int /* id */, Peer& peer) { pending_ops += peer.pending_ops; });
+    }
+  }
+  drainInbox();  // posted by other reactors before they stopped
+  closeMarked();
+
+  m_peers.forEach([&](int /* id */, Peer& peer) {
+    if (peer.carrier == nullptr && !m_server.savePeer(peer, state)) {
+      m_server.parkSession(peer);  // closed with this process, its client comes back for the session
+    }
+  });
+  state->listen_sockets.push_back(m_socket);
+}
+
+// handOver() has cancelled the operations of io_uring, epoll registrations are still there
+void Reactor::resume() {
+  if (m_uring) {
+    armUring();
+  } else {
+    setNonBlocking(m_socket);  // the next process may have made it blocking
+  }
+  m_timer_deadline = 0;  // re-armed by flushDirty()
+  m_peers.forEach([&](int /* id */, Peer& peer) {
+    if (peer.carrier != nullptr || peer.is_closing) {
+      return;
+    }
+    if (m_uring) {
+      peer.is_receiving = false;
+      watch(peer);
+    }
+    schedule(peer);  // whatever came meanwhile, a turn with nothing to read costs one EAGAIN
+    if (!peer.outbound.empty()) {
+      flushPeer(peer);
+    }
+  });
+}
+
+void Reactor::submitSend(Peer& peer) {
+  if (peer.is_closing || peer.outbound.isWriting() || peer.outbound.empty()) {
+    return;  // a write in flight picks up the new frames on completion
+  }
+  if (peer.send_parts.empty()) {
+    peer.send_parts.resize(OUTBOUND_MAX_IOV);
+  }
+  Metrics::record(HISTOGRAM_QUEUE_BYTES, peer.outbound.bytes());
+  memset(&peer.send_header, 0, sizeof(peer.send_header));
+  peer.send_header.msg_iov = peer.send_parts.data();
+  peer.send_header.msg_iovlen = peer.outbound.gather(peer.send_parts.data(), OUTBOUND_MAX_IOV);
+  Metrics::record(HISTOGRAM_BATCH_FRAMES, peer.send_header.msg_iovlen);
+  m_uring->prepSendmsg(peer.socket, &peer.send_header, MSG_NOSIGNAL, (peer.slot << URING_OP_BITS) | URING_OP_SEND);
+  ++peer.pending_ops;
+}
+
+/* Точка входа в программу */
+// --------------------------------------------------------------------------------------------------------------------
+static Server* server_instance = nullptr;
+
+static void onSignal(int /* signal_number */) {
+  if (server_instance != nullptr) {
+    server_instance->stop();
+  }
+}
+
+int main(int argc, char** argv) {
+  ServerConfig config;
+  std::string federation_path;
+  if (argc > 1) {
+    config.port = std::atoi(argv[1]);
+  }
+  for (int i = 2; i < argc; ++i) {
+    std::string option(argv[i]);
+    if (option == "--mode=threads") {
+      config.mode = ServerMode::THREADS;
+    } else if (option == "--mode=epoll") {
+      config.mode = ServerMode::EPOLL;
+    } else if (option == "--mode=uring") {
+      config.mode = ServerMode::URING;
+    } else if (option.find("--workers=") == 0) {
+      config.workers = std::atoi(option.c_str() + 10);
+    } else if (option.find("--queue-bytes=") == 0) {
+      config.outbound.max_bytes = std::atol(option.c_str() + 14);
+    } else if (option == "--overflow=drop-oldest") {
+      config.outbound.policy = OverflowPolicy::DROP_OLDEST;
+    } else if (option == "--overflow=disconnect") {
+      config.outbound.policy = OverflowPolicy::DISCONNECT;
+    } else if (option == "--overflow=block") {
+      config.outbound.policy = OverflowPolicy::BLOCK;
+    } else if (option.find("--block-timeout=") == 0) {
+      config.outbound.block_timeout_ms = std::atoi(option.c_str() + 16);
+    } else if (option == "--delivery=latency") {
+      config.outbound.delivery = DeliveryMode::LATENCY;
+    } else if (option == "--delivery=throughput") {
+      config.outbound.delivery = DeliveryMode::THROUGHPUT;
+    } else if (option.find("--batch-delay=") == 0) {
+      config.outbound.batch_delay_us = std::atoi(option.c_str() + 14);
+    } else if (option.find("--batch-bytes=") == 0) {
+      config.outbound.batch_bytes = std::atol(option.c_str() + 14);
+    } else if (option.find("--rate-limit=") == 0) {
+      config.limit.rate = std::atol(option.c_str() + 13);
+    } else if (option.find("--rate-burst=") == 0) {
+      config.limit.burst = std::atol(option.c_str() + 13);
+    } else if (option == "--rate-policy=delay") {
+      config.limit.policy = LimitPolicy::DELAY;
+    } else if (option == "--rate-policy=reject") {
+      config.limit.policy = LimitPolicy::REJECT;
+    } else if (option.find("--max-sessions=") == 0) {
+      config.max_sessions = std::atol(option.c_str() + 15);
+    } else if (option == "--compression") {
+      config.compression = true;
+    } else if (option.find("--history=") == 0) {
+      config.history.directory = option.substr(10);
+    } else if (option.find("--history-segment-bytes=") == 0) {
+      config.history.segment_bytes = std::atol(option.c_str() + 24);
+    } else if (option.find("--history-bytes=") == 0) {
+      config.history.max_bytes = std::atol(option.c_str() + 16);
+    } else if (option.find("--history-age=") == 0) {
+      config.history.max_age_s = std::atoi(option.c_str() + 14);
+    } else if (option.find("--resume=") == 0) {
+      config.resume.messages = std::atol(option.c_str() + 9);
+    } else if (option.find("--resume-window=") == 0) {
+      config.resume.window_s = std::atoi(option.c_str() + 16);
+    } else if (option.find("--federation=") == 0) {
+      federation_path = option.substr(13);
+    } else if (option.find("--node=") == 0) {
+      config.federation.node = std::atoi(option.c_str() + 7);
+    } else if (option.find("--handoff=") == 0) {
+      config.handoff_path = option.substr(10);
+    } else if (option.find("--unix=") == 0) {
+      config.unix_path = option.substr(7);
+    } else if (option.find("--shm=") == 0) {
+      config.shm_path = option.substr(6);
+    } else if (option.find("--shm-ring=") == 0) {
+      config.shm_ring = std::atol(option.c_str() + 11);
+    } else if (option.find("--capture=") == 0) {
+      config.capture_path = option.substr(10);
+    } else if (option.find("--admin=") == 0) {
+      config.admin_path = option.substr(8);
+    } else if (option.find("--log-level=") == 0 && AsyncLog::parseLevel(option.c_str() + 12) >= 0) {
+      AsyncLog::setLevel(AsyncLog::parseLevel(option.c_str() + 12));
+    } else if (option.find("--log-file=") == 0) {
+      if (!AsyncLog::instance().open(option.c_str() + 11)) {
+        ERR("Failed to open log file %s: %s", option.c_str() + 11, strerror(errno));
+        return 1;
+      }
+    } else {
+      ERR("Unknown option: %s", option.c_str());
+      printf("Usage: %s [port] [--mode=threads|epoll|uring] [--workers=N] [--queue-bytes=N] "
+             "[--overflow=drop-oldest|disconnect|block] [--block-timeout=MS]\n"
+             "       [--delivery=latency|throughput] [--batch-delay=US] [--batch-bytes=N] [--compression]\n"
+             "       [--rate-limit=FRAMES_PER_S] [--rate-burst=N] [--rate-policy=delay|reject] [--max-sessions=N]\n"
+             "       [--history=DIR] [--history-segment-bytes=N] [--history-bytes=N] [--history-age=S]\n"
+             "       [--resume=MESSAGES] [--resume-window=S] [--federation=FILE --node=N] [--handoff=SOCKET_PATH]\n"
+             "       [--unix=SOCKET_PATH] [--shm=SOCKET_PATH] [--shm-ring=BYTES] [--capture=FILE]\n"
+             "       [--admin=SOCKET_PATH] [--log-level=fatal|critical|error|warning|info|debug|verbose|trace] [--log-file=PATH]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (!federation_path.empty() || config.federation.node != 0) {
+    if (config.federation.node < 1 || federation_path.empty() || !config.federation.read(federation_path)) {
+      ERR("--federation=FILE needs --node=N of a node listed there");
+      return 1;
+    }
+  }
+  Server server(config);
+  server_instance = &server;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onSignal;  // no SA_RESTART: blocking calls return EINTR
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
   server.run();
+  server_instance = nullptr;
   return 0;
 }
 
@@ -0,0 +1,371 @@
+#ifndef SHMRING__H__
+#define SHMRING__H__
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "logger.h"
+
+#define SHM_MAGIC 0x53484d31  // "SHM1"
+#define SHM_HEADER_SIZE 4096  // the rings' data follows, page-aligned
+#define SHM_DEFAULT_RING_SIZE (1024 * 1024)
+#define SHM_WAIT_SLICE_MS 100  // a blocked writer looks at its socket this often: the other side may be gone
+
+enum ShmWaiter : uint32_t {
+  SHM_WAITER_NONE = 0,
+  SHM_WAITER_EVENT = 1,  // wants the eventfd of its side signalled
+  SHM_WAITER_FUTEX = 2   // sleeps on the waiter word itself
+};
+
+// one direction in shared memory; positions only grow, the data offset is position & (size - 1)
+struct ShmRing {
+  alignas(64) std::atomic<uint64_t> head;  // bytes written, by the producer
+  std::atomic<uint32_t> room_waiter;       // a producer that found the ring full, cleared by the consumer
+  alignas(64) std::atomic<uint64_t> tail;  // bytes read, by the consumer
+  std::atomic<uint32_t> data_waiter;       // a consumer that found the ring empty, cleared by the producer
+};
+
+struct ShmLayout {
+  uint32_t magic;
+  uint32_t ring_size;
+  ShmRing rings[2];  // client to server, server to client
+};
+
+/**
+ * Byte stream between a client and the server on one host: a single-producer single-consumer ring
+ * per direction in a memfd both processes map. The frames are the same as over a socket, only copied
+ * instead of sent. Nobody makes a syscall per message: a side that has drained its ring announces
+ * that it is going to sleep and the other one signals it only then, through the eventfd of the
+ * sleeping side (which the server's loops and the client's receiver wait on together with the unix
+ * socket the channel was set up over, whose hang-up ends the channel) or through a futex for a
+ * writer blocked until there is room. Reads and writes of one direction are each done by one
+ * thread at a time, the owner serializes them.
+ *
+ * The other side can write anything into the mapping: a distance between head and tail beyond the
+ * ring's size is not believed, the channel is broken from then on and neither reads nor writes.
+ */
+class ShmChannel {
+public:
+  ~ShmChannel();
+
+  static ShmChannel* create(size_t ring_size);  // server side, nullptr on failure
+  bool sendSetup(int socket) const;  // to the client, over the unix socket it has connected with
+  static ShmChannel* receiveSetup(int socket);  // client side, nullptr on failure
+
+  size_t write(const char* data, size_t size);  // as much as fits
+  size_t write(const iovec* parts, int count);
+  size_t read(char* out, size_t size);  // as much as there is
+  bool isBroken() const { return m_is_broken; }  // 0 from write() or read() means nothing more ever will
+
+  size_t available() const { return m_in->head.load(std::memory_order_acquire) - m_in->tail.load(std::memory_order_relaxed); }
+
+  // before waiting on event(): false - no need, there is data or room already
+  bool sleepUntilData();
+  bool sleepUntilRoom();
+  bool writeAll(const char* data, size_t size, int socket);  // blocks on a futex, false - socket is gone
+
+  int event() const { return m_event; }  // of this side: data to read or room to write
+  void clearEvent();
+
+private:
+  int m_memory;  // memfd
+  int m_event;
+  int m_remote_event;  // of the other side
+  bool m_is_server;
+  ShmLayout* m_layout;
+  size_t m_mapped;
+  ShmRing* m_in;
+  ShmRing* m_out;
+  char* m_in_data;
+  char* m_out_data;
+  uint64_t m_mask;
+  bool m_is_broken;
+
+  ShmChannel(int memory, int event, int remote_event, bool is_server);
+  bool map(size_t size);
+  void wake(std::atomic<uint32_t>& waiter);
+
+  ShmChannel(const ShmChannel&) = delete;
+  ShmChannel& operator = (const ShmChannel&) = delete;
+};
+
+// ----------------------------------------------
+inline ShmChannel::ShmChannel(int memory, int event, int remote_event, bool is_server)
+  : m_memory(memory), m_event(event), m_remote_event(remote_event), m_is_server(is_server), m_layout(nullptr), m_mapped(0),
+    m_in(nullptr), m_out(nullptr), m_in_data(nullptr), m_out_data(nullptr), m_mask(0),
+    m_is_broken(false) {}
+
+inline ShmChannel::~ShmChannel() {
+  if (m_layout != nullptr) {
+    munmap(m_layout, m_mapped);
+  }
+  for (int it : { m_memory, m_event, m_remote_event }) {
+    if (it >= 0) {
+      close(it);
+    }
+  }
+}
+
+inline bool ShmChannel::map(size_t size) {
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_memory, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  m_layout = static_cast<ShmLayout*>(memory);
+  m_mapped = size;
+  m_mask = m_layout->ring_size - 1;
+  char* data = static_cast<char*>(memory) + SHM_HEADER_SIZE;
+  m_in = &m_layout->rings[m_is_server ? 0 : 1];
+  m_out = &m_layout->rings[m_is_server ? 1 : 0];
+  m_in_data = data + (m_is_server ? 0 : m_layout->ring_size);
+  m_out_data = data + (m_is_server ? m_layout->ring_size : 0);
+  return true;
+}
+
+inline ShmChannel* ShmChannel::create(size_t ring_size) {
+  size_t size = 4096;
+  while (size < ring_size) {  // positions are masked
+    size *= 2;
+  }
+  int memory = static_cast<int>(syscall(SYS_memfd_create, "chat-shm", 1u /* MFD_CLOEXEC */));
+  int server_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int client_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ShmChannel* channel = new ShmChannel(memory, server_event, client_event, true);
+  if (memory < 0 || server_event < 0 || client_event < 0 || ftruncate(memory, SHM_HEADER_SIZE + 2 * size) < 0) {
+    ERR("Failed to create shared memory channel: %s", strerror(errno));
+    delete channel;
+    return nullptr;
+  }
+  void* memory_view = mmap(nullptr, SHM_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+  if (memory_view == MAP_FAILED) {
+    ERR("Failed to map shared memory channel: %s", strerror(errno));
+    delete channel;
+    return nullptr;
+  }
+  ShmLayout* layout = new (memory_view) ShmLayout();  // a fresh memfd is zeroed, the atomics start at 0
+  layout->magic = SHM_MAGIC;
+  layout->ring_size = static_cast<uint32_t>(size);
+  for (ShmRing& it : layout->rings) {
+    it.data_waiter.store(SHM_WAITER_EVENT);  // neither side has looked at its ring yet: the first write is signalled
+  }
+  munmap(memory_view, SHM_HEADER_SIZE);
+  if (!channel->map(SHM_HEADER_SIZE + 2 * size)) {
+    ERR("Failed to map shared memory channel: %s", strerror(errno));
+    delete channel;
+    return nullptr;
+  }
+  return channel;
+}
+
+// the memfd and both eventfds, the client's own first
+inline bool ShmChannel::sendSetup(int socket) const {
+  uint32_t magic = SHM_MAGIC;
+  iovec part = { &magic, sizeof(magic) };
+  int fds[3] = { m_memory, m_remote_event, m_event };
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  cmsghdr* rights = CMSG_FIRSTHDR(&message);
+  rights->cmsg_level = SOL_SOCKET;
+  rights->cmsg_type = SCM_RIGHTS;
+  rights->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(rights), fds, sizeof(fds));
+  ssize_t sent;
+  while ((sent = sendmsg(socket, &message, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+  return sent == sizeof(magic);
+}
+
+inline ShmChannel* ShmChannel::receiveSetup(int socket) {
+  uint32_t magic = 0;
+  iovec part = { &magic, sizeof(magic) };
+  int fds[3] = { -1, -1, -1 };
+  char control[CMSG_SPACE(sizeof(fds))];
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t read_bytes;
+  while ((read_bytes = recvmsg(socket, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL)) < 0 && errno == EINTR) {}
+  cmsghdr* rights = read_bytes > 0 ? CMSG_FIRSTHDR(&message) : nullptr;
+  if (rights != nullptr && rights->cmsg_level == SOL_SOCKET && rights->cmsg_type == SCM_RIGHTS &&
+      rights->cmsg_len == CMSG_LEN(sizeof(fds))) {
+    memcpy(fds, CMSG_DATA(rights), sizeof(fds));
+  }
+  ShmChannel* channel = new ShmChannel(fds[0], fds[1], fds[2], false);
+  struct stat info;
+  if (read_bytes != sizeof(magic) || magic != SHM_MAGIC || fds[0] < 0 || fstat(fds[0], &info) < 0 ||
+      static_cast<size_t>(info.st_size) <= SHM_HEADER_SIZE || !channel->map(info.st_size) ||
+      channel->m_layout->magic != SHM_MAGIC ||
+      SHM_HEADER_SIZE + 2 * static_cast<off_t>(channel->m_layout->ring_size) != info.st_size) {
+    ERR("Failed to set up shared memory channel with Server");
+    delete channel;
+    return nullptr;
+  }
+  return channel;
+}
+
+// ----------------------------------------------
+inline size_t ShmChannel::write(const char* data, size_t size) {
+  iovec part = { const_cast<char*>(data), size };
+  return write(&part, 1);
+}
+
+inline size_t ShmChannel::write(const iovec* parts, int count) {
+  uint64_t head = m_out->head.load(std::memory_order_relaxed);
+  uint64_t used = head - m_out->tail.load(std::memory_order_acquire);
+  if (m_is_broken || used > m_mask + 1) {  // a tail past the head or a lap behind
+    m_is_broken = true;
+    return 0;
+  }
+  uint64_t room = m_mask + 1 - used;
+  size_t written = 0;
+  for (int i = 0; i < count && room > 0; ++i) {
+    const char* data = static_cast<const char*>(parts[i].iov_base);
+    size_t size = std::min<uint64_t>(parts[i].iov_len, room);
+    size_t offset = (head + written) & m_mask;
+    size_t first = std::min<size_t>(size, m_mask + 1 - offset);  // up to the end of the ring, then from its start
+    memcpy(m_out_data + offset, data, first);
+    memcpy(m_out_data, data + first, size - first);
+    written += size;
+    room -= size;
+  }
+  if (written == 0) {
+    return 0;
+  }
+  m_out->head.store(head + written, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);  // the head before the waiter, see sleepUntilData()
+  wake(m_out->data_waiter);
+  return written;
+}
+
+inline size_t ShmChannel::read(char* out, size_t size) {
+  uint64_t tail = m_in->tail.load(std::memory_order_relaxed);
+  uint64_t used = m_in->head.load(std::memory_order_acquire) - tail;
+  if (m_is_broken || used > m_mask + 1) {
+    m_is_broken = true;
+    return 0;
+  }
+  size = std::min<uint64_t>(size, used);
+  if (size == 0) {
+    return 0;
+  }
+  size_t offset = tail & m_mask;
+  size_t first = std::min<size_t>(size, m_mask + 1 - offset);
+  memcpy(out, m_in_data + offset, first);
+  memcpy(out + first, m_in_data, size - first);
+  m_in->tail.store(tail + size, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  wake(m_in->room_waiter);
+  return size;
+}
+
+// the waiter is set before the ring is looked at again and the other side looks at the waiter after it
+// has moved its position: either this side sees the new position or the other one sees the waiter
+inline bool ShmChannel::sleepUntilData() {
+  m_in->data_waiter.store(SHM_WAITER_EVENT, std::memory_order_seq_cst);
+  return m_in->head.load(std::memory_order_seq_cst) == m_in->tail.load(std::memory_order_relaxed);
+}
+
+inline bool ShmChannel::sleepUntilRoom() {
+  m_out->room_waiter.store(SHM_WAITER_EVENT, std::memory_order_seq_cst);
+  return m_out->head.load(std::memory_order_relaxed) - m_out->tail.load(std::memory_order_seq_cst) > m_mask;
+}
+
+inline bool ShmChannel::writeAll(const char* data, size_t size, int socket) {
+  while (size > 0) {
+    size_t written = write(data, size);
+    data += written;
+    size -= written;
+    if (size == 0) {
+      break;
+    }
+    if (m_is_broken) {
+      return false;
+    }
+    m_out->room_waiter.store(SHM_WAITER_FUTEX, std::memory_order_seq_cst);
+    if (m_out->head.load(std::memory_order_relaxed) - m_out->tail.load(std::memory_order_seq_cst) <= m_mask) {
+      continue;  // room already
+    }
+    timespec timeout = { 0, SHM_WAIT_SLICE_MS * 1000000L };
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_out->room_waiter), FUTEX_WAIT, SHM_WAITER_FUTEX, &timeout, nullptr, 0);
+    pollfd descriptor = { socket, POLLIN, 0 };  // nothing is ever sent over it: readable means closed
+    if (poll(&descriptor, 1, 0) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline void ShmChannel::clearEvent() {
+  uint64_t value = 0;
+  while (::read(m_event, &value, sizeof(value)) < 0 && errno == EINTR) {}
+}
+
+inline void ShmChannel::wake(std::atomic<uint32_t>& waiter) {
+  if (waiter.load(std::memory_order_relaxed) == SHM_WAITER_NONE) {
+    return;  // the common case under load: the other side is busy, no syscall
+  }
+  switch (waiter.exchange(SHM_WAITER_NONE)) {
+    case SHM_WAITER_EVENT: {
+      uint64_t value = 1;
+      if (::write(m_remote_event, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        ERR("Failed to wake the other side of a shared memory channel: %s", strerror(errno));
+      }
+      break;
+    }
+    case SHM_WAITER_FUTEX:
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&waiter), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+      break;
+  }
+}
+
+// ----------------------------------------------
+inline bool localAddress(const std::string& path, sockaddr_un* address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address->sun_path)) {
+    ERR("Unix socket path is too long: %s", path.c_str());
+    return false;
+  }
+  strncpy(address->sun_path, path.c_str(), sizeof(address->sun_path) - 1);
+  return true;
+}
+
+// a client's stream to the server's unix socket at path, -1 on failure
+inline int connectLocal(const std::string& path) {
+  sockaddr_un address;
+  if (!localAddress(path, &address)) {
+    return -1;
+  }
+  int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket >= 0 && connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+    close(socket);
+    socket = -1;
+  }
+  return socket;
+}
+
+#endif  // SHMRING__H__
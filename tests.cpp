@@ -0,0 +1,1534 @@
+/**
+ * Unit tests of the header-only modules, and a few of a real Server process talked to over its unix socket.
+ *
+ *   ./tests [NAME...]
+ *
+ * Runs the named tests, all of them without arguments; ctest runs each one on its own (CMakeLists.txt).
+ * A failed check prints its file, line and condition, and the test goes on with the next one.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "asynclog.h"
+#include "capture.h"
+#include "channels.h"
+#include "compression.h"
+#include "handoff.h"
+#include "histogram.h"
+#include "history.h"
+#include "outbound.h"
+#include "protocol.h"
+#include "registry.h"
+#include "ratelimit.h"
+#include "resume.h"
+#include "shmring.h"
+#include "textscan.h"
+
+#ifndef TESTS_SERVER_PATH
+#define TESTS_SERVER_PATH "./server"
+#endif
+
+#define CHECK(condition) check(condition, #condition, __FILE__, __LINE__)
+
+static int g_failures = 0;
+
+static void check(bool is_passed, const char* condition, const char* file, int line) {
+  if (!is_passed) {
+    printf("%s:%i: failed: %s\n", file, line, condition);
+    ++g_failures;
+  }
+}
+
+// bytes into a decoder the way a socket gives them, step at a time
+static void feed(FrameDecoder& decoder, const std::string& data, size_t step) {
+  for (size_t i = 0; i < data.size(); i += step) {
+    size_t size = std::min(step, data.size() - i);
+    memcpy(decoder.prepare(size), data.data() + i, size);
+    decoder.commit(size);
+  }
+}
+
+static std::string tempPath(const char* name) {
+  return "/tmp/tests-" + std::to_string(getpid()) + "-" + name;
+}
+
+static Message makeMessage(int id, const std::string& channel, const std::string& text) {
+  Message message;
+  message.id = id;
+  message.channel = channel;
+  message.login = "tester";
+  message.text = text;
+  return message;
+}
+
+static BufferRef makeFrame(size_t size, char fill) {
+  BufferRef frame = BufferPool::instance().acquire(size);
+  frame->setSize(size);
+  memset(frame->data(), fill, size);
+  return frame;
+}
+
+/* Кадры и поля */
+// --------------------------------------------------------------------------------------------------------------------
+static void testDecoder() {
+  std::string stream;
+  encodeMessage(MessageView(makeMessage(7, "", "binary")), 1, stream);
+  encodeText(MessageView(makeMessage(8, "", "text")), stream);
+  encodeChannelCommand(stream, FRAME_JOIN, Slice("room"));
+
+  for (size_t step : { static_cast<size_t>(1), static_cast<size_t>(3), stream.size() }) {  // frames cut anywhere come out whole
+    FrameDecoder decoder;
+    std::vector<Frame> frames;
+    std::vector<std::string> raw;
+    Frame frame;
+    for (size_t i = 0; i < stream.size(); i += step) {
+      feed(decoder, stream.substr(i, step), step);
+      while (decoder.next(&frame) == FrameDecoder::FRAME) {
+        MessageView view;
+        if (frame.type == FRAME_MESSAGE || frame.type == FRAME_TEXT) {
+          CHECK(frame.type == FRAME_MESSAGE ? MessageView::fromFrame(frame, &view) : MessageView::fromText(frame.payload, &view));
+          raw.push_back(view.login.str() + ":" + view.text.str() + ":" + std::to_string(view.id));
+        } else {
+          Slice channel;
+          CHECK(readChannelCommand(frame, &channel));
+          raw.push_back(channel.str());
+        }
+        frames.push_back(frame);
+      }
+    }
+    CHECK(frames.size() == 3);
+    CHECK(raw.size() == 3 && raw[0] == "tester:binary:7" && raw[1] == "tester:text:8" && raw[2] == "room");
+    CHECK(frames.size() == 3 && frames[0].version == 1 && frames[1].version == 0 && frames[2].type == FRAME_JOIN);
+    CHECK(decoder.buffered() == 0 && decoder.next(&frame) == FrameDecoder::NEED_MORE);
+  }
+
+  FrameDecoder decoder;  // unget() gives the same frame again
+  feed(decoder, stream, stream.size());
+  Frame first, again;
+  CHECK(decoder.next(&first) == FrameDecoder::FRAME);
+  decoder.unget();
+  CHECK(decoder.next(&again) == FrameDecoder::FRAME && again.payload.size == first.payload.size);
+  CHECK(decoder.last().size == PROTOCOL_HEADER_SIZE + first.payload.size);
+
+  FrameDecoder small(64);  // a binary frame longer than the limit, a text one without its NUL in time
+  std::string big;
+  encodeMessage(MessageView(makeMessage(1, "", std::string(100, 'x'))), 1, big);
+  feed(small, big, big.size());
+  CHECK(small.next(&first) == FrameDecoder::BROKEN);
+  FrameDecoder endless(64);
+  feed(endless, std::string(100, 'x'), 100);
+  CHECK(endless.next(&first) == FrameDecoder::BROKEN);
+  FrameDecoder unversioned;
+  std::string zero = big;
+  zero[1] = 0;
+  feed(unversioned, zero, zero.size());
+  CHECK(unversioned.next(&first) == FrameDecoder::BROKEN);
+}
+
+static void testUnterminated() {
+  FrameDecoder decoder;  // a legacy server's hello: the id and nothing else
+  feed(decoder, "17", 2);
+  Frame frame;
+  CHECK(decoder.next(&frame) == FrameDecoder::NEED_MORE);
+  CHECK(decoder.nextUnterminated(&frame));
+  CHECK(frame.type == FRAME_TEXT && frame.payload.str() == "17" && decoder.buffered() == 0);
+  CHECK(!decoder.nextUnterminated(&frame));
+
+  std::string hello;
+  encodeHello(hello, 1, 5);
+  FrameDecoder binary;
+  feed(binary, hello.substr(0, 3), 3);
+  CHECK(!binary.nextUnterminated(&frame));  // binary frames wait for their length
+}
+
+static bool isSameMarks(const TextMarks& lhs, const TextMarks& rhs) {
+  return lhs.scanned == rhs.scanned && lhs.id_end == rhs.id_end && lhs.login_end == rhs.login_end;
+}
+
+// the same buffer given at once or as it arrives, step bytes at a time
+static TextMarks scanWith(TextScanFunction scan, const std::string& data, size_t step, size_t* result) {
+  TextMarks marks;
+  for (size_t size = std::min(step, data.size()); ; size = std::min(size + step, data.size())) {
+    *result = scan(data.data(), size, &marks);
+    if (*result < size || size == data.size()) {
+      return marks;
+    }
+  }
+}
+
+// SIMD scanners find what the scalar one finds, on delimiter-heavy random buffers
+static void testTextScan() {
+  std::vector<TextScanFunction> scanners = { scanTextScalar };
+#ifdef TEXTSCAN_SIMD
+  scanners.push_back(scanTextSse2);
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scanners.push_back(scanTextAvx2);
+  }
+#endif
+  const char alphabet[] = { 'a', 'b', '@', '@', '#', '#', '\0' };
+  uint32_t random = 2024;
+  for (int round = 0; round < 20000; ++round) {
+    random = random * 1103515245 + 12345;
+    std::string data((random >> 8) % 150, 'x');
+    for (char& it : data) {
+      random = random * 1103515245 + 12345;
+      it = alphabet[(random >> 16) % (round % 7 == 0 ? 7 : 6)];  // mostly without a NUL
+    }
+    size_t step = round % 3 == 0 ? 1 + (random >> 24) % 40 : data.size() + 1;
+    size_t expected_result = 0;
+    TextMarks expected = scanWith(scanTextScalar, data, data.size() + 1, &expected_result);
+    for (TextScanFunction scan : scanners) {
+      size_t result = 0;
+      TextMarks marks = scanWith(scan, data, step, &result);
+      CHECK(result == expected_result && isSameMarks(marks, expected));
+    }
+  }
+
+  std::string frame("12@@li##ne@@##text\0next@@", 26);  // delimiters past the first ones and the NUL don't count
+  for (TextScanFunction scan : scanners) {
+    size_t result = 0;
+    TextMarks marks = scanWith(scan, frame, 5, &result);
+    CHECK(result == 18 && marks.id_end == 2 && marks.login_end == 6);
+  }
+}
+
+static void testFields() {
+  std::string hello;
+  std::string token(16, '\x5a');
+  encodeHello(hello, 1, 42, COMPRESSION_DEFLATE, 0x123456789ULL, Slice(token));
+  FrameDecoder decoder;
+  feed(decoder, hello, hello.size());
+  Frame frame;
+  CHECK(decoder.next(&frame) == FrameDecoder::FRAME && frame.type == FRAME_HELLO);
+  int version = 0, compression = 0, id = -1;
+  uint64_t sequence = 0;
+  Slice received_token;
+  CHECK(readHello(frame, &version, &compression, &id, &sequence, &received_token));
+  CHECK(version == 1 && compression == COMPRESSION_DEFLATE && id == 42 && sequence == 0x123456789ULL);
+  CHECK(received_token.str() == token);
+
+  std::string message;
+  encodeMessage(MessageView(makeMessage(-3, "news", "with a channel")), 1, message);
+  Frame message_frame;
+  FrameDecoder message_decoder;
+  feed(message_decoder, message, message.size());
+  MessageView view;
+  CHECK(message_decoder.next(&message_frame) == FrameDecoder::FRAME && MessageView::fromFrame(message_frame, &view));
+  CHECK(view.id == -3 && view.channel.str() == "news" && view.text.str() == "with a channel");
+  CHECK(message.compare(PROTOCOL_CHANNEL_OFFSET, 4, "news") == 0);
+
+  std::string opened;
+  encodeSession(opened, FRAME_OPEN, 9, 1001);
+  FrameDecoder session_decoder;
+  feed(session_decoder, opened, opened.size());
+  uint32_t number = 0;
+  int peer_id = -1;
+  CHECK(session_decoder.next(&frame) == FrameDecoder::FRAME && readOpened(frame, &number, &peer_id));
+  CHECK(number == 9 && peer_id == 1001);
+
+  uint32_t sessions[] = { 1, 2, 70000 };
+  std::string route(routeSize(3, message.size()), '\0');
+  CHECK(writeRoute(sessions, 3, Slice(message), &route[0]) == route.data() + route.size());
+  FrameDecoder route_decoder;
+  feed(route_decoder, route, route.size());
+  Slice recipients;
+  Frame routed;
+  CHECK(route_decoder.next(&frame) == FrameDecoder::FRAME && readRoute(frame, &recipients, &routed));
+  CHECK(recipients.size == 12 && readUint32(recipients.data + 8) == 70000);
+  CHECK(routed.type == FRAME_MESSAGE && MessageView::fromFrame(routed, &view) && view.id == -3);
+
+  std::string truncated;  // a field longer than the payload left
+  appendIntField(truncated, FIELD_ID, 5);
+  truncated.resize(truncated.size() - 1);
+  FieldReader reader{Slice(truncated)};
+  uint8_t tag;
+  Slice value;
+  CHECK(!reader.next(&tag, &value) && reader.isBroken());
+  int result = 0;
+  CHECK(!readIntField(Slice("abc", 3), &result));
+}
+
+/* Асинхронный лог */
+// --------------------------------------------------------------------------------------------------------------------
+// a record for the log and what printf makes of it
+template <typename... Args>
+static void logBoth(std::string* expected, const char* format, Args... args) {
+  AsyncLog::instance().log(LOG_INFO, format, args...);
+  char line[256];
+  snprintf(line, sizeof(line), format, args...);
+  *expected += line;
+}
+
+static std::string readFile(const std::string& path) {
+  std::string data;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  char chunk[4096];
+  ssize_t read_bytes;
+  while (fd >= 0 && (read_bytes = read(fd, chunk, sizeof(chunk))) > 0) {
+    data.append(chunk, read_bytes);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return data;
+}
+
+static void testAsyncLog() {
+  std::string path = tempPath("async.log");
+  unlink(path.c_str());
+  AsyncLog& log = AsyncLog::instance();
+  CHECK(log.open(path.c_str()));
+  std::string expected;
+  logBoth(&expected, "%.*s|%.2s|%s\n", 3, "abcdef", "two", "whole");
+  logBoth(&expected, "%*d|%-*d|%*.*s|%10.3s|\n", 6, 42, 5, 7, 8, 2, "xyz", "abcdef");
+  logBoth(&expected, "100%% done, %d%%, %%s stays\n", 5);
+  logBoth(&expected, "%i %u %x %X %o %c%c\n", -5, 4000000000u, 255, 255, 8, 'o', 'k');
+  logBoth(&expected, "%lu %llx %hhd %hu %zu\n", 123ul, 255ull, 300, 70000, static_cast<size_t>(9));
+  logBoth(&expected, "%5.2f|%e|%g|%p\n", 3.14159, 0.5, 1e20, static_cast<void*>(&expected));
+  logBoth(&expected, "%-8s|%8s|\n", "left", "right");
+  usleep(50000);  // written before the rest
+
+  std::vector<std::thread> threads;  // bursts overflow the threads' own rings into the shared one, then stop
+  for (int thread = 0; thread < 8; ++thread) {
+    threads.emplace_back([thread]() {
+      for (int i = 0; i < 12000; ++i) {
+        AsyncLog::instance().log(LOG_INFO, "thread %d record %d\n", thread, i);
+        if (i % 600 == 599) {
+          usleep(1000);
+        }
+      }
+    });
+  }
+  for (auto& it : threads) {
+    it.join();
+  }
+  log.stop();  // everything is written; later records are written at once
+  std::string written = readFile(path);
+  CHECK(written.compare(0, expected.size(), expected) == 0);
+
+  int last[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };  // each thread's records in order, some may be dropped
+  bool is_ordered = true;
+  for (size_t i = expected.size(); i < written.size(); ) {
+    size_t end = written.find('\n', i);
+    int thread = -1, record = -1;
+    if (sscanf(written.substr(i, end - i).c_str(), "thread %d record %d", &thread, &record) == 2) {
+      is_ordered &= thread >= 0 && thread < 8 && record > last[thread];
+      last[thread] = record;
+    }
+    i = end == std::string::npos ? written.size() : end + 1;
+  }
+  CHECK(is_ordered);
+  unlink(path.c_str());
+}
+
+/* Гистограмма и лимиты */
+// --------------------------------------------------------------------------------------------------------------------
+static void testHistogram() {
+  LatencyHistogram histogram;
+  CHECK(histogram.percentile(50) == 0 && histogram.count() == 0);
+  for (uint64_t value = 1; value <= 100000; ++value) {
+    histogram.record(value);
+  }
+  CHECK(histogram.count() == 100000 && histogram.max() == 100000);
+  CHECK(histogram.mean() > 50000.4 && histogram.mean() < 50000.6);
+  for (double percent : { 1.0, 50.0, 99.0, 99.9 }) {  // within a bucket's 1%
+    double expected = percent * 1000;
+    double actual = static_cast<double>(histogram.percentile(percent));
+    CHECK(actual >= expected && actual <= expected * 1.01);
+  }
+  CHECK(histogram.percentile(100) >= 100000 && histogram.percentile(100) <= 101000);
+
+  LatencyHistogram small;  // exact below 128
+  for (uint64_t value : { 3, 3, 5, 127 }) {
+    small.record(value);
+  }
+  CHECK(small.percentile(50) == 3 && small.percentile(75) == 5 && small.percentile(100) == 127);
+
+  small.merge(histogram);
+  CHECK(small.count() == 100004 && small.max() == 100000);
+  small.reset();
+  CHECK(small.count() == 0 && small.max() == 0 && small.percentile(99) == 0);
+}
+
+static void testTokenBucket() {
+  const int64_t second = 1000000000;
+  TokenBucket bucket;
+  CHECK(!bucket.isLimited());
+  for (int i = 0; i < 1000; ++i) {
+    CHECK(bucket.take(second));
+  }
+
+  bucket.setLimit(10, 5);  // a full bucket first, then 10 per second
+  int64_t now = 100 * second;
+  int taken = 0;
+  while (bucket.take(now)) {
+    ++taken;
+  }
+  CHECK(bucket.isLimited() && taken == 5);
+  CHECK(bucket.readyAt() > now && bucket.readyAt() <= now + second / 10 + 1000);  // a microsecond late at most
+  CHECK(!bucket.take(now + second / 20));
+  CHECK(bucket.take(now + second / 10 + 1000));
+  CHECK(!bucket.take(now + second / 10 + 1000));
+  taken = 0;
+  while (bucket.take(now + 10 * second)) {  // a long quiet time refills up to the burst only
+    ++taken;
+  }
+  CHECK(taken == 5);
+
+  TokenBucket defaulted;
+  defaulted.setLimit(20, 0);  // burst of a second's worth
+  taken = 0;
+  while (defaulted.take(now)) {
+    ++taken;
+  }
+  CHECK(taken == 20);
+  defaulted.setLimit(0, 0);
+  CHECK(!defaulted.isLimited() && defaulted.take(now));
+}
+
+/* Реестр и каналы */
+// --------------------------------------------------------------------------------------------------------------------
+struct Counted {
+  static int s_alive;
+  int value;
+
+  explicit Counted(int value): value(value) { ++s_alive; }
+  ~Counted() { --s_alive; }
+};
+
+int Counted::s_alive = 0;
+
+static std::vector<int> registryKeys(const Registry<Counted>& registry) {
+  std::vector<int> keys;
+  registry.forEach([&](int key, Counted& item) {
+    CHECK(item.value == key * 10);
+    keys.push_back(key);
+  });
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+static void testRegistry() {
+  {
+    Registry<Counted> registry;
+    std::vector<size_t> slots;
+    for (int key = 0; key < 5; ++key) {
+      slots.push_back(registry.add(new Counted(key * 10), key));
+    }
+    CHECK(registry.size() == 5 && registry.at(slots[2])->value == 20 && registry.at(1000) == nullptr);
+    registry.remove(slots[1]);
+    registry.remove(slots[3]);
+    registry.remove(slots[3]);  // twice is harmless
+    CHECK(registry.size() == 3 && registry.at(slots[1]) == nullptr);
+    CHECK(registryKeys(registry) == std::vector<int>({ 0, 2, 4 }));
+    CHECK(Counted::s_alive == 5);  // retired, not deleted yet
+
+    size_t slot = registry.add(new Counted(70), 7);  // retired slots are not reused before they are reclaimed
+    CHECK(slot != slots[1] && slot != slots[3]);
+    registry.reclaim();
+    CHECK(Counted::s_alive == 4);
+    size_t reused = registry.add(new Counted(80), 8);
+    CHECK(reused == slots[1] || reused == slots[3]);
+
+    registry.at(slots[0])->value = 90;
+    registry.setKey(slots[0], 9);
+    CHECK(registryKeys(registry) == std::vector<int>({ 2, 4, 7, 8, 9 }));
+
+    std::vector<size_t> many;  // a batch of removals is reclaimed by itself, across chunks
+    for (int key = 100; key < 100 + REGISTRY_CHUNK_SIZE + REGISTRY_RETIRE_BATCH; ++key) {
+      many.push_back(registry.add(new Counted(key * 10), key));
+    }
+    CHECK(Counted::s_alive == 5 + static_cast<int>(many.size()));
+    for (size_t i = 0; i < REGISTRY_RETIRE_BATCH; ++i) {
+      registry.remove(many[i]);
+    }
+    CHECK(Counted::s_alive == 5 + static_cast<int>(many.size()) - REGISTRY_RETIRE_BATCH);
+  }
+  CHECK(Counted::s_alive == 0);
+
+  {  // removals wait for readers that could see the removed item
+    Registry<Counted> registry;
+    std::atomic<bool> is_done(false);
+    std::atomic<long> bad(0);
+    std::thread reader([&]() {
+      while (!is_done) {
+        registry.forEach([&](int key, Counted& item) {
+          if (item.value != key * 10) {
+            ++bad;
+          }
+        });
+      }
+    });
+    for (int round = 0; round < 200; ++round) {
+      std::vector<size_t> slots;
+      for (int key = 0; key < 50; ++key) {
+        slots.push_back(registry.add(new Counted(key * 10), key));
+      }
+      for (size_t slot : slots) {
+        registry.remove(slot);
+      }
+    }
+    is_done = true;
+    reader.join();
+    CHECK(bad == 0 && registry.size() == 0);
+  }
+  CHECK(Counted::s_alive == 0);
+}
+
+struct Member {
+  int id;
+  std::vector<ChannelIndex<Member>::Subscription> subscriptions;
+
+  explicit Member(int id): id(id) {}
+};
+
+static std::vector<int> channelKeys(const ChannelIndex<Member>& index, const std::string& name) {
+  std::vector<int> keys;
+  size_t count = index.forEach(Slice(name), [&](int key, Member& member) {
+    CHECK(member.id == key);
+    keys.push_back(key);
+  });
+  CHECK(count == keys.size());
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+// both sides' back references stay right whichever subscription is removed
+static bool isConsistent(const std::vector<Member*>& members) {
+  for (Member* member : members) {
+    for (size_t i = 0; i < member->subscriptions.size(); ++i) {
+      const auto& subscription = member->subscriptions[i];
+      const auto& entry = subscription.channel->members[subscription.position];
+      if (entry.item != member || entry.subscription != i) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void testChannels() {
+  ChannelIndex<Member> index;
+  Member a(1), b(2), c(3);
+  std::vector<Member*> members = { &a, &b, &c };
+  for (Member* member : members) {
+    CHECK(index.join(member, member->id, Slice("all", 3)));
+  }
+  CHECK(!index.join(&a, 1, Slice("all", 3)));
+  CHECK(index.join(&a, 1, Slice("x", 1), 42) && index.join(&b, 2, Slice("x", 1)) && index.join(&a, 1, Slice("y", 1)));
+  CHECK(index.size() == 3 && a.subscriptions[1].since == 42);
+  CHECK(channelKeys(index, "all") == std::vector<int>({ 1, 2, 3 }));
+  CHECK(channelKeys(index, "x") == std::vector<int>({ 1, 2 }) && channelKeys(index, "none").empty());
+
+  CHECK(index.leave(&a, Slice("all", 3)) && !index.leave(&a, Slice("all", 3)));  // from the front of both arrays
+  CHECK(channelKeys(index, "all") == std::vector<int>({ 2, 3 }) && isConsistent(members));
+  CHECK(a.subscriptions.size() == 2);
+
+  CHECK(index.leave(&b, Slice("x", 1)) && isConsistent(members));
+  CHECK(channelKeys(index, "x") == std::vector<int>({ 1 }));
+
+  index.leaveAll(&a);  // its channels empty: x and y are gone
+  CHECK(a.subscriptions.empty() && index.size() == 1 && isConsistent(members));
+  CHECK(channelKeys(index, "x").empty() && channelKeys(index, "all") == std::vector<int>({ 2, 3 }));
+
+  std::vector<std::unique_ptr<Member>> crowd;  // random joins and leaves against a plain model
+  std::vector<std::vector<bool>> model(20, std::vector<bool>(5, false));
+  std::vector<Member*> all;
+  for (int id = 0; id < 20; ++id) {
+    crowd.emplace_back(new Member(100 + id));
+    all.push_back(crowd.back().get());
+  }
+  uint32_t random = 12345;
+  for (int step = 0; step < 5000; ++step) {
+    random = random * 1103515245 + 12345;
+    int who = (random >> 8) % 20, which = (random >> 16) % 5;
+    std::string name = "r" + std::to_string(which);
+    bool is_joined = model[who][which];
+    CHECK((random & 1 ? index.join(all[who], all[who]->id, Slice(name)) : index.leave(all[who], Slice(name))) ==
+          (random & 1 ? !is_joined : is_joined));
+    model[who][which] = random & 1;
+  }
+  CHECK(isConsistent(all));
+  for (int which = 0; which < 5; ++which) {
+    std::vector<int> expected;
+    for (int who = 0; who < 20; ++who) {
+      if (model[who][which]) {
+        expected.push_back(100 + who);
+      }
+    }
+    CHECK(channelKeys(index, "r" + std::to_string(which)) == expected);
+  }
+  for (Member* member : all) {
+    index.leaveAll(member);
+  }
+  index.leaveAll(&b);
+  index.leaveAll(&c);
+  CHECK(index.size() == 0);
+}
+
+/* История */
+// --------------------------------------------------------------------------------------------------------------------
+static void removeDirectory(const std::string& path) {
+  if (DIR* directory = opendir(path.c_str())) {
+    while (dirent* entry = readdir(directory)) {
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+        unlink((path + "/" + entry->d_name).c_str());
+      }
+    }
+    closedir(directory);
+  }
+  rmdir(path.c_str());
+}
+
+static void appendText(HistoryLog& log, const std::string& text) {
+  std::string raw;
+  encodeMessage(MessageView(makeMessage(1, "", text)), 1, raw);
+  log.append(raw.data(), raw.size());
+}
+
+// texts of a replay, all of its frames flagged as history
+static std::vector<std::string> replayTexts(HistoryCursor& cursor) {
+  std::vector<std::string> texts;
+  FrameDecoder decoder;
+  Frame frame;
+  MessageView view;
+  while (BufferRef chunk = cursor.next(1000)) {  // several chunks per replay
+    feed(decoder, std::string(chunk.data(), chunk.size()), chunk.size());
+    while (decoder.next(&frame) == FrameDecoder::FRAME) {
+      CHECK((frame.flags & FRAME_FLAG_HISTORY) != 0);
+      if (MessageView::fromFrame(frame, &view)) {
+        texts.push_back(view.text.str());
+      }
+    }
+  }
+  CHECK(cursor.count() == texts.size());
+  return texts;
+}
+
+static std::vector<std::string> numbered(int from, int to) {
+  std::vector<std::string> texts;
+  for (int i = from; i < to; ++i) {
+    texts.push_back("m" + std::to_string(i));
+  }
+  return texts;
+}
+
+static size_t segmentFiles(const std::string& path) {
+  size_t count = 0;
+  if (DIR* directory = opendir(path.c_str())) {
+    while (dirent* entry = readdir(directory)) {
+      count += strstr(entry->d_name, ".log") != nullptr;
+    }
+    closedir(directory);
+  }
+  return count;
+}
+
+static void testHistory() {
+  HistoryConfig config;
+  config.directory = tempPath("history");
+  config.segment_bytes = 4096;
+  config.max_bytes = 2 * 4096;
+  removeDirectory(config.directory);
+  HistoryCursor cursor;
+  int64_t middle = 0;
+  {
+    HistoryLog log(config);
+    for (int i = 0; i < 20; ++i) {
+      appendText(log, "m" + std::to_string(i));
+    }
+    CHECK(log.lastSequence() == 20 && segmentFiles(config.directory) == 1);
+    log.last(5, &cursor);
+    CHECK(replayTexts(cursor) == numbered(15, 20));
+    log.last(100, &cursor);
+    CHECK(replayTexts(cursor) == numbered(0, 20));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    middle = HistoryLog::now();
+    for (int i = 20; i < 200; ++i) {  // several segments, the oldest ones deleted beyond max_bytes
+      appendText(log, "m" + std::to_string(i));
+    }
+    CHECK(segmentFiles(config.directory) >= 2 && segmentFiles(config.directory) <= 3);
+    log.last(30, &cursor);
+    CHECK(replayTexts(cursor) == numbered(170, 200));  // across a segment boundary
+    log.since(middle, &cursor);
+    std::vector<std::string> texts = replayTexts(cursor);  // what is left of those sent since
+    CHECK(!texts.empty() && texts.size() < 180 && texts.back() == "m199");
+    CHECK(texts == numbered(200 - static_cast<int>(texts.size()), 200));
+    log.last(1000, &cursor);
+    CHECK(replayTexts(cursor) == texts);
+    log.since(HistoryLog::now() + 60000, &cursor);
+    CHECK(replayTexts(cursor).empty());
+
+    log.last(10, &cursor);  // a replay keeps its segments even when they are deleted meanwhile
+    for (int i = 200; i < 400; ++i) {
+      appendText(log, "m" + std::to_string(i));
+    }
+    CHECK(replayTexts(cursor) == numbered(190, 200));
+  }
+
+  {
+    HistoryLog log(config);  // recovered from the files
+    CHECK(log.lastSequence() == 400);
+    log.last(3, &cursor);
+    CHECK(replayTexts(cursor) == numbered(397, 400));
+    appendText(log, "m400");
+    CHECK(log.lastSequence() == 401);
+  }
+
+  config.directory = tempPath("history-old");  // an age limit deletes old segments, the current one stays
+  config.max_bytes = 1024 * 1024;
+  config.max_age_s = 1;
+  removeDirectory(config.directory);
+  {
+    HistoryLog log(config);
+    for (int i = 0; i < 100; ++i) {
+      appendText(log, "m" + std::to_string(i));
+    }
+    size_t files = segmentFiles(config.directory);
+    CHECK(files >= 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    appendText(log, "m100");
+    CHECK(segmentFiles(config.directory) == 1);
+    log.last(1000, &cursor);
+    std::vector<std::string> texts = replayTexts(cursor);
+    CHECK(!texts.empty() && texts.back() == "m100" && texts.size() < 101);
+  }
+  removeDirectory(tempPath("history"));
+  removeDirectory(config.directory);
+}
+
+/* Сжатие */
+// --------------------------------------------------------------------------------------------------------------------
+static void testCompression() {
+  std::vector<std::string> frames;
+  for (int i = 0; i < 20; ++i) {
+    std::string text;
+    while (text.size() < 400) {
+      text += "we deploy tomorrow if the build is green " + std::to_string(i) + " ";
+    }
+    std::string frame;
+    encodeMessage(MessageView(makeMessage(i, i % 2 == 0 ? "" : "ops", text)), 1, frame);
+    frames.push_back(frame);
+  }
+
+  for (bool is_streaming : { false, true }) {  // a client's stream, the server's frames each on its own
+    Deflater deflater(is_streaming);
+    Inflater inflater(is_streaming);
+    CHECK(deflater.isStreaming() == is_streaming);
+    std::string stream;
+    for (const std::string& frame : frames) {
+      CHECK(compressFrame(deflater, Slice(frame), stream));
+    }
+    size_t total = 0;
+    for (const std::string& frame : frames) {
+      total += frame.size();
+    }
+    CHECK(stream.size() < total / 2);
+
+    FrameDecoder decoder;
+    feed(decoder, stream, 1000);
+    Frame frame;
+    std::string inflated;
+    size_t count = 0;
+    while (decoder.next(&frame) == FrameDecoder::FRAME) {
+      CHECK(frame.flags & FRAME_FLAG_COMPRESSED);
+      CHECK(decompressFrame(inflater, &frame, &inflated));
+      CHECK(!(frame.flags & FRAME_FLAG_COMPRESSED));
+      CHECK(count < frames.size() && frame.payload.str() == frames[count].substr(PROTOCOL_HEADER_SIZE));
+      ++count;
+    }
+    CHECK(count == frames.size());
+  }
+
+  Deflater deflater(false);  // too small to bother, or not a binary frame
+  std::string out;
+  std::string small;
+  encodeMessage(MessageView(makeMessage(1, "", "hi")), 1, small);
+  CHECK(!compressFrame(deflater, Slice(small), out) && out.empty());
+  std::string text(300, 'a');
+  CHECK(!compressFrame(deflater, Slice(text), out) && out.empty());
+
+  Inflater inflater(false);
+  Frame garbage;
+  std::string noise(64, '\x77');
+  garbage.payload = Slice(noise);
+  garbage.flags = FRAME_FLAG_COMPRESSED;
+  std::string inflated;
+  CHECK(!decompressFrame(inflater, &garbage, &inflated));
+}
+
+/* Передача состояния */
+// --------------------------------------------------------------------------------------------------------------------
+static bool isOpen(int fd) {
+  return fcntl(fd, F_GETFD) != -1;
+}
+
+static void testHandoff() {
+  HandoffState state;
+  state.last_id = 1234;
+  state.next_sequence = 777;
+  std::vector<int> ours;  // the other ends, to tell the descriptors that came are the same sockets
+  auto pairOf = [&ours]() {
+    int pair[2] = { -1, -1 };
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair);
+    ours.push_back(pair[0]);
+    return pair[1];
+  };
+  state.listen_sockets.push_back(pairOf());
+  for (int i = 0; i < HANDOFF_MAX_FDS + 6; ++i) {  // more than one part
+    HandoffPeer peer;
+    peer.id = 100 + i;
+    peer.socket = pairOf();
+    peer.protocol = i % 2;
+    peer.accepted_sequence = 500 + i;
+    peer.first_sequence = 400 + i;
+    peer.token = std::string(16, static_cast<char>('a' + i % 26));
+    peer.channels = { "room" + std::to_string(i), "all" };
+    peer.joined = { 450, 460 + static_cast<uint64_t>(i) };
+    peer.received = std::string(i, 'r');
+    peer.unsent = std::string(2 * i, 'u');
+    state.peers.push_back(peer);
+  }
+  HandoffSession session;
+  session.id = 55;
+  session.first_sequence = 600;
+  session.next_sequence = 700;
+  session.deadline = 123456789;
+  session.token = "secret";
+  session.channels = { "news" };
+  session.joined = { 650 };
+  state.sessions.push_back(session);
+  HandoffMessage message;
+  message.sequence = 776;
+  message.sender_id = 101;
+  message.channel_size = 4;
+  encodeMessage(MessageView(makeMessage(101, "news", "recent")), 1, message.frame);
+  state.recent.push_back(message);
+
+  int pair[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0);
+  bool is_sent = false;
+  std::thread sender([&]() { is_sent = sendHandoff(pair[0], state); });
+  HandoffState received;
+  bool is_received = receiveHandoff(pair[1], &received);
+  CHECK(confirmHandoff(pair[1]));  // the one byte the old process waits for
+  sender.join();
+  CHECK(is_sent && is_received);
+
+  CHECK(received.last_id == 1234 && received.next_sequence == 777);
+  CHECK(received.listen_sockets.size() == 1 && received.peers.size() == state.peers.size());
+  for (size_t i = 0; i < received.peers.size() && i < state.peers.size(); ++i) {
+    const HandoffPeer& peer = received.peers[i];
+    const HandoffPeer& sent = state.peers[i];
+    CHECK(peer.id == sent.id && peer.protocol == sent.protocol && peer.accepted_sequence == sent.accepted_sequence);
+    CHECK(peer.first_sequence == sent.first_sequence && peer.joined == sent.joined);
+    CHECK(peer.token == sent.token && peer.channels == sent.channels);
+    CHECK(peer.received == sent.received && peer.unsent == sent.unsent);
+    CHECK(peer.socket != sent.socket && isOpen(peer.socket));
+    char byte = 'x';  // the same socket under another number: what one end writes the other reads
+    CHECK(write(ours[i + 1], &byte, 1) == 1);
+    char in = 0;
+    CHECK(read(peer.socket, &in, 1) == 1 && in == 'x');
+  }
+  CHECK(received.sessions.size() == 1);
+  if (received.sessions.size() == 1) {
+    const HandoffSession& parked = received.sessions[0];
+    CHECK(parked.id == 55 && parked.first_sequence == 600 && parked.next_sequence == 700 && parked.deadline == 123456789);
+    CHECK(parked.token == "secret" && parked.channels == session.channels && parked.joined == session.joined);
+  }
+  CHECK(received.recent.size() == 1);
+  if (received.recent.size() == 1) {
+    const HandoffMessage& recent = received.recent[0];
+    CHECK(recent.sequence == 776 && recent.sender_id == 101 && recent.channel_size == 4);
+    CHECK(recent.frame == message.frame);
+  }
+
+  HandoffState cut;  // the old process gone halfway
+  close(pair[0]);
+  CHECK(!receiveHandoff(pair[1], &cut));
+  close(pair[1]);
+
+  for (int it : received.listen_sockets) {
+    close(it);
+  }
+  for (const HandoffPeer& peer : received.peers) {
+    close(peer.socket);
+  }
+  for (const HandoffPeer& peer : state.peers) {
+    close(peer.socket);
+  }
+  for (int it : state.listen_sockets) {
+    close(it);
+  }
+  for (int it : ours) {
+    close(it);
+  }
+}
+
+/* Разделяемая память */
+// --------------------------------------------------------------------------------------------------------------------
+static void testShmChannel() {
+  std::unique_ptr<ShmChannel> server(ShmChannel::create(4096));
+  CHECK(server != nullptr);
+  if (!server) {
+    return;
+  }
+  int pair[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0);
+  CHECK(server->sendSetup(pair[0]));
+  std::unique_ptr<ShmChannel> client(ShmChannel::receiveSetup(pair[1]));
+  CHECK(client != nullptr);
+  if (!client) {
+    close(pair[0]);
+    close(pair[1]);
+    return;
+  }
+
+  char buffer[8192];
+  CHECK(server->write("to client", 9) == 9 && client->available() == 9);
+  CHECK(client->read(buffer, sizeof(buffer)) == 9 && memcmp(buffer, "to client", 9) == 0);
+  CHECK(client->write("to server", 9) == 9);
+  CHECK(server->read(buffer, sizeof(buffer)) == 9 && memcmp(buffer, "to server", 9) == 0);
+  CHECK(server->read(buffer, sizeof(buffer)) == 0 && !server->isBroken());
+
+  std::string big(6000, 'b');  // as much as fits, the rest when there is room again
+  CHECK(server->write(big.data(), big.size()) == 4096);
+  CHECK(server->write(big.data(), big.size()) == 0 && !server->isBroken());
+  CHECK(client->read(buffer, sizeof(buffer)) == 4096);
+
+  std::string sent, received;  // positions run around the ring many times
+  for (int i = 0; i < 200; ++i) {
+    std::string chunk(1000 + i * 7 % 1000, static_cast<char>('a' + i % 26));
+    iovec parts[2] = { { const_cast<char*>(chunk.data()), 10 }, { const_cast<char*>(chunk.data()) + 10, chunk.size() - 10 } };
+    size_t written = client->write(parts, 2);
+    CHECK(written == chunk.size());
+    sent += chunk.substr(0, written);
+    size_t read_bytes;
+    while ((read_bytes = server->read(buffer, 777)) > 0) {
+      received.append(buffer, read_bytes);
+    }
+  }
+  CHECK(received == sent);
+
+  int lone[2];  // a socket that sends no descriptors
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, lone) == 0);
+  uint32_t magic = SHM_MAGIC;
+  CHECK(write(lone[0], &magic, sizeof(magic)) == sizeof(magic));
+  std::unique_ptr<ShmChannel> bogus(ShmChannel::receiveSetup(lone[1]));
+  CHECK(bogus == nullptr);
+  for (int it : { pair[0], pair[1], lone[0], lone[1] }) {
+    close(it);
+  }
+}
+
+/* Запись трафика */
+// --------------------------------------------------------------------------------------------------------------------
+static void testCapture() {
+  std::string path = tempPath("capture");
+  {
+    CaptureWriter writer(path);
+    writer.record(CAPTURE_OPEN, 3);
+    writer.record(CAPTURE_FRAME, 3, Slice("first", 5));
+    writer.record(CAPTURE_FRAME, 4, Slice(std::string(1000, 'z')));
+    writer.record(CAPTURE_CLOSE, 3);
+    CHECK(writer.records() == 4 && writer.dropped() == 0);
+  }  // written out as the writer stops
+  struct stat info;
+  CHECK(stat(path.c_str(), &info) == 0 && (info.st_mode & 0777) == 0600);
+
+  {
+    CaptureReader reader(path);
+    CHECK(reader.startedAt() > 0);
+    CaptureRecord record;
+    int64_t last_time = 0;
+    std::vector<std::string> seen;
+    while (reader.next(&record)) {
+      CHECK(record.time_ns >= last_time);
+      last_time = record.time_ns;
+      seen.push_back(std::to_string(record.kind) + "/" + std::to_string(record.peer) + "/" + std::to_string(record.data.size));
+    }
+    CHECK(seen.size() == 4);
+    CHECK(seen.size() == 4 && seen[0] == "1/3/0" && seen[1] == "2/3/5" && seen[2] == "2/4/1000" && seen[3] == "3/3/0");
+    reader.rewind();
+    CHECK(reader.next(&record) && record.kind == CAPTURE_OPEN);
+  }
+
+  CHECK(truncate(path.c_str(), info.st_size - 1) == 0);  // a crash in the middle of the last record
+  {
+    CaptureReader reader(path);
+    CaptureRecord record;
+    int count = 0;
+    while (reader.next(&record)) {
+      ++count;
+    }
+    CHECK(count == 3);
+  }
+
+  int fd = open(path.c_str(), O_WRONLY | O_TRUNC);
+  CHECK(fd >= 0 && write(fd, "NOTACAPTUREFILE!", 16) == 16);
+  close(fd);
+  bool is_refused = false;
+  try {
+    CaptureReader reader(path);
+  } catch (const CaptureException&) {
+    is_refused = true;
+  }
+  CHECK(is_refused);
+  unlink(path.c_str());
+}
+
+/* Порядок сообщений при возобновлении */
+// --------------------------------------------------------------------------------------------------------------------
+static void testSequenceWindow() {
+  SequenceWindow window;
+  CHECK(window.watermark() == 0);
+  CHECK(window.add(0) && window.add(0));  // not numbered, never a duplicate
+  CHECK(window.watermark() == 0);
+
+  for (uint64_t sequence = 10; sequence <= 12; ++sequence) {
+    CHECK(window.add(sequence));
+  }
+  CHECK(window.watermark() == 12);
+  CHECK(!window.add(11));
+
+  CHECK(window.add(15) && window.add(14));  // 13 still to come, or not meant for this client
+  CHECK(window.watermark() == 12);
+  CHECK(window.add(13) && window.watermark() == 15);
+  CHECK(!window.add(13) && !window.add(15));
+
+  CHECK(window.add(15 + 2 * RESUME_REORDER_WINDOW));  // a jump: all but the last is missing
+  CHECK(window.watermark() == 15 + RESUME_REORDER_WINDOW);
+  CHECK(window.add(20));  // too old to tell, taken
+  CHECK(!window.add(15 + 2 * RESUME_REORDER_WINDOW));
+
+  window.reset();
+  CHECK(window.watermark() == 0 && window.add(11) && window.watermark() == 11);
+}
+
+static std::vector<uint64_t> readRing(const ResumeRing& ring, uint64_t* from, uint64_t end, size_t max) {
+  ResumeRing::Entry batch[8];
+  std::vector<uint64_t> sequences;
+  size_t count = ring.read(from, end, batch, std::min(max, sizeof(batch) / sizeof(batch[0])));
+  for (size_t i = 0; i < count; ++i) {
+    CHECK(batch[i].frame && batch[i].frame.data()[0] == static_cast<char>('a' + batch[i].sequence % 26));
+    CHECK(batch[i].sender_id == static_cast<int>(batch[i].sequence % 3));
+    sequences.push_back(batch[i].sequence);
+  }
+  return sequences;
+}
+
+static void testResumeRing() {
+  ResumeRing ring(5);  // 8 entries
+  CHECK(ring.next() == 1);
+  auto append = [&ring]() {
+    ring.append([](uint64_t sequence) {
+      return ResumeRing::Entry(static_cast<int>(sequence % 3), Slice(), makeFrame(16, static_cast<char>('a' + sequence % 26)));
+    });
+  };
+  for (int i = 0; i < 5; ++i) {
+    append();
+  }
+  uint64_t from = 2;
+  CHECK(readRing(ring, &from, 100, 8) == std::vector<uint64_t>({ 2, 3, 4, 5 }) && from == 6);
+  CHECK(readRing(ring, &from, 100, 8).empty() && from == 6);
+
+  for (int i = 0; i < 15; ++i) {  // around the ring twice: 13..20 are kept
+    append();
+  }
+  CHECK(ring.next() == 21);
+  from = 1;
+  CHECK(readRing(ring, &from, 16, 8) == std::vector<uint64_t>({ 13, 14, 15 }) && from == 16);
+  CHECK(readRing(ring, &from, 100, 3) == std::vector<uint64_t>({ 16, 17, 18 }) && from == 19);
+  CHECK(readRing(ring, &from, 100, 8) == std::vector<uint64_t>({ 19, 20 }) && from == 21);
+
+  ResumeRing numbers(0);  // no ring, only numbers
+  numbers.restart(100);
+  numbers.append([](uint64_t sequence) {
+    CHECK(sequence == 100);
+    return ResumeRing::Entry();
+  });
+  from = 1;
+  ResumeRing::Entry batch[4];
+  CHECK(numbers.next() == 101 && numbers.read(&from, 200, batch, 4) == 0);
+}
+
+/* Очередь исходящих */
+// --------------------------------------------------------------------------------------------------------------------
+// a peer that reads nothing: its socket takes no more bytes
+static void fillSocket(int socket) {
+  fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+  char chunk[4096] = {};
+  while (send(socket, chunk, sizeof(chunk), MSG_NOSIGNAL) > 0) {}
+}
+
+static void drainSocket(int socket) {
+  char chunk[4096];
+  while (recv(socket, chunk, sizeof(chunk), MSG_DONTWAIT) > 0) {}
+}
+
+static void testOutbound() {
+  int pair[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0);
+  fillSocket(pair[0]);
+  OutboundConfig config;
+  config.max_bytes = 1000;
+  OutboundStats stats;
+  std::string unsent;
+
+  {  // drop oldest
+    OutboundQueue queue(pair[0], config, &stats);
+    for (char fill : { 'a', 'b', 'c', 'd' }) {
+      CHECK(queue.push(makeFrame(300, fill)));
+    }
+    CHECK(queue.frames() == 3 && queue.bytes() == 900 && stats.dropped_messages == 1);
+    queue.copyUnsent(&unsent);
+    CHECK(unsent == std::string(300, 'b') + std::string(300, 'c') + std::string(300, 'd'));
+
+    CHECK(queue.push(makeFrame(1500, 'x')));  // larger than the limit: it goes, the queue stays
+    CHECK(queue.frames() == 3 && queue.bytes() == 900 && stats.dropped_messages == 2);
+
+    iovec parts[OUTBOUND_MAX_IOV];  // frames being written are pinned
+    CHECK(queue.gather(parts, OUTBOUND_MAX_IOV) == 3 && queue.isWriting());
+    CHECK(queue.push(makeFrame(300, 'e')));
+    CHECK(queue.frames() == 3 && stats.dropped_messages == 3);
+    CHECK(queue.flush() == OutboundQueue::PENDING);
+
+    CHECK(queue.complete(450) == OutboundQueue::PENDING && !queue.isWriting());
+    CHECK(queue.frames() == 2 && queue.bytes() == 450 && stats.written_messages == 1);
+    CHECK(queue.push(makeFrame(600, 'f')));  // the partly written front one stays, the next goes
+    CHECK(queue.frames() == 2 && queue.bytes() == 750 && stats.dropped_messages == 4);
+    queue.copyUnsent(&unsent);
+    CHECK(unsent == std::string(150, 'c') + std::string(600, 'f'));
+
+    CHECK(queue.gather(parts, 1) == 1 && parts[0].iov_len == 150);
+    CHECK(queue.complete(-EPIPE) == OutboundQueue::FAILED);
+  }
+
+  {  // disconnect
+    config.policy = OverflowPolicy::DISCONNECT;
+    OutboundQueue queue(pair[0], config, &stats);
+    CHECK(queue.push(makeFrame(600, 'a')));
+    CHECK(!queue.push(makeFrame(600, 'b')));
+    CHECK(queue.frames() == 1 && stats.disconnected_peers == 1);
+  }
+
+  {  // block: until the peer reads, or for block_timeout_ms at most
+    config.policy = OverflowPolicy::BLOCK;
+    config.block_timeout_ms = 50;
+    OutboundQueue queue(pair[0], config, &stats);
+    CHECK(queue.push(makeFrame(600, 'a')));
+    CHECK(!queue.push(makeFrame(600, 'b')));
+    CHECK(stats.blocked_sends == 1 && stats.disconnected_peers == 2);
+
+    config.block_timeout_ms = 5000;
+    std::thread reader([&pair]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      drainSocket(pair[1]);
+    });
+    CHECK(queue.push(makeFrame(600, 'c')));
+    reader.join();
+    CHECK(stats.blocked_sends == 2 && stats.disconnected_peers == 2);
+    CHECK(queue.bytes() <= config.max_bytes);
+  }
+
+  {  // gather-write of everything queued
+    drainSocket(pair[1]);
+    config.policy = OverflowPolicy::DROP_OLDEST;
+    OutboundQueue queue(pair[0], config, &stats);
+    long written = stats.written_messages;
+    CHECK(queue.push(makeFrame(10, 'a')) && queue.push(makeFrame(20, 'b')));
+    CHECK(queue.flush() == OutboundQueue::DRAINED && queue.empty() && queue.bytes() == 0);
+    CHECK(stats.written_messages == written + 2);
+    char buffer[64];
+    CHECK(recv(pair[1], buffer, sizeof(buffer), 0) == 30);
+    CHECK(memcmp(buffer, std::string(10, 'a').data(), 10) == 0 && memcmp(buffer + 10, std::string(20, 'b').data(), 20) == 0);
+  }
+  close(pair[0]);
+  close(pair[1]);
+}
+
+/* Сервер в отдельном процессе */
+// --------------------------------------------------------------------------------------------------------------------
+struct TestClient {  // a binary client of a server started by startServer(), blocking reads with a timeout
+  int socket;
+  int id;
+  std::string token;
+  FrameDecoder decoder;
+
+  TestClient(): socket(-1), id(-1) {}
+  ~TestClient() {
+    if (socket >= 0) {
+      close(socket);
+    }
+  }
+};
+
+// the server's process once its unix socket takes connections, -1 on failure
+static pid_t startServer(const std::string& unix_path, const std::vector<std::string>& options) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    std::vector<std::string> arguments = { TESTS_SERVER_PATH, "0", "--unix=" + unix_path, "--log-level=error" };
+    arguments.insert(arguments.end(), options.begin(), options.end());
+    std::vector<char*> argv;
+    for (auto& it : arguments) {
+      argv.push_back(&it[0]);
+    }
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+  for (int i = 0; pid > 0 && i < 500; ++i) {
+    int s = connectLocal(unix_path);
+    if (s >= 0) {
+      close(s);
+      return pid;
+    }
+    usleep(10000);
+  }
+  printf("Server %s did not start\n", TESTS_SERVER_PATH);
+  if (pid > 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+  }
+  return -1;
+}
+
+static void stopServer(pid_t pid, const std::string& unix_path) {
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+  unlink(unix_path.c_str());
+}
+
+static bool nextFrame(TestClient& client, Frame* frame, int timeout_ms) {
+  while (client.decoder.next(frame) != FrameDecoder::FRAME) {
+    pollfd descriptor = { client.socket, POLLIN, 0 };
+    if (poll(&descriptor, 1, timeout_ms) <= 0) {
+      return false;
+    }
+    ssize_t read_bytes = recv(client.socket, client.decoder.prepare(PROTOCOL_READ_SIZE), PROTOCOL_READ_SIZE, 0);
+    if (read_bytes <= 0) {
+      return false;
+    }
+    client.decoder.commit(read_bytes);
+  }
+  return true;
+}
+
+static bool sendAll(TestClient& client, const std::string& data) {
+  return handoffWriteAll(client.socket, data.data(), data.size());
+}
+
+// the text greeting, then binary hellos; resume_id - the session to take over with its token
+static bool connectClient(const std::string& unix_path, TestClient* client, int resume_id = -1, uint64_t last_sequence = 0,
+                          const std::string& token = std::string()) {
+  client->socket = connectLocal(unix_path);
+  Frame frame;
+  int server_version = 0;
+  if (client->socket < 0 || !nextFrame(*client, &frame, 2000) || frame.type != FRAME_TEXT ||
+      !parseTextHello(frame.payload, &client->id, &server_version)) {
+    return false;
+  }
+  std::string hello;
+  encodeHello(hello, 1, resume_id, COMPRESSION_NONE, last_sequence, Slice(token));
+  int version = 0, compression = 0;
+  Slice received_token;
+  if (!sendAll(*client, hello) || !nextFrame(*client, &frame, 2000) ||
+      !readHello(frame, &version, &compression, &client->id, nullptr, &received_token)) {
+    return false;
+  }
+  client->token = received_token.str();
+  return true;
+}
+
+static bool sendText(TestClient& client, const std::string& channel, const std::string& text) {
+  std::string raw;
+  encodeMessage(MessageView(makeMessage(client.id, channel, text)), 1, raw);
+  return sendAll(client, raw);
+}
+
+static bool join(TestClient& client, const std::string& channel) {
+  std::string raw;
+  encodeChannelCommand(raw, FRAME_JOIN, Slice(channel));
+  return sendAll(client, raw);
+}
+
+// texts of the messages that come in timeout_ms, or until one with text until
+static std::vector<std::string> receiveTexts(TestClient& client, int timeout_ms, const std::string& until = std::string()) {
+  std::vector<std::string> texts;
+  Frame frame;
+  MessageView view;
+  while (nextFrame(client, &frame, timeout_ms)) {
+    if (MessageView::fromFrame(frame, &view)) {  // text ones too: sent before the peer's hello took effect
+      texts.push_back(view.text.str());
+      if (!until.empty() && texts.back() == until) {
+        break;
+      }
+    }
+  }
+  return texts;
+}
+
+static bool contains(const std::vector<std::string>& texts, const std::string& text) {
+  return std::find(texts.begin(), texts.end(), text) != texts.end();
+}
+
+// a message is from the peer that sent it, whatever id its client wrote
+static void testSenderId() {
+  for (const char* mode : { "--mode=threads", "--mode=epoll" }) {
+    std::string path = tempPath("sender.socket");
+    pid_t pid = startServer(path, { mode });
+    CHECK(pid > 0);
+    if (pid < 0) {
+      return;
+    }
+    TestClient sender, impersonated, observer;
+    CHECK(connectClient(path, &sender) && connectClient(path, &impersonated) && connectClient(path, &observer));
+    std::string raw;
+    encodeMessage(MessageView(makeMessage(impersonated.id, "", "spoofed")), 1, raw);
+    CHECK(sendAll(sender, raw));
+    for (TestClient* client : { &impersonated, &observer }) {  // the impersonated one gets it too, it is not its own
+      Frame frame;
+      MessageView view;
+      bool is_received = false;
+      while (!is_received && nextFrame(*client, &frame, 2000)) {
+        is_received = MessageView::fromFrame(frame, &view) && view.text.str() == "spoofed";
+      }
+      CHECK(is_received && view.id == sender.id);
+    }
+    stopServer(pid, path);
+  }
+}
+
+// a client that resumes from message 1 gets what it missed, nothing from before its session or its joins
+static void testResume() {
+  for (const char* mode : { "--mode=threads", "--mode=epoll" }) {
+    std::string path = tempPath("resume.socket");
+    pid_t pid = startServer(path, { mode, "--resume=1000", "--resume-window=30" });
+    CHECK(pid > 0);
+    if (pid < 0) {
+      return;
+    }
+    TestClient sender, observer, resumed;
+    CHECK(connectClient(path, &sender) && connectClient(path, &observer));
+    CHECK(join(observer, "c") && sendText(observer, "", "observer ready"));
+    CHECK(contains(receiveTexts(sender, 2000, "observer ready"), "observer ready"));  // its join is done too
+
+    CHECK(sendText(sender, "", "before") && sendText(sender, "c", "channel before"));
+    CHECK(contains(receiveTexts(observer, 2000, "channel before"), "channel before"));
+
+    {
+      TestClient away;
+      CHECK(connectClient(path, &away));
+      CHECK(sendText(sender, "c", "channel before join"));
+      CHECK(contains(receiveTexts(observer, 2000, "channel before join"), "channel before join"));
+      CHECK(join(away, "c") && sendText(away, "", "away ready"));
+      CHECK(contains(receiveTexts(observer, 2000, "away ready"), "away ready"));
+      CHECK(sendText(sender, "c", "channel live"));
+      CHECK(contains(receiveTexts(away, 2000, "channel live"), "channel live"));
+      resumed.id = away.id;
+      resumed.token = away.token;
+    }  // disconnected
+    CHECK(sendText(sender, "", "missed") && sendText(sender, "c", "channel missed"));
+    CHECK(contains(receiveTexts(observer, 2000, "channel missed"), "channel missed"));
+
+    int id = resumed.id;
+    std::string token = resumed.token;
+    bool is_resumed = false;
+    for (int i = 0; i < 100 && !is_resumed; ++i) {  // once the server has parked the session
+      TestClient attempt;
+      if (connectClient(path, &attempt, id, 1, token) && attempt.id == id) {
+        std::swap(resumed.socket, attempt.socket);
+        std::swap(resumed.decoder, attempt.decoder);  // what came with the hello
+        is_resumed = true;
+      } else {
+        usleep(20000);
+      }
+    }
+    CHECK(is_resumed);
+    std::vector<std::string> texts = receiveTexts(resumed, 300);
+    CHECK(contains(texts, "missed") && contains(texts, "channel missed"));
+    CHECK(!contains(texts, "before") && !contains(texts, "channel before") && !contains(texts, "observer ready"));
+    CHECK(!contains(texts, "channel before join"));
+    CHECK(!contains(texts, "away ready"));  // its own
+    stopServer(pid, path);
+  }
+}
+
+// a sender waiting for a slow consumer holds nothing others need: a new peer joins and talks meanwhile
+static void testBlock() {
+  std::string path = tempPath("block.socket");
+  pid_t pid = startServer(path, { "--mode=threads", "--overflow=block", "--block-timeout=5000", "--queue-bytes=65536" });
+  CHECK(pid > 0);
+  if (pid < 0) {
+    return;
+  }
+  TestClient sender, slow, listener;
+  CHECK(connectClient(path, &sender) && connectClient(path, &slow) && connectClient(path, &listener));
+  CHECK(join(sender, "s") && join(sender, "c") && sendText(sender, "", "sender ready"));
+  CHECK(contains(receiveTexts(slow, 2000, "sender ready"), "sender ready"));
+  CHECK(contains(receiveTexts(listener, 2000, "sender ready"), "sender ready"));
+  CHECK(join(slow, "s") && sendText(slow, "s", "slow ready"));
+  CHECK(contains(receiveTexts(sender, 2000, "slow ready"), "slow ready"));
+  CHECK(join(listener, "c") && sendText(listener, "c", "listener ready"));
+  CHECK(contains(receiveTexts(sender, 2000, "listener ready"), "listener ready"));
+
+  std::thread flood([&sender]() {  // slow reads nothing, the sender's thread ends up waiting for it
+    std::string text(8192, 'f');
+    for (int i = 0; i < 300 && sendText(sender, "s", text); ++i) {}
+  });
+  usleep(300000);
+  TestClient late;
+  CHECK(connectClient(path, &late));
+  CHECK(join(late, "c") && sendText(late, "c", "late ready"));
+  CHECK(contains(receiveTexts(listener, 1000, "late ready"), "late ready"));
+
+  shutdown(slow.socket, SHUT_RDWR);  // lets the sender go on
+  flood.join();
+  stopServer(pid, path);
+}
+
+// a peer over its rate is held back under delay, losing nothing, and loses what is over under reject
+static void testRateLimit() {
+  for (const char* mode : { "--mode=threads", "--mode=epoll" }) {
+    std::string path = tempPath("limit.socket");
+    pid_t pid = startServer(path, { mode, "--rate-limit=100", "--rate-burst=10", "--rate-policy=delay" });
+    CHECK(pid > 0);
+    if (pid < 0) {
+      return;
+    }
+    TestClient sender, observer;
+    CHECK(connectClient(path, &sender) && connectClient(path, &observer));
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 40; ++i) {
+      CHECK(sendText(sender, "", "d" + std::to_string(i)));
+    }
+    std::vector<std::string> texts = receiveTexts(observer, 2000, "d39");
+    CHECK(texts.size() == 40 && texts.back() == "d39");
+    CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(250));  // 30 over the burst at 100 per second
+    stopServer(pid, path);
+
+    pid = startServer(path, { mode, "--rate-limit=1", "--rate-burst=5", "--rate-policy=reject" });
+    CHECK(pid > 0);
+    if (pid < 0) {
+      return;
+    }
+    TestClient flooder, listener;
+    CHECK(connectClient(path, &flooder) && connectClient(path, &listener));
+    for (int i = 0; i < 20; ++i) {
+      CHECK(sendText(flooder, "", "r" + std::to_string(i)));
+    }
+    texts = receiveTexts(listener, 500);
+    CHECK(texts.size() >= 5 && texts.size() <= 6);
+    CHECK(std::vector<std::string>(texts.begin(), texts.begin() + std::min<size_t>(5, texts.size())) ==
+          std::vector<std::string>({ "r0", "r1", "r2", "r3", "r4" }));
+    stopServer(pid, path);
+  }
+}
+
+// an event loop serves a flooding peer in turns: a frame of another peer does not wait for all of its frames
+static void testFairness() {
+  std::string path = tempPath("fairness.socket");
+  pid_t pid = startServer(path, { "--mode=epoll", "--workers=1" });
+  CHECK(pid > 0);
+  if (pid < 0) {
+    return;
+  }
+  TestClient flooder, prober, observer;
+  CHECK(connectClient(path, &flooder) && connectClient(path, &prober) && connectClient(path, &observer));
+  std::string flood;
+  for (int i = 0; i < 2000; ++i) {
+    encodeMessage(MessageView(makeMessage(flooder.id, "", "f" + std::to_string(i))), 1, flood);
+  }
+  kill(pid, SIGSTOP);  // both arrive while the loop is not looking
+  CHECK(sendAll(flooder, flood) && sendText(prober, "", "probe"));
+  kill(pid, SIGCONT);
+  std::vector<std::string> texts = receiveTexts(observer, 2000, "probe");
+  CHECK(!texts.empty() && texts.back() == "probe");
+  CHECK(texts.size() <= 65);  // the flooder had two turns before it at most, REACTOR_TURN_FRAMES each
+  stopServer(pid, path);
+}
+
+/* Main */
+// --------------------------------------------------------------------------------------------------------------------
+struct Test {
+  const char* name;
+  void (*run)();
+};
+
+static const Test g_tests[] = {
+  { "decoder", testDecoder },
+  { "unterminated", testUnterminated },
+  { "text_scan", testTextScan },
+  { "fields", testFields },
+  { "async_log", testAsyncLog },
+  { "histogram", testHistogram },
+  { "token_bucket", testTokenBucket },
+  { "registry", testRegistry },
+  { "channels", testChannels },
+  { "history", testHistory },
+  { "compression", testCompression },
+  { "handoff", testHandoff },
+  { "shm_channel", testShmChannel },
+  { "capture", testCapture },
+  { "sequence_window", testSequenceWindow },
+  { "resume_ring", testResumeRing },
+  { "outbound", testOutbound },
+  { "sender_id", testSenderId },
+  { "resume", testResume },
+  { "block", testBlock },
+  { "rate_limit", testRateLimit },
+  { "fairness", testFairness },
+};
+
+int main(int argc, char** argv) {
+  signal(SIGPIPE, SIG_IGN);  // a server gone shows up as a failed check
+  std::vector<const Test*> selected;
+  for (int i = 1; i < argc; ++i) {
+    const Test* found = nullptr;
+    for (const Test& test : g_tests) {
+      if (strcmp(argv[i], test.name) == 0) {
+        found = &test;
+      }
+    }
+    if (found == nullptr) {
+      printf("Unknown test %s, there are:", argv[i]);
+      for (const Test& test : g_tests) {
+        printf(" %s", test.name);
+      }
+      printf("\n");
+      return 1;
+    }
+    selected.push_back(found);
+  }
+  if (selected.empty()) {
+    for (const Test& test : g_tests) {
+      selected.push_back(&test);
+    }
+  }
+  for (const Test* test : selected) {
+    int failures = g_failures;
+    test->run();
+    printf("%s: %s\n", test->name, g_failures == failures ? "ok" : "FAILED");
+  }
+  return g_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+#ifndef TEXTSCAN__H__
+#define TEXTSCAN__H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#ifdef __SSE2__
+  #include <immintrin.h>
+  #define TEXTSCAN_SIMD 1
+#endif
+
+#define TEXTSCAN_NONE static_cast<size_t>(-1)
+
+/**
+ * Delimiters of a legacy text frame "<id>@@<login>##<text>\0", found by the same pass that looks
+ * for its NUL. The scan goes over the bytes received so far and stops where they end, so a frame
+ * split across reads is never searched twice: the next scan resumes at scanned with the delimiters
+ * seen before. Offsets are from the start of the frame.
+ */
+struct TextMarks {
+  size_t scanned;    // bytes of the frame searched, up to its NUL once that is found
+  size_t id_end;     // the first "@@"
+  size_t login_end;  // the first "##" after it
+
+  TextMarks() { reset(); }
+
+  void reset() {
+    scanned = 0;
+    id_end = TEXTSCAN_NONE;
+    login_end = TEXTSCAN_NONE;
+  }
+
+  // masks of one block at offset, bit k - byte offset + k; true - the NUL is there
+  bool take(const char* frame, size_t offset, uint32_t nul, uint32_t at, uint32_t hash, size_t width);
+  void found(size_t second_byte, char delimiter);  // a pair of delimiters ending at second_byte
+  size_t skipToNul(const char* frame, size_t size);  // both delimiters are there, the rest is text
+};
+
+typedef size_t (*TextScanFunction)(const char* frame, size_t size, TextMarks* marks);
+
+// ----------------------------------------------
+inline void TextMarks::found(size_t second_byte, char delimiter) {
+  if (delimiter == '@') {
+    if (id_end == TEXTSCAN_NONE) {
+      id_end = second_byte - 1;
+    }
+  } else if (id_end != TEXTSCAN_NONE && login_end == TEXTSCAN_NONE && second_byte >= id_end + 3) {
+    login_end = second_byte - 1;  // "##" that starts at the login or later, not the one overlapping "@@"
+  }
+}
+
+inline size_t TextMarks::skipToNul(const char* frame, size_t size) {
+  const char* nul = static_cast<const char*>(memchr(frame + scanned, '\0', size - scanned));
+  scanned = nul != nullptr ? nul - frame : size;
+  return scanned;
+}
+
+inline bool TextMarks::take(const char* frame, size_t offset, uint32_t nul, uint32_t at, uint32_t hash, size_t width) {
+  if (nul != 0) {
+    width = __builtin_ctz(nul);  // what follows the NUL belongs to the next frame
+  }
+  if (login_end == TEXTSCAN_NONE) {
+    // bit k: bytes k - 1 and k are both delimiters, the one before the block counts for k = 0
+    bool is_at_before = offset > 0 && frame[offset - 1] == '@';
+    bool is_hash_before = offset > 0 && frame[offset - 1] == '#';
+    uint32_t at_pairs = at & ((at << 1) | (is_at_before ? 1 : 0));
+    uint32_t hash_pairs = hash & ((hash << 1) | (is_hash_before ? 1 : 0));
+    uint32_t pairs = at_pairs | hash_pairs;
+    if (width < 32) {
+      pairs &= (1u << width) - 1;
+    }
+    while (pairs != 0 && login_end == TEXTSCAN_NONE) {
+      int k = __builtin_ctz(pairs);
+      found(offset + k, (at_pairs >> k) & 1 ? '@' : '#');
+      pairs &= pairs - 1;
+    }
+  }
+  scanned = offset + width;
+  return nul != 0;
+}
+
+/* Scanners */
+// --------------------------------------------------------------------------------------------------------------------
+/**
+ * Search frame[marks->scanned, size) and return the offset of the NUL, or size if there is none yet.
+ * The scalar one goes byte by byte; SSE2 and AVX2 ones compare 16 and 32 bytes at once and look at
+ * the masks bit by bit only where a block has delimiter pairs. Past the "##" only the NUL is left to
+ * find, and libc's memchr() is as fast as it gets for that. scanText() uses the widest this CPU has.
+ */
+inline size_t scanTextScalar(const char* frame, size_t size, TextMarks* marks) {
+  size_t i = marks->scanned;
+  for (; i < size && frame[i] != '\0' && marks->login_end == TEXTSCAN_NONE; ++i) {
+    if (i > 0 && (frame[i] == '@' || frame[i] == '#') && frame[i] == frame[i - 1]) {
+      marks->found(i, frame[i]);
+    }
+  }
+  marks->scanned = i;
+  return marks->login_end != TEXTSCAN_NONE ? marks->skipToNul(frame, size) : i;
+}
+
+#ifdef TEXTSCAN_SIMD
+inline size_t scanTextSse2(const char* frame, size_t size, TextMarks* marks) {
+  const __m128i nul = _mm_setzero_si128();
+  const __m128i at = _mm_set1_epi8('@');
+  const __m128i hash = _mm_set1_epi8('#');
+  size_t i = marks->scanned;
+  for (; i + 16 <= size && marks->login_end == TEXTSCAN_NONE; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(frame + i));
+    if (marks->take(frame, i, _mm_movemask_epi8(_mm_cmpeq_epi8(block, nul)), _mm_movemask_epi8(_mm_cmpeq_epi8(block, at)),
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(block, hash)), 16)) {
+      return marks->scanned;
+    }
+  }
+  return scanTextScalar(frame, size, marks);  // the tail shorter than a block
+}
+
+__attribute__((target("avx2")))
+inline size_t scanTextAvx2(const char* frame, size_t size, TextMarks* marks) {
+  const __m256i nul = _mm256_setzero_si256();
+  const __m256i at = _mm256_set1_epi8('@');
+  const __m256i hash = _mm256_set1_epi8('#');
+  size_t i = marks->scanned;
+  for (; i + 32 <= size && marks->login_end == TEXTSCAN_NONE; i += 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(frame + i));
+    if (marks->take(frame, i, _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nul)),
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, at)),
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, hash)), 32)) {
+      return marks->scanned;
+    }
+  }
+  return scanTextSse2(frame, size, marks);
+}
+#endif
+
+inline TextScanFunction textScanFunction() {
+#ifdef TEXTSCAN_SIMD
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? scanTextAvx2 : scanTextSse2;
+#else
+  return scanTextScalar;
+#endif
+}
+
+inline size_t scanText(const char* frame, size_t size, TextMarks* marks) {
+  static const TextScanFunction scan = textScanFunction();
+  return scan(frame, size, marks);
+}
+
+#endif  // TEXTSCAN__H__
@@ -0,0 +1,329 @@
+#ifndef URING__H__
+#define URING__H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 1024
+#define URING_BUFFER_COUNT 1024  // provided receive buffers per ring, a power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+struct UringStats {
+  std::atomic<long> enters;       // io_uring_enter syscalls
+  std::atomic<long> submissions;  // operations passed to the kernel by them
+  std::atomic<long> completions;
+  std::atomic<long> buffer_shortages;  // multishot receives stopped for lack of provided buffers
+
+  UringStats(): enters(0), submissions(0), completions(0), buffer_shortages(0) {}
+};
+
+/**
+ * io_uring over raw syscalls: submission and completion rings and a ring of provided receive buffers
+ * the kernel picks from, so that a multishot recv needs no buffer of its own per peer. Operations are
+ * queued with prep*() and go to the kernel all at once, with the wait for completions, in a single
+ * io_uring_enter. Owned and used by one thread.
+ */
+class Uring {
+public:
+  static bool isSupported();  // everything the server's backend needs: multishot accept/recv, buffer rings
+
+  explicit Uring(UringStats* stats);
+  ~Uring();
+
+  bool init(unsigned entries);  // false with errno set
+  bool provideBuffers(unsigned count, unsigned size, uint16_t group);
+
+  void prepAccept(int socket, uint64_t user_data);  // multishot
+  void prepRecv(int socket, uint16_t group, uint64_t user_data);  // multishot, into provided buffers
+  void prepSendmsg(int socket, const msghdr* header, int flags, uint64_t user_data);
+  void prepPoll(int fd, unsigned events, uint64_t user_data);  // multishot
+  void prepCancel(uint64_t target, uint64_t user_data);  // the operation submitted as target, with -ECANCELED
+  void prepCancelAll(uint64_t user_data);  // every operation in flight completes, cancelled ones with -ECANCELED
+
+  int submitAndWait(unsigned wait);  // submits everything queued, -errno on failure
+
+  template <typename Function>
+  unsigned forEachCompletion(Function function);  // function(const io_uring_cqe&)
+
+  const char* buffer(uint16_t id) const { return m_buffers + static_cast<size_t>(id) * m_buffer_size; }
+  void recycleBuffer(uint16_t id);  // back to the kernel with the next submit
+
+private:
+  int m_fd;
+  UringStats* m_stats;
+
+  void* m_ring;
+  size_t m_ring_size;
+  io_uring_sqe* m_sqes;
+  size_t m_sqes_size;
+  unsigned* m_sq_head;
+  unsigned* m_sq_tail;
+  unsigned m_sq_mask;
+  unsigned m_sq_entries;
+  unsigned m_sq_local_tail;  // queued SQEs, published on submit
+  unsigned m_sq_submitted;
+  unsigned* m_cq_head;
+  unsigned* m_cq_tail;
+  unsigned m_cq_mask;
+  io_uring_cqe* m_cqes;
+
+  io_uring_buf_ring* m_buffer_ring;
+  size_t m_buffer_ring_size;
+  char* m_buffers;
+  size_t m_buffers_size;
+  unsigned m_buffer_size;
+  unsigned m_buffer_mask;
+  uint16_t m_buffer_tail;  // recycled buffers, published on submit
+
+  io_uring_sqe* next();
+  int enter(unsigned submit, unsigned wait, unsigned flags);
+  bool isOpSupported(uint8_t op) const;
+
+  Uring(const Uring&) = delete;
+  Uring& operator = (const Uring&) = delete;
+};
+
+// ----------------------------------------------
+inline Uring::Uring(UringStats* stats)
+  : m_fd(-1), m_stats(stats), m_ring(MAP_FAILED), m_ring_size(0), m_sqes(nullptr), m_sqes_size(0),
+    m_sq_head(nullptr), m_sq_tail(nullptr), m_sq_mask(0), m_sq_entries(0), m_sq_local_tail(0), m_sq_submitted(0),
+    m_cq_head(nullptr), m_cq_tail(nullptr), m_cq_mask(0), m_cqes(nullptr), m_buffer_ring(nullptr),
+    m_buffer_ring_size(0), m_buffers(nullptr), m_buffers_size(0), m_buffer_size(0), m_buffer_mask(0),
+    m_buffer_tail(0) {}
+
+inline Uring::~Uring() {
+  if (m_fd >= 0) {
+    close(m_fd);  // cancels whatever is still in flight
+  }
+  if (m_buffer_ring != nullptr) {
+    munmap(m_buffer_ring, m_buffer_ring_size);
+  }
+  if (m_buffers != nullptr) {
+    munmap(m_buffers, m_buffers_size);
+  }
+  if (m_sqes != nullptr) {
+    munmap(m_sqes, m_sqes_size);
+  }
+  if (m_ring != MAP_FAILED) {
+    munmap(m_ring, m_ring_size);
+  }
+}
+
+inline bool Uring::isSupported() {
+  UringStats stats;
+  Uring probe(&stats);
+  // multishot recv came with the same kernel release (6.0) as zero-copy send, the probe only lists opcodes
+  return probe.init(8) && probe.isOpSupported(IORING_OP_SEND_ZC) && probe.provideBuffers(8, 64, URING_BUFFER_GROUP);
+}
+
+inline bool Uring::init(unsigned entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;  // no IPIs, completions are run on enter
+  m_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (m_fd < 0 && errno == EINVAL) {  // older kernel without these flags
+    memset(&params, 0, sizeof(params));
+    m_fd = syscall(__NR_io_uring_setup, entries, &params);
+  }
+  if (m_fd < 0) {
+    return false;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+    errno = ENOSYS;
+    return false;
+  }
+
+  m_ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                         params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  m_ring = mmap(nullptr, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+  if (m_ring == MAP_FAILED) {
+    return false;
+  }
+  m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+  char* ring = static_cast<char*>(m_ring);
+  m_sq_head = reinterpret_cast<unsigned*>(ring + params.sq_off.head);
+  m_sq_tail = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+  m_sq_mask = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+  m_sq_entries = params.sq_entries;
+  m_sq_local_tail = m_sq_submitted = *m_sq_tail;
+  unsigned* array = reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+  for (unsigned i = 0; i < m_sq_entries; ++i) {
+    array[i] = i;  // SQEs are used in ring order, the indirection is fixed once
+  }
+  m_cq_head = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+  m_cq_tail = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+  m_cq_mask = *reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+  m_cqes = reinterpret_cast<io_uring_cqe*>(ring + params.cq_off.cqes);
+  return true;
+}
+
+inline bool Uring::provideBuffers(unsigned count, unsigned size, uint16_t group) {
+  m_buffer_ring_size = count * sizeof(io_uring_buf);
+  void* memory = mmap(nullptr, m_buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  m_buffer_ring = static_cast<io_uring_buf_ring*>(memory);
+  m_buffers_size = static_cast<size_t>(count) * size;
+  memory = mmap(nullptr, m_buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  m_buffers = static_cast<char*>(memory);
+  m_buffer_size = size;
+  m_buffer_mask = count - 1;
+
+  io_uring_buf_reg registration;
+  memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = reinterpret_cast<uint64_t>(m_buffer_ring);
+  registration.ring_entries = count;
+  registration.bgid = group;
+  if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+    return false;
+  }
+  for (unsigned i = 0; i < count; ++i) {
+    recycleBuffer(static_cast<uint16_t>(i));
+  }
+  __atomic_store_n(&m_buffer_ring->tail, m_buffer_tail, __ATOMIC_RELEASE);
+  return true;
+}
+
+inline bool Uring::isOpSupported(uint8_t op) const {
+  size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+  io_uring_probe* probe = static_cast<io_uring_probe*>(calloc(1, size));
+  bool result = syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, 256) >= 0 &&
+                op < probe->ops_len && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return result;
+}
+
+// ----------------------------------------------
+inline io_uring_sqe* Uring::next() {
+  if (m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+    submitAndWait(0);  // ring is full, hand the queued ones to the kernel first
+  }
+  io_uring_sqe* sqe = &m_sqes[m_sq_local_tail & m_sq_mask];
+  ++m_sq_local_tail;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+inline void Uring::prepAccept(int socket, uint64_t user_data) {
+  io_uring_sqe* sqe = next();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = socket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = user_data;
+}
+
+inline void Uring::prepRecv(int socket, uint16_t group, uint64_t user_data) {
+  io_uring_sqe* sqe = next();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = socket;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = group;
+  sqe->user_data = user_data;
+}
+
+inline void Uring::prepSendmsg(int socket, const msghdr* header, int flags, uint64_t user_data) {
+  io_uring_sqe* sqe = next();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = socket;
+  sqe->addr = reinterpret_cast<uint64_t>(header);
+  sqe->len = 1;
+  sqe->msg_flags = flags;
+  sqe->user_data = user_data;
+}
+
+inline void Uring::prepPoll(int fd, unsigned events, uint64_t user_data) {
+  io_uring_sqe* sqe = next();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = user_data;
+}
+
+inline void Uring::prepCancel(uint64_t target, uint64_t user_data) {
+  io_uring_sqe* sqe = next();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = user_data;
+}
+
+inline void Uring::prepCancelAll(uint64_t user_data) {
+  io_uring_sqe* sqe = next();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+  sqe->user_data = user_data;
+}
+
+inline void Uring::recycleBuffer(uint16_t id) {
+  // not through io_uring_buf_ring::bufs, its flexible array member is misplaced when compiled as C++;
+  // fields are set one by one: the ring tail overlays the reserved field of the first entry
+  io_uring_buf& entry = reinterpret_cast<io_uring_buf*>(m_buffer_ring)[m_buffer_tail & m_buffer_mask];
+  entry.addr = reinterpret_cast<uint64_t>(buffer(id));
+  entry.len = m_buffer_size;
+  entry.bid = id;
+  ++m_buffer_tail;
+}
+
+inline int Uring::enter(unsigned submit, unsigned wait, unsigned flags) {
+  ++m_stats->enters;
+  int result = syscall(__NR_io_uring_enter, m_fd, submit, wait, flags, nullptr, 0);
+  return result < 0 ? -errno : result;
+}
+
+inline int Uring::submitAndWait(unsigned wait) {
+  if (m_buffer_ring != nullptr) {
+    __atomic_store_n(&m_buffer_ring->tail, m_buffer_tail, __ATOMIC_RELEASE);
+  }
+  unsigned submit = m_sq_local_tail - m_sq_submitted;
+  __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+  int result = enter(submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+  if (result >= 0) {
+    m_sq_submitted += result;
+    m_stats->submissions += result;
+  }
+  return result;
+}
+
+template <typename Function>
+unsigned Uring::forEachCompletion(Function function) {
+  unsigned total = 0;
+  unsigned head = *m_cq_head;
+  while (true) {
+    unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      break;
+    }
+    for (; head != tail; ++head, ++total) {
+      io_uring_cqe cqe = m_cqes[head & m_cq_mask];  // the slot is reused once head moves past it
+      __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+      function(cqe);
+    }
+  }
+  m_stats->completions += total;
+  return total;
+}
+
+#endif  // URING__H__